@@ -34,3 +34,9 @@ function(add_unit_test TEST_NAME TEST_DIR EXTRA_INCLUDES IS_GTEST EXPAND_GTEST)
         add_test(${TEST_NAME} ${TEST_NAME})
     endif()
 endfunction()
+
+# Count the heap usage of a test with the replaced global `operator new` (see `common/test/alloc_hooks.h`)
+function(add_alloc_hooks TEST_NAME)
+    target_sources(${TEST_NAME} PRIVATE ${CMAKE_CURRENT_FUNCTION_LIST_DIR}/../common/test/alloc_hooks.cpp)
+    target_include_directories(${TEST_NAME} PRIVATE ${CMAKE_CURRENT_FUNCTION_LIST_DIR}/../common/test)
+endfunction()
@@ -35,8 +35,10 @@ typedef enum {
 } VpnUpstreamProtocol;
 
 struct VpnConnectionStats {
-    uint32_t rtt_us;          // RTT in microseconds
-    double packet_loss_ratio; // the ratio of the number of lost packets to the total number of sent packets
+    uint32_t rtt_us;           // RTT in microseconds
+    double packet_loss_ratio;  // the ratio of the number of lost packets to the total number of sent packets
+    uint32_t recv_window_size; // receive window of the connection in bytes (0 if not applicable)
+    uint32_t bytes_in_flight;  // bytes sent and not acknowledged yet (0 if not known)
 };
 
 // The longest ipv6 address len (45) + brackets (2) + port delimiter (1) + maximum port length (5) + null (1)
@@ -0,0 +1,64 @@
+#include "alloc_hooks.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// The size of each block is kept in front of it
+static constexpr size_t HEADER_SIZE = alignof(std::max_align_t);
+
+static std::atomic<uint64_t> g_heap_allocs{0};
+static std::atomic<int64_t> g_heap_bytes{0};
+
+static void *allocate(size_t size) noexcept {
+    // NOLINTNEXTLINE(cppcoreguidelines-no-malloc,hicpp-no-malloc)
+    auto *block = (uint8_t *) malloc(size + HEADER_SIZE);
+    if (block == nullptr) {
+        return nullptr;
+    }
+    *(size_t *) block = size;
+    g_heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    g_heap_bytes.fetch_add(int64_t(size), std::memory_order_relaxed);
+    return block + HEADER_SIZE;
+}
+
+void *operator new(size_t size) {
+    if (void *ptr = allocate(size); ptr != nullptr) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return allocate(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    uint8_t *block = (uint8_t *) ptr - HEADER_SIZE;
+    g_heap_bytes.fetch_sub(int64_t(*(size_t *) block), std::memory_order_relaxed);
+    free(block); // NOLINT(cppcoreguidelines-no-malloc,hicpp-no-malloc)
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    operator delete(ptr);
+}
+
+namespace ag::test {
+
+uint64_t heap_allocs() {
+    return g_heap_allocs.load(std::memory_order_relaxed);
+}
+
+int64_t heap_bytes() {
+    return g_heap_bytes.load(std::memory_order_relaxed);
+}
+
+} // namespace ag::test
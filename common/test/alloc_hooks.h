@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Replaces the global `operator new` and `operator delete` to count the heap usage of a test.
+ * Link `alloc_hooks.cpp` into the test with `add_alloc_hooks()` (see `cmake/add_unit_test.cmake`).
+ */
+
+namespace ag::test {
+
+/** Number of blocks allocated with `operator new` since the start of the process */
+uint64_t heap_allocs();
+
+/** Number of bytes currently allocated with `operator new` */
+int64_t heap_bytes();
+
+} // namespace ag::test
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+#include "common/logger.h"
+#include "vpn/event_loop.h"
+
+namespace ag {
+
+/**
+ * Keeps the total size of the data buffered for all connections within a budget.
+ *
+ * Every connection buffering data reports the size of its buffer through an account. Once the total
+ * exceeds the budget, the connections with the largest buffers are throttled until the rest fit in
+ * the low watermark (3/4 of the budget): a throttled connection is expected to stop granting its
+ * peer the flow control credit for the data it drains, so the peer stops sending to it. All
+ * the throttled connections are released as soon as the total goes down to the low watermark.
+ * A throttled connection which has drained its buffer is released earlier if the total fits in
+ * the budget, so that it is not starved by the others keeping the total above the low watermark.
+ *
+ * Not thread-safe, except `usage()`.
+ */
+class BufferGovernor {
+public:
+    struct Handler {
+        /**
+         * Raised when the connection gets throttled or released
+         * @param conn_id the connection id passed to `open_account()`
+         */
+        void (*func)(void *arg, uint64_t conn_id, bool throttled);
+        void *arg;
+    };
+
+    /**
+     * Registration of a connection in the governor.
+     * Unregisters the connection when destroyed.
+     */
+    class Account {
+    public:
+        Account() = default;
+        ~Account();
+
+        Account(const Account &) = delete;
+        Account &operator=(const Account &) = delete;
+        Account(Account &&other) noexcept;
+        Account &operator=(Account &&other) noexcept;
+
+        /**
+         * Check if the account is registered in a governor
+         */
+        [[nodiscard]] bool is_open() const {
+            return m_governor != nullptr;
+        }
+
+        /**
+         * Report the current size of the data buffered for the connection.
+         * May raise the handlers of any account, including this one.
+         */
+        void set_size(size_t size);
+
+        /**
+         * Check if the connection should withhold the flow control credit from its peer
+         */
+        [[nodiscard]] bool throttled() const;
+
+    private:
+        friend class BufferGovernor;
+
+        BufferGovernor *m_governor = nullptr;
+        uint64_t m_key = 0;
+
+        Account(BufferGovernor *governor, uint64_t key)
+                : m_governor(governor)
+                , m_key(key) {
+        }
+
+        void close();
+    };
+
+    /**
+     * @param ev_loop event loop to rebalance on after an account is closed (if null, waits for the next update)
+     */
+    explicit BufferGovernor(VpnEventLoop *ev_loop)
+            : m_ev_loop(ev_loop) {
+    }
+    ~BufferGovernor() = default;
+
+    BufferGovernor(const BufferGovernor &) = delete;
+    BufferGovernor &operator=(const BufferGovernor &) = delete;
+    BufferGovernor(BufferGovernor &&) = delete;
+    BufferGovernor &operator=(BufferGovernor &&) = delete;
+
+    /**
+     * Set the limit of the total buffered data size
+     */
+    void set_budget(size_t budget);
+
+    /**
+     * Register a connection
+     * @param conn_id the connection id to pass to the handler
+     * @param handler notified when the connection gets throttled or released
+     */
+    Account open_account(uint64_t conn_id, Handler handler);
+
+    /**
+     * Total size of the data buffered for all connections. May be called from any thread.
+     */
+    [[nodiscard]] size_t usage() const {
+        return m_usage.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Number of the throttled connections
+     */
+    [[nodiscard]] size_t throttled_num() const {
+        return m_throttled_num;
+    }
+
+private:
+    struct Entry {
+        uint64_t conn_id = 0;
+        Handler handler = {};
+        size_t size = 0;
+        bool throttled = false;
+    };
+
+    VpnEventLoop *m_ev_loop;
+    event_loop::AutoTaskId m_rebalance_task_id;
+    std::unordered_map<uint64_t, Entry> m_accounts;
+    uint64_t m_next_key = 0;
+    size_t m_budget = SIZE_MAX;
+    std::atomic<size_t> m_usage = 0;
+    size_t m_throttled_usage = 0; // part of `m_usage` buffered for the throttled connections
+    size_t m_throttled_num = 0;
+    ag::Logger m_log{"BUFFER_GOVERNOR"};
+
+    [[nodiscard]] size_t low_watermark() const {
+        return m_budget / 4 * 3;
+    }
+
+    void update(uint64_t key, size_t size);
+    void close(uint64_t key);
+    void rebalance();
+    void throttle_largest();
+    void release_all();
+};
+
+} // namespace ag
@@ -3,6 +3,7 @@
 #include <cassert>
 #include <cstdint>
 
+#include "vpn/internal/data_ref.h"
 #include "vpn/internal/utils.h"
 #include "vpn/platform.h"
 #include "vpn/utils.h"
@@ -23,6 +24,8 @@ enum ClientEvent {
                             `VpnClientOutputEvent`) */
     CLIENT_EVENT_ICMP_ECHO_REQUEST, /**< Called when ICMP echo request is received (raised with
                                        `icmp_echo_request_event_t`) */
+    CLIENT_EVENT_OUTPUT_BATCH, /**< Called instead of `CLIENT_EVENT_OUTPUT` in batched output mode (raised with
+                                  `VpnClientOutputBatchEvent`) */
 };
 
 enum ClientConnectResult {
@@ -43,6 +46,7 @@ struct ClientConnectRequest {
     const TunnelAddress *dst;  /**< destination address */
     std::string_view app_name; /**< name of application that initiated this request */
     uint32_t flags;            /**< see ClientConnectRequestFlags */
+    uint8_t dscp;              /**< DSCP of the packet initiated this request (0 if unknown) */
 };
 
 struct ClientRead {
@@ -60,6 +64,11 @@ struct ClientRead {
      * may retry later or drop the packet.
      */
     int result;
+    /**
+     * Reference to the data, if the listener can share its storage (may be null). A handler which needs
+     * the data after returning (e.g. to buffer the unsent part) should keep this instead of copying.
+     */
+    const DataRef *ref;
 };
 
 struct ClientDataSentEvent {
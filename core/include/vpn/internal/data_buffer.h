@@ -2,6 +2,7 @@
 
 #include <cstdlib>
 #include <optional>
+#include <span>
 #include <string>
 
 #include "vpn/internal/utils.h"
@@ -15,6 +16,9 @@ struct BufferPeekResult {
 
 class DataBuffer {
 public:
+    /** Number of chunks it makes sense to peek at once */
+    static constexpr size_t PEEK_CHUNKS_NUM = 8;
+
     DataBuffer() = default;
     virtual ~DataBuffer() = default;
 
@@ -42,6 +46,15 @@ public:
      */
     virtual BufferPeekResult peek() = 0;
 
+    /**
+     * Peek several consecutive data chunks from buffer at once, e.g. to pass them on without
+     * peeking again after each one. Like `peek`, does not advance the buffer. The peeked chunks
+     * stay valid until they are drained, even if more data is pushed meanwhile.
+     * @param chunks array to fill
+     * @return number of filled chunks (0 if the buffer is empty)
+     */
+    virtual size_t peek(std::span<U8View> chunks) = 0;
+
     /**
      * Remove data from buffer
      * @param length data length to remove
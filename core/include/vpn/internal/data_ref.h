@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "tcpip/tcpip.h"
+#include "vpn/utils.h"
+
+namespace ag {
+
+/**
+ * Piece of data passed from a client listener to a server upstream, which may share reference-counted storage
+ * (e.g. a packet buffer of the TCP/IP stack). Queueing a reference instead of a copy lets a byte received from
+ * the client be copied at most once before it gets to the upstream's transport.
+ * Must be used on the event loop thread only.
+ */
+class DataRef {
+public:
+    /** Cleanup callback in the form `evbuffer_add_reference()` accepts */
+    struct Retained {
+        void (*cleanup)(const void *data, size_t length, void *arg);
+        void *arg;
+    };
+
+    DataRef() = default;
+
+    /**
+     * Reference `data` without owning it: the data is valid only as long as the caller guarantees.
+     * `to_owned()` must be used to keep it longer.
+     */
+    explicit DataRef(U8View data)
+            : m_data(data.data())
+            , m_size(data.size()) {
+    }
+
+    /**
+     * Reference `data` which lives inside `buffer` (takes a new reference to the buffer)
+     */
+    DataRef(TcpipBuffer *buffer, U8View data);
+
+    /**
+     * Make a reference which owns a copy of `data`
+     */
+    static DataRef copy_of(U8View data);
+
+    ~DataRef();
+
+    DataRef(const DataRef &other);
+    DataRef &operator=(const DataRef &other);
+    DataRef(DataRef &&other) noexcept;
+    DataRef &operator=(DataRef &&other) noexcept;
+
+    [[nodiscard]] const uint8_t *data() const {
+        return m_data;
+    }
+    [[nodiscard]] size_t size() const {
+        return m_size;
+    }
+    [[nodiscard]] bool empty() const {
+        return m_size == 0;
+    }
+    [[nodiscard]] U8View view() const {
+        return {m_data, m_size};
+    }
+
+    /**
+     * Check if the data is kept alive by the reference itself
+     */
+    [[nodiscard]] bool is_owned() const {
+        return m_kind != BORROWED;
+    }
+
+    /**
+     * Get a reference which stays valid after the borrowed data is gone: shares the storage if there is one,
+     * copies the data otherwise
+     */
+    [[nodiscard]] DataRef to_owned() const;
+
+    /**
+     * Skip the first `n` bytes of the data
+     */
+    void remove_prefix(size_t n) {
+        m_data += n;
+        m_size -= n;
+    }
+
+    /**
+     * Take a new reference to the storage for a C API which releases it with a cleanup callback.
+     * Must not be called on a borrowed reference.
+     */
+    [[nodiscard]] Retained retain() const;
+
+private:
+    enum Kind : uint8_t {
+        BORROWED,
+        TCPIP_BUFFER,
+        HEAP,
+    };
+
+    struct HeapBlock;
+
+    Kind m_kind = BORROWED;
+    void *m_storage = nullptr;
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+
+    void ref() const;
+    void unref();
+    static void release_tcpip_buffer(const void *data, size_t length, void *arg);
+    static void release_heap_block(const void *data, size_t length, void *arg);
+};
+
+} // namespace ag
@@ -40,6 +40,11 @@ public:
 
     void reset();
 
+    /**
+     * Number of bytes allocated for the extraction state
+     */
+    [[nodiscard]] size_t memory_usage() const;
+
 private:
     struct Context;
     std::unique_ptr<Context> m_context;
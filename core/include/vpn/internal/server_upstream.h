@@ -2,9 +2,11 @@
 
 #include <cstdint>
 #include <optional>
+#include <span>
 
 #include "common/defs.h"
 #include "net/utils.h"
+#include "vpn/internal/data_ref.h"
 #include "vpn/internal/icmp_manager.h"
 #include "vpn/internal/utils.h"
 #include "vpn/vpn.h"
@@ -147,6 +149,38 @@ public:
      */
     virtual ssize_t send(uint64_t id, const uint8_t *data, size_t length) = 0;
 
+    /**
+     * Send a sequence of data chunks through connection. An upstream which can pass the chunks
+     * to its transport by reference (instead of copying them) should override this.
+     * @param id connection id
+     * @param chunks data to send
+     * @return number of consumed bytes (< 0 in case of error)
+     */
+    virtual ssize_t send(uint64_t id, std::span<const DataRef> chunks) {
+        ssize_t total = 0;
+        for (const DataRef &chunk : chunks) {
+            ssize_t r = send(id, chunk.data(), chunk.size());
+            if (r < 0) {
+                return (total > 0) ? total : r;
+            }
+            total += r;
+            if (size_t(r) < chunk.size()) {
+                break;
+            }
+        }
+        return total;
+    }
+
+    /**
+     * Set the priority class of a connection. An upstream which multiplexes connections
+     * over a shared transport should override this to schedule their data accordingly.
+     * @param id connection id
+     * @param traffic_class the priority class
+     */
+    virtual void set_traffic_class([[maybe_unused]] uint64_t id, [[maybe_unused]] VpnTrafficClass traffic_class) {
+        // Default no-op
+    }
+
     /**
      * Notify server of client sent some data
      * @param id connection id
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "common/logger.h"
+
+namespace ag {
+
+/**
+ * Memory-mapped file shared by the connection data buffers to spill the data not fitting in memory.
+ *
+ * The file is split into fixed-size segments, so a buffer keeps a list of segments and frees each one
+ * as soon as it's drained, without moving the rest of the data. The file grows by regions of
+ * `SEGMENTS_PER_REGION` segments mapped separately, so the data of an allocated segment never moves.
+ * The lowest free segment is allocated first, so that the data gathers in the first regions: the
+ * trailing regions are unmapped and cut off the file as soon as they become free, and the pages of
+ * the other free regions are given back to the system (on Linux).
+ * The disk space of a region is reserved before its segments are allocated, so that running out of it
+ * fails an allocation instead of a write to the mapping.
+ * The file is unlinked right after it's created (deleted on close on Windows), so it does not outlive
+ * the process.
+ */
+class SpillArena {
+public:
+    static constexpr size_t SEGMENT_SIZE = 64 * 1024;
+    static constexpr size_t SEGMENTS_PER_REGION = 64;
+    static constexpr size_t REGION_SIZE = SEGMENT_SIZE * SEGMENTS_PER_REGION;
+
+    struct AllocateResult {
+        std::optional<std::string> err; // nullopt if successful, some error description otherwise
+        uint32_t segment = 0;           // allocated segment
+    };
+
+    /**
+     * @param path path of the file which is created on the first allocation
+     */
+    explicit SpillArena(std::string path);
+    ~SpillArena();
+
+    SpillArena(const SpillArena &) = delete;
+    SpillArena &operator=(const SpillArena &) = delete;
+    SpillArena(SpillArena &&) = delete;
+    SpillArena &operator=(SpillArena &&) = delete;
+
+    /**
+     * Allocate a segment of `SEGMENT_SIZE` bytes.
+     * Fails if the disk space for the segment can't be reserved.
+     */
+    AllocateResult allocate();
+
+    /**
+     * Free a segment allocated with `allocate()`
+     */
+    void free(uint32_t segment);
+
+    /**
+     * Get the memory of a segment
+     */
+    [[nodiscard]] uint8_t *data(uint32_t segment) const {
+        return m_regions[segment / SEGMENTS_PER_REGION].memory + segment % SEGMENTS_PER_REGION * SEGMENT_SIZE;
+    }
+
+    /**
+     * Number of the allocated segments
+     */
+    [[nodiscard]] size_t segments_in_use() const {
+        return m_used;
+    }
+
+    /**
+     * Size of the file
+     */
+    [[nodiscard]] size_t file_size() const {
+        return m_regions.size() * REGION_SIZE;
+    }
+
+private:
+    std::string m_path;
+#ifdef _WIN32
+    void *m_file = nullptr; // HANDLE
+#else
+    int m_fd = -1;
+#endif
+    struct Region {
+        uint8_t *memory = nullptr;
+        uint64_t free_mask = 0; // bit per segment, set if the segment is free
+        bool reserved = false;  // whether the disk space of the region is reserved
+    };
+
+    std::vector<Region> m_regions;
+    size_t m_used = 0;
+    ag::Logger m_log{"SPILL_ARENA"};
+
+    static constexpr uint64_t ALL_FREE = UINT64_MAX;
+    static_assert(SEGMENTS_PER_REGION == 64, "Free mask must have a bit per segment");
+
+    std::optional<std::string> open_file();
+    std::optional<std::string> resize_file(size_t size);
+    /** Reserve the disk space of the region at an offset, so that the writes to its mapping don't fail */
+    std::optional<std::string> reserve_space(size_t offset);
+    std::optional<std::string> add_region();
+    /** Unmap the trailing free regions and cut them off the file */
+    void trim();
+    /**
+     * Give the pages of a free region back to the system (if supported by the platform).
+     * The disk space of the region has to be reserved again before it's used.
+     */
+    void discard(size_t region);
+};
+
+} // namespace ag
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "vpn/vpn.h"
+
+namespace ag {
+
+static constexpr size_t TRAFFIC_CLASSES_NUM = VPN_TC_BULK + 1;
+
+/**
+ * Properties of a connection the priority class is assigned by
+ */
+struct TrafficProperties {
+    int proto;                 // IPPROTO_TCP or IPPROTO_UDP
+    uint16_t dst_port;         // destination port (0 if unknown)
+    std::string_view app_name; // name of the application which initiated the connection (empty if unknown)
+    uint8_t dscp;              // DSCP of the packet which initiated the connection (0 if unknown)
+};
+
+/**
+ * How a session treats the connections of a priority class
+ */
+struct TrafficClassPolicy {
+    int32_t weight;          // HTTP/2 stream weight (1-256)
+    size_t send_queue_limit; // max bytes of the class framed and waiting in the socket's write buffer (SIZE_MAX if any)
+};
+
+/**
+ * Assigns priority classes to the connections, see `VpnUpstreamConfig.traffic_class_rules`
+ */
+class TrafficClassifier {
+public:
+    TrafficClassifier() = default;
+
+    /**
+     * @param rules the user rules, checked before the built-in ones in the order given
+     */
+    explicit TrafficClassifier(std::span<const VpnTrafficClassRule> rules);
+
+    /**
+     * Get the priority class of a connection
+     */
+    [[nodiscard]] VpnTrafficClass classify(const TrafficProperties &props) const;
+
+private:
+    struct Rule {
+        std::optional<std::string> app_name;
+        uint16_t port_min;
+        uint16_t port_max;
+        std::optional<uint8_t> dscp;
+        VpnTrafficClass traffic_class;
+    };
+
+    std::vector<Rule> m_rules;
+};
+
+/**
+ * Get the policy of a priority class
+ */
+[[nodiscard]] TrafficClassPolicy traffic_class_policy(VpnTrafficClass traffic_class);
+
+/**
+ * Data of the connections framed into a session's output and not yet written from the socket's write buffer,
+ * by priority class. Each class is capped by `TrafficClassPolicy::send_queue_limit`.
+ */
+class TrafficClassSendQueue {
+public:
+    /**
+     * Account the data of a class framed into the output
+     * @param length number of bytes of the data
+     * @param end number of bytes of the output in total once the frame is output
+     */
+    void push(VpnTrafficClass traffic_class, size_t length, uint64_t end);
+
+    /**
+     * Get the number of bytes a class may frame yet. If it's 0, the class is blocked until `release()`
+     * reports it.
+     */
+    size_t available(VpnTrafficClass traffic_class);
+
+    /**
+     * Release the data which has left the write buffer
+     * @param written number of bytes of the output written from the write buffer in total
+     * @param flushed true if the write buffer is empty
+     * @return the blocked classes which have got below the cap
+     */
+    std::bitset<TRAFFIC_CLASSES_NUM> release(uint64_t written, bool flushed);
+
+    /**
+     * Get the number of bytes of a class waiting in the write buffer
+     */
+    [[nodiscard]] size_t queued(VpnTrafficClass traffic_class) const;
+
+    void reset();
+
+private:
+    struct Mark {
+        VpnTrafficClass traffic_class;
+        size_t length;
+        uint64_t end;
+    };
+
+    std::array<size_t, TRAFFIC_CLASSES_NUM> m_queued{};
+    std::bitset<TRAFFIC_CLASSES_NUM> m_blocked; // classes which have hit the cap
+    std::deque<Mark> m_marks;
+};
+
+} // namespace ag
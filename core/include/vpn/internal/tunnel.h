@@ -6,7 +6,6 @@
 #include <unordered_map>
 
 #include <event2/event.h>
-#include <khash.h>
 
 #include "common/cache.h"
 #include "common/logger.h"
@@ -15,6 +14,7 @@
 #include "vpn/internal/server_upstream.h"
 #include "vpn/internal/utils.h"
 #include "vpn/internal/vpn_connection.h"
+#include "vpn/internal/vpn_connection_table.h"
 #include "vpn/internal/vpn_dns_resolver.h"
 #include "vpn/utils.h"
 #include "vpn/vpn.h"
@@ -24,13 +24,6 @@ namespace ag {
 class DnsHandler;
 class ConnectionStatisticsMonitor;
 
-KHASH_MAP_INIT_INT64(connections_by_id, VpnConnection *);
-
-struct VpnConnections {
-    khash_t(connections_by_id) *by_client_id = nullptr;
-    khash_t(connections_by_id) *by_server_id = nullptr;
-};
-
 struct DnsResolveWaiter {
     uint64_t conn_client_id = NON_ID;
 };
@@ -38,7 +31,7 @@ struct DnsResolveWaiter {
 struct Tunnel {
     static constexpr std::chrono::seconds EXCLUSIONS_RESOLVE_PERIOD{60 * 60};
 
-    VpnConnections connections = {};
+    VpnConnections connections;
     VpnClient *vpn = nullptr;
     IcmpManager icmp_manager;
     ag::Logger log{"TUNNEL"};
@@ -109,6 +102,11 @@ struct Tunnel {
      */
     std::optional<VpnConnectAction> finalize_connect_action(ConnectRequestResult request_result) const;
 
+    /**
+     * Number of bytes occupied by the live connections and their indices
+     */
+    size_t connections_memory_usage() const;
+
     static void on_icmp_reply_ready(void *arg, const IcmpEchoReply &reply);
 
     bool update_dns_handler_parameters();
@@ -25,6 +25,7 @@
 #include "net/utils.h"
 #include "vpn/event_loop.h"
 #include "vpn/fsm.h"
+#include "vpn/internal/buffer_governor.h"
 #include "vpn/internal/client_listener.h"
 #include "vpn/internal/data_buffer.h"
 #include "vpn/internal/dns_proxy_accessor.h"
@@ -33,6 +34,8 @@
 #include "vpn/internal/endpoint_connector.h"
 #include "vpn/internal/id_generator.h"
 #include "vpn/internal/server_upstream.h"
+#include "vpn/internal/spill_arena.h"
+#include "vpn/internal/traffic_classifier.h"
 #include "vpn/internal/tunnel.h"
 #include "vpn/internal/utils.h"
 #include "vpn/internal/vpn_dns_resolver.h"
@@ -58,6 +61,8 @@ enum Event {
                                 and  only for connections routed through a VPN endpoint) */
     EVENT_CONNECTION_CLOSED, /** Raised when a connection is closed (raised with `VpnTunnelConnectionClosedEvent`) */
     EVENT_CONNECTION_INFO,   /** Notifies that connection info is ready (raised with `VpnConnectionInfoEvent`) */
+    EVENT_OUTPUT_BATCH,      /** Raised instead of `EVENT_OUTPUT` in batched output mode (raised with
+                                `VpnClientOutputBatchEvent`) */
 };
 
 struct Handler {
@@ -86,6 +91,7 @@ struct EndpointConnectionConfig {
     std::string password;
     IpVersionSet ip_availability;
     bool anti_dpi = false;
+    TrafficClassifier traffic_classifier;
 };
 
 static constexpr const char *LOG_NAME = "VPNCLIENT";
@@ -143,7 +149,7 @@ public:
 
     VpnConnectionStats get_connection_stats() const;
 
-    [[nodiscard]] std::unique_ptr<DataBuffer> make_buffer(uint64_t id) const;
+    [[nodiscard]] std::unique_ptr<DataBuffer> make_buffer() const;
 
     [[nodiscard]] bool may_send_icmp_request() const;
 
@@ -159,6 +165,8 @@ public:
 
     void on_network_change();
 
+    BufferGovernor buffer_governor;          // declared first to outlive the connections accounted in it
+    std::unique_ptr<SpillArena> spill_arena; // shared by the connection data buffers, outlives them too
     Fsm fsm;
     std::unique_ptr<Tunnel> tunnel = std::make_unique<Tunnel>(); // tunnel connections manager
     vpn_client::Parameters parameters = {};
@@ -184,7 +192,7 @@ public:
     std::optional<std::string> ssl_session_storage_path;   // directory where SSL sessions will be cached
     size_t conn_memory_buffer_threshold =
             0; // connection in-memory buffer size exceeding which causes storing incoming data in a file
-    size_t max_conn_buffer_file_size = 0; // maximum size of file of a connection data buffer
+    size_t max_conn_buffer_file_size = 0; // maximum size of the spilled data of a connection data buffer
     ag::Logger log{vpn_client::LOG_NAME}; // logger
     int id = 0;
     std::optional<VpnError> pending_error;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <bitset>
 #include <chrono>
 #include <cstdint>
@@ -9,6 +10,7 @@
 #include <vector>
 
 #include "vpn/event_loop.h"
+#include "vpn/internal/data_ref.h"
 #include "vpn/internal/domain_extractor.h"
 #include "vpn/internal/utils.h"
 #include "vpn/utils.h"
@@ -61,7 +63,31 @@ enum VpnConnectionFlags {
 class ClientListener;
 class ServerUpstream;
 
+/**
+ * Position of a connection in `VpnConnectionSlab`. The generation tells apart the connections
+ * which occupied the same slot at different times.
+ */
+struct VpnConnectionHandle {
+    uint32_t slot = UINT32_MAX;
+    uint32_t generation = 0;
+};
+
+/**
+ * Part of the connection state which is needed only while the connection is being set up:
+ * until it's connected, the domain lookup is over and the packets buffered meanwhile are sent.
+ */
+struct VpnConnectionSetup {
+    DomainExtractor domain_extractor;
+    uint64_t migrating_client_id = NON_ID;
+    std::string app_name;
+    uint8_t dscp = 0;
+    std::list<DataRef> buffered_packets;
+    int lookup_attempts_num = 0;
+    std::chrono::high_resolution_clock::time_point requested_at{};
+};
+
 struct VpnConnection {
+    VpnConnectionHandle handle;
     uint64_t client_id = NON_ID;
     uint64_t server_id = NON_ID;
     std::weak_ptr<ClientListener> listener;
@@ -71,10 +97,8 @@ struct VpnConnection {
     int proto = 0;
     std::bitset<width_of<VpnConnectionFlags>()> flags;
     int uid = 0;
-    DomainExtractor domain_extractor;
+    // Kept after the setup state is released, as it's cached on close for the UDP connections
     DomainExtractorResult domain_extractor_result;
-    uint64_t migrating_client_id = NON_ID;
-    std::string app_name;
     event_loop::AutoTaskId complete_connect_request_task;
     // This pair of counters is used to make it visible in the logs whether
     // any traffic has passed through the connection.
@@ -82,13 +106,14 @@ struct VpnConnection {
     // on the connections that have been routed through an endpoint.
     size_t incoming_bytes = 0;
     size_t outgoing_bytes = 0;
-    std::list<std::vector<uint8_t>> buffered_packets;
     event_loop::AutoTaskId send_buffered_task;
-    int lookup_attempts_num = 0;
     std::optional<VpnConnectAction> action;
-    std::chrono::high_resolution_clock::time_point requested_at{};
 
-    static VpnConnection *make(uint64_t client_id, TunnelAddressPair addr, int proto);
+    /**
+     * Construct a connection of the type matching the protocol
+     * @param storage memory to construct the connection in (at least `VPN_CONNECTION_MAX_SIZE` bytes)
+     */
+    static VpnConnection *make(void *storage, uint64_t client_id, TunnelAddressPair addr, int proto);
 
     VpnConnection(const VpnConnection &) = delete;
     VpnConnection(VpnConnection &&) = delete;
@@ -99,8 +124,41 @@ struct VpnConnection {
     virtual ~VpnConnection() = default;
     [[nodiscard]] SockAddrTag make_tag() const;
 
+    /**
+     * Get the setup state, allocating it if the connection has none
+     */
+    VpnConnectionSetup &setup();
+
+    /**
+     * Check if the connection has the setup state
+     */
+    [[nodiscard]] bool has_setup() const {
+        return m_setup != nullptr;
+    }
+
+    /**
+     * Check if there are client packets waiting to be sent to the server side
+     */
+    [[nodiscard]] bool has_buffered_packets() const {
+        return m_setup != nullptr && !m_setup->buffered_packets.empty();
+    }
+
+    /**
+     * Release the setup state if the connection is done with it
+     * @return true if the connection has no setup state after the call
+     */
+    bool release_setup_if_done();
+
+    /**
+     * Number of bytes occupied by the connection: the object itself and the memory it owns
+     */
+    [[nodiscard]] size_t memory_usage() const;
+
 protected:
     explicit VpnConnection(TunnelAddressPair);
+
+private:
+    std::unique_ptr<VpnConnectionSetup> m_setup;
 };
 
 struct UdpVpnConnection : public VpnConnection {
@@ -111,4 +169,7 @@ struct TcpVpnConnection : public VpnConnection {
     explicit TcpVpnConnection(TunnelAddressPair);
 };
 
+/** Size of the largest connection type */
+inline constexpr size_t VPN_CONNECTION_MAX_SIZE = std::max(sizeof(TcpVpnConnection), sizeof(UdpVpnConnection));
+
 } // namespace ag
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "vpn/internal/vpn_connection.h"
+
+namespace ag {
+
+/**
+ * Pool of connection objects.
+ *
+ * Connections are constructed in fixed-size slots of slabs holding `SLOTS_PER_SLAB` connections each,
+ * so that creating a connection does not allocate the object itself, and neighbouring connections
+ * share cache lines and pages instead of being scattered over the heap. A slab which becomes empty
+ * is released if there are enough free slots in the other ones.
+ *
+ * Each slot has a generation counter which is bumped when the connection in the slot is destroyed,
+ * so a handle of a destroyed connection is never resolved to the connection which reused its slot.
+ */
+class VpnConnectionSlab {
+public:
+    static constexpr size_t SLOTS_PER_SLAB = 64;
+
+    VpnConnectionSlab() = default;
+    ~VpnConnectionSlab();
+
+    VpnConnectionSlab(const VpnConnectionSlab &) = delete;
+    VpnConnectionSlab &operator=(const VpnConnectionSlab &) = delete;
+    VpnConnectionSlab(VpnConnectionSlab &&) = delete;
+    VpnConnectionSlab &operator=(VpnConnectionSlab &&) = delete;
+
+    /**
+     * Create a connection (see `VpnConnection::make()`)
+     */
+    VpnConnection *make(uint64_t client_id, TunnelAddressPair addr, int proto);
+
+    /**
+     * Destroy a connection created with `make()`
+     */
+    void destroy(VpnConnection *conn);
+
+    /**
+     * Get the connection by its handle
+     * @return null if the connection has been destroyed
+     */
+    [[nodiscard]] VpnConnection *get(VpnConnectionHandle handle) const {
+        if (handle.slot >= m_generations.size() || m_generations[handle.slot] != handle.generation) {
+            return nullptr;
+        }
+        return slot_ptr(handle.slot);
+    }
+
+    /**
+     * Number of live connections
+     */
+    [[nodiscard]] size_t size() const {
+        return m_size;
+    }
+
+    /**
+     * Number of bytes occupied by the slabs and the bookkeeping
+     */
+    [[nodiscard]] size_t memory_usage() const;
+
+    /**
+     * Call `func(VpnConnection *)` for each live connection, including the ones which are not indexed
+     */
+    template <typename Func>
+    void for_each(Func &&func) const {
+        for (size_t s = 0; s < m_slabs.size(); ++s) {
+            if (m_slabs[s].memory == nullptr) {
+                continue;
+            }
+            for (uint64_t used = ~m_slabs[s].free_mask; used != 0; used &= used - 1) {
+                func(slot_ptr(uint32_t(s * SLOTS_PER_SLAB + std::countr_zero(used))));
+            }
+        }
+    }
+
+private:
+    struct Slab {
+        alignas(VpnConnection) std::byte slots[SLOTS_PER_SLAB][VPN_CONNECTION_MAX_SIZE];
+    };
+
+    struct SlabInfo {
+        std::unique_ptr<Slab> memory; // null if the slab is released
+        uint64_t free_mask = 0;       // bit per slot, set if the slot is free
+        bool partial = false;         // true if the slab is in `m_partial`
+    };
+
+    std::vector<SlabInfo> m_slabs;
+    std::vector<uint32_t> m_generations; // per slot, stay valid after the slab is released
+    std::vector<uint32_t> m_partial;     // slabs which may have free slots (checked lazily)
+    std::vector<uint32_t> m_released;    // slab indices to reuse
+    size_t m_size = 0;
+    size_t m_free_slots = 0; // in the allocated slabs
+
+    [[nodiscard]] VpnConnection *slot_ptr(uint32_t slot) const {
+        return (VpnConnection *) m_slabs[slot / SLOTS_PER_SLAB].memory->slots[slot % SLOTS_PER_SLAB];
+    }
+    uint32_t allocate_slot();
+    void release_slot(uint32_t slot);
+};
+
+/**
+ * Index of the connections in a `VpnConnectionSlab` by identifier (client or server side).
+ *
+ * An open-addressing hash table of identifier/handle pairs: a lookup probes a contiguous array
+ * instead of following the chained nodes, and an entry is resolved through the slab, so an entry
+ * left for a destroyed connection finds nothing. Like with khash, entries may be removed while
+ * iterating, but must not be added.
+ */
+class VpnConnectionIndex {
+public:
+    explicit VpnConnectionIndex(const VpnConnectionSlab *slab)
+            : m_slab(slab) {
+    }
+
+    /**
+     * Find a connection
+     * @return null if not found
+     */
+    [[nodiscard]] VpnConnection *get(uint64_t id) const {
+        size_t i = find(id);
+        return (i != m_entries.size()) ? m_slab->get(m_entries[i].handle) : nullptr;
+    }
+
+    /**
+     * Add a connection or replace the one with the same identifier
+     */
+    void put(uint64_t id, const VpnConnection *conn);
+
+    /**
+     * Remove a connection if it's present
+     */
+    void remove(uint64_t id);
+
+    /**
+     * Number of entries
+     */
+    [[nodiscard]] size_t size() const {
+        return m_size;
+    }
+
+    /**
+     * Number of bytes occupied by the table
+     */
+    [[nodiscard]] size_t memory_usage() const {
+        return m_entries.capacity() * sizeof(Entry);
+    }
+
+    /**
+     * Call `func(VpnConnection *)` for each connection
+     */
+    template <typename Func>
+    void for_each(Func &&func) const {
+        for (size_t i = 0; i < m_entries.size(); ++i) {
+            const Entry &entry = m_entries[i];
+            if (entry.id == NON_ID || entry.handle.slot == TOMBSTONE) {
+                continue;
+            }
+            if (VpnConnection *conn = m_slab->get(entry.handle); conn != nullptr) {
+                func(conn);
+            }
+        }
+    }
+
+private:
+    static constexpr uint32_t TOMBSTONE = UINT32_MAX;
+    static constexpr size_t MIN_CAPACITY = 16;
+    // The table is rebuilt at 7/8 load (tombstones included), close to khash's 0.77, to use as much memory
+    static constexpr size_t MAX_LOAD_NUM = 7;
+    static constexpr size_t MAX_LOAD_DEN = 8;
+    // and its size is doubled if the live entries alone would take more than 13/16 of it
+    static constexpr size_t MAX_LIVE_LOAD_NUM = 13;
+    static constexpr size_t MAX_LIVE_LOAD_DEN = 16;
+
+    struct Entry {
+        uint64_t id = NON_ID; // `NON_ID` if the entry has never been used
+        VpnConnectionHandle handle;
+    };
+
+    const VpnConnectionSlab *m_slab;
+    std::vector<Entry> m_entries; // the size is a power of 2
+    int m_hash_shift = 0;         // 64 - log2 of the size
+    size_t m_size = 0;
+    size_t m_tombstones = 0;
+
+    // Fibonacci hashing: the identifiers are mostly sequential, so spread them over the whole table
+    [[nodiscard]] size_t home_index(uint64_t id) const {
+        return size_t((id * 0x9e3779b97f4a7c15) >> m_hash_shift);
+    }
+
+    /**
+     * Triangular probing, as in khash: visits every entry of a table of power of 2 size
+     * @return the entry index, or the table size if not found
+     */
+    [[nodiscard]] size_t find(uint64_t id) const {
+        if (m_entries.empty()) {
+            return 0;
+        }
+        size_t mask = m_entries.size() - 1;
+        size_t step = 0;
+        for (size_t i = home_index(id); step < m_entries.size(); i = (i + ++step) & mask) {
+            const Entry &entry = m_entries[i];
+            if (entry.id == id && entry.handle.slot != TOMBSTONE) {
+                return i;
+            }
+            if (entry.id == NON_ID) {
+                break;
+            }
+        }
+        return m_entries.size();
+    }
+
+    void rehash(size_t capacity);
+};
+
+/**
+ * Connections of a tunnel indexed by the client and the server side identifiers
+ */
+struct VpnConnections {
+    VpnConnectionSlab slab;
+    VpnConnectionIndex by_client_id{&slab};
+    VpnConnectionIndex by_server_id{&slab};
+
+    /**
+     * Number of bytes occupied by the connections, including their heap data, and the indices
+     */
+    [[nodiscard]] size_t memory_usage() const;
+};
+
+} // namespace ag
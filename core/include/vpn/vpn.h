@@ -34,6 +34,7 @@ static constexpr int VPN_DEFAULT_TCP_TIMEOUT_MS = TCPIP_TCP_TIMEOUT_FOR_ESTABLIS
 static constexpr int VPN_DEFAULT_UDP_TIMEOUT_MS = TCPIP_UDP_TIMEOUT_S * 1000; // for bypassed and redirected server-side and client-side UDP connections
 static constexpr int VPN_DEFAULT_MAX_CONN_BUFFER_FILE_SIZE = 4 * 1024 * 1024;
 static constexpr int VPN_DEFAULT_CONN_MEMORY_BUFFER_THRESHOLD = DEFAULT_CONNECTION_MEMORY_BUFFER_SIZE;
+static constexpr int VPN_DEFAULT_CONN_BUFFERS_BUDGET = 64 * 1024 * 1024;
 static constexpr int VPN_DEFAULT_RECOVERY_LOCATION_UPDATE_PERIOD_MS = 10 * 1000;
 static constexpr int VPN_DEFAULT_INITIAL_RECOVERY_INTERVAL_MS = 1 * 1000;
 static constexpr int VPN_DEFAULT_CONNECT_ATTEMPTS_NUM = 5;
@@ -88,12 +89,38 @@ typedef struct {
     VpnOsTunnel *tunnel;
     /** Maximum transfer unit for TCP protocol (if 0, `DEFAULT_MTU_SIZE` will be used) */
     uint32_t mtu_size;
-    /** TCP receive window size in bytes (if 0, compile-time default is used) */
+    /**
+     * Maximum TCP receive window of a connection in bytes (if 0, the largest window the window scale allows,
+     * about 1 MB). Windows are tuned per connection according to how fast the data is consumed.
+     */
     uint32_t tcp_recv_buf_size;
+    /** Limit of the sum of TCP receive windows of all connections in bytes (if 0, default is used) */
+    uint32_t tcp_recv_buf_budget;
     /** TCP send buffer size in bytes (if 0, compile-time default is used) */
     uint32_t tcp_send_buf_size;
     /** Pcap file name */
     const char *pcap_filename;
+    /**
+     * Additional queue descriptors of a multi-queue TUN device (Linux `IFF_MULTI_QUEUE`).
+     * They are serviced together with `fd` and ignored if `fd` is -1. The listener does not close them,
+     * they must outlive it.
+     */
+    AG_ARRAY_OF(const evutil_socket_t) queue_fds;
+    /**
+     * The descriptors were opened with `IFF_VNET_HDR` and segmentation offloads (Linux only),
+     * see `VpnOsTunnelSettings::offload`.
+     */
+    bool offload;
+    /**
+     * Service the descriptors with io_uring instead of a syscall per packet (Linux only).
+     * Falls back to syscalls if io_uring is not available.
+     */
+    bool io_uring;
+    /**
+     * For non-fd mode without `tunnel`: collect the packets produced during an event loop iteration and raise
+     * them with a single `VPN_EVENT_CLIENT_OUTPUT_BATCH` instead of `VPN_EVENT_CLIENT_OUTPUT` per packet.
+     */
+    bool batch_output;
 } VpnTunListenerConfig;
 
 /**
@@ -152,8 +179,26 @@ typedef struct {
 } VpnListenerConfig;
 
 typedef struct {
-    /** Number of parallel HTTP2 sessions. If 0, default value will be assigned. */
+    /** Maximum number of parallel HTTP2 sessions. If 0, default value will be assigned. */
     uint32_t connections_num;
+    /** Number of HTTP2 sessions kept open even if unused. If 0, 1 will be assigned. */
+    uint32_t min_connections_num;
+    /**
+     * Number of unused HTTP2 sessions established ahead of demand, so that a connection which
+     * does not fit in the existing sessions does not wait for a handshake. 0 disables it.
+     */
+    uint32_t spare_connections_num;
+    /**
+     * Sessions without connections above `min_connections_num` are closed after being unused
+     * for this period. If 0, default value will be assigned.
+     */
+    uint32_t idle_connection_timeout_ms;
+    /**
+     * Bounds of the session receive window. The window is adjusted within them after the estimated
+     * bandwidth-delay product of the connection. If 0, default value will be assigned.
+     */
+    uint32_t min_window_size;
+    uint32_t max_window_size;
 } VpnHttp2UpstreamConfig;
 
 typedef struct {
@@ -207,6 +252,35 @@ typedef struct {
     VpnUpstreamProtocolConfig protocol;
 } VpnUpstreamFallbackConfig;
 
+/**
+ * Priority class of a connection routed through a VPN endpoint.
+ * The connections of a higher class get a larger share of an HTTP/2 session. The default and bulk
+ * connections may fill only a part of the session's socket write buffer, so that the interactive data
+ * is not stuck behind theirs.
+ */
+typedef enum {
+    VPN_TC_DEFAULT,     /**< Ordinary traffic */
+    VPN_TC_INTERACTIVE, /**< Latency-sensitive traffic, e.g. remote shells, VoIP, games */
+    VPN_TC_BULK,        /**< Background transfers, e.g. downloads, backups */
+} VpnTrafficClass;
+
+/**
+ * A rule assigning a priority class to the matching connections.
+ * A connection matches if it matches all the specified criteria.
+ */
+typedef struct {
+    /** Name of the application which initiated the connection (case-insensitive). If null, any. */
+    const char *app_name;
+    /** Range of the destination ports. If both are 0, any. */
+    uint16_t port_min;
+    uint16_t port_max;
+    /** If true, the DSCP of the packet which initiated the connection must be equal to `dscp` */
+    bool match_dscp;
+    uint8_t dscp;
+    /** The class assigned to the matching connections */
+    VpnTrafficClass traffic_class;
+} VpnTrafficClassRule;
+
 /**
  * VPN client's server-side interface configuration
  */
@@ -256,6 +330,13 @@ typedef struct {
     VpnUpstreamSessionRecoverySettings recovery;
     /** Enable anti-dpi measures */
     bool anti_dpi;
+    /**
+     * Rules assigning priority classes to the connections, the first matching one is applied.
+     * The connections not matching any rule are classified by the DSCP of the packet which initiated
+     * them (EF, CS4-CS7, AF4x are interactive, CS1 and LE are bulk) and then by the well-known ports
+     * of the interactive protocols (SSH, Telnet, DNS, RDP, VNC, SIP, STUN/TURN).
+     */
+    AG_ARRAY_OF(const VpnTrafficClassRule) traffic_class_rules;
 } VpnUpstreamConfig;
 
 /**
@@ -283,6 +364,9 @@ typedef enum {
                                             `VpnTunnelConnectionClosedEvent`) */
     VPN_EVENT_CONNECTION_INFO,           /** Notifies that connection info is ready (raised with
                                             `VpnConnectionInfoEvent`) */
+    VPN_EVENT_CLIENT_OUTPUT_BATCH,       /** Raised instead of `VPN_EVENT_CLIENT_OUTPUT` if
+                                            `VpnTunListenerConfig.batch_output` is set (raised with
+                                            `VpnClientOutputBatchEvent`) */
 } VpnEvent;
 
 typedef struct {
@@ -364,6 +448,11 @@ typedef struct {
     } packet;                       // note, that it's a single packet which should be sent in one piece
 } VpnClientOutputEvent;
 
+typedef struct {
+    size_t packets_num;                  // number of packets
+    const VpnClientOutputEvent *packets; // packets in the order they were produced (valid only during the call)
+} VpnClientOutputBatchEvent;
+
 typedef enum {
     VPN_AT_ADDR, // address contains socket address
     VPN_AT_HOST, // address contains host name + port
@@ -522,8 +611,8 @@ typedef struct {
      */
     ag::VpnStr exclusions;
     /**
-     * Path to directory where some temporary files (like connection buffers) will be stored.
-     * If null, temporary files won't be used at all.
+     * Path to directory where some temporary files will be stored (like the file which
+     * the connection buffers spill their data to). If null, temporary files won't be used at all.
      */
     const char *tmp_files_base_path;
     /**
@@ -533,11 +622,17 @@ typedef struct {
      */
     int conn_memory_buffer_threshold;
     /**
-     * Maximum size of file of a connection data buffer.
+     * Maximum size of the data a connection buffer spills to the file.
      * If `tmp_files_base_path` is null, takes no effect. Otherwise, if equals 0,
      * `VPN_DEFAULT_MAX_CONN_BUFFER_FILE_SIZE` will be used.
      */
     int max_conn_buffer_file_size;
+    /**
+     * Limit of the total size of the data buffered for all connections (both in memory and in files).
+     * Exceeding it makes the connections with the largest buffers stop accepting data from their peers
+     * until the total goes down. If equals 0, `VPN_DEFAULT_CONN_BUFFERS_BUDGET` will be used.
+     */
+    int conn_buffers_budget;
     /**
      * When disabled, all connection requests are routed directly to target hosts in case session
      * to VPN endpoint is lost and the library fails to recover it. This helps not to break
@@ -707,6 +802,12 @@ WIN_EXPORT void vpn_close(Vpn *vpn);
  */
 WIN_EXPORT SocketAddressStorage vpn_get_socks_listener_address(Vpn *vpn);
 
+/**
+ * Return the total size of the data currently buffered for the connections
+ * (see `VpnSettings::conn_buffers_budget`). May be called from any thread.
+ */
+WIN_EXPORT size_t vpn_get_conn_buffers_usage(Vpn *vpn);
+
 /**
  * Clone common listener config.
  * @return cloned config (must be freed by caller via `vpn_listener_config_destroy()`)
@@ -716,15 +817,32 @@ WIN_EXPORT VpnListenerConfig vpn_listener_config_clone(const VpnListenerConfig *
 /** Destroy cloned common listener config. */
 WIN_EXPORT void vpn_listener_config_destroy(VpnListenerConfig *config);
 
+typedef enum {
+    VPN_PCPR_OK,         /**< All the packets are scheduled for processing */
+    VPN_PCPR_QUEUE_FULL, /**< The client packet queue is full, only a part of the packets (or none) is scheduled */
+    VPN_PCPR_STOPPED,    /**< VPN client is not running */
+} VpnProcessClientPacketsResult;
+
 /**
  * Pass data packets received from a client application to the client listener in case it
- * doesn't listen for incoming data by itself
+ * doesn't listen for incoming data by itself.
+ * The packets that don't fit in the client packet queue are dropped.
  * @param vpn VPN client
  * @param packets packets
  * @return true if processing has been scheduled, false it vpn is already stopped
  */
 bool vpn_process_client_packets(Vpn *vpn, VpnPackets packets);
 
+/**
+ * Same as `vpn_process_client_packets()`, but reports backpressure instead of dropping packets.
+ * May be called from any thread, neither locks nor allocates.
+ * @param vpn VPN client
+ * @param packets packets; on return, contains the packets which were not scheduled (their ownership
+ *                stays with the caller, e.g. to retry them after the queue drains)
+ * @return see `VpnProcessClientPacketsResult`
+ */
+VpnProcessClientPacketsResult vpn_try_process_client_packets(Vpn *vpn, VpnPackets *packets);
+
 /**
  * Complete connect request according to action.
  * @param vpn VPN client
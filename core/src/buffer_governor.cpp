@@ -0,0 +1,168 @@
+#include "vpn/internal/buffer_governor.h"
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+#include <vector>
+
+namespace ag {
+
+BufferGovernor::Account::~Account() {
+    close();
+}
+
+BufferGovernor::Account::Account(Account &&other) noexcept
+        : m_governor(std::exchange(other.m_governor, nullptr))
+        , m_key(other.m_key) {
+}
+
+BufferGovernor::Account &BufferGovernor::Account::operator=(Account &&other) noexcept {
+    if (this != &other) {
+        close();
+        m_governor = std::exchange(other.m_governor, nullptr);
+        m_key = other.m_key;
+    }
+    return *this;
+}
+
+void BufferGovernor::Account::set_size(size_t size) {
+    if (m_governor != nullptr) {
+        m_governor->update(m_key, size);
+    }
+}
+
+bool BufferGovernor::Account::throttled() const {
+    if (m_governor == nullptr) {
+        return false;
+    }
+    auto i = m_governor->m_accounts.find(m_key);
+    return i != m_governor->m_accounts.end() && i->second.throttled;
+}
+
+void BufferGovernor::Account::close() {
+    if (BufferGovernor *governor = std::exchange(m_governor, nullptr); governor != nullptr) {
+        governor->close(m_key);
+    }
+}
+
+void BufferGovernor::set_budget(size_t budget) {
+    m_budget = budget;
+    rebalance();
+}
+
+BufferGovernor::Account BufferGovernor::open_account(uint64_t conn_id, Handler handler) {
+    uint64_t key = m_next_key++;
+    m_accounts.emplace(key, Entry{.conn_id = conn_id, .handler = handler});
+    return {this, key};
+}
+
+void BufferGovernor::update(uint64_t key, size_t size) {
+    auto i = m_accounts.find(key);
+    assert(i != m_accounts.end());
+    Entry &entry = i->second;
+    m_usage.store(usage() - entry.size + size, std::memory_order_relaxed);
+    if (entry.throttled) {
+        m_throttled_usage = m_throttled_usage - entry.size + size;
+    }
+    entry.size = size;
+
+    if (entry.throttled && size == 0 && usage() <= m_budget) {
+        // Do not starve the connection while the others keep the total above the low watermark
+        entry.throttled = false;
+        --m_throttled_num;
+        dbglog(m_log, "Buffered {} bytes of {} allowed, released drained connection", usage(), m_budget);
+        entry.handler.func(entry.handler.arg, entry.conn_id, false);
+    }
+
+    rebalance();
+}
+
+void BufferGovernor::close(uint64_t key) {
+    auto i = m_accounts.find(key);
+    assert(i != m_accounts.end());
+    const Entry &entry = i->second;
+    m_usage.store(usage() - entry.size, std::memory_order_relaxed);
+    if (entry.throttled) {
+        m_throttled_usage -= entry.size;
+        --m_throttled_num;
+    }
+    m_accounts.erase(i);
+
+    // Accounts are closed while the connections are being destroyed, which is not the right moment
+    // to raise the handlers
+    if (m_ev_loop != nullptr && !m_rebalance_task_id.has_value()) {
+        m_rebalance_task_id = event_loop::submit(m_ev_loop,
+                {
+                        this,
+                        [](void *arg, TaskId) {
+                            auto *self = (BufferGovernor *) arg;
+                            self->m_rebalance_task_id.release();
+                            self->rebalance();
+                        },
+                });
+    }
+}
+
+void BufferGovernor::rebalance() {
+    size_t total = usage();
+    if (total > m_budget && total - m_throttled_usage > low_watermark()) {
+        throttle_largest();
+    } else if (m_throttled_num > 0 && total <= low_watermark()) {
+        release_all();
+    }
+}
+
+void BufferGovernor::throttle_largest() {
+    std::vector<std::pair<size_t, uint64_t>> candidates;
+    for (const auto &[key, entry] : m_accounts) {
+        if (!entry.throttled && entry.size > 0) {
+            candidates.emplace_back(entry.size, key);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), std::greater<>{});
+
+    std::vector<uint64_t> throttled;
+    for (const auto &[size, key] : candidates) {
+        if (usage() - m_throttled_usage <= low_watermark()) {
+            break;
+        }
+        m_accounts[key].throttled = true;
+        m_throttled_usage += size;
+        ++m_throttled_num;
+        throttled.push_back(key);
+    }
+
+    dbglog(m_log, "Buffered {} bytes of {} allowed, throttled {} more connection(s), {} in total", usage(), m_budget,
+            throttled.size(), m_throttled_num);
+
+    // The handlers may close the accounts
+    for (uint64_t key : throttled) {
+        if (auto i = m_accounts.find(key); i != m_accounts.end()) {
+            i->second.handler.func(i->second.handler.arg, i->second.conn_id, true);
+        }
+    }
+}
+
+void BufferGovernor::release_all() {
+    std::vector<uint64_t> released;
+    released.reserve(m_throttled_num);
+    for (auto &[key, entry] : m_accounts) {
+        if (entry.throttled) {
+            entry.throttled = false;
+            released.push_back(key);
+        }
+    }
+    m_throttled_usage = 0;
+    m_throttled_num = 0;
+
+    dbglog(m_log, "Buffered {} bytes of {} allowed, released {} connection(s)", usage(), m_budget, released.size());
+
+    // The handlers may close the accounts
+    for (uint64_t key : released) {
+        if (auto i = m_accounts.find(key); i != m_accounts.end()) {
+            i->second.handler.func(i->second.handler.arg, i->second.conn_id, false);
+        }
+    }
+}
+
+} // namespace ag
@@ -0,0 +1,137 @@
+#include "client_packet_queue.h"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <thread>
+
+namespace ag {
+
+ClientPacketQueue::ClientPacketQueue(size_t capacity, Handler handler, void *arg)
+        : m_slots(new Slot[std::bit_ceil(std::max<size_t>(capacity, 1))])
+        , m_mask(std::bit_ceil(std::max<size_t>(capacity, 1)) - 1)
+        , m_handler(handler)
+        , m_handler_arg(arg) {
+    m_batch.reserve(BATCH_SIZE);
+}
+
+ClientPacketQueue::~ClientPacketQueue() {
+    stop();
+}
+
+bool ClientPacketQueue::start(VpnEventLoop *loop) {
+    assert(!m_open.load());
+    m_event.reset(event_new(vpn_event_loop_get_base(loop), -1, 0, on_wakeup, this));
+    if (m_event == nullptr) {
+        return false;
+    }
+    m_wakeup_pending.store(false);
+    m_open.store(true);
+    return true;
+}
+
+void ClientPacketQueue::stop() {
+    m_open.store(false);
+    // A producer which has seen the queue open is about to finish, let it publish its packets
+    while (m_producers.load() != 0) {
+        std::this_thread::yield();
+    }
+    m_event.reset();
+    release_queued();
+}
+
+VpnProcessClientPacketsResult ClientPacketQueue::push(VpnPackets *packets) {
+    // Pairs with `stop()`: either it sees the producer and waits for it, or the producer sees the queue closed
+    m_producers.fetch_add(1);
+    if (!m_open.load()) {
+        m_producers.fetch_sub(1);
+        return VPN_PCPR_STOPPED;
+    }
+
+    uint64_t tail = m_tail.load(std::memory_order_relaxed);
+    size_t n;
+    do {
+        uint64_t head = m_head.load(std::memory_order_acquire);
+        size_t free = m_mask + 1 - size_t(tail - head);
+        n = std::min<size_t>(packets->size, free);
+        if (n == 0) {
+            break;
+        }
+    } while (!m_tail.compare_exchange_weak(tail, tail + n, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    for (size_t i = 0; i < n; ++i) {
+        Slot &slot = m_slots[(tail + i) & m_mask];
+        slot.packet = packets->data[i];
+        slot.seq.store(tail + i + 1, std::memory_order_release);
+    }
+    packets->data += n;
+    packets->size -= n;
+    if (n != 0) {
+        wakeup();
+    }
+
+    m_producers.fetch_sub(1, std::memory_order_release);
+    return (packets->size == 0) ? VPN_PCPR_OK : VPN_PCPR_QUEUE_FULL;
+}
+
+size_t ClientPacketQueue::size() const {
+    uint64_t head = m_head.load(std::memory_order_acquire);
+    uint64_t tail = m_tail.load(std::memory_order_acquire);
+    return (tail > head) ? size_t(tail - head) : 0;
+}
+
+void ClientPacketQueue::on_wakeup(evutil_socket_t, short, void *arg) {
+    auto *self = (ClientPacketQueue *) arg;
+    self->drain();
+}
+
+void ClientPacketQueue::wakeup() {
+    // The consumer resets the flag before draining, so only the first batch after that activates the event
+    if (!m_wakeup_pending.exchange(true, std::memory_order_acq_rel)) {
+        event_active(m_event.get(), 0, 0);
+    }
+}
+
+void ClientPacketQueue::drain() {
+    m_wakeup_pending.exchange(false, std::memory_order_acq_rel);
+
+    size_t delivered = 0;
+    uint64_t head = m_head.load(std::memory_order_relaxed);
+    while (delivered < DRAIN_BUDGET) {
+        m_batch.clear();
+        while (m_batch.size() < BATCH_SIZE) {
+            Slot &slot = m_slots[head & m_mask];
+            if (slot.seq.load(std::memory_order_acquire) != head + 1) {
+                // Not published yet, the producer will wake us up
+                break;
+            }
+            m_batch.push_back(slot.packet);
+            ++head;
+        }
+        if (m_batch.empty()) {
+            return;
+        }
+        m_head.store(head, std::memory_order_release);
+        delivered += m_batch.size();
+        m_handler(m_handler_arg, {m_batch.data(), uint32_t(m_batch.size())});
+    }
+
+    // Let the other events be processed before the rest of the queue
+    if (m_slots[head & m_mask].seq.load(std::memory_order_acquire) == head + 1) {
+        wakeup();
+    }
+}
+
+void ClientPacketQueue::release_queued() {
+    uint64_t head = m_head.load();
+    uint64_t tail = m_tail.load();
+    for (; head != tail; ++head) {
+        VpnPacket &packet = m_slots[head & m_mask].packet;
+        if (packet.destructor != nullptr) {
+            packet.destructor(packet.destructor_arg, packet.data);
+        }
+    }
+    m_head.store(head);
+}
+
+} // namespace ag
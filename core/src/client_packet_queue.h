@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <event2/event.h>
+
+#include "common/defs.h"
+#include "vpn/event_loop.h"
+#include "vpn/utils.h"
+#include "vpn/vpn.h"
+
+namespace ag {
+
+/**
+ * Bounded multi-producer single-consumer queue passing client packets from application threads
+ * to the event loop.
+ *
+ * A producer reserves a range of slots with a CAS on the tail and publishes each slot by storing
+ * its sequence number, so pushing takes neither a lock nor an allocation. The event loop is woken up
+ * (with `event_active()`, i.e. an eventfd write) only if it is not going to drain the queue already,
+ * so a burst of batches costs a single wakeup.
+ */
+class ClientPacketQueue {
+public:
+    /** Maximum number of packets passed to the handler at once */
+    static constexpr size_t BATCH_SIZE = 64;
+
+    /**
+     * Packets handler, called on the event loop. Takes the ownership of the packets.
+     */
+    using Handler = void (*)(void *arg, VpnPackets packets);
+
+    /**
+     * @param capacity maximum number of queued packets (rounded up to a power of two)
+     * @param handler packets handler
+     * @param arg handler argument
+     */
+    ClientPacketQueue(size_t capacity, Handler handler, void *arg);
+    ~ClientPacketQueue();
+
+    ClientPacketQueue(const ClientPacketQueue &) = delete;
+    ClientPacketQueue &operator=(const ClientPacketQueue &) = delete;
+    ClientPacketQueue(ClientPacketQueue &&) = delete;
+    ClientPacketQueue &operator=(ClientPacketQueue &&) = delete;
+
+    /**
+     * Start accepting packets and delivering them on the event loop
+     * @return false if failed
+     */
+    bool start(VpnEventLoop *loop);
+
+    /**
+     * Stop accepting packets and release the ones not delivered yet.
+     * Must be called when the event loop is not running. Waits for the concurrent `push()` calls to return.
+     */
+    void stop();
+
+    /**
+     * Queue packets. May be called from any thread.
+     * @param packets the packets; on return, the packets not taken (the caller keeps their ownership)
+     * @return `VPN_PCPR_OK` if all the packets are queued,
+     *         `VPN_PCPR_QUEUE_FULL` if only part of the packets (or none) fit,
+     *         `VPN_PCPR_STOPPED` if the queue is not started
+     */
+    VpnProcessClientPacketsResult push(VpnPackets *packets);
+
+    /**
+     * Number of packets queued but not delivered yet (approximate if called concurrently)
+     */
+    [[nodiscard]] size_t size() const;
+
+private:
+    static constexpr size_t CACHE_LINE_SIZE = 64;
+    /** Maximum number of packets delivered per wakeup, so that the rest of the loop is not starved */
+    static constexpr size_t DRAIN_BUDGET = 4 * BATCH_SIZE;
+
+    struct Slot {
+        std::atomic<uint64_t> seq{0}; /**< Position + 1 once the packet at the position is published */
+        VpnPacket packet{};
+    };
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask;
+    Handler m_handler;
+    void *m_handler_arg;
+    DeclPtr<event, &event_free> m_event;
+    std::vector<VpnPacket> m_batch; /**< Packets being delivered (accessed by the consumer only) */
+
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> m_tail{0}; /**< Next position to reserve */
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> m_head{0}; /**< Next position to deliver */
+    alignas(CACHE_LINE_SIZE) std::atomic<bool> m_wakeup_pending{false};
+    std::atomic<bool> m_open{false};
+    std::atomic<uint32_t> m_producers{0}; /**< Number of `push()` calls in progress */
+
+    static void on_wakeup(evutil_socket_t, short, void *arg);
+    void wakeup();
+    void drain();
+    void release_queued();
+};
+
+} // namespace ag
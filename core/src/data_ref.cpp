@@ -0,0 +1,134 @@
+#include "vpn/internal/data_ref.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+namespace ag {
+
+struct DataRef::HeapBlock {
+    size_t refs;
+    uint8_t data[];
+};
+
+DataRef::DataRef(TcpipBuffer *buffer, U8View data)
+        : m_kind(TCPIP_BUFFER)
+        , m_storage(buffer)
+        , m_data(data.data())
+        , m_size(data.size()) {
+    assert(buffer != nullptr);
+    ref();
+}
+
+DataRef DataRef::copy_of(U8View data) {
+    // NOLINTNEXTLINE(cppcoreguidelines-no-malloc,hicpp-no-malloc)
+    auto *block = (HeapBlock *) malloc(sizeof(HeapBlock) + data.size());
+    if (block == nullptr) {
+        abort();
+    }
+    block->refs = 1;
+    if (!data.empty()) {
+        std::memcpy(block->data, data.data(), data.size());
+    }
+
+    DataRef ref;
+    ref.m_kind = HEAP;
+    ref.m_storage = block;
+    ref.m_data = block->data;
+    ref.m_size = data.size();
+    return ref;
+}
+
+DataRef::~DataRef() {
+    unref();
+}
+
+DataRef::DataRef(const DataRef &other)
+        : m_kind(other.m_kind)
+        , m_storage(other.m_storage)
+        , m_data(other.m_data)
+        , m_size(other.m_size) {
+    ref();
+}
+
+DataRef &DataRef::operator=(const DataRef &other) {
+    if (this != &other) {
+        other.ref();
+        unref();
+        m_kind = other.m_kind;
+        m_storage = other.m_storage;
+        m_data = other.m_data;
+        m_size = other.m_size;
+    }
+    return *this;
+}
+
+DataRef::DataRef(DataRef &&other) noexcept
+        : m_kind(std::exchange(other.m_kind, BORROWED))
+        , m_storage(std::exchange(other.m_storage, nullptr))
+        , m_data(std::exchange(other.m_data, nullptr))
+        , m_size(std::exchange(other.m_size, 0)) {
+}
+
+DataRef &DataRef::operator=(DataRef &&other) noexcept {
+    if (this != &other) {
+        unref();
+        m_kind = std::exchange(other.m_kind, BORROWED);
+        m_storage = std::exchange(other.m_storage, nullptr);
+        m_data = std::exchange(other.m_data, nullptr);
+        m_size = std::exchange(other.m_size, 0);
+    }
+    return *this;
+}
+
+DataRef DataRef::to_owned() const {
+    return is_owned() ? *this : copy_of(view());
+}
+
+DataRef::Retained DataRef::retain() const {
+    assert(is_owned());
+    ref();
+    return {(m_kind == TCPIP_BUFFER) ? release_tcpip_buffer : release_heap_block, m_storage};
+}
+
+void DataRef::ref() const {
+    switch (m_kind) {
+    case BORROWED:
+        break;
+    case TCPIP_BUFFER:
+        tcpip_buffer_ref((TcpipBuffer *) m_storage);
+        break;
+    case HEAP:
+        ++((HeapBlock *) m_storage)->refs;
+        break;
+    }
+}
+
+void DataRef::unref() {
+    switch (m_kind) {
+    case BORROWED:
+        break;
+    case TCPIP_BUFFER:
+        release_tcpip_buffer(nullptr, 0, m_storage);
+        break;
+    case HEAP:
+        release_heap_block(nullptr, 0, m_storage);
+        break;
+    }
+    m_kind = BORROWED;
+    m_storage = nullptr;
+}
+
+void DataRef::release_tcpip_buffer(const void *, size_t, void *arg) {
+    tcpip_buffer_unref((TcpipBuffer *) arg);
+}
+
+void DataRef::release_heap_block(const void *, size_t, void *arg) {
+    auto *block = (HeapBlock *) arg;
+    if (--block->refs == 0) {
+        free(block); // NOLINT(cppcoreguidelines-no-malloc,hicpp-no-malloc)
+    }
+}
+
+} // namespace ag
@@ -366,6 +366,33 @@ ssize_t DirectUpstream::send(uint64_t id, const uint8_t *data, size_t length) {
     return -1;
 }
 
+ssize_t DirectUpstream::send(uint64_t id, std::span<const DataRef> chunks) {
+    auto i = m_tcp_connections.find(id);
+    if (i == m_tcp_connections.end()) {
+        return ServerUpstream::send(id, chunks);
+    }
+
+    TcpConnection *conn = &i->second;
+    ssize_t total = 0;
+    for (const DataRef &chunk : chunks) {
+        VpnError error;
+        if (chunk.is_owned()) {
+            DataRef::Retained retained = chunk.retain();
+            error = tcp_socket_write_ref(
+                    conn->socket.get(), chunk.data(), chunk.size(), retained.cleanup, retained.arg);
+        } else {
+            error = tcp_socket_write(conn->socket.get(), chunk.data(), chunk.size());
+        }
+        if (error.code != 0) {
+            log_conn(this, id, dbg, "Failed to send data: {} ({})", safe_to_string_view(error.text), error.code);
+            return (total > 0) ? total : -1;
+        }
+        total += ssize_t(chunk.size());
+    }
+
+    return total;
+}
+
 void DirectUpstream::consume(uint64_t id, size_t length) {
     // do nothing
 }
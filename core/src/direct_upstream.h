@@ -62,6 +62,7 @@ private:
     uint64_t open_connection(const TunnelAddressPair *addr, int proto, std::string_view app_name) override;
     void close_connection(uint64_t id, bool graceful, bool async) override;
     ssize_t send(uint64_t id, const uint8_t *data, size_t length) override;
+    ssize_t send(uint64_t id, std::span<const DataRef> chunks) override;
     void consume(uint64_t id, size_t length) override;
     size_t available_to_send(uint64_t id) override;
     void update_flow_control(uint64_t id, TcpFlowCtrlInfo info) override;
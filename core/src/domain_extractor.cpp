@@ -292,6 +292,10 @@ void DomainExtractor::reset() {
     m_context.reset();
 }
 
+size_t DomainExtractor::memory_usage() const {
+    return (m_context != nullptr) ? sizeof(Context) + m_context->buffer.capacity() : 0;
+}
+
 DomainExtractor::DomainExtractor() = default;
 DomainExtractor::~DomainExtractor() = default;
 
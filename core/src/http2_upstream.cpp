@@ -1,10 +1,14 @@
 #include "http2_upstream.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include <event2/util.h>
+#include <magic_enum/magic_enum.hpp>
 #include <nghttp2/nghttp2.h>
 
 #include "common/net_utils.h"
@@ -129,15 +133,25 @@ int Http2Upstream::read_out_pending_data(uint64_t id, TcpConnection *conn) {
     DataBuffer *pending = conn->unread_data.get();
 
     while (conn->flags.test(TcpConnection::TCF_READ_ENABLED) && pending->size() > 0) {
-        BufferPeekResult res = pending->peek();
-        if (res.err.has_value()) {
-            log_conn(this, id, err, "Failed to read buffered data: {}", *res.err);
-            return -1;
-        }
-        int r = handle_read(id, res.data.data(), res.data.size());
-        if (r > 0) {
-            pending->drain(r);
-        } else if (r < 0) {
+        std::array<U8View, DataBuffer::PEEK_CHUNKS_NUM> chunks;
+        size_t chunks_num = pending->peek(chunks);
+        size_t read = 0;
+        int r = 0;
+        for (size_t i = 0; i < chunks_num && conn->flags.test(TcpConnection::TCF_READ_ENABLED); ++i) {
+            r = handle_read(id, chunks[i].data(), chunks[i].size());
+            if (r < 0) {
+                break;
+            }
+            read += r;
+            if (size_t(r) < chunks[i].size()) {
+                break;
+            }
+        }
+        if (read > 0) {
+            pending->drain(read);
+            conn->buffer_account.set_size(pending->size());
+        }
+        if (r < 0) {
             return r;
         }
     }
@@ -199,13 +213,15 @@ void Http2Upstream::http_handler(void *arg, HttpEventId what, void *data) {
                 size_t size = http_event->length - http_event->result;
 
                 if (pending == nullptr) {
-                    conn->unread_data = upstream->vpn->make_buffer(found.first);
+                    conn->unread_data = upstream->vpn->make_buffer();
                     pending = conn->unread_data.get();
                     if (std::optional<std::string> err = pending->init(); err.has_value()) {
                         log_conn(upstream, found.first, err, "Failed to initialize data buffer: {}", *err);
                         http_event->result = -1;
                         break;
                     }
+                    conn->buffer_account = upstream->vpn->buffer_governor.open_account(
+                            found.first, {buffer_governor_handler, upstream});
                 }
 
                 // FIXME: this buffer grows too large for comfort:
@@ -216,6 +232,7 @@ void Http2Upstream::http_handler(void *arg, HttpEventId what, void *data) {
                     log_conn(upstream, found.first, err, "Failed to put data (size={}) in buffer: {}", size, *err);
                     http_event->result = -1;
                 }
+                conn->buffer_account.set_size(pending->size());
             }
             http_event->result = std::min(http_event->result, 0);
         }
@@ -292,6 +309,11 @@ void Http2Upstream::http_handler(void *arg, HttpEventId what, void *data) {
         if ((uint32_t) http_event->stream_id != upstream->m_udp_mux.get_stream_id()) {
             auto found = upstream->get_conn_by_stream_id(http_event->stream_id);
             if (found.second != nullptr) {
+                if (http_event->length > 0) {
+                    upstream->m_send_queue.push(found.second->traffic_class, http_event->length,
+                            upstream->m_output_bytes + http_event->pending_output);
+                }
+
                 ServerDataSentEvent serv_event = {found.first, http_event->length};
                 upstream->handler.func(upstream->handler.arg, SERVER_EVENT_DATA_SENT, &serv_event);
             }
@@ -322,8 +344,12 @@ void Http2Upstream::http_handler(void *arg, HttpEventId what, void *data) {
     case HTTP_EVENT_OUTPUT: {
         const HttpOutputEvent *http_event = (HttpOutputEvent *) data;
         log_upstream(upstream, trace, "Sending {} bytes to server", http_event->length);
+        upstream->m_output_bytes += http_event->length;
 
-        VpnError error = tcp_socket_write(upstream->m_socket.get(), http_event->data, http_event->length);
+        VpnError error = (http_event->cleanup != nullptr)
+                ? tcp_socket_write_ref(upstream->m_socket.get(), http_event->data, http_event->length,
+                        http_event->cleanup, http_event->cleanup_arg)
+                : tcp_socket_write(upstream->m_socket.get(), http_event->data, http_event->length);
         if (error.code != 0) {
             upstream->close_session_inner(VpnError{VPN_EC_ERROR, error.text});
         }
@@ -335,8 +361,9 @@ void Http2Upstream::http_handler(void *arg, HttpEventId what, void *data) {
 int Http2Upstream::establish_http_session() {
     assert(m_session == nullptr);
 
-    HttpSessionParams params = {
-            uint64_t(this->id), {http_handler, this}, HTTP2_STREAM_INITIAL_WINDOW_SIZE, HTTP_VER_2_0};
+    const VpnHttp2UpstreamConfig &h2_config = this->PROTOCOL_CONFIG->http2;
+    HttpSessionParams params = {uint64_t(this->id), {http_handler, this}, HTTP2_STREAM_INITIAL_WINDOW_SIZE,
+            HTTP_VER_2_0, h2_config.min_window_size, h2_config.max_window_size};
     m_session.reset(http_session_open(&params));
 
     int r = 0;
@@ -436,11 +463,26 @@ void Http2Upstream::net_handler(void *arg, TcpSocketEvent what, void *data) {
         break;
     }
     case TCP_SOCKET_EVENT_SENT: {
-        // do nothing
+        std::bitset<TRAFFIC_CLASSES_NUM> unblocked = upstream->release_sent_data(false);
+        if (unblocked.none()) {
+            break;
+        }
+
+        std::vector<uint64_t> ids;
+        for (auto &[id, conn] : upstream->m_tcp_connections) {
+            if (unblocked.test(conn.traffic_class)) {
+                ids.push_back(id);
+            }
+        }
+        for (uint64_t id : ids) {
+            ServerDataSentEvent serv_event = {id, 0};
+            upstream->handler.func(upstream->handler.arg, SERVER_EVENT_DATA_SENT, &serv_event);
+        }
         break;
     }
     case TCP_SOCKET_EVENT_WRITE_FLUSH: {
         log_upstream(upstream, trace, "Write buffer flushed");
+        upstream->release_sent_data(true);
 
         for (auto &[id, _] : upstream->m_tcp_connections) {
             ServerDataSentEvent serv_event = {id, 0};
@@ -589,6 +631,8 @@ void Http2Upstream::close_session() {
     m_icmp_mux.close();
     m_stream_id_generator.reset();
     m_health_check_info.reset();
+    m_send_queue.reset();
+    m_output_bytes = 0;
 
     m_closing = false;
 
@@ -733,6 +777,37 @@ ssize_t Http2Upstream::send(uint64_t id, const uint8_t *data, size_t length) {
     return r;
 }
 
+ssize_t Http2Upstream::send(uint64_t id, std::span<const DataRef> chunks) {
+    auto i = m_tcp_connections.find(id);
+    if (i == m_tcp_connections.end() || i->second.flags.test(TcpConnection::TCF_STREAM_CLOSED)) {
+        // Datagrams are framed into the multiplexer's stream anyway
+        return ServerUpstream::send(id, chunks);
+    }
+
+    TcpConnection *conn = &i->second;
+    ssize_t total = 0;
+    for (const DataRef &chunk : chunks) {
+        int r;
+        if (chunk.is_owned()) {
+            DataRef::Retained retained = chunk.retain();
+            r = http_session_send_data_ref(m_session.get(), (int32_t) conn->stream_id, chunk.data(), chunk.size(),
+                    retained.cleanup, retained.arg);
+        } else {
+            r = http_session_send_data(m_session.get(), (int32_t) conn->stream_id, chunk.data(), chunk.size(), false);
+        }
+        if (r == NGHTTP2_ERR_BUFFER_ERROR) {
+            break;
+        }
+        if (r != 0) {
+            log_conn(this, id, dbg, "Failed to send data from client: {} ({})", nghttp2_strerror(r), r);
+            return (total > 0) ? total : r;
+        }
+        total += ssize_t(chunk.size());
+    }
+
+    return total;
+}
+
 std::optional<uint32_t> Http2Upstream::get_stream_id(uint64_t id) const {
     std::optional<uint32_t> stream_id;
     if (m_udp_mux.check_connection(id)) {
@@ -762,6 +837,12 @@ void Http2Upstream::consume(uint64_t id, size_t length) {
         return;
     }
 
+    if (auto i = m_tcp_connections.find(id); i != m_tcp_connections.end() && i->second.buffer_account.throttled()) {
+        // Keep the stream window closed until the governor releases the connection
+        i->second.withheld_consume += length;
+        return;
+    }
+
     int r = http_session_data_consume(m_session.get(), (int32_t) stream_id.value(), length);
     if (r != 0) {
         log_conn(this, id, err, "Failed to consume data: {} ({})", nghttp2_strerror(r), r);
@@ -796,8 +877,46 @@ size_t Http2Upstream::available_to_send(uint64_t id) {
         return 0;
     }
 
-    return std::min(tcp_socket_available_to_write(m_socket.get()),
+    size_t available = std::min(tcp_socket_available_to_write(m_socket.get()),
             http_session_available_to_write(m_session.get(), (int32_t) stream_id.value()));
+    if (auto i = m_tcp_connections.find(id); i != m_tcp_connections.end()) {
+        // If the class is blocked, it's resumed once its data leaves the socket buffer
+        available = std::min(available, m_send_queue.available(i->second.traffic_class));
+    }
+
+    return available;
+}
+
+void Http2Upstream::set_traffic_class(uint64_t id, VpnTrafficClass traffic_class) {
+    auto i = m_tcp_connections.find(id);
+    if (i == m_tcp_connections.end()) {
+        // The datagrams of all the UDP connections share a single stream
+        return;
+    }
+
+    TcpConnection *conn = &i->second;
+    if (conn->traffic_class == traffic_class) {
+        return;
+    }
+
+    log_conn(this, id, dbg, "Traffic class: {}", magic_enum::enum_name(traffic_class));
+    conn->traffic_class = traffic_class;
+
+    if (!conn->flags.test(TcpConnection::TCF_STREAM_CLOSED)) {
+        int r = http_session_set_stream_weight(
+                m_session.get(), (int32_t) conn->stream_id, traffic_class_policy(traffic_class).weight);
+        if (r != 0) {
+            log_conn(this, id, dbg, "Failed to set stream weight: {} ({})", nghttp2_strerror(r), r);
+        }
+    }
+}
+
+std::bitset<TRAFFIC_CLASSES_NUM> Http2Upstream::release_sent_data(bool flushed) {
+    uint64_t written = m_output_bytes;
+    if (!flushed && m_socket != nullptr) {
+        written -= std::min(written, uint64_t(tcp_socket_get_write_queue_size(m_socket.get())));
+    }
+    return m_send_queue.release(written, flushed);
 }
 
 void Http2Upstream::complete_read(void *arg, TaskId) {
@@ -820,6 +939,27 @@ void Http2Upstream::complete_read(void *arg, TaskId) {
     }
 }
 
+void Http2Upstream::buffer_governor_handler(void *arg, uint64_t id, bool throttled) {
+    auto *upstream = (Http2Upstream *) arg;
+    log_conn(upstream, id, dbg, "{} by buffer governor", throttled ? "Throttled" : "Released");
+    if (throttled) {
+        return;
+    }
+
+    auto i = upstream->m_tcp_connections.find(id);
+    if (i == upstream->m_tcp_connections.end()) {
+        return;
+    }
+    TcpConnection *conn = &i->second;
+    size_t withheld = std::exchange(conn->withheld_consume, 0);
+    if (withheld > 0 && conn->stream_id != 0 && !conn->flags.test(TcpConnection::TCF_STREAM_CLOSED)) {
+        int r = http_session_data_consume(upstream->m_session.get(), (int32_t) conn->stream_id, withheld);
+        if (r != 0) {
+            log_conn(upstream, id, err, "Failed to consume withheld data: {} ({})", nghttp2_strerror(r), r);
+        }
+    }
+}
+
 int Http2Upstream::verify_callback(X509_STORE_CTX *store_ctx, void *arg) {
     auto *self = (Http2Upstream *) arg;
     auto [ret, host_name, cert, chain] = verify_endpoint_cert(store_ctx, self->vpn);
@@ -867,6 +1007,15 @@ size_t Http2Upstream::connections_num() const {
     return m_tcp_connections.size() + m_udp_mux.connections_num();
 }
 
+UpstreamLoad Http2Upstream::get_load() const {
+    VpnConnectionStats stats = get_connection_stats();
+    return {
+            .rtt_us = stats.rtt_us,
+            .bytes_in_flight = stats.bytes_in_flight,
+            .send_queue_size = (m_socket != nullptr) ? tcp_socket_get_write_queue_size(m_socket.get()) : 0,
+    };
+}
+
 void Http2Upstream::do_health_check(bool need_result) {
     m_health_check_info.reset(); // Forget about the current health check.
 
@@ -917,7 +1066,16 @@ void Http2Upstream::cancel_health_check() {
 }
 
 VpnConnectionStats Http2Upstream::get_connection_stats() const {
-    return (m_socket != nullptr) ? tcp_socket_get_stats(m_socket.get()) : VpnConnectionStats{};
+    VpnConnectionStats stats = (m_socket != nullptr) ? tcp_socket_get_stats(m_socket.get()) : VpnConnectionStats{};
+    if (m_session != nullptr) {
+        HttpSessionStats session_stats = http_session_get_stats(m_session.get());
+        // The socket statistics are not available on every platform
+        if (stats.rtt_us == 0) {
+            stats.rtt_us = session_stats.rtt_us;
+        }
+        stats.recv_window_size = session_stats.recv_window_size;
+    }
+    return stats;
 }
 
 std::optional<uint64_t> Http2Upstream::send_connect_request_callback(
@@ -12,8 +12,10 @@
 #include "multiplexable_upstream.h"
 #include "net/http_session.h"
 #include "net/tcp_socket.h"
+#include "vpn/internal/buffer_governor.h"
 #include "vpn/internal/data_buffer.h"
 #include "vpn/internal/id_generator.h"
+#include "vpn/internal/traffic_classifier.h"
 #include "vpn/utils.h"
 
 namespace ag {
@@ -38,9 +40,12 @@ private:
         uint32_t stream_id = 0;
         std::bitset<width_of<Flag>()> flags;
         std::unique_ptr<DataBuffer> unread_data;
+        BufferGovernor::Account buffer_account; // tracks `unread_data`
+        size_t withheld_consume = 0;            // consumed bytes not yet reported to the peer while throttled
         event_loop::AutoTaskId complete_read_task_id;
         std::optional<ServerError> pending_error; // to store bad HTTP response status until stream processed event
         event_loop::AutoTaskId close_task_id;
+        VpnTrafficClass traffic_class = VPN_TC_DEFAULT;
     };
 
     struct HealthCheckInfo {
@@ -69,6 +74,10 @@ private:
     // For client initiated streams ids are odd numbers
     // https://tools.ietf.org/html/rfc7540#section-5.1.1
     IdGenerator m_stream_id_generator{2};
+    // Only the framed data is accounted, as the data waiting for the stream window must not hold back
+    // the other streams of the class
+    TrafficClassSendQueue m_send_queue;
+    uint64_t m_output_bytes = 0; // bytes of the session's output written to the socket
 
     ag::Logger m_log{"H2_UPSTREAM"};
 
@@ -76,6 +85,8 @@ private:
     void close_session() override;
     void close_connection(uint64_t id, bool graceful, bool async) override;
     ssize_t send(uint64_t id, const uint8_t *data, size_t length) override;
+    ssize_t send(uint64_t id, std::span<const DataRef> chunks) override;
+    void set_traffic_class(uint64_t id, VpnTrafficClass traffic_class) override;
     void consume(uint64_t id, size_t length) override;
     size_t available_to_send(uint64_t id) override;
     void update_flow_control(uint64_t id, TcpFlowCtrlInfo info) override;
@@ -83,6 +94,7 @@ private:
     void cancel_health_check() override;
     [[nodiscard]] VpnConnectionStats get_connection_stats() const override;
     [[nodiscard]] size_t connections_num() const override;
+    [[nodiscard]] UpstreamLoad get_load() const override;
     bool open_connection(uint64_t id, const TunnelAddressPair *addr, int proto, std::string_view app_name) override;
     void on_icmp_request(IcmpEchoRequestEvent &event) override;
     void handle_sleep() override;
@@ -92,6 +104,7 @@ private:
     static void http_handler(void *arg, HttpEventId what, void *data);
     static void net_handler(void *arg, TcpSocketEvent what, void *data);
     static void complete_read(void *arg, TaskId task_id);
+    static void buffer_governor_handler(void *arg, uint64_t id, bool throttled);
     static int verify_callback(X509_STORE_CTX *store_ctx, void *arg);
 
     int establish_http_session();
@@ -107,6 +120,13 @@ private:
 
     void close_session_inner(std::optional<VpnError> error);
     void clean_tcp_connection_data(uint64_t id);
+
+    /**
+     * Account the data which has left the socket write buffer
+     * @param flushed true if the buffer is empty
+     * @return the traffic classes which have got below the cap
+     */
+    std::bitset<TRAFFIC_CLASSES_NUM> release_sent_data(bool flushed);
     int handle_read(uint64_t id, const uint8_t *data, size_t length);
     void handle_response(const HttpHeadersEvent *http_event);
     void close_tcp_connection(uint64_t id, bool graceful);
@@ -1,8 +1,10 @@
 #include "http3_upstream.h"
 
 #include <algorithm>
+#include <array>
 #include <cstdlib>
 #include <unordered_set>
+#include <utility>
 
 #include <magic_enum/magic_enum.hpp>
 #include <openssl/rand.h>
@@ -730,7 +732,7 @@ void Http3Upstream::on_body(void *arg, uint64_t stream_id, Uint8View chunk) {
         }
         chunk.remove_prefix(r);
         if (r > 0) {
-            self->m_h3_client->consume_stream(stream_id, r);
+            self->consume_stream(conn, r);
         }
     }
 
@@ -1057,19 +1059,21 @@ std::optional<uint64_t> Http3Upstream::get_stream_id(uint64_t id) const {
     return stream_id;
 }
 
-bool Http3Upstream::push_unread_data(uint64_t conn_id, TcpConnection *conn, U8View data) const {
+bool Http3Upstream::push_unread_data(uint64_t conn_id, TcpConnection *conn, U8View data) {
     if (conn->unread_data == nullptr) {
-        conn->unread_data = this->vpn->make_buffer(conn_id);
+        conn->unread_data = this->vpn->make_buffer();
         if (std::optional<std::string> err = conn->unread_data->init(); err.has_value()) {
             log_conn(this, conn_id, err, "Failed to initialize data buffer: {}", *err);
             return false;
         }
+        conn->buffer_account = this->vpn->buffer_governor.open_account(conn_id, {buffer_governor_handler, this});
     }
 
     std::optional<std::string> err = conn->unread_data->push(data);
     if (err.has_value()) {
         log_conn(this, conn_id, err, "Failed to store data in buffer: {}", *err);
     }
+    conn->buffer_account.set_size(conn->unread_data->size());
 
     return !err.has_value();
 }
@@ -1081,19 +1085,27 @@ int Http3Upstream::read_out_pending_data(uint64_t conn_id, TcpConnection *conn)
     }
 
     while (conn->flags.test(TcpConnection::TCF_READ_ENABLED) && pending->size() > 0) {
-        BufferPeekResult res = pending->peek();
-        if (res.err.has_value()) {
-            log_conn(this, conn_id, err, "Failed to read buffered data: {}", *res.err);
-            return -1;
-        }
-        int r = this->raise_read_event(conn_id, res.data);
-        if (r > 0) {
-            pending->drain(r);
-            // Tell server it can now send r more bytes on this stream
-            if (m_h3_client) {
-                m_h3_client->consume_stream(conn->stream_id, r);
+        std::array<U8View, DataBuffer::PEEK_CHUNKS_NUM> chunks;
+        size_t chunks_num = pending->peek(chunks);
+        size_t read = 0;
+        int r = 0;
+        for (size_t i = 0; i < chunks_num && conn->flags.test(TcpConnection::TCF_READ_ENABLED); ++i) {
+            r = this->raise_read_event(conn_id, chunks[i]);
+            if (r < 0) {
+                break;
             }
-        } else if (r < 0) {
+            read += r;
+            if (size_t(r) < chunks[i].size()) {
+                break;
+            }
+        }
+        if (read > 0) {
+            pending->drain(read);
+            conn->buffer_account.set_size(pending->size());
+            // Tell server it can now send more bytes on this stream
+            consume_stream(conn, read);
+        }
+        if (r < 0) {
             return r;
         }
     }
@@ -1101,6 +1113,33 @@ int Http3Upstream::read_out_pending_data(uint64_t conn_id, TcpConnection *conn)
     return 0;
 }
 
+void Http3Upstream::consume_stream(TcpConnection *conn, size_t length) {
+    if (conn->buffer_account.throttled()) {
+        // Keep the stream window closed until the governor releases the connection
+        conn->withheld_consume += length;
+    } else if (m_h3_client) {
+        m_h3_client->consume_stream(conn->stream_id, length);
+    }
+}
+
+void Http3Upstream::buffer_governor_handler(void *arg, uint64_t conn_id, bool throttled) {
+    auto *self = (Http3Upstream *) arg;
+    log_conn(self, conn_id, dbg, "{} by buffer governor", throttled ? "Throttled" : "Released");
+    if (throttled) {
+        return;
+    }
+
+    auto it = self->m_tcp_connections.find(conn_id);
+    if (it == self->m_tcp_connections.end()) {
+        return;
+    }
+    TcpConnection *conn = &it->second;
+    if (size_t withheld = std::exchange(conn->withheld_consume, 0); withheld > 0 && self->m_h3_client) {
+        self->m_h3_client->consume_stream(conn->stream_id, withheld);
+        self->m_h3_client->flush();
+    }
+}
+
 int Http3Upstream::raise_read_event(uint64_t conn_id, U8View data) {
     ServerReadEvent serv_event = {conn_id, data.data(), data.size(), 0};
     this->handler.func(this->handler.arg, SERVER_EVENT_READ, &serv_event);
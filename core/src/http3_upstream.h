@@ -16,6 +16,7 @@
 #include "http_icmp_multiplexer.h"
 #include "http_udp_multiplexer.h"
 #include "net/udp_socket.h"
+#include "vpn/internal/buffer_governor.h"
 #include "vpn/internal/data_buffer.h"
 #include "vpn/internal/server_upstream.h"
 #include "vpn/utils.h"
@@ -53,6 +54,8 @@ private:
          * So this buffer is a workaround for such cases.
          */
         std::unique_ptr<DataBuffer> unread_data;
+        BufferGovernor::Account buffer_account; // tracks `unread_data`
+        size_t withheld_consume = 0;            // drained bytes not yet reported to the peer while throttled
         std::optional<ServerError> pending_error;
         size_t sent_bytes_to_notify = 0;
 
@@ -165,14 +168,16 @@ private:
     void clean_tcp_connection_data(uint64_t id);
     [[nodiscard]] bool is_health_check_stream(uint64_t stream_id) const;
     [[nodiscard]] std::optional<uint64_t> get_stream_id(uint64_t id) const;
-    bool push_unread_data(uint64_t conn_id, TcpConnection *conn, U8View data) const;
+    bool push_unread_data(uint64_t conn_id, TcpConnection *conn, U8View data);
     int read_out_pending_data(uint64_t conn_id, TcpConnection *conn);
+    void consume_stream(TcpConnection *conn, size_t length);
     int raise_read_event(uint64_t conn_id, U8View data);
     void poll_tcp_connections();
     void poll_mux_connections();
     void poll_connections();
     void retry_connect_requests();
     static void complete_read(void *arg, TaskId task_id);
+    static void buffer_governor_handler(void *arg, uint64_t conn_id, bool throttled);
     static std::optional<uint64_t> mux_send_connect_request_callback(
             ServerUpstream *upstream, const TunnelAddress *dst_addr, std::string_view app_name);
     static int mux_send_data_callback(ServerUpstream *upstream, uint64_t stream_id, U8View data);
@@ -1,18 +1,21 @@
 #pragma once
 
-#include "common/file.h"
+#include <deque>
+#include <memory>
+
 #include "vpn/internal/data_buffer.h"
+#include "vpn/internal/spill_arena.h"
 
 namespace ag {
 
 class MemfileBuffer : public DataBuffer {
 public:
     /**
-     * @param path file path
-     * @param mem_threshold memory buffer size (exceeding this limit causes storing incoming data in file)
-     * @param max_file_size maximum file size (exceeding this limit causes data truncation)
+     * @param arena arena to spill data in (must outlive the buffer)
+     * @param mem_threshold memory buffer size (exceeding this limit causes spilling incoming data in the arena)
+     * @param max_file_size maximum size of the spilled data (exceeding this limit causes data truncation)
      */
-    MemfileBuffer(std::string path, size_t mem_threshold, size_t max_file_size = SIZE_MAX);
+    MemfileBuffer(SpillArena *arena, size_t mem_threshold, size_t max_file_size = SIZE_MAX);
     ~MemfileBuffer() override;
 
     MemfileBuffer(const MemfileBuffer &) = delete;
@@ -24,31 +27,29 @@ public:
 private:
     std::unique_ptr<DataBuffer> m_mem_buffer; // memory buffer
     size_t m_threshold = 0;                   // memory buffer theshold
-    size_t m_max_file_size = SIZE_MAX;        // maximum file size
-    file::Handle m_fd = file::INVALID_HANDLE; // file descriptor
-    size_t m_read_offset = 0;                 // file read offset
-    std::string m_path;                       // full file path
+    size_t m_max_file_size = SIZE_MAX;        // maximum size of the spilled data
+    SpillArena *m_arena = nullptr;            // arena to spill data in
+    std::deque<uint32_t> m_segments;          // arena segments holding the spilled data
+    size_t m_spill_offset = 0;                // read offset in the first segment
+    size_t m_spill_size = 0;                  // size of the spilled data
 
     std::optional<std::string> init() override;
     [[nodiscard]] size_t size() const override;
     std::optional<std::string> push(U8View data) override;
     std::optional<std::string> push(std::vector<uint8_t> data) override;
     BufferPeekResult peek() override;
+    size_t peek(std::span<U8View> chunks) override;
     void drain(size_t length) override;
 
-    /** Fill free space in memory buffer with file content */
-    std::optional<std::string> transfer_file2mem();
     /** Fill free space in memory buffer with given data */
     std::vector<uint8_t> transfer_mem2mem(std::vector<uint8_t> data);
     U8View transfer_mem2mem(U8View data);
     /** Get free space size in memory buffer */
     [[nodiscard]] size_t get_free_mem_space() const;
-    /** Check if read part needs to be stripped from file */
-    [[nodiscard]] bool need_to_strip_file(size_t fsize, size_t data_size) const;
-    /** Strip read part from file */
-    std::optional<std::string> strip_file();
-    /** Write data in file */
-    std::optional<std::string> write_in_file(U8View data);
+    /** Append data to the spilled data */
+    std::optional<std::string> spill(U8View data);
+    /** Remove data from the beginning of the spilled data */
+    void drain_spilled(size_t length);
 };
 
 } // namespace ag
@@ -1,13 +1,41 @@
 #include "memory_buffer.h"
 
 #include <algorithm>
+#include <bit>
 #include <cassert>
 
 namespace ag {
 
+static constexpr size_t MAX_CACHED_BLOCKS = 64;
+
+// Empty blocks of `MemoryBuffer::BLOCK_SIZE` capacity released by the buffers of the thread
+static thread_local std::vector<std::vector<uint8_t>> g_block_cache;
+
+static std::vector<uint8_t> acquire_block(size_t capacity) {
+    std::vector<uint8_t> block;
+    if (capacity == MemoryBuffer::BLOCK_SIZE && !g_block_cache.empty()) {
+        block = std::move(g_block_cache.back());
+        g_block_cache.pop_back();
+    } else {
+        block.reserve(capacity);
+    }
+    return block;
+}
+
+static void release_block(std::vector<uint8_t> block) {
+    if (block.capacity() == MemoryBuffer::BLOCK_SIZE && g_block_cache.size() < MAX_CACHED_BLOCKS) {
+        block.clear();
+        g_block_cache.emplace_back(std::move(block));
+    }
+}
+
 MemoryBuffer::MemoryBuffer() = default;
 
-MemoryBuffer::~MemoryBuffer() = default;
+MemoryBuffer::~MemoryBuffer() {
+    for (Block &block : m_blocks) {
+        release_block(std::move(block.data));
+    }
+}
 
 std::optional<std::string> MemoryBuffer::init() {
     return std::nullopt;
@@ -18,41 +46,69 @@ size_t MemoryBuffer::size() const {
 }
 
 std::optional<std::string> MemoryBuffer::push(U8View data) {
-    return push(std::vector<uint8_t>(data.data(), data.data() + data.length()));
+    m_total_size += data.size();
+
+    while (!data.empty()) {
+        if (m_blocks.empty() || m_blocks.back().data.size() == m_blocks.back().data.capacity()) {
+            // A buffer holding a few bytes must not take a whole block, so the blocks start small
+            // and double up to `BLOCK_SIZE` while the data keeps coming
+            size_t capacity = m_blocks.empty() ? MIN_BLOCK_SIZE : 2 * m_blocks.back().data.capacity();
+            capacity = std::min(std::max(capacity, std::bit_ceil(data.size())), BLOCK_SIZE);
+            m_blocks.push_back({acquire_block(capacity)});
+        }
+        std::vector<uint8_t> &tail = m_blocks.back().data;
+        size_t to_copy = std::min(data.size(), tail.capacity() - tail.size());
+        tail.insert(tail.end(), data.data(), data.data() + to_copy);
+        data.remove_prefix(to_copy);
+    }
+
+    return std::nullopt;
 }
 
 std::optional<std::string> MemoryBuffer::push(std::vector<uint8_t> data) {
-    if (!data.empty()) {
-        m_total_size += data.size();
-        m_chunks.emplace(std::move(data));
+    if (data.size() < BLOCK_SIZE) {
+        return push(U8View{data.data(), data.size()});
     }
+
+    // Appending to the block never exceeds its capacity, so the data is not moved
+    m_total_size += data.size();
+    m_blocks.push_back({std::move(data)});
     return std::nullopt;
 }
 
 BufferPeekResult MemoryBuffer::peek() {
     U8View chunk;
-    if (!m_chunks.empty()) {
-        const std::vector<uint8_t> &front = m_chunks.front();
-        chunk = {front.data(), front.size()};
+    if (!m_blocks.empty()) {
+        const Block &front = m_blocks.front();
+        chunk = {front.data.data() + front.read_offset, front.data.size() - front.read_offset};
     }
     return {std::nullopt, chunk};
 }
 
+size_t MemoryBuffer::peek(std::span<U8View> chunks) {
+    size_t n = std::min(chunks.size(), m_blocks.size());
+    for (size_t i = 0; i < n; ++i) {
+        const Block &block = m_blocks[i];
+        chunks[i] = {block.data.data() + block.read_offset, block.data.size() - block.read_offset};
+    }
+    return n;
+}
+
 void MemoryBuffer::drain(size_t length) {
     assert(length <= m_total_size);
     m_total_size -= length;
 
     while (length > 0) {
-        assert(!m_chunks.empty());
-
-        std::vector<uint8_t> &front = m_chunks.front();
-        size_t to_remove = std::min(front.size(), length);
-        // NOLINTNEXTLINE(bugprone-narrowing-conversions,cppcoreguidelines-narrowing-conversions)
-        front.erase(front.begin(), front.begin() + to_remove);
+        assert(!m_blocks.empty());
 
+        Block &front = m_blocks.front();
+        size_t to_remove = std::min(front.data.size() - front.read_offset, length);
+        front.read_offset += to_remove;
         length -= to_remove;
-        if (front.empty()) {
-            m_chunks.pop();
+
+        if (front.read_offset == front.data.size()) {
+            release_block(std::move(front.data));
+            m_blocks.pop_front();
         }
     }
 }
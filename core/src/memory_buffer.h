@@ -1,26 +1,49 @@
 #pragma once
 
-#include <queue>
+#include <deque>
 #include <vector>
 
 #include "vpn/internal/data_buffer.h"
 
 namespace ag {
 
+/**
+ * Buffer of data in a chain of blocks.
+ *
+ * Pushed data is appended to the last block while it has free space, so a series of small chunks
+ * is peeked as one (up to `BLOCK_SIZE`). The first block is small, so that a buffer of a few bytes
+ * does not take much more memory than its size, and the next ones double up to `BLOCK_SIZE`.
+ * A large vector is taken over as a block by itself instead of being copied. The drained blocks
+ * of `BLOCK_SIZE` are kept in a per-thread cache for the next buffers.
+ */
 class MemoryBuffer : public DataBuffer {
 public:
+    static constexpr size_t BLOCK_SIZE = 16 * 1024;
+    static constexpr size_t MIN_BLOCK_SIZE = 512;
+
     MemoryBuffer();
     ~MemoryBuffer() override;
 
+    MemoryBuffer(const MemoryBuffer &) = delete;
+    MemoryBuffer &operator=(const MemoryBuffer &) = delete;
+    MemoryBuffer(MemoryBuffer &&) = delete;
+    MemoryBuffer &operator=(MemoryBuffer &&) = delete;
+
 private:
+    struct Block {
+        std::vector<uint8_t> data; // never grows beyond its capacity, so the peeked chunks stay in place
+        size_t read_offset = 0;
+    };
+
     size_t m_total_size = 0;
-    std::queue<std::vector<uint8_t>> m_chunks;
+    std::deque<Block> m_blocks;
 
     std::optional<std::string> init() override;
     [[nodiscard]] size_t size() const override;
     std::optional<std::string> push(U8View data) override;
     std::optional<std::string> push(std::vector<uint8_t> data) override;
     BufferPeekResult peek() override;
+    size_t peek(std::span<U8View> chunks) override;
     void drain(size_t length) override;
 };
 
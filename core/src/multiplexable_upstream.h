@@ -2,6 +2,7 @@
 
 #include <cassert>
 
+#include "upstream_selector.h"
 #include "vpn/internal/server_upstream.h"
 
 namespace ag {
@@ -27,6 +28,13 @@ public:
      */
     [[nodiscard]] virtual size_t connections_num() const = 0;
 
+    /**
+     * Get live load metrics. The number of connections and the throughput are filled by the multiplexer.
+     */
+    [[nodiscard]] virtual UpstreamLoad get_load() const {
+        return {.rtt_us = get_connection_stats().rtt_us};
+    }
+
     /**
      * Create connection to peer. Result will be raised asynchronously with
      * `SERVER_EVENT_CONNECTION_OPENED` in case of success, or with `SERVER_EVENT_ERROR` in case of
@@ -0,0 +1,220 @@
+#include "vpn/internal/spill_arena.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <iterator>
+#include <utility>
+
+#include "vpn/platform.h"
+#include "vpn/utils.h"
+
+namespace ag {
+
+SpillArena::SpillArena(std::string path)
+        : m_path(std::move(path)) {
+}
+
+SpillArena::~SpillArena() {
+    assert(m_used == 0);
+    for (const Region &region : m_regions) {
+#ifdef _WIN32
+        UnmapViewOfFile(region.memory);
+#else
+        munmap(region.memory, REGION_SIZE);
+#endif
+    }
+#ifdef _WIN32
+    if (m_file != nullptr) {
+        CloseHandle(m_file);
+    }
+#else
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+#endif
+}
+
+SpillArena::AllocateResult SpillArena::allocate() {
+    auto region = std::find_if(m_regions.begin(), m_regions.end(), [](const Region &r) {
+        return r.free_mask != 0;
+    });
+    if (region == m_regions.end()) {
+        if (std::optional<std::string> err = add_region(); err.has_value()) {
+            return {std::move(err)};
+        }
+        region = std::prev(m_regions.end());
+    }
+    if (!region->reserved) {
+        // The space of a discarded region is given back, reserve it again before writing
+        if (std::optional<std::string> err = reserve_space(size_t(region - m_regions.begin()) * REGION_SIZE);
+                err.has_value()) {
+            return {std::move(err)};
+        }
+        region->reserved = true;
+    }
+
+    int slot = std::countr_zero(region->free_mask);
+    region->free_mask &= ~(uint64_t(1) << slot);
+    ++m_used;
+    return {std::nullopt, uint32_t(size_t(region - m_regions.begin()) * SEGMENTS_PER_REGION + slot)};
+}
+
+void SpillArena::free(uint32_t segment) {
+    size_t index = segment / SEGMENTS_PER_REGION;
+    assert(index < m_regions.size());
+    Region &region = m_regions[index];
+    assert(!(region.free_mask & (uint64_t(1) << (segment % SEGMENTS_PER_REGION))));
+    region.free_mask |= uint64_t(1) << (segment % SEGMENTS_PER_REGION);
+    --m_used;
+
+    if (region.free_mask != ALL_FREE) {
+        return;
+    }
+    if (std::all_of(m_regions.begin() + ssize_t(index), m_regions.end(), [](const Region &r) {
+            return r.free_mask == ALL_FREE;
+        })) {
+        trim();
+    } else {
+        discard(index);
+    }
+}
+
+std::optional<std::string> SpillArena::open_file() {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(m_path.c_str(), GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return str_format("Failed to open file: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
+    }
+    m_file = file;
+#else
+    m_fd = open(m_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (m_fd < 0) {
+        return str_format("Failed to open file: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
+    }
+    unlink(m_path.c_str());
+#endif
+    dbglog(m_log, "Opened spill file: {}", m_path);
+    return std::nullopt;
+}
+
+std::optional<std::string> SpillArena::resize_file(size_t size) {
+#ifdef _WIN32
+    LARGE_INTEGER end = {.QuadPart = (LONGLONG) size};
+    if (!SetFilePointerEx(m_file, end, nullptr, FILE_BEGIN) || !SetEndOfFile(m_file)) {
+#else
+    if (0 != ftruncate(m_fd, (off_t) size)) {
+#endif
+        return str_format("Failed to resize file: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
+    }
+    return std::nullopt;
+}
+
+std::optional<std::string> SpillArena::reserve_space([[maybe_unused]] size_t offset) {
+#ifdef _WIN32
+    // The file is not sparse, the space is allocated as it grows
+    int err = 0;
+#elif defined(__APPLE__)
+    // Holes are not punched here, so only the regions added at the end of the file need the space
+    fstore_t store = {F_ALLOCATEALL, F_PEOFPOSMODE, 0, off_t(REGION_SIZE), 0};
+    int err = (-1 != fcntl(m_fd, F_PREALLOCATE, &store)) ? 0 : sys::last_error();
+#else
+    int err = posix_fallocate(m_fd, off_t(offset), off_t(REGION_SIZE));
+#endif
+    if (err != 0) {
+        return str_format("Failed to reserve disk space: %s (%d)", sys::strerror(err), err);
+    }
+    return std::nullopt;
+}
+
+std::optional<std::string> SpillArena::add_region() {
+#ifdef _WIN32
+    bool opened = m_file != nullptr;
+#else
+    bool opened = m_fd >= 0;
+#endif
+    if (!opened) {
+        if (std::optional<std::string> err = open_file(); err.has_value()) {
+            return err;
+        }
+    }
+
+    size_t offset = file_size();
+    if (std::optional<std::string> err = resize_file(offset + REGION_SIZE); err.has_value()) {
+        return err;
+    }
+    // The file grows sparse, and a write to the mapping raises a signal if there's no disk space for it
+    if (std::optional<std::string> err = reserve_space(offset); err.has_value()) {
+        resize_file(offset);
+        return err;
+    }
+
+#ifdef _WIN32
+    uint64_t size = offset + REGION_SIZE;
+    HANDLE mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE, DWORD(size >> 32), DWORD(size), nullptr);
+    void *region = nullptr;
+    if (mapping != nullptr) {
+        region = MapViewOfFile(
+                mapping, FILE_MAP_ALL_ACCESS, DWORD(uint64_t(offset) >> 32), DWORD(offset), REGION_SIZE);
+        // The view keeps the mapping alive
+        CloseHandle(mapping);
+    }
+    if (region == nullptr) {
+#else
+    void *region = mmap(nullptr, REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, (off_t) offset);
+    if (region == MAP_FAILED) {
+#endif
+        std::string err =
+                str_format("Failed to map file: %s (%d)", sys::strerror(sys::last_error()), sys::last_error());
+        resize_file(offset);
+        return err;
+    }
+
+    m_regions.push_back({(uint8_t *) region, ALL_FREE, true});
+    dbglog(m_log, "Spill file size: {}", file_size());
+    return std::nullopt;
+}
+
+void SpillArena::trim() {
+    // A free region is kept after the used ones to not remap it every time the usage crosses the boundary
+    size_t keep = m_regions.size();
+    while (keep > 1 && m_regions[keep - 1].free_mask == ALL_FREE && m_regions[keep - 2].free_mask == ALL_FREE) {
+        --keep;
+    }
+    if (keep < m_regions.size()) {
+        for (size_t i = keep; i < m_regions.size(); ++i) {
+#ifdef _WIN32
+            UnmapViewOfFile(m_regions[i].memory);
+#else
+            munmap(m_regions[i].memory, REGION_SIZE);
+#endif
+        }
+        m_regions.resize(keep);
+        resize_file(file_size());
+        dbglog(m_log, "Spill file size: {}", file_size());
+    }
+    if (m_regions.back().free_mask == ALL_FREE) {
+        discard(m_regions.size() - 1);
+    }
+}
+
+void SpillArena::discard([[maybe_unused]] size_t region) {
+#ifdef __linux__
+    // Free the disk space and the page cache, otherwise the drained data would be written back sooner or later
+    if (0 == fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off_t(region * REGION_SIZE), REGION_SIZE)) {
+        m_regions[region].reserved = false;
+    }
+#endif
+}
+
+} // namespace ag
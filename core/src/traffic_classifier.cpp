@@ -0,0 +1,144 @@
+#include "vpn/internal/traffic_classifier.h"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+
+namespace ag {
+
+// Differentiated Services code points (RFC 4594, RFC 8622)
+static constexpr uint8_t DSCP_LE = 1;
+static constexpr uint8_t DSCP_CS1 = 8;
+static constexpr uint8_t DSCP_CS4 = 32;
+static constexpr uint8_t DSCP_AF41 = 34;
+static constexpr uint8_t DSCP_AF43 = 38;
+static constexpr uint8_t DSCP_EF = 46;
+
+// Ports of the protocols which exchange small latency-sensitive messages:
+// SSH, Telnet, DNS, RDP, VNC, SIP, SIP over TLS, STUN/TURN, STUN/TURN over TLS
+static constexpr std::array<uint16_t, 9> INTERACTIVE_PORTS = {22, 23, 53, 3389, 5900, 5060, 5061, 3478, 5349};
+
+// Fractions of the 128 KiB the TCP socket keeps in its write buffer, so that the lower classes leave room
+// for the interactive data. The interactive class is limited by the socket only.
+static constexpr TrafficClassPolicy DEFAULT_POLICY = {.weight = 16, .send_queue_limit = 64 * 1024};
+static constexpr TrafficClassPolicy INTERACTIVE_POLICY = {.weight = 256, .send_queue_limit = SIZE_MAX};
+static constexpr TrafficClassPolicy BULK_POLICY = {.weight = 4, .send_queue_limit = 32 * 1024};
+
+static bool equals_ignore_case(std::string_view lh, std::string_view rh) {
+    return std::ranges::equal(lh, rh, [](char l, char r) {
+        return std::tolower((unsigned char) l) == std::tolower((unsigned char) r);
+    });
+}
+
+static std::optional<VpnTrafficClass> classify_by_dscp(uint8_t dscp) {
+    // Class selectors 4-7 are used for video, signaling and network control
+    if (dscp == DSCP_EF || (dscp >= DSCP_CS4 && dscp % 8 == 0) || (dscp >= DSCP_AF41 && dscp <= DSCP_AF43)) {
+        return VPN_TC_INTERACTIVE;
+    }
+    if (dscp == DSCP_CS1 || dscp == DSCP_LE) {
+        return VPN_TC_BULK;
+    }
+    return std::nullopt;
+}
+
+TrafficClassifier::TrafficClassifier(std::span<const VpnTrafficClassRule> rules) {
+    m_rules.reserve(rules.size());
+    for (const VpnTrafficClassRule &r : rules) {
+        Rule &rule = m_rules.emplace_back(Rule{
+                .app_name = std::nullopt,
+                .port_min = r.port_min,
+                .port_max = r.port_max,
+                .dscp = std::nullopt,
+                .traffic_class = r.traffic_class,
+        });
+        if (r.app_name != nullptr) {
+            rule.app_name = r.app_name;
+        }
+        if (r.match_dscp) {
+            rule.dscp = r.dscp;
+        }
+        if (rule.port_min == 0 && rule.port_max == 0) {
+            rule.port_max = UINT16_MAX;
+        }
+    }
+}
+
+VpnTrafficClass TrafficClassifier::classify(const TrafficProperties &props) const {
+    for (const Rule &rule : m_rules) {
+        if (rule.app_name.has_value() && !equals_ignore_case(*rule.app_name, props.app_name)) {
+            continue;
+        }
+        if (props.dst_port < rule.port_min || props.dst_port > rule.port_max) {
+            continue;
+        }
+        if (rule.dscp.has_value() && *rule.dscp != props.dscp) {
+            continue;
+        }
+        return rule.traffic_class;
+    }
+
+    if (std::optional<VpnTrafficClass> traffic_class = classify_by_dscp(props.dscp); traffic_class.has_value()) {
+        return *traffic_class;
+    }
+
+    if (std::ranges::find(INTERACTIVE_PORTS, props.dst_port) != INTERACTIVE_PORTS.end()) {
+        return VPN_TC_INTERACTIVE;
+    }
+
+    return VPN_TC_DEFAULT;
+}
+
+TrafficClassPolicy traffic_class_policy(VpnTrafficClass traffic_class) {
+    switch (traffic_class) {
+    case VPN_TC_INTERACTIVE:
+        return INTERACTIVE_POLICY;
+    case VPN_TC_BULK:
+        return BULK_POLICY;
+    case VPN_TC_DEFAULT:
+        break;
+    }
+    return DEFAULT_POLICY;
+}
+
+void TrafficClassSendQueue::push(VpnTrafficClass traffic_class, size_t length, uint64_t end) {
+    m_queued[traffic_class] += length;
+    m_marks.push_back({traffic_class, length, end});
+}
+
+size_t TrafficClassSendQueue::available(VpnTrafficClass traffic_class) {
+    size_t limit = traffic_class_policy(traffic_class).send_queue_limit;
+    if (m_queued[traffic_class] >= limit) {
+        m_blocked.set(traffic_class);
+        return 0;
+    }
+    return limit - m_queued[traffic_class];
+}
+
+std::bitset<TRAFFIC_CLASSES_NUM> TrafficClassSendQueue::release(uint64_t written, bool flushed) {
+    while (!m_marks.empty() && (flushed || m_marks.front().end <= written)) {
+        const Mark &mark = m_marks.front();
+        m_queued[mark.traffic_class] -= std::min(mark.length, m_queued[mark.traffic_class]);
+        m_marks.pop_front();
+    }
+
+    std::bitset<TRAFFIC_CLASSES_NUM> unblocked;
+    for (size_t i = 0; i < TRAFFIC_CLASSES_NUM; ++i) {
+        if (m_blocked.test(i) && m_queued[i] < traffic_class_policy(VpnTrafficClass(i)).send_queue_limit) {
+            unblocked.set(i);
+        }
+    }
+    m_blocked &= ~unblocked;
+    return unblocked;
+}
+
+size_t TrafficClassSendQueue::queued(VpnTrafficClass traffic_class) const {
+    return m_queued[traffic_class];
+}
+
+void TrafficClassSendQueue::reset() {
+    m_queued = {};
+    m_blocked.reset();
+    m_marks.clear();
+}
+
+} // namespace ag
@@ -33,6 +33,10 @@ struct CloseAsyncCtx {
     bool graceful;
 };
 
+// Limits of a batched output event, reaching either of them flushes the batch early
+static constexpr size_t MAX_OUTPUT_BATCH_PACKETS = 256;
+static constexpr size_t MAX_OUTPUT_BATCH_BYTES = 1024 * 1024;
+
 static constexpr TcpipAction CONNECT_RESULT_TO_TCPIP_ACTION[magic_enum::enum_count<TcpipAction>()] = {
         /** CCR_PASS */ TCPIP_ACT_BYPASS,
         /** CCR_DROP */ TCPIP_ACT_DROP,
@@ -41,18 +45,26 @@ static constexpr TcpipAction CONNECT_RESULT_TO_TCPIP_ACTION[magic_enum::enum_cou
 };
 
 static VpnTunListenerConfig clone_config(const VpnTunListenerConfig *config) {
+    auto *queue_fds = new evutil_socket_t[config->queue_fds.size];
+    std::copy(config->queue_fds.data, config->queue_fds.data + config->queue_fds.size, queue_fds);
     return VpnTunListenerConfig{
             .fd = config->fd,
             .tunnel = config->tunnel,
             .mtu_size = config->mtu_size,
             .tcp_recv_buf_size = config->tcp_recv_buf_size,
+            .tcp_recv_buf_budget = config->tcp_recv_buf_budget,
             .tcp_send_buf_size = config->tcp_send_buf_size,
             .pcap_filename = safe_strdup(config->pcap_filename),
+            .queue_fds = {queue_fds, config->queue_fds.size},
+            .offload = config->offload,
+            .io_uring = config->io_uring,
+            .batch_output = config->batch_output,
     };
 }
 
 static void destroy_cloned_config(VpnTunListenerConfig *config) {
     free((void *) config->pcap_filename); // NOLINT(cppcoreguidelines-no-malloc,hicpp-no-malloc)
+    delete[] config->queue_fds.data;
     *config = {};
 }
 
@@ -84,14 +96,28 @@ ClientListener::InitResult TunListener::init(VpnClient *vpn, ClientHandler handl
 
     TcpipParameters tcpip_params = {
             .tun_fd = m_config.fd,
+            .tun_queue_fds = {m_config.queue_fds.data, m_config.queue_fds.size},
+            .tun_offload = m_config.offload,
+            .tun_io_backend = m_config.io_uring ? TCPIP_TUN_IO_URING : TCPIP_TUN_IO_SYSCALL,
             .event_loop = this->vpn->parameters.ev_loop,
             .mtu_size = m_config.mtu_size,
             .tcp_recv_buf_size = m_config.tcp_recv_buf_size,
+            .tcp_recv_buf_budget = m_config.tcp_recv_buf_budget,
             .tcp_send_buf_size = m_config.tcp_send_buf_size,
             .pcap_filename = m_config.pcap_filename,
             .handler = {tcpip_handler, this},
     };
 
+    if (m_config.fd == -1 && m_config.tunnel == nullptr && m_config.batch_output) {
+        m_output_flush_event.reset(event_new(vpn_event_loop_get_base(this->vpn->parameters.ev_loop), -1, 0,
+                output_flush_callback, this));
+        if (m_output_flush_event == nullptr) {
+            errlog(m_log, "Failed to create output flush event");
+            deinit();
+            return InitResult::FAILURE;
+        }
+    }
+
     m_tcpip = tcpip_open(&tcpip_params);
     if (m_tcpip == nullptr) {
         errlog(m_log, "Failed to initialize TCP/IP stack");
@@ -119,16 +145,29 @@ void TunListener::deinit() {
         }
     }
 #endif // _WIN32
+    // Deliver the pending batch while the stack's buffers it references are alive,
+    // the output produced while closing the stack is raised unbatched
+    if (m_output_flush_event != nullptr) {
+        flush_output();
+        m_output_flush_event.reset();
+    }
     tcpip_close(m_tcpip);
     m_tcpip = nullptr;
 }
 
+// Reference the data inside the stack's buffer holding the chunk, or just point to it if the buffer can't be referenced
+static DataRef make_chunk_ref(TcpipBuffer *buffer, const evbuffer_iovec &vec) {
+    U8View data = {(uint8_t *) vec.iov_base, vec.iov_len};
+    return (buffer != nullptr) ? DataRef(buffer, data) : DataRef(data);
+}
+
 int TunListener::read_out_pending_data(uint64_t id, Connection *conn) const {
-    std::queue<std::vector<uint8_t>> &pending = conn->unread_data;
+    std::queue<DataRef> &pending = conn->unread_data;
 
     while ((conn->flags & CF_READ_ENABLED) && !pending.empty()) {
-        std::vector<uint8_t> &chunk = pending.front();
-        ClientRead event = {id, chunk.data(), chunk.size(), 0};
+        DataRef &chunk = pending.front();
+        size_t chunk_size = chunk.size();
+        ClientRead event = {id, chunk.data(), chunk.size(), 0, &chunk};
         this->handler.func(this->handler.arg, CLIENT_EVENT_READ, &event);
         if (event.result < 0) {
             return event.result;
@@ -136,14 +175,16 @@ int TunListener::read_out_pending_data(uint64_t id, Connection *conn) const {
         if (conn->proto == IPPROTO_UDP && ssize_t(chunk.size()) != event.result) {
             log_conn(this, id, dbg, "UDP packet wasn't sent or sent partially: length={}, result={}", chunk.size(),
                     event.result);
-            chunk.clear();
+            chunk = DataRef{};
         } else {
-            chunk.erase(chunk.begin(), chunk.begin() + event.result);
+            chunk.remove_prefix(event.result);
         }
+        conn->unread_bytes -= chunk_size - chunk.size();
         if (chunk.empty()) {
             pending.pop();
         }
     }
+    conn->buffer_account.set_size(conn->unread_bytes);
 
     return 0;
 }
@@ -166,7 +207,13 @@ void TunListener::tcpip_handler(void *arg, TcpipEvent what, void *data) {
 
         TunnelAddress dst(*(SocketAddress *) tcp_event->dst);
 
-        ClientConnectRequest event = {tcp_event->id, tcp_event->proto, tcp_event->src, &dst};
+        ClientConnectRequest event = {
+                .id = tcp_event->id,
+                .protocol = tcp_event->proto,
+                .src = tcp_event->src,
+                .dst = &dst,
+                .dscp = tcp_event->dscp,
+        };
         listener->handler.func(listener->handler.arg, CLIENT_EVENT_CONNECT_REQUEST, &event);
         break;
     }
@@ -189,16 +236,19 @@ void TunListener::tcpip_handler(void *arg, TcpipEvent what, void *data) {
             break;
         }
 
-        std::queue<std::vector<uint8_t>> &pending = conn->unread_data;
+        std::queue<DataRef> &pending = conn->unread_data;
         std::span<evbuffer_iovec> iov = {(evbuffer_iovec *) tcp_event->iov, tcp_event->iovlen};
+        TcpipBuffer *chunk_buffer = tcp_event->buffer; // storage of `iov.front()`
         int conn_proto = conn->proto; // conn may be freed in the callback
         if ((conn->flags & CF_READ_ENABLED) && pending.empty()) {
-            ClientRead event = {tcp_event->id, nullptr, 0, 0};
+            ClientRead event = {tcp_event->id, nullptr, 0, 0, nullptr};
             while (!iov.empty()) {
                 evbuffer_iovec *v = &iov.front();
                 do {
-                    event.data = (uint8_t *) v->iov_base;
-                    event.length = v->iov_len;
+                    DataRef chunk = make_chunk_ref(chunk_buffer, *v);
+                    event.data = chunk.data();
+                    event.length = chunk.size();
+                    event.ref = &chunk;
                     listener->handler.func(listener->handler.arg, CLIENT_EVENT_READ, &event);
                     if (conn_proto == IPPROTO_UDP && event.result >= 0 && event.length != size_t(event.result)) {
                         goto loop_exit;
@@ -216,6 +266,9 @@ void TunListener::tcpip_handler(void *arg, TcpipEvent what, void *data) {
                     }
                 } while (v->iov_len > 0);
                 iov = iov.subspan(1);
+                if (chunk_buffer != nullptr) {
+                    chunk_buffer = tcpip_buffer_next(chunk_buffer);
+                }
             }
         }
 
@@ -234,9 +287,18 @@ void TunListener::tcpip_handler(void *arg, TcpipEvent what, void *data) {
             tcp_event->result = static_cast<int>(total_length);
         } else if (tcp_event->result >= 0) {
             // not completely sent
-            std::for_each(iov.begin(), iov.end(), [&pending](const evbuffer_iovec &vec) {
-                pending.emplace((uint8_t *) vec.iov_base, (uint8_t *) vec.iov_base + vec.iov_len);
+            std::for_each(iov.begin(), iov.end(), [&pending, conn, &chunk_buffer](const evbuffer_iovec &vec) {
+                pending.emplace(make_chunk_ref(chunk_buffer, vec).to_owned());
+                conn->unread_bytes += vec.iov_len;
+                if (chunk_buffer != nullptr) {
+                    chunk_buffer = tcpip_buffer_next(chunk_buffer);
+                }
             });
+            if (!conn->buffer_account.is_open()) {
+                conn->buffer_account =
+                        listener->vpn->buffer_governor.open_account(tcp_event->id, {buffer_governor_handler, listener});
+            }
+            conn->buffer_account.set_size(conn->unread_bytes);
         }
 
         break;
@@ -299,6 +361,11 @@ void TunListener::tcpip_handler(void *arg, TcpipEvent what, void *data) {
         }
 #endif
 
+        if (listener->m_output_flush_event != nullptr) {
+            listener->append_output(tcpip_event);
+            break;
+        }
+
         VpnClientOutputEvent vpn_event = {
                 .family = tcpip_event->family,
                 .packet =
@@ -316,6 +383,90 @@ void TunListener::tcpip_handler(void *arg, TcpipEvent what, void *data) {
     }
 }
 
+void TunListener::append_output(const TcpipTunOutputEvent *event) {
+    size_t length = 0;
+    for (size_t i = 0; i < event->packet.chunks_num; ++i) {
+        length += event->packet.chunks[i].iov_len;
+    }
+    if (!m_flushing_output && !m_output_batch.packets.empty()
+            && (m_output_batch.packets.size() == MAX_OUTPUT_BATCH_PACKETS
+                    || m_output_batch.bytes + length > MAX_OUTPUT_BATCH_BYTES)) {
+        flush_output();
+    }
+
+    OutputPacket packet = {
+            .family = event->family,
+            .buffer = event->buffer,
+            .chunks_offset = m_output_batch.chunks.size(),
+    };
+    if (packet.buffer != nullptr) {
+        tcpip_buffer_ref(packet.buffer);
+        for (size_t i = 0; i < event->packet.chunks_num; ++i) {
+            const evbuffer_iovec &chunk = event->packet.chunks[i];
+            m_output_batch.chunks.push_back({.iov_base = chunk.iov_base, .iov_len = chunk.iov_len});
+        }
+        packet.chunks_num = event->packet.chunks_num;
+    } else {
+        // The chunks are valid only during the call, so copy the packet.
+        // The chunk is pointed to the copy on flush, as `data` may be reallocated until then.
+        packet.data_offset = m_output_batch.data.size();
+        m_output_batch.data.resize(packet.data_offset + length);
+        uint8_t *dst = &m_output_batch.data[packet.data_offset];
+        for (size_t i = 0; i < event->packet.chunks_num; ++i) {
+            const evbuffer_iovec &chunk = event->packet.chunks[i];
+            dst = std::copy_n((const uint8_t *) chunk.iov_base, chunk.iov_len, dst);
+        }
+        m_output_batch.chunks.push_back({.iov_base = nullptr, .iov_len = length});
+        packet.chunks_num = 1;
+    }
+    m_output_batch.packets.push_back(packet);
+    m_output_batch.bytes += length;
+
+    if (m_output_batch.packets.size() == 1) {
+        event_active(m_output_flush_event.get(), 0, 0);
+    }
+}
+
+void TunListener::flush_output() {
+    if (m_flushing_output || m_output_batch.packets.empty()) {
+        return;
+    }
+
+    // The handler may produce more output, which goes to the next batch
+    std::swap(m_output_batch, m_flushing_output_batch);
+    OutputBatch &batch = m_flushing_output_batch;
+    batch.events.clear();
+    for (const OutputPacket &packet : batch.packets) {
+        if (packet.buffer == nullptr) {
+            batch.chunks[packet.chunks_offset].iov_base = &batch.data[packet.data_offset];
+        }
+        batch.events.push_back({
+                .family = packet.family,
+                .packet = {.chunks_num = packet.chunks_num, .chunks = &batch.chunks[packet.chunks_offset]},
+        });
+    }
+
+    VpnClientOutputBatchEvent event = {.packets_num = batch.events.size(), .packets = batch.events.data()};
+    m_flushing_output = true;
+    handler.func(handler.arg, CLIENT_EVENT_OUTPUT_BATCH, &event);
+    m_flushing_output = false;
+
+    for (const OutputPacket &packet : batch.packets) {
+        if (packet.buffer != nullptr) {
+            tcpip_buffer_unref(packet.buffer);
+        }
+    }
+    batch.data.clear();
+    batch.packets.clear();
+    batch.chunks.clear();
+    batch.bytes = 0;
+}
+
+void TunListener::output_flush_callback(evutil_socket_t, short, void *arg) {
+    auto *listener = (TunListener *) arg;
+    listener->flush_output();
+}
+
 void TunListener::complete_connect_request(uint64_t id, ClientConnectResult result) {
     tcpip_complete_connect_request(m_tcpip, id, CONNECT_RESULT_TO_TCPIP_ACTION[result]);
 }
@@ -388,9 +539,29 @@ void TunListener::consume(uint64_t id, size_t n) {
         log_conn(this, id, trace, "{}", n);
     }
 
+    if (auto i = m_connections.find(id); i != m_connections.end() && i->second.buffer_account.throttled()) {
+        // Keep the TCP window closed until the governor releases the connection
+        i->second.withheld_consume += n;
+        return;
+    }
+
     tcpip_sent_to_remote(m_tcpip, id, n);
 }
 
+void TunListener::buffer_governor_handler(void *arg, uint64_t id, bool throttled) {
+    auto *listener = (TunListener *) arg;
+    log_conn(listener, id, dbg, "{} by buffer governor", throttled ? "Throttled" : "Released");
+    if (throttled) {
+        return;
+    }
+
+    if (auto i = listener->m_connections.find(id); i != listener->m_connections.end()) {
+        if (size_t withheld = std::exchange(i->second.withheld_consume, 0); withheld > 0) {
+            tcpip_sent_to_remote(listener->m_tcpip, id, withheld);
+        }
+    }
+}
+
 TcpFlowCtrlInfo TunListener::flow_control_info(uint64_t id) {
     return tcpip_flow_ctrl_info(m_tcpip, id);
 }
@@ -7,7 +7,9 @@
 #include <vector>
 
 #include "tcpip/tcpip.h"
+#include "vpn/internal/buffer_governor.h"
 #include "vpn/internal/client_listener.h"
+#include "vpn/internal/data_ref.h"
 #include "vpn/internal/vpn_client.h"
 #include "vpn/vpn.h"
 
@@ -32,18 +34,41 @@ private:
         ssize_t scheduled_to_send = 0;
         uint32_t flags = 0;
         int proto = 0; // connection protocol (TCP/UDP)
-        // @todo: consider using `DataBuffer`, but it needs some modifications to guarantee
-        // that peeked chunks would be the same as pushed ones
-        // buffer for data raised with `TCPIP_EVENT_READ`, but wasn't actaully sent to server
-        std::queue<std::vector<uint8_t>> unread_data;
+        // data raised with `TCPIP_EVENT_READ`, but wasn't actaully sent to server
+        // (holds references to the stack's buffers, not copies)
+        std::queue<DataRef> unread_data;
+        size_t unread_bytes = 0;                // total size of `unread_data`
+        BufferGovernor::Account buffer_account; // tracks `unread_bytes`
+        size_t withheld_consume = 0;            // sent bytes not yet reported to the stack while throttled
         event_loop::AutoTaskId complete_read_task_id;
         event_loop::AutoTaskId close_task_id;
     };
 
+    struct OutputPacket {
+        int family = 0;
+        TcpipBuffer *buffer = nullptr; // referenced storage of the packet (null if the packet is copied to `data`)
+        size_t data_offset = 0;        // offset of the copied packet in `OutputBatch::data`
+        size_t chunks_offset = 0;      // index of the first chunk of the packet in `OutputBatch::chunks`
+        size_t chunks_num = 0;
+    };
+
+    // Packets collected in batched output mode
+    struct OutputBatch {
+        std::vector<uint8_t> data; // copies of the packets whose storage can't be referenced
+        std::vector<OutputPacket> packets;
+        std::vector<iovec> chunks;
+        size_t bytes = 0; // total size of `packets`
+        std::vector<VpnClientOutputEvent> events;
+    };
+
     TcpipCtx *m_tcpip = nullptr;
     std::unordered_map<uint64_t, Connection> m_connections;
     ag::Logger m_log{"TUN_LISTENER"};
     VpnTunListenerConfig m_config;
+    OutputBatch m_output_batch;
+    OutputBatch m_flushing_output_batch;
+    DeclPtr<event, &event_free> m_output_flush_event;
+    bool m_flushing_output = false;
 
 #ifdef _WIN32
     std::vector<VpnPacket> m_recv_packets_queue;
@@ -65,6 +90,11 @@ private:
 
     static void tcpip_handler(void *arg, TcpipEvent id, void *data);
     static void complete_read(void *arg, TaskId task_id);
+    static void output_flush_callback(evutil_socket_t, short, void *arg);
+    static void buffer_governor_handler(void *arg, uint64_t id, bool throttled);
+
+    void append_output(const TcpipTunOutputEvent *event);
+    void flush_output();
 
 #ifdef _WIN32
     static void recv_packets_handler(void *arg);
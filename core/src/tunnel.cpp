@@ -5,6 +5,7 @@
 #include <bitset>
 #include <cassert>
 #include <optional>
+#include <span>
 #include <utility>
 #include <vector>
 
@@ -39,56 +40,28 @@ struct CompleteConnectRequestCtx {
     int err_code = -1;
 };
 
-// Func: void(VpnConnection *)
-// Call `func` for each value in `table`.
-template <typename Func>
-void vpn_connections_foreach(const khash_t(connections_by_id) * table, Func &&func) {
-    auto f = std::forward<Func>(func);
-    for (auto it = kh_begin(table); it != kh_end(table); ++it) {
-        if (!kh_exist(table, it)) {
-            continue;
-        }
-        VpnConnection *conn = kh_value(table, it);
-        f(conn);
-    }
-}
-
-static VpnConnection *vpn_connection_get_by_id(const khash_t(connections_by_id) * table, uint64_t id) {
-    VpnConnection *conn = nullptr;
-
-    khiter_t iter = kh_get(connections_by_id, table, id);
-    if (iter != kh_end(table)) {
-        conn = kh_value(table, iter);
-    }
-
-    return conn;
-}
-
-static void vpn_connection_put(khash_t(connections_by_id) * table, uint64_t id, VpnConnection *conn) {
-    int r = 0;
-    khiter_t iter = kh_put(connections_by_id, table, id, &r);
-    assert(r >= 0);
-    if (r >= 0) {
-        kh_value(table, iter) = conn;
-    }
-}
-
-static void vpn_connection_remove(khash_t(connections_by_id) * table, uint64_t id) {
-    khiter_t iter = kh_get(connections_by_id, table, id);
-    if (iter != kh_end(table)) {
-        kh_del(connections_by_id, table, iter);
-    }
-}
-
 static void add_connection(Tunnel *tunnel, VpnConnection *conn) {
     assert(conn->client_id != NON_ID || conn->server_id != NON_ID);
 
     if (conn->client_id != NON_ID) {
-        vpn_connection_put(tunnel->connections.by_client_id, conn->client_id, conn);
+        tunnel->connections.by_client_id.put(conn->client_id, conn);
     }
     if (conn->server_id != NON_ID) {
-        vpn_connection_put(tunnel->connections.by_server_id, conn->server_id, conn);
+        tunnel->connections.by_server_id.put(conn->server_id, conn);
+    }
+}
+
+static void set_traffic_class(const Tunnel *self, VpnConnection *conn, ServerUpstream *upstream) {
+    VpnTrafficClass traffic_class = self->vpn->upstream_config.traffic_classifier.classify({
+            .proto = conn->proto,
+            .dst_port = conn->addr.dstport(),
+            .app_name = conn->setup().app_name,
+            .dscp = conn->setup().dscp,
+    });
+    if (traffic_class != VPN_TC_DEFAULT) {
+        log_conn(self, conn, trace, "Traffic class: {}", magic_enum::enum_name(traffic_class));
     }
+    upstream->set_traffic_class(conn->server_id, traffic_class);
 }
 
 static void cancel_destination_resolve(Tunnel *self, VpnConnection *conn) {
@@ -107,10 +80,10 @@ static void destroy_connection(Tunnel *tunnel, uint64_t client_id, uint64_t serv
 
     VpnConnection *conn = nullptr;
     if (client_id != NON_ID) {
-        conn = vpn_connection_get_by_id(tunnel->connections.by_client_id, client_id);
+        conn = tunnel->connections.by_client_id.get(client_id);
     }
     if (conn == nullptr && server_id != NON_ID) {
-        conn = vpn_connection_get_by_id(tunnel->connections.by_server_id, server_id);
+        conn = tunnel->connections.by_server_id.get(server_id);
     }
 
     if (conn != nullptr) {
@@ -118,15 +91,16 @@ static void destroy_connection(Tunnel *tunnel, uint64_t client_id, uint64_t serv
             cancel_destination_resolve(tunnel, conn);
         }
 
-        vpn_connection_remove(tunnel->connections.by_client_id, conn->client_id);
-        vpn_connection_remove(tunnel->connections.by_server_id, conn->server_id);
+        tunnel->connections.by_client_id.remove(conn->client_id);
+        tunnel->connections.by_server_id.remove(conn->server_id);
 
         if (conn->proto == IPPROTO_UDP && tunnel->udp_close_wait_hostname_cache) {
             std::scoped_lock l(tunnel->udp_close_wait_hostname_cache->mtx);
             tunnel->udp_close_wait_hostname_cache->val.insert(conn->addr, conn->domain_extractor_result);
         }
 
-        log_conn(tunnel, conn, dbg, "Destroyed (download={}, upload={})", conn->incoming_bytes, conn->outgoing_bytes);
+        log_conn(tunnel, conn, dbg, "Destroyed (download={}, upload={}, memory={})", conn->incoming_bytes,
+                conn->outgoing_bytes, conn->memory_usage());
 
         if (conn->flags.test(CONNF_MONITOR_STATS)) {
             tunnel->statistics_monitor->unregister_conn(conn->client_id, /*do_report*/ true);
@@ -139,16 +113,16 @@ static void destroy_connection(Tunnel *tunnel, uint64_t client_id, uint64_t serv
             handler.func(handler.arg, vpn_client::EVENT_CONNECTION_CLOSED, &event);
         }
 
-        assert(nullptr == vpn_connection_get_by_id(tunnel->connections.by_client_id, conn->client_id));
-        assert(nullptr == vpn_connection_get_by_id(tunnel->connections.by_server_id, conn->server_id));
-        delete conn;
+        assert(nullptr == tunnel->connections.by_client_id.get(conn->client_id));
+        assert(nullptr == tunnel->connections.by_server_id.get(conn->server_id));
+        tunnel->connections.slab.destroy(conn);
     } else {
         log_tun(tunnel, dbg, "Trying to destroy non-existent connection: L:{}-R:{}", client_id, server_id);
         return;
     }
 
     log_tun(tunnel, dbg, "Remaining connections: client-side={} server-side={}",
-            (int) kh_size(tunnel->connections.by_client_id), (int) kh_size(tunnel->connections.by_server_id));
+            tunnel->connections.by_client_id.size(), tunnel->connections.by_server_id.size());
 }
 
 static ClientConnectResult server_error_to_connect_result(int err) {
@@ -169,7 +143,7 @@ static void complete_connect_request_task(void *arg, TaskId) {
     auto *ctx = (CompleteConnectRequestCtx *) arg;
     Tunnel *tunnel = ctx->tunnel;
 
-    VpnConnection *conn = vpn_connection_get_by_id(tunnel->connections.by_client_id, ctx->listener_conn_id);
+    VpnConnection *conn = tunnel->connections.by_client_id.get(ctx->listener_conn_id);
     if (conn == nullptr) {
         log_tun(tunnel, dbg, "Connection not found: L:{}", ctx->listener_conn_id);
         assert(0);
@@ -193,7 +167,7 @@ static void complete_connect_request_task(void *arg, TaskId) {
         listener->complete_connect_request(conn->client_id, result);
         if (result != CCR_PASS) {
             // Relookup connection since complete_connect_request may lead to it's close.
-            conn = vpn_connection_get_by_id(tunnel->connections.by_client_id, ctx->listener_conn_id);
+            conn = tunnel->connections.by_client_id.get(ctx->listener_conn_id);
             if (conn != nullptr) {
                 conn->state = CONNS_REJECTED;
             }
@@ -237,7 +211,7 @@ static void close_client_side_connection(Tunnel *self, VpnConnection *conn, int
             uint64_t conn_client_id = conn->client_id;
             listener->complete_connect_request(conn->client_id, result);
             if (result != CCR_PASS) {
-                conn = vpn_connection_get_by_id(self->connections.by_client_id, conn_client_id);
+                conn = self->connections.by_client_id.get(conn_client_id);
                 if (conn != nullptr) {
                     conn->state = CONNS_REJECTED;
                 }
@@ -265,24 +239,21 @@ static void close_client_side_connection(Tunnel *self, VpnConnection *conn, int
 }
 
 static void close_client_side(Tunnel *tunnel, ServerUpstream *upstream) {
-    if (tunnel->connections.by_client_id == nullptr) {
-        return;
-    }
-    kh_connections_by_id_t *table = tunnel->connections.by_client_id;
+    VpnConnectionIndex &table = tunnel->connections.by_client_id;
 
     // `close_client_side_connection()` might insert new connections into the table,
     // leading to undefined behaviour if called within the foreach loop
     std::vector<uint64_t> ids;
-    ids.reserve(kh_size(table));
+    ids.reserve(table.size());
 
-    vpn_connections_foreach(table, [&](VpnConnection *conn) {
+    table.for_each([&](VpnConnection *conn) {
         if (!conn->upstream.expired() && conn->upstream.lock().get() == upstream) {
             ids.push_back(conn->client_id);
         }
     });
 
     for (uint64_t id : ids) {
-        if (VpnConnection *conn = vpn_connection_get_by_id(table, id)) {
+        if (VpnConnection *conn = table.get(id)) {
             conn->flags.set(CONNF_SESSION_CLOSED);
             close_client_side_connection(tunnel, conn, -1, false);
         }
@@ -313,7 +284,7 @@ static std::variant<TunnelDomainLookupAction, DomainExtractorResult> domain_look
                 // no data for domain lookup
                 return TDLA_DONE;
             }
-            return conn->domain_extractor.proceed(dir, conn->proto, quic_data->data(), quic_data->size());
+            return conn->setup().domain_extractor.proceed(dir, conn->proto, quic_data->data(), quic_data->size());
         }
     }
 
@@ -342,7 +313,7 @@ static std::variant<TunnelDomainLookupAction, DomainExtractorResult> domain_look
 
 static TunnelDomainLookupAction pass_through_domain_lookup(
         Tunnel *tunnel, VpnConnection *conn, DomainExtractorPacketDirection dir, const uint8_t *data, size_t length) {
-    DomainExtractor *domain_extractor = &conn->domain_extractor;
+    DomainExtractor *domain_extractor = &conn->setup().domain_extractor;
     DomainExtractorResult r;
     TunnelDomainLookupAction action = TDLA_DONE;
     DomainFilter *filter = &tunnel->vpn->domain_filter;
@@ -398,10 +369,10 @@ static void dns_resolver_handler(void *arg, ClientEvent what, void *data) {
 //
 // Return `false` on fatal error, `true` otherwise.
 //
-// Caller should check `conn->buffered_packets` after this function returns
+// Caller should check `conn->has_buffered_packets()` after this function returns
 // if handling a listener read event.
 static bool send_buffered_data(const Tunnel *self, uint64_t conn_client_id) {
-    VpnConnection *conn = vpn_connection_get_by_id(self->connections.by_client_id, conn_client_id);
+    VpnConnection *conn = self->connections.by_client_id.get(conn_client_id);
     if (conn == nullptr) {
         log_tun(self, dbg, "Connection not found: [L:{}]", conn_client_id);
         return false;
@@ -422,16 +393,17 @@ static bool send_buffered_data(const Tunnel *self, uint64_t conn_client_id) {
     }
 
     bool sent_zero_bytes = false;
-    for (auto it = conn->buffered_packets.begin(); it != conn->buffered_packets.end();) {
+    std::list<DataRef> &buffered_packets = conn->setup().buffered_packets;
+    for (auto it = buffered_packets.begin(); it != buffered_packets.end();) {
         auto &packet = *it;
         log_conn(self, conn, trace, "Sending {} bytes from buffered packets", packet.size());
-        ssize_t r = upstream->send(conn->server_id, packet.data(), packet.size());
+        ssize_t r = upstream->send(conn->server_id, std::span(&packet, 1));
         if (r >= 0 && size_t(r) == packet.size()) {
             conn->outgoing_bytes += r;
             if (conn->flags.test(CONNF_MONITOR_STATS)) {
                 self->statistics_monitor->update_upload(conn_client_id, r);
             }
-            it = conn->buffered_packets.erase(it);
+            it = buffered_packets.erase(it);
             continue;
         }
 
@@ -447,9 +419,10 @@ static bool send_buffered_data(const Tunnel *self, uint64_t conn_client_id) {
         }
 
         log_conn(self, conn, dbg, "Sent partially: {} bytes out of {}", r, packet.size());
-        packet.erase(packet.begin(), packet.begin() + r);
+        packet.remove_prefix(r);
         break;
     }
+    conn->release_setup_if_done();
 
     size_t server_can_send = upstream->available_to_send(conn->server_id);
     log_conn(self, conn, trace, "Can send to server side: {} bytes, upstream sent zero bytes: {}", server_can_send,
@@ -459,6 +432,11 @@ static bool send_buffered_data(const Tunnel *self, uint64_t conn_client_id) {
     return true;
 }
 
+// Data of a client read event, sharing the listener's storage if it allows
+static DataRef client_read_data(const ClientRead *event) {
+    return (event->ref != nullptr) ? *event->ref : DataRef(U8View{event->data, event->length});
+}
+
 static VpnAddress tunnel_to_vpn_address(const TunnelAddress *tunnel);
 static VpnFinalConnectionAction get_final_action(VpnMode mode, VpnConnectAction action) {
     if (action == VPN_CA_DEFAULT) {
@@ -564,7 +542,7 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
     case SERVER_EVENT_CONNECTION_OPENED: {
         uint64_t id = *(uint64_t *) data;
 
-        VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_server_id, id);
+        VpnConnection *conn = this->connections.by_server_id.get(id);
         if (conn == nullptr) {
             log_tun(this, warn, "Got server connect result for inexistent or already closed connection: {}", id);
             upstream->close_connection(id, false, true);
@@ -601,8 +579,7 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
             break;
         }
         case CONNS_WAITING_RESPONSE_MIGRATING: {
-            VpnConnection *src_conn =
-                    vpn_connection_get_by_id(this->connections.by_client_id, conn->migrating_client_id);
+            VpnConnection *src_conn = this->connections.by_client_id.get(conn->setup().migrating_client_id);
             if (src_conn == nullptr) {
                 log_conn(this, conn, dbg, "Migrating connection closed while had being connecting to another upstream");
                 upstream->close_connection(id, false, true);
@@ -611,11 +588,10 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
 
             std::swap(conn->client_id, src_conn->client_id);
             conn->state = CONNS_CONNECTED;
-            conn->migrating_client_id = NON_ID;
+            conn->setup().migrating_client_id = NON_ID;
             add_connection(this, conn);
             if (conn->proto == IPPROTO_UDP) {
-                std::swap(((UdpVpnConnection *) conn)->buffered_packets,
-                        ((UdpVpnConnection *) src_conn)->buffered_packets);
+                std::swap(conn->setup().buffered_packets, src_conn->setup().buffered_packets);
             }
 
             if (std::shared_ptr<ServerUpstream> src_conn_upstream = src_conn->upstream.lock();
@@ -624,11 +600,12 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
             }
 
             log_conn(this, conn, dbg, "Upstream has been switched successfully");
-            if (!conn->buffered_packets.empty()) {
+            if (conn->has_buffered_packets()) {
                 schedule_send_buffered_data(this, conn);
                 break;
             }
 
+            conn->release_setup_if_done();
             listener->turn_read(conn->client_id, true);
             upstream->update_flow_control(conn->server_id, listener->flow_control_info(conn->client_id));
             break;
@@ -651,7 +628,7 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
     case SERVER_EVENT_CONNECTION_CLOSED: {
         uint64_t id = *(uint64_t *) data;
 
-        VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_server_id, id);
+        VpnConnection *conn = this->connections.by_server_id.get(id);
         if (conn == nullptr) {
             log_tun(this, dbg, "Got close event for nonexistent or already closed connection: R:{}", id);
             destroy_connection(this, NON_ID, id);
@@ -660,9 +637,9 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
 
         log_conn(this, conn, dbg, "Connection closed");
         if (std::shared_ptr<ClientListener> listener;
-                nullptr != vpn_connection_get_by_id(this->connections.by_client_id, conn->client_id)
+                nullptr != this->connections.by_client_id.get(conn->client_id)
                 && nullptr != (listener = conn->listener.lock())) {
-            vpn_connection_remove(this->connections.by_server_id, conn->server_id);
+            this->connections.by_server_id.remove(conn->server_id);
             listener->turn_read(conn->client_id, false);
             close_client_side_connection(this, conn, 0, false);
         } else {
@@ -673,7 +650,7 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
     case SERVER_EVENT_READ: {
         auto *event = (ServerReadEvent *) data;
 
-        VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_server_id, event->id);
+        VpnConnection *conn = this->connections.by_server_id.get(event->id);
         if (conn == nullptr) {
             log_tun(this, dbg, "Got data from server for inexistent or already closed connection: {}", event->id);
             event->result = -1;
@@ -746,7 +723,7 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
     case SERVER_EVENT_DATA_SENT: {
         const ServerDataSentEvent *event = (ServerDataSentEvent *) data;
 
-        VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_server_id, event->id);
+        VpnConnection *conn = this->connections.by_server_id.get(event->id);
         if (conn == nullptr) {
             break;
         }
@@ -778,7 +755,7 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
                         event->length, server_can_send);
             }
 
-            if (!conn->buffered_packets.empty()) {
+            if (conn->has_buffered_packets()) {
                 schedule_send_buffered_data(this, conn);
                 break;
             }
@@ -792,7 +769,7 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
     }
     case SERVER_EVENT_GET_AVAILABLE_TO_SEND: {
         auto *event = (ServerAvailableToSendEvent *) data;
-        VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_server_id, event->id);
+        VpnConnection *conn = this->connections.by_server_id.get(event->id);
         if (conn == nullptr) {
             break;
         }
@@ -809,7 +786,7 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
             break;
         }
 
-        VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_server_id, event->id);
+        VpnConnection *conn = this->connections.by_server_id.get(event->id);
         if (conn == nullptr) {
             destroy_connection(this, NON_ID, event->id);
             break;
@@ -827,8 +804,7 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
             log_conn(this, conn, dbg, "Failed to switch upstream: {} ({})", safe_to_string_view(event->error.text),
                     event->error.code);
 
-            VpnConnection *src_conn =
-                    vpn_connection_get_by_id(this->connections.by_client_id, conn->migrating_client_id);
+            VpnConnection *src_conn = this->connections.by_client_id.get(conn->setup().migrating_client_id);
             if (src_conn == nullptr) {
                 // do nothing
             } else {
@@ -848,8 +824,8 @@ void Tunnel::upstream_handler(const std::shared_ptr<ServerUpstream> &upstream, S
         }
 
         if (need_close_client_side) {
-            if (nullptr != vpn_connection_get_by_id(this->connections.by_client_id, conn->client_id)) {
-                vpn_connection_remove(this->connections.by_server_id, conn->server_id);
+            if (nullptr != this->connections.by_client_id.get(conn->client_id)) {
+                this->connections.by_server_id.remove(conn->server_id);
                 close_client_side_connection(this, conn, event->error.code, false);
             } else {
                 destroy_connection(this, conn->client_id, conn->server_id);
@@ -940,7 +916,7 @@ static std::shared_ptr<ServerUpstream> select_upstream(
  * @return The result code which should be set to the event
  */
 [[nodiscard]] static ssize_t initiate_connection_migration(
-        Tunnel *self, VpnConnection *conn, std::shared_ptr<ServerUpstream> upstream, U8View packet) {
+        Tunnel *self, VpnConnection *conn, std::shared_ptr<ServerUpstream> upstream, const DataRef &packet) {
     if (upstream == nullptr) {
         log_conn(self, conn, dbg, "Can't start migration due to upstream isn't selected");
         return -1;
@@ -960,23 +936,25 @@ static std::shared_ptr<ServerUpstream> select_upstream(
 
     size_t processed = 0;
 
-    VpnConnection *sw_conn = VpnConnection::make(NON_ID, conn->addr, conn->proto);
+    VpnConnection *sw_conn = self->connections.slab.make(NON_ID, conn->addr, conn->proto);
     sw_conn->server_id = server_id;
     sw_conn->listener = conn->listener;
     sw_conn->upstream = upstream;
     sw_conn->state = CONNS_WAITING_RESPONSE_MIGRATING;
     sw_conn->flags.set(CONNF_LOOKINGUP_DOMAIN, conn->flags.test(CONNF_LOOKINGUP_DOMAIN));
-    sw_conn->migrating_client_id = conn->client_id;
-    sw_conn->app_name = conn->app_name;
+    sw_conn->setup().migrating_client_id = conn->client_id;
+    sw_conn->setup().app_name = conn->setup().app_name;
+    sw_conn->setup().dscp = conn->setup().dscp;
     sw_conn->domain_extractor_result = conn->domain_extractor_result;
     add_connection(self, sw_conn);
+    set_traffic_class(self, sw_conn, upstream.get());
     if (conn->proto == IPPROTO_UDP) {
         // do not turn off reads on migrating UDP connections,
         // because otherwise the unread packets might be dropped
-        conn->buffered_packets.emplace_back(packet.begin(), packet.end());
+        conn->setup().buffered_packets.emplace_back(packet.to_owned());
         processed = packet.size();
     } else {
-        sw_conn->buffered_packets = std::move(conn->buffered_packets);
+        sw_conn->setup().buffered_packets = std::move(conn->setup().buffered_packets);
         if (std::shared_ptr<ClientListener> listener = conn->listener.lock(); listener != nullptr) {
             listener->turn_read(conn->client_id, false);
         } else {
@@ -997,21 +975,22 @@ static std::shared_ptr<ServerUpstream> select_upstream(
 }
 
 std::optional<VpnConnectAction> Tunnel::finalize_connect_action(ConnectRequestResult request_result) const {
-    VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_client_id, request_result.id);
+    VpnConnection *conn = this->connections.by_client_id.get(request_result.id);
     if (conn == nullptr) {
         log_tun(this, dbg, "Got complete connect request result for inexistent or already closed connection: {}",
                 request_result.id);
         return std::nullopt;
     }
 
+    std::string &app_name = conn->setup().app_name;
     if (!request_result.appname.empty()) {
-        conn->app_name = std::move(request_result.appname);
+        app_name = std::move(request_result.appname);
     }
 #ifdef _WIN32
-    std::string_view process_name = conn->app_name;
+    std::string_view process_name = app_name;
     if (auto backslash_pos = process_name.rfind('\\'); backslash_pos != std::string_view::npos) {
         process_name.remove_prefix(backslash_pos + 1);
-        conn->app_name = process_name;
+        app_name = process_name;
     }
 #endif
     conn->uid = request_result.uid;
@@ -1112,7 +1091,7 @@ static void on_destination_resolve_result(void *arg, VpnDnsResolveId id, VpnDnsR
 
     // `close_client_side_connection()` can invalidate `it`
     DnsResolveWaiter &waiter = it->second;
-    VpnConnection *conn = vpn_connection_get_by_id(self->connections.by_client_id, waiter.conn_client_id);
+    VpnConnection *conn = self->connections.by_client_id.get(waiter.conn_client_id);
     if (conn == nullptr) {
         log_tun(self, dbg, "Connection is closed: resolve_id={} conn_id=[L:{}]", id, waiter.conn_client_id);
         self->dns_resolver->cancel(id);
@@ -1175,12 +1154,13 @@ static void on_destination_resolve_result(void *arg, VpnDnsResolveId id, VpnDnsR
     conn->upstream = upstream;
     conn->addr.dst = address;
     if (upstream != nullptr) {
-        conn->server_id = upstream->open_connection(&conn->addr, conn->proto, conn->app_name);
+        conn->server_id = upstream->open_connection(&conn->addr, conn->proto, conn->setup().app_name);
     }
     if (conn->server_id != NON_ID) {
         conn->state = CONNS_WAITING_RESPONSE;
         log_conn(self, conn, trace, "Connecting...");
         add_connection(self, conn);
+        set_traffic_class(self, conn, upstream.get());
         self->do_health_check(upstream);
     } else {
         close_client_side_connection(self, conn, 0, false);
@@ -1269,7 +1249,7 @@ static bool is_destination_reachable(const Tunnel *self, VpnConnection *conn, Se
 }
 
 void Tunnel::complete_connect_request(uint64_t id, std::optional<VpnConnectAction> action) {
-    VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_client_id, id);
+    VpnConnection *conn = this->connections.by_client_id.get(id);
     if (conn == nullptr) {
         log_tun(this, dbg, "Got complete connect request result for inexistent or already closed connection: {}", id);
         return;
@@ -1277,7 +1257,7 @@ void Tunnel::complete_connect_request(uint64_t id, std::optional<VpnConnectActio
 
     if (vpn_handler_profiling_enabled()) {
         auto now = std::chrono::high_resolution_clock::now();
-        int64_t dt = std::chrono::duration_cast<std::chrono::nanoseconds>(now - conn->requested_at).count();
+        int64_t dt = std::chrono::duration_cast<std::chrono::nanoseconds>(now - conn->setup().requested_at).count();
         if (int64_t threshold = vpn_handler_profiling_threshold_ns(); dt > threshold) {
             log_tun(this, warn, "Connection request [L:{}] completed after {} ms, threshold: {} ms", conn->client_id,
                     dt / 1'000'000.0, threshold / 1'000'000.0);
@@ -1335,7 +1315,7 @@ void Tunnel::complete_connect_request(uint64_t id, std::optional<VpnConnectActio
 
     if (upstream != nullptr) {
         conn->flags.set(CONNF_FAKE_CONNECTION, this->fake_upstream.get() == upstream.get());
-        conn->server_id = upstream->open_connection(&conn->addr, conn->proto, conn->app_name);
+        conn->server_id = upstream->open_connection(&conn->addr, conn->proto, conn->setup().app_name);
         if (conn->server_id == NON_ID) {
             log_conn(this, conn, dbg, "Upstream failed to open connection");
         }
@@ -1347,6 +1327,7 @@ void Tunnel::complete_connect_request(uint64_t id, std::optional<VpnConnectActio
         conn->state = CONNS_WAITING_RESPONSE;
         log_conn(this, conn, dbg, "Connecting...");
         add_connection(this, conn);
+        set_traffic_class(this, conn, upstream.get());
         if (conn->flags.test(CONNF_PLAIN_DNS_CONNECTION)) {
             if (conn->listener.lock().get() == this->dns_resolver.get()) {
                 this->dns_handler->notify_vpn_resolver_connection(conn->server_id);
@@ -1360,14 +1341,14 @@ void Tunnel::complete_connect_request(uint64_t id, std::optional<VpnConnectActio
 
 void Tunnel::reset_connections(int uid) {
     log_tun(this, dbg, "Resetting connections with uid {}", uid);
-    khash_t(connections_by_id) *table = this->connections.by_client_id;
+    VpnConnectionIndex &table = this->connections.by_client_id;
 
     // `close_client_side_connection()` might insert new connections into the table,
     // leading to undefined behaviour if called within the foreach loop
     std::vector<uint64_t> ids;
-    ids.reserve(kh_size(table));
+    ids.reserve(table.size());
 
-    vpn_connections_foreach(table, [&](VpnConnection *conn) {
+    table.for_each([&](VpnConnection *conn) {
         std::shared_ptr<ClientListener> listener = conn->listener.lock();
         if ((uid == -1 || conn->uid == uid) && listener.get() != this->dns_resolver.get()
                 && (listener.get() != this->dns_handler.get()
@@ -1377,7 +1358,7 @@ void Tunnel::reset_connections(int uid) {
     });
 
     for (uint64_t id : ids) {
-        if (VpnConnection *conn = vpn_connection_get_by_id(table, id)) {
+        if (VpnConnection *conn = table.get(id)) {
             close_client_side_connection(this, conn, -1, false);
         }
     }
@@ -1386,25 +1367,25 @@ void Tunnel::reset_connections(int uid) {
 void Tunnel::reset_connections(ClientListener *listener) {
     log_tun(this, dbg, "Resetting connections by listener");
 
-    khash_t(connections_by_id) *table = this->connections.by_client_id;
+    VpnConnectionIndex &table = this->connections.by_client_id;
     std::vector<uint64_t> ids;
-    ids.reserve(kh_size(table));
+    ids.reserve(table.size());
 
-    vpn_connections_foreach(table, [&](VpnConnection *conn) {
+    table.for_each([&](VpnConnection *conn) {
         if (conn->listener.lock().get() == listener) {
             ids.push_back(conn->client_id);
         }
     });
 
     for (uint64_t conn_id : ids) {
-        if (VpnConnection *conn = vpn_connection_get_by_id(table, conn_id); conn != nullptr) {
+        if (VpnConnection *conn = table.get(conn_id); conn != nullptr) {
             close_client_side_connection(this, conn, -1, false);
         }
     }
 }
 
 void Tunnel::reset_connection(uint64_t client_id) {
-    if (VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_client_id, client_id)) {
+    if (VpnConnection *conn = this->connections.by_client_id.get(client_id)) {
         log_tun(this, dbg, "Resetting connection with client id: {}", client_id);
         close_client_side_connection(this, conn, -1, false);
     } else {
@@ -1420,12 +1401,12 @@ void Tunnel::on_before_endpoint_disconnect(ServerUpstream *upstream) {
     this->repeat_exclusions_resolve_task.reset();
 
     std::vector<uint64_t> ids;
-    vpn_connections_foreach(this->connections.by_client_id, [&ids](VpnConnection *conn) {
+    this->connections.by_client_id.for_each([&ids](VpnConnection *conn) {
         ids.push_back(conn->client_id);
     });
 
     for (uint64_t id : ids) {
-        VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_client_id, id);
+        VpnConnection *conn = this->connections.by_client_id.get(id);
         if (conn != nullptr) {
             close_client_side_connection(this, conn, -1, false);
         }
@@ -1435,11 +1416,7 @@ void Tunnel::on_before_endpoint_disconnect(ServerUpstream *upstream) {
 }
 
 void Tunnel::on_after_endpoint_disconnect(ServerUpstream *upstream) { // NOLINT(readability-make-member-function-const)
-    if (this->connections.by_client_id == nullptr) {
-        return;
-    }
-
-    vpn_connections_foreach(this->connections.by_client_id, [upstream](VpnConnection *conn) {
+    this->connections.by_client_id.for_each([upstream](VpnConnection *conn) {
         if (conn->upstream.lock().get() == upstream) {
             conn->flags.set(CONNF_SESSION_CLOSED);
             if (std::shared_ptr<ClientListener> listener = conn->listener.lock(); listener != nullptr) {
@@ -1492,7 +1469,7 @@ void Tunnel::on_exclusions_updated() {
 }
 
 bool Tunnel::should_complete_immediately(uint64_t client_id) const {
-    const VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_client_id, client_id);
+    const VpnConnection *conn = this->connections.by_client_id.get(client_id);
     // In general mode, conection requests suspected to be to an exclusion host should be completed
     // immediately -- don't wait for recovery to bypass a connection. In selective mode, it's the opposite.
     // Connections to the plain DNS port should be completed immediately: PlainDnsManager should decide
@@ -1502,6 +1479,10 @@ bool Tunnel::should_complete_immediately(uint64_t client_id) const {
                     || conn->addr.dstport() == utils::PLAIN_DNS_PORT_NUMBER);
 }
 
+size_t Tunnel::connections_memory_usage() const {
+    return this->connections.memory_usage();
+}
+
 static VpnAddress tunnel_to_vpn_address(const TunnelAddress *tunnel) {
     VpnAddress vpn = {};
 
@@ -1538,12 +1519,14 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
             }
         }
 
-        VpnConnection *conn = VpnConnection::make(client_event->id, client_event_addr, client_event->protocol);
+        VpnConnection *conn =
+                this->connections.slab.make(client_event->id, client_event_addr, client_event->protocol);
         conn->listener = listener;
-        conn->app_name = client_event->app_name;
+        conn->setup().app_name = client_event->app_name;
+        conn->setup().dscp = client_event->dscp;
         conn->flags.set(CONNF_FIRST_PACKET);
         if (vpn_handler_profiling_enabled()) {
-            conn->requested_at = std::chrono::high_resolution_clock::now();
+            conn->setup().requested_at = std::chrono::high_resolution_clock::now();
         }
 
         log_conn(this, conn, dbg, "New client connection request: {}->{} (proto: {})", *client_event->src,
@@ -1580,7 +1563,7 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
 
         VpnAddress dst = tunnel_to_vpn_address(&client_event_addr.dst);
         VpnConnectRequestEvent vpn_event = {client_event->id, client_event->protocol, client_event->src->c_sockaddr(),
-                &dst, conn->app_name.c_str()};
+                &dst, conn->setup().app_name.c_str()};
         // result will come in `complete_connect_request`
         vpn->parameters.handler.func(vpn->parameters.handler.arg, vpn_client::EVENT_CONNECT_REQUEST, &vpn_event);
         break;
@@ -1588,7 +1571,7 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
     case CLIENT_EVENT_CONNECTION_ACCEPTED: {
         uint64_t id = *(uint64_t *) data;
 
-        VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_client_id, id);
+        VpnConnection *conn = this->connections.by_client_id.get(id);
         if (conn == nullptr) {
             log_tun(this, dbg, "Got accepted event for inexistent or already closed connection: {}", id);
             assert(0);
@@ -1603,6 +1586,7 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
         }
 
         conn->state = CONNS_CONNECTED;
+        conn->release_setup_if_done();
         listener->turn_read(id, true);
 
         if (std::shared_ptr<ServerUpstream> upstream = conn->upstream.lock(); upstream != nullptr) {
@@ -1619,14 +1603,14 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
     case CLIENT_EVENT_CONNECTION_CLOSED: {
         uint64_t id = *(uint64_t *) data;
 
-        VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_client_id, id);
+        VpnConnection *conn = this->connections.by_client_id.get(id);
         if (conn == nullptr) {
             break;
         }
 
         log_conn(this, conn, dbg, "Connection closed");
         if (conn->flags.test(CONNF_SESSION_CLOSED)
-                || nullptr == vpn_connection_get_by_id(this->connections.by_server_id, conn->server_id)) {
+                || nullptr == this->connections.by_server_id.get(conn->server_id)) {
             destroy_connection(this, id, conn->server_id);
             break;
         }
@@ -1641,14 +1625,14 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
             upstream->update_flow_control(conn->server_id, {});
         }
 
-        vpn_connection_remove(this->connections.by_client_id, id);
+        this->connections.by_client_id.remove(id);
         upstream->close_connection(conn->server_id, true, true);
 
         break;
     }
     case CLIENT_EVENT_READ: {
         auto *event = (ClientRead *) data;
-        VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_client_id, event->id);
+        VpnConnection *conn = this->connections.by_client_id.get(event->id);
         if (conn == nullptr) {
             log_tun(this, dbg, "Got data from client for inexistent or already closed connection: {}", event->id);
             event->result = -1;
@@ -1686,9 +1670,9 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
                 // If tunnel faced with Anti-Dpi which can split ClientHello into parts, it needs to wait other parts
                 // of ClientHello message (max - 3 parts)
                 static constexpr int MAX_LOOKUP_ATTEMPTS = 3;
-                if (conn->lookup_attempts_num++ < MAX_LOOKUP_ATTEMPTS) {
+                if (VpnConnectionSetup &setup = conn->setup(); setup.lookup_attempts_num++ < MAX_LOOKUP_ATTEMPTS) {
                     log_conn(this, conn, trace, "Adding pending packet, length: {}", event->length);
-                    conn->buffered_packets.emplace_back(event->data, event->data + event->length);
+                    setup.buffered_packets.emplace_back(client_read_data(event).to_owned());
                     event->result = static_cast<int>(event->length);
                     return;
                 }
@@ -1730,7 +1714,7 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
                                                                                                   : "unknown upstream");
                 // NOLINTNEXTLINE(bugprone-narrowing-conversions,cppcoreguidelines-narrowing-conversions)
                 event->result = initiate_connection_migration(
-                        this, conn, std::move(upstream_to_migrate), {event->data, event->length});
+                        this, conn, std::move(upstream_to_migrate), client_read_data(event));
                 if (event->result < 0) {
                     listener->turn_read(conn->client_id, false);
                     close_client_side_connection(this, conn, utils::AG_ECONNRESET, /*async*/ true);
@@ -1750,7 +1734,7 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
             conn->flags.reset(CONNF_FAKE_CONNECTION);
             conn->flags.reset(CONNF_SUSPECT_EXCLUSION);
             event->result = static_cast<int>(initiate_connection_migration(
-                    this, conn, select_upstream(this, VPN_CA_DEFAULT, conn), {event->data, event->length}));
+                    this, conn, select_upstream(this, VPN_CA_DEFAULT, conn), client_read_data(event)));
             if (event->result < 0) {
                 listener->turn_read(conn->client_id, false);
                 close_client_side_connection(this, conn, utils::AG_ECONNRESET, /*async*/ true);
@@ -1763,20 +1747,22 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
 
         switch (conn->state) {
         case CONNS_CONNECTED: {
-            if (!conn->buffered_packets.empty()) {
+            if (conn->has_buffered_packets()) {
                 if (!send_buffered_data(this, conn->client_id)) {
                     // Listener should handle send error by closing connection.
                     event->result = -1;
                     return;
                 }
-                if (!conn->buffered_packets.empty()) {
+                if (conn->has_buffered_packets()) {
                     // Listener should wait, buffered data will be sent out on SERVER_EVENT_DATA_SENT.
                     event->result = 0;
                     return;
                 }
             }
+            conn->release_setup_if_done();
             log_conn(this, conn, trace, "Sending {} bytes", event->length);
-            event->result = (int) upstream->send(conn->server_id, event->data, event->length);
+            DataRef chunk = client_read_data(event);
+            event->result = (int) upstream->send(conn->server_id, std::span(&chunk, 1));
             if (event->result > 0 || (size_t) event->result == event->length) {
                 conn->outgoing_bytes += event->result;
                 if (conn->flags.test(CONNF_MONITOR_STATS)) {
@@ -1795,7 +1781,7 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
         }
         case CONNS_CONNECTED_MIGRATING: {
             if (conn->proto == IPPROTO_UDP) {
-                conn->buffered_packets.emplace_back(event->data, event->data + event->length);
+                conn->setup().buffered_packets.emplace_back(client_read_data(event).to_owned());
                 break;
             }
             [[fallthrough]];
@@ -1813,7 +1799,7 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
     case CLIENT_EVENT_DATA_SENT: {
         const ClientDataSentEvent *event = (ClientDataSentEvent *) data;
 
-        VpnConnection *conn = vpn_connection_get_by_id(this->connections.by_client_id, event->id);
+        VpnConnection *conn = this->connections.by_client_id.get(event->id);
         if (conn == nullptr) {
             log_tun(this, dbg, "Got client sent data event for inexistent or already closed connection: {}", event->id);
             assert(0);
@@ -1846,6 +1832,11 @@ void Tunnel::listener_handler(const std::shared_ptr<ClientListener> &listener, C
         vpn_handler->func(vpn_handler->arg, vpn_client::EVENT_OUTPUT, data);
         break;
     }
+    case CLIENT_EVENT_OUTPUT_BATCH: {
+        vpn_client::Handler *vpn_handler = &this->vpn->parameters.handler;
+        vpn_handler->func(vpn_handler->arg, vpn_client::EVENT_OUTPUT_BATCH, data);
+        break;
+    }
     case CLIENT_EVENT_ICMP_ECHO_REQUEST: {
         auto *event = (IcmpEchoRequestEvent *) data;
         if (!this->vpn->may_send_icmp_request()) {
@@ -2010,12 +2001,10 @@ bool Tunnel::init(VpnClient *vpn) {
     return true;
 }
 
-static void clean_connection_table(Tunnel *tunnel, khash_t(connections_by_id) * table) {
-    if (table != nullptr) {
-        vpn_connections_foreach(table, [tunnel](VpnConnection *conn) {
-            destroy_connection(tunnel, conn->client_id, conn->server_id);
-        });
-    }
+static void clean_connection_table(Tunnel *tunnel, const VpnConnectionIndex &table) {
+    table.for_each([tunnel](VpnConnection *conn) {
+        destroy_connection(tunnel, conn->client_id, conn->server_id);
+    });
 }
 
 void Tunnel::deinit() {
@@ -2043,13 +2032,9 @@ void Tunnel::deinit() {
 }
 
 Tunnel::Tunnel()
-        : connections({kh_init(connections_by_id), kh_init(connections_by_id)})
-        , id(g_next_tunnel_id++) {
+        : id(g_next_tunnel_id++) {
 }
 
-Tunnel::~Tunnel() {
-    kh_destroy(connections_by_id, load_and_null(this->connections.by_client_id));
-    kh_destroy(connections_by_id, load_and_null(this->connections.by_server_id));
-}
+Tunnel::~Tunnel() = default;
 
 } // namespace ag
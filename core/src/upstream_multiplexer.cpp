@@ -2,7 +2,9 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <numeric>
+#include <vector>
 
 #include <magic_enum/magic_enum.hpp>
 
@@ -41,14 +43,35 @@ struct UpstreamInfo {
     std::unique_ptr<MultiplexableUpstream> upstream;
     std::unique_ptr<UpstreamCtx> ctx;
     event_loop::AutoTaskId deferred_task_id;
+    ThroughputMeter throughput;
+    bool spare = false; // opened ahead of demand and has not got any connection yet
+    std::chrono::steady_clock::time_point last_used = std::chrono::steady_clock::now();
 };
 
-UpstreamMultiplexer::UpstreamMultiplexer(
-        int id, const VpnUpstreamProtocolConfig &protocol_config, size_t upstreams_num, MakeUpstream make_upstream)
+static UpstreamMultiplexer::PoolParameters apply_pool_defaults(UpstreamMultiplexer::PoolParameters pool) {
+    if (pool.max_upstreams_num == 0) {
+        pool.max_upstreams_num = UpstreamMultiplexer::DEFAULT_UPSTREAMS_NUM;
+    }
+    pool.min_upstreams_num = std::clamp<size_t>(pool.min_upstreams_num, 1, pool.max_upstreams_num);
+    pool.spare_upstreams_num = std::min(pool.spare_upstreams_num, pool.max_upstreams_num - 1);
+    if (pool.idle_timeout.count() <= 0) {
+        pool.idle_timeout = UpstreamMultiplexer::DEFAULT_IDLE_TIMEOUT;
+    }
+    return pool;
+}
+
+static int next_upstream_id() {
+    static std::atomic<int> next_id = 0;
+    return next_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+UpstreamMultiplexer::UpstreamMultiplexer(int id, const VpnUpstreamProtocolConfig &protocol_config,
+        PoolParameters pool, MakeUpstream make_upstream, std::unique_ptr<UpstreamSelector> selector)
         : ServerUpstream(id, protocol_config)
-        , m_max_upstreams_num((upstreams_num == 0) ? DEFAULT_UPSTREAMS_NUM : upstreams_num)
-        , m_make_upstream(make_upstream) {
-    m_upstreams_pool.reserve(m_max_upstreams_num);
+        , m_pool(apply_pool_defaults(pool))
+        , m_make_upstream(make_upstream)
+        , m_selector((selector != nullptr) ? std::move(selector) : std::make_unique<LatencyAwareSelector>()) {
+    m_upstreams_pool.reserve(m_pool.max_upstreams_num);
 }
 
 UpstreamMultiplexer::~UpstreamMultiplexer() = default;
@@ -94,6 +117,7 @@ static void clear_upstreams_map(std::unordered_map<int, std::unique_ptr<Upstream
 }
 
 void UpstreamMultiplexer::close_session() {
+    m_idle_check_task.reset();
     for (auto &[_, info] : m_upstreams_pool) {
         info->upstream->close_session();
     }
@@ -138,6 +162,8 @@ uint64_t UpstreamMultiplexer::open_connection(const TunnelAddressPair *addr, int
         conn_id = NON_ID;
     }
 
+    open_spare_upstreams();
+
     return conn_id;
 }
 
@@ -155,7 +181,28 @@ ssize_t UpstreamMultiplexer::send(uint64_t id, const uint8_t *data, size_t lengt
 
     MultiplexableUpstream *upstream = get_upstream_by_conn(id);
     if (upstream != nullptr) {
+        int upstream_id = upstream->get_id();
         result = upstream->send(id, data, length);
+        if (auto i = m_upstreams_pool.find(upstream_id); result > 0 && i != m_upstreams_pool.end()) {
+            i->second->throughput.account(result);
+        }
+    } else {
+        log_conn(this, id, dbg, "Connection was not found");
+    }
+
+    return result;
+}
+
+ssize_t UpstreamMultiplexer::send(uint64_t id, std::span<const DataRef> chunks) {
+    ssize_t result = -1;
+
+    MultiplexableUpstream *upstream = get_upstream_by_conn(id);
+    if (upstream != nullptr) {
+        int upstream_id = upstream->get_id();
+        result = upstream->send(id, chunks);
+        if (auto i = m_upstreams_pool.find(upstream_id); result > 0 && i != m_upstreams_pool.end()) {
+            i->second->throughput.account(result);
+        }
     } else {
         log_conn(this, id, dbg, "Connection was not found");
     }
@@ -163,6 +210,21 @@ ssize_t UpstreamMultiplexer::send(uint64_t id, const uint8_t *data, size_t lengt
     return result;
 }
 
+void UpstreamMultiplexer::set_traffic_class(uint64_t id, VpnTrafficClass traffic_class) {
+    // Applied once the upstream session is established
+    if (auto i = m_pending_connections.find(id); i != m_pending_connections.end()) {
+        i->second.traffic_class = traffic_class;
+        return;
+    }
+
+    MultiplexableUpstream *upstream = get_upstream_by_conn(id);
+    if (upstream != nullptr) {
+        upstream->set_traffic_class(id, traffic_class);
+    } else {
+        log_conn(this, id, dbg, "Connection was not found");
+    }
+}
+
 void UpstreamMultiplexer::consume(uint64_t id, size_t length) {
     MultiplexableUpstream *upstream = get_upstream_by_conn(id);
     if (upstream != nullptr) {
@@ -234,6 +296,8 @@ VpnConnectionStats UpstreamMultiplexer::get_connection_stats() const {
             stats = {
                     PICK_WORST_RTT(stats.rtt_us, i_stats.rtt_us),
                     PICK_WORST_LOSS_RATIO(stats.packet_loss_ratio, i_stats.packet_loss_ratio),
+                    stats.recv_window_size + i_stats.recv_window_size,
+                    stats.bytes_in_flight + i_stats.bytes_in_flight,
             };
         }
     }
@@ -304,6 +368,7 @@ void UpstreamMultiplexer::child_upstream_handler(void *arg, ServerEvent what, vo
         }
 
         pool_it->second->state = US_SESSION_OPENED;
+        pool_it->second->last_used = std::chrono::steady_clock::now();
 
         for (auto i = mux->m_pending_connections.begin(); i != mux->m_pending_connections.end();) {
             const PendingConnection *conn = &i->second;
@@ -314,6 +379,8 @@ void UpstreamMultiplexer::child_upstream_handler(void *arg, ServerEvent what, vo
                 ++i;
             }
         }
+
+        mux->open_spare_upstreams();
         break;
     case SERVER_EVENT_SESSION_CLOSED: {
         for (auto i = mux->m_pending_connections.begin(); i != mux->m_pending_connections.end();) {
@@ -334,12 +401,16 @@ void UpstreamMultiplexer::child_upstream_handler(void *arg, ServerEvent what, vo
         uint64_t id = *(uint64_t *) data;
         assert(mux->m_connections.count(id) != 0);
         mux->m_connections.erase(id);
+        pool_it->second->last_used = std::chrono::steady_clock::now();
         log_mux(mux, dbg, "Remaining upstreams={} connections={} pending connections={}", mux->m_upstreams_pool.size(),
                 mux->m_connections.size(), mux->m_pending_connections.size());
         mux->handler.func(mux->handler.arg, what, data);
         break;
     }
     case SERVER_EVENT_READ: {
+        if (auto i = mux->m_upstreams_pool.find(ctx->id); i != mux->m_upstreams_pool.end()) {
+            i->second->throughput.account(((ServerReadEvent *) data)->length);
+        }
         mux->handler.func(mux->handler.arg, what, data);
         break;
     }
@@ -355,6 +426,7 @@ void UpstreamMultiplexer::child_upstream_handler(void *arg, ServerEvent what, vo
         if (event->id != NON_ID) {
             // An error on connection also means that some data was received.
             mux->m_connections.erase(event->id);
+            pool_it->second->last_used = std::chrono::steady_clock::now();
             log_mux(mux, dbg, "Remaining upstreams={} connections={} pending connections={}",
                     mux->m_upstreams_pool.size(), mux->m_connections.size(), mux->m_pending_connections.size());
             mux->handler.func(mux->handler.arg, SERVER_EVENT_ERROR, data);
@@ -399,34 +471,32 @@ MultiplexableUpstream *UpstreamMultiplexer::get_upstream_by_conn(uint64_t id) co
 
 std::optional<int> UpstreamMultiplexer::select_existing_upstream(
         std::optional<int> ignored_upstream, bool allow_underflow) const {
-    // for the first try to pick underloaded upstream
-    for (const auto &[id, _] : m_upstreams_pool) {
-        if (ignored_upstream != id && connections_num_by_upstream(id) < NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD) {
-            return id;
+    std::vector<UpstreamSelector::Candidate> candidates;
+    candidates.reserve(m_upstreams_pool.size());
+    std::optional<int> spare_id;
+    for (const auto &[id, info] : m_upstreams_pool) {
+        if (ignored_upstream == id) {
+            continue;
         }
-    }
-
-    // if a caller wants an existing upstream or the number of open upstreams reached the cap,
-    // choose the least loaded
-    if (allow_underflow || m_upstreams_pool.size() == DEFAULT_UPSTREAMS_NUM) {
-        std::optional<decltype(m_upstreams_pool.begin())> least_loaded;
-        for (auto i = m_upstreams_pool.begin(); i != m_upstreams_pool.end(); ++i) {
-            if (i->first == ignored_upstream) {
-                continue;
-            }
-
-            if (!least_loaded.has_value()
-                    || (*least_loaded)->second->upstream->connections_num() > i->second->upstream->connections_num()) {
-                least_loaded = i;
+        // spare upstreams are handed out only instead of opening new ones, the established ones go first
+        if (info->spare) {
+            if (!spare_id.has_value() || info->state == US_SESSION_OPENED) {
+                spare_id = id;
             }
+            continue;
         }
-
-        if (least_loaded.has_value()) {
-            return (*least_loaded)->first;
-        }
+        UpstreamLoad load = info->upstream->get_load();
+        load.connections_num = connections_num_by_upstream(id);
+        load.throughput = info->throughput.get();
+        candidates.push_back({id, load});
     }
 
-    return std::nullopt;
+    // if a caller wants an existing upstream or the number of open upstreams reached the cap,
+    // a new one is not opened
+    bool can_open_new =
+            !allow_underflow && (spare_id.has_value() || m_upstreams_pool.size() < m_pool.max_upstreams_num);
+    std::optional<int> id = m_selector->select(candidates, can_open_new);
+    return id.has_value() ? id : spare_id;
 }
 
 int UpstreamMultiplexer::select_upstream_for_connection() {
@@ -436,8 +506,7 @@ int UpstreamMultiplexer::select_upstream_for_connection() {
     }
 
     // otherwise, create a new one
-    static std::atomic<int> next_upstream_id = 0;
-    return next_upstream_id.fetch_add(1, std::memory_order_relaxed);
+    return next_upstream_id();
 }
 
 bool UpstreamMultiplexer::open_new_upstream(int id, std::optional<Millis> timeout) {
@@ -453,6 +522,9 @@ bool UpstreamMultiplexer::open_new_upstream(int id, std::optional<Millis> timeou
     }
 
     m_upstreams_pool[id] = std::move(info);
+    if (m_upstreams_pool.size() > m_pool.min_upstreams_num && !m_idle_check_task.has_value()) {
+        schedule_idle_check(m_pool.idle_timeout);
+    }
     return true;
 }
 
@@ -467,6 +539,8 @@ bool UpstreamMultiplexer::open_connection(
 
     bool successful = true;
     UpstreamInfo *info = i->second.get();
+    info->spare = false;
+    info->last_used = std::chrono::steady_clock::now();
     switch (info->state) {
     case US_OPENING_SESSION:
         log_ups_conn(this, upstream_id, conn_id, trace, "Postpone connection until session is established");
@@ -484,19 +558,25 @@ bool UpstreamMultiplexer::open_connection(
 }
 
 void UpstreamMultiplexer::proceed_pending_connection(int upstream_id, uint64_t conn_id, const PendingConnection *conn) {
-    if (open_connection(upstream_id, conn_id, &conn->addr, conn->proto, conn->app_name)) {
-        return;
+    if (!open_connection(upstream_id, conn_id, &conn->addr, conn->proto, conn->app_name)) {
+        assert(!m_upstreams_pool.empty());
+        int fallback_upstream_id = m_upstreams_pool.begin()->first;
+        log_ups_conn(this, upstream_id, conn_id, dbg,
+                "Failed to open connection on new upstream, falling back on existing one (id={})",
+                fallback_upstream_id);
+
+        if (!open_connection(fallback_upstream_id, conn_id, &conn->addr, conn->proto, conn->app_name)) {
+            log_ups_conn(this, fallback_upstream_id, conn_id, dbg, "Failed to fall back on existing upstream");
+            ServerError err_event = {conn_id, {ag::utils::AG_ECONNREFUSED, "Failed to connect"}};
+            this->handler.func(this->handler.arg, SERVER_EVENT_ERROR, &err_event);
+            return;
+        }
     }
 
-    assert(!m_upstreams_pool.empty());
-    int fallback_upstream_id = m_upstreams_pool.begin()->first;
-    log_ups_conn(this, upstream_id, conn_id, dbg,
-            "Failed to open connection on new upstream, falling back on existing one (id={})", fallback_upstream_id);
-
-    if (!open_connection(fallback_upstream_id, conn_id, &conn->addr, conn->proto, conn->app_name)) {
-        log_ups_conn(this, fallback_upstream_id, conn_id, dbg, "Failed to fall back on existing upstream");
-        ServerError err_event = {conn_id, {ag::utils::AG_ECONNREFUSED, "Failed to connect"}};
-        this->handler.func(this->handler.arg, SERVER_EVENT_ERROR, &err_event);
+    if (conn->traffic_class != VPN_TC_DEFAULT) {
+        if (MultiplexableUpstream *upstream = get_upstream_by_conn(conn_id); upstream != nullptr) {
+            upstream->set_traffic_class(conn_id, conn->traffic_class);
+        }
     }
 }
 
@@ -510,6 +590,73 @@ size_t UpstreamMultiplexer::connections_num_by_upstream(int id) const {
                     });
 }
 
+void UpstreamMultiplexer::open_spare_upstreams() {
+    auto now = std::chrono::steady_clock::now();
+    size_t spare_num = 0;
+    for (auto &[_, info] : m_upstreams_pool) {
+        if (info->spare) {
+            // there is demand for connections, so the spare ones are not idle
+            info->last_used = now;
+            spare_num += 1;
+        }
+    }
+
+    size_t target_num = std::clamp(m_upstreams_pool.size() - spare_num + m_pool.spare_upstreams_num,
+            m_pool.min_upstreams_num, m_pool.max_upstreams_num);
+    while (m_upstreams_pool.size() < target_num) {
+        int upstream_id = next_upstream_id();
+        if (!open_new_upstream(upstream_id, std::nullopt)) {
+            log_ups(this, upstream_id, dbg, "Failed to open spare upstream");
+            break;
+        }
+        log_ups(this, upstream_id, dbg, "Opening spare upstream");
+        m_upstreams_pool[upstream_id]->spare = true;
+    }
+}
+
+void UpstreamMultiplexer::schedule_idle_check(Millis defer) {
+    m_idle_check_task = event_loop::schedule(this->vpn->parameters.ev_loop,
+            {
+                    this,
+                    [](void *arg, TaskId) {
+                        auto *self = (UpstreamMultiplexer *) arg;
+                        self->m_idle_check_task.release();
+                        self->close_idle_upstreams();
+                    },
+            },
+            defer);
+}
+
+void UpstreamMultiplexer::close_idle_upstreams() {
+    auto now = std::chrono::steady_clock::now();
+    Millis next_check = m_pool.idle_timeout;
+    std::vector<int> expired;
+    for (const auto &[id, info] : m_upstreams_pool) {
+        if (info->state != US_SESSION_OPENED || connections_num_by_upstream(id) != 0) {
+            continue;
+        }
+        auto idle_for = std::chrono::duration_cast<Millis>(now - info->last_used);
+        if (idle_for >= m_pool.idle_timeout) {
+            expired.push_back(id);
+        } else {
+            next_check = std::min(next_check, m_pool.idle_timeout - idle_for);
+        }
+    }
+
+    for (int upstream_id : expired) {
+        if (m_upstreams_pool.size() <= m_pool.min_upstreams_num) {
+            break;
+        }
+        log_ups(this, upstream_id, dbg, "Closing idle upstream");
+        m_upstreams_pool[upstream_id]->upstream->close_session();
+        close_upstream(upstream_id);
+    }
+
+    if (m_upstreams_pool.size() > m_pool.min_upstreams_num) {
+        schedule_idle_check(next_check);
+    }
+}
+
 void UpstreamMultiplexer::handle_sleep() {
     log_mux(this, dbg, "...");
 
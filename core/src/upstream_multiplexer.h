@@ -8,6 +8,7 @@
 
 #include "common/logger.h"
 #include "multiplexable_upstream.h"
+#include "vpn/event_loop.h"
 
 namespace ag {
 
@@ -17,14 +18,31 @@ class UpstreamMultiplexer : public ServerUpstream {
 public:
     // Maximum number of upstreams
     static constexpr size_t DEFAULT_UPSTREAMS_NUM = 8;
+    // Period after which an upstream without connections may be closed
+    static constexpr Millis DEFAULT_IDLE_TIMEOUT{60'000};
     // Number of connection exceeding which a new upstream will be opened
-    static constexpr size_t NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD = 5;
+    static constexpr size_t NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD =
+            UpstreamSelector::NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD;
 
     using MakeUpstream = std::unique_ptr<MultiplexableUpstream> (*)(
             const VpnUpstreamProtocolConfig &protocol_config, int id, VpnClient *vpn, ServerHandler handler);
 
-    UpstreamMultiplexer(
-            int id, const VpnUpstreamProtocolConfig &protocol_config, size_t upstreams_num, MakeUpstream make_upstream);
+    /**
+     * Bounds of the upstreams pool
+     */
+    struct PoolParameters {
+        size_t max_upstreams_num;   // maximum number of upstreams (if 0, `DEFAULT_UPSTREAMS_NUM`)
+        size_t min_upstreams_num;   // number of upstreams kept open even if unused (if 0, 1)
+        size_t spare_upstreams_num; // number of unused upstreams kept open ahead of demand
+        Millis idle_timeout;        // unused upstreams above the minimum are closed after it (if 0, the default)
+    };
+
+    /**
+     * @param pool bounds of the upstreams pool
+     * @param selector policy of choosing an upstream for a new connection (if null, `LatencyAwareSelector`)
+     */
+    UpstreamMultiplexer(int id, const VpnUpstreamProtocolConfig &protocol_config, PoolParameters pool,
+            MakeUpstream make_upstream, std::unique_ptr<UpstreamSelector> selector = nullptr);
     ~UpstreamMultiplexer() override;
 
     UpstreamMultiplexer() = delete;
@@ -42,14 +60,17 @@ private:
         TunnelAddressPair addr;
         int proto;
         std::string app_name;
+        VpnTrafficClass traffic_class = VPN_TC_DEFAULT;
     };
 
     std::unordered_map<uint64_t, Connection> m_connections;
     std::unordered_map<int, std::unique_ptr<UpstreamInfo>> m_upstreams_pool;
-    size_t m_max_upstreams_num = DEFAULT_UPSTREAMS_NUM;
+    PoolParameters m_pool;
     std::unordered_map<uint64_t, PendingConnection> m_pending_connections;
     MakeUpstream m_make_upstream;
+    std::unique_ptr<UpstreamSelector> m_selector;
     std::optional<VpnError> m_pending_error;
+    event_loop::AutoTaskId m_idle_check_task;
     bool m_session_open = false; // True if session has been opened at least once.
 
     ag::Logger m_log{"UPSTREAM_MUX"};
@@ -61,6 +82,8 @@ private:
     uint64_t open_connection(const TunnelAddressPair *addr, int proto, std::string_view app_name) override;
     void close_connection(uint64_t id, bool graceful, bool async) override;
     ssize_t send(uint64_t id, const uint8_t *data, size_t length) override;
+    ssize_t send(uint64_t id, std::span<const DataRef> chunks) override;
+    void set_traffic_class(uint64_t id, VpnTrafficClass traffic_class) override;
     void consume(uint64_t id, size_t length) override;
     size_t available_to_send(uint64_t id) override;
     void update_flow_control(uint64_t id, TcpFlowCtrlInfo info) override;
@@ -80,6 +103,9 @@ private:
             int upstream_id, uint64_t conn_id, const TunnelAddressPair *addr, int proto, std::string_view app_name);
     void proceed_pending_connection(int upstream_id, uint64_t conn_id, const PendingConnection *conn);
     [[nodiscard]] size_t connections_num_by_upstream(int upstream_id) const;
+    void open_spare_upstreams();
+    void schedule_idle_check(Millis defer);
+    void close_idle_upstreams();
     void close_upstream(int upstream_id);
     void handle_sleep() override;
     void handle_wake() override;
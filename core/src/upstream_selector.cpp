@@ -0,0 +1,110 @@
+#include "upstream_selector.h"
+
+#include <algorithm>
+#include <tuple>
+
+namespace ag {
+
+// The throughput is measured over intervals at least this long
+static constexpr auto THROUGHPUT_INTERVAL = std::chrono::milliseconds(100);
+// The intervals longer than this replace the measured throughput instead of being averaged with it
+static constexpr auto THROUGHPUT_RESET_INTERVAL = 8 * THROUGHPUT_INTERVAL;
+static constexpr uint64_t USEC_PER_SEC = 1'000'000;
+
+void ThroughputMeter::account(size_t bytes, Clock::time_point now) {
+    update(now);
+    m_interval_bytes += bytes;
+}
+
+uint64_t ThroughputMeter::get(Clock::time_point now) {
+    update(now);
+    return m_throughput;
+}
+
+void ThroughputMeter::update(Clock::time_point now) {
+    if (m_interval_start == Clock::time_point{}) {
+        m_interval_start = now;
+        return;
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - m_interval_start);
+    if (elapsed < THROUGHPUT_INTERVAL) {
+        return;
+    }
+
+    uint64_t throughput = m_interval_bytes * USEC_PER_SEC / uint64_t(elapsed.count());
+    m_throughput = (m_throughput == 0 || elapsed >= THROUGHPUT_RESET_INTERVAL) ? throughput
+                                                                                : (m_throughput + throughput) / 2;
+    m_interval_start = now;
+    m_interval_bytes = 0;
+}
+
+std::optional<int> ConnectionCountSelector::select(std::span<const Candidate> candidates, bool can_open_new) const {
+    // for the first try to pick underloaded upstream
+    for (const Candidate &c : candidates) {
+        if (c.load.connections_num < NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD) {
+            return c.id;
+        }
+    }
+
+    // if a new upstream can't be opened, choose the least loaded
+    if (can_open_new || candidates.empty()) {
+        return std::nullopt;
+    }
+    return std::min_element(candidates.begin(), candidates.end(),
+            [](const Candidate &lh, const Candidate &rh) {
+                return lh.load.connections_num < rh.load.connections_num;
+            })
+            ->id;
+}
+
+uint64_t LatencyAwareSelector::estimate_queueing_delay_us(const UpstreamLoad &load) {
+    uint64_t queued = load.bytes_in_flight + load.send_queue_size;
+    return queued * USEC_PER_SEC / std::max(load.throughput, MIN_DRAIN_RATE);
+}
+
+uint64_t LatencyAwareSelector::estimate_delay_us(const UpstreamLoad &load, uint32_t fallback_rtt_us) {
+    uint64_t rtt_us = (load.rtt_us != 0) ? load.rtt_us : fallback_rtt_us;
+    return rtt_us + estimate_queueing_delay_us(load);
+}
+
+std::optional<int> LatencyAwareSelector::select(std::span<const Candidate> candidates, bool can_open_new) const {
+    // The upstreams which have not measured the round-trip time yet are assumed to be as good as the best one
+    uint32_t fallback_rtt_us = 0;
+    for (const Candidate &c : candidates) {
+        if (c.load.rtt_us != 0 && (fallback_rtt_us == 0 || c.load.rtt_us < fallback_rtt_us)) {
+            fallback_rtt_us = c.load.rtt_us;
+        }
+    }
+
+    const Candidate *best = nullptr;
+    const Candidate *best_available = nullptr;
+    std::tuple<uint64_t, size_t> best_key;
+    std::tuple<uint64_t, size_t> best_available_key;
+    for (const Candidate &c : candidates) {
+        uint64_t delay_us = estimate_delay_us(c.load, fallback_rtt_us);
+        std::tuple key{delay_us, c.load.connections_num};
+        if (best == nullptr || key < best_key) {
+            best = &c;
+            best_key = key;
+        }
+        // A session filling the pipe has about a round trip worth of data in flight, only the data above
+        // that is queued. Without the round-trip time measured, the session is too fresh to be congested.
+        bool congested = c.load.rtt_us != 0 && estimate_queueing_delay_us(c.load) > c.load.rtt_us;
+        if (!congested && c.load.connections_num < NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD
+                && (best_available == nullptr || key < best_available_key)) {
+            best_available = &c;
+            best_available_key = key;
+        }
+    }
+
+    if (best_available != nullptr) {
+        return best_available->id;
+    }
+    if (can_open_new || best == nullptr) {
+        return std::nullopt;
+    }
+    return best->id;
+}
+
+} // namespace ag
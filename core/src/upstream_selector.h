@@ -0,0 +1,119 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+
+namespace ag {
+
+/**
+ * Live load metrics of an upstream
+ */
+struct UpstreamLoad {
+    size_t connections_num; // number of connections, including the ones waiting for the session
+    uint32_t rtt_us;        // smoothed round-trip time (0 if not known)
+    size_t bytes_in_flight; // bytes sent to the endpoint and not acknowledged yet
+    size_t send_queue_size; // bytes waiting in the send buffer
+    uint64_t throughput;    // recent throughput in both directions (bytes per second)
+};
+
+/**
+ * Measures the recent throughput of an upstream
+ */
+class ThroughputMeter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * Account data passed through the upstream
+     */
+    void account(size_t bytes, Clock::time_point now = Clock::now());
+
+    /**
+     * Get the throughput in bytes per second
+     */
+    [[nodiscard]] uint64_t get(Clock::time_point now = Clock::now());
+
+private:
+    Clock::time_point m_interval_start{};
+    uint64_t m_interval_bytes = 0;
+    uint64_t m_throughput = 0;
+
+    void update(Clock::time_point now);
+};
+
+/**
+ * Policy of choosing an upstream for a new connection
+ */
+class UpstreamSelector {
+public:
+    struct Candidate {
+        int id;
+        UpstreamLoad load;
+    };
+
+    // Number of connections exceeding which a new upstream is preferred
+    static constexpr size_t NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD = 5;
+
+    UpstreamSelector() = default;
+    virtual ~UpstreamSelector() = default;
+
+    UpstreamSelector(const UpstreamSelector &) = delete;
+    UpstreamSelector &operator=(const UpstreamSelector &) = delete;
+    UpstreamSelector(UpstreamSelector &&) = delete;
+    UpstreamSelector &operator=(UpstreamSelector &&) = delete;
+
+    /**
+     * Select an upstream for a new connection
+     * @param candidates the existing upstreams
+     * @param can_open_new whether a new upstream may be opened instead
+     * @return the id of the selected upstream, or none if a new one should be opened
+     *         (none is never returned if `can_open_new` is false, unless there are no candidates)
+     */
+    [[nodiscard]] virtual std::optional<int> select(std::span<const Candidate> candidates, bool can_open_new) const = 0;
+};
+
+/**
+ * Fills upstreams up to `NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD` connections one by one,
+ * then picks the one with the fewest connections
+ */
+class ConnectionCountSelector : public UpstreamSelector {
+public:
+    [[nodiscard]] std::optional<int> select(std::span<const Candidate> candidates, bool can_open_new) const override;
+};
+
+/**
+ * Picks the upstream on which the data of a new connection is expected to be delayed the least.
+ *
+ * The delay is estimated as the round-trip time plus the queueing delay, i.e. the time needed to pass
+ * the bytes in flight and the send buffer at the recent throughput (but not less than `MIN_DRAIN_RATE`).
+ * An upstream is considered congested if the queueing delay is more than its round-trip time, as a session
+ * filling the pipe keeps about a round trip worth of data in flight. An upstream which has not measured
+ * the round-trip time yet is not considered congested.
+ * If all the upstreams are congested or have `NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD` connections,
+ * a new upstream is preferred.
+ */
+class LatencyAwareSelector : public UpstreamSelector {
+public:
+    // The data queued ahead is assumed to be passed at least at this rate (bytes per second)
+    static constexpr uint64_t MIN_DRAIN_RATE = 1024 * 1024;
+
+    [[nodiscard]] std::optional<int> select(std::span<const Candidate> candidates, bool can_open_new) const override;
+
+    /**
+     * Estimate the delay of a new connection's data on an upstream
+     * @param load the upstream load
+     * @param fallback_rtt_us the round-trip time to assume if the upstream does not know it
+     */
+    [[nodiscard]] static uint64_t estimate_delay_us(const UpstreamLoad &load, uint32_t fallback_rtt_us);
+
+    /**
+     * Estimate the time needed to pass the data queued on an upstream
+     * @param load the upstream load
+     */
+    [[nodiscard]] static uint64_t estimate_queueing_delay_us(const UpstreamLoad &load);
+};
+
+} // namespace ag
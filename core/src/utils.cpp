@@ -111,6 +111,18 @@ AutoPod<VpnUpstreamConfig, vpn_upstream_config_destroy> vpn_upstream_config_clon
     dst->username = safe_strdup(src->username);
     dst->password = safe_strdup(src->password);
 
+    dst->traffic_class_rules = {};
+    if (src->traffic_class_rules.size > 0) {
+        // NOLINTNEXTLINE(cppcoreguidelines-no-malloc,hicpp-no-malloc)
+        auto *rules = (VpnTrafficClassRule *) malloc(src->traffic_class_rules.size * sizeof(VpnTrafficClassRule));
+        for (size_t i = 0; i < src->traffic_class_rules.size; ++i) {
+            rules[i] = src->traffic_class_rules.data[i];
+            rules[i].app_name = safe_strdup(src->traffic_class_rules.data[i].app_name);
+        }
+        dst->traffic_class_rules.data = rules;
+        dst->traffic_class_rules.size = src->traffic_class_rules.size;
+    }
+
     return dst;
 }
 
@@ -119,6 +131,10 @@ void vpn_upstream_config_destroy(VpnUpstreamConfig *config) {
     // NOLINTBEGIN(cppcoreguidelines-no-malloc,hicpp-no-malloc)
     free((void *) config->username);
     free((void *) config->password);
+    for (size_t i = 0; i < config->traffic_class_rules.size; ++i) {
+        free((void *) config->traffic_class_rules.data[i].app_name);
+    }
+    free((void *) config->traffic_class_rules.data);
     // NOLINTEND(cppcoreguidelines-no-malloc,hicpp-no-malloc)
     *config = {};
 }
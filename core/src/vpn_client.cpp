@@ -243,7 +243,8 @@ static FsmParameters make_fsm_params(VpnClient *vpn) {
 }
 
 VpnClient::VpnClient(vpn_client::Parameters parameters)
-        : fsm(make_fsm_params(this))
+        : buffer_governor(parameters.ev_loop)
+        , fsm(make_fsm_params(this))
         , parameters(parameters)
         , id(g_next_id++) {
 }
@@ -293,7 +294,11 @@ VpnError VpnClient::init(const VpnSettings *settings) {
         if (settings->max_conn_buffer_file_size == 0) {
             this->max_conn_buffer_file_size = VPN_DEFAULT_MAX_CONN_BUFFER_FILE_SIZE;
         }
+        this->spill_arena = std::make_unique<SpillArena>(
+                make_buffer_file_path(this->tmp_files_base_path->c_str(), (uint64_t) this->id));
     }
+    this->buffer_governor.set_budget((settings->conn_buffers_budget > 0) ? settings->conn_buffers_budget
+                                                                          : VPN_DEFAULT_CONN_BUFFERS_BUDGET);
     if (settings->ssl_sessions_storage_path != nullptr) {
         this->ssl_session_storage_path = settings->ssl_sessions_storage_path;
         load_session_cache(*this->ssl_session_storage_path);
@@ -362,7 +367,12 @@ static std::unique_ptr<ServerUpstream> make_upstream(const VpnUpstreamProtocolCo
     switch (protocol.type) {
     case VPN_UP_HTTP2:
         upstream = std::make_unique<UpstreamMultiplexer>(VpnClient::next_upstream_id(), protocol,
-                protocol.http2.connections_num,
+                UpstreamMultiplexer::PoolParameters{
+                        .max_upstreams_num = protocol.http2.connections_num,
+                        .min_upstreams_num = protocol.http2.min_connections_num,
+                        .spare_upstreams_num = protocol.http2.spare_connections_num,
+                        .idle_timeout = Millis{protocol.http2.idle_connection_timeout_ms},
+                },
                 [](const VpnUpstreamProtocolConfig &protocol_config, int id, VpnClient *vpn,
                         ServerHandler handler) -> std::unique_ptr<MultiplexableUpstream> {
                     return std::make_unique<Http2Upstream>(protocol_config, id, vpn, handler);
@@ -644,10 +654,10 @@ VpnConnectionStats VpnClient::get_connection_stats() const {
                                                               : VpnConnectionStats{};
 }
 
-std::unique_ptr<DataBuffer> VpnClient::make_buffer(uint64_t id) const {
-    if (this->tmp_files_base_path.has_value()) {
-        return std::make_unique<MemfileBuffer>(make_buffer_file_path(this->tmp_files_base_path->c_str(), id),
-                this->conn_memory_buffer_threshold, this->max_conn_buffer_file_size);
+std::unique_ptr<DataBuffer> VpnClient::make_buffer() const {
+    if (this->spill_arena != nullptr) {
+        return std::make_unique<MemfileBuffer>(
+                this->spill_arena.get(), this->conn_memory_buffer_threshold, this->max_conn_buffer_file_size);
     }
 
     return std::make_unique<MemoryBuffer>();
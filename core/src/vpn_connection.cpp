@@ -1,4 +1,7 @@
 #include "vpn/internal/vpn_connection.h"
+
+#include <new>
+
 #include "common/net_utils.h"
 
 namespace ag {
@@ -15,14 +18,14 @@ TcpVpnConnection::TcpVpnConnection(TunnelAddressPair addr)
         : VpnConnection(std::move(addr)) {
 }
 
-VpnConnection *VpnConnection::make(uint64_t client_id, TunnelAddressPair addr, int proto) {
+VpnConnection *VpnConnection::make(void *storage, uint64_t client_id, TunnelAddressPair addr, int proto) {
     VpnConnection *self;                                    // NOLINT(cppcoreguidelines-init-variables)
     switch (ipproto_to_transport_protocol(proto).value()) { // NOLINT(bugprone-unchecked-optional-access)
     case utils::TP_TCP:
-        self = new TcpVpnConnection{addr};
+        self = new (storage) TcpVpnConnection{addr};
         break;
     case utils::TP_UDP:
-        self = new UdpVpnConnection{addr};
+        self = new (storage) UdpVpnConnection{addr};
         break;
     }
 
@@ -38,7 +41,47 @@ VpnConnection *VpnConnection::make(uint64_t client_id, TunnelAddressPair addr, i
 
 SockAddrTag VpnConnection::make_tag() const {
     const SocketAddress *dst = std::get_if<SocketAddress>(&this->addr.dst);
-    return {(dst != nullptr) ? *dst : SocketAddress{}, this->app_name};
+    return {(dst != nullptr) ? *dst : SocketAddress{}, (m_setup != nullptr) ? m_setup->app_name : std::string{}};
+}
+
+VpnConnectionSetup &VpnConnection::setup() {
+    if (m_setup == nullptr) {
+        m_setup = std::make_unique<VpnConnectionSetup>();
+    }
+    return *m_setup;
+}
+
+bool VpnConnection::release_setup_if_done() {
+    if (m_setup == nullptr) {
+        return true;
+    }
+    if (this->state != CONNS_CONNECTED || this->flags.test(CONNF_LOOKINGUP_DOMAIN)
+            || this->flags.test(CONNF_FAKE_CONNECTION) || !m_setup->buffered_packets.empty()) {
+        return false;
+    }
+    m_setup.reset();
+    return true;
+}
+
+// Number of bytes allocated for a string outside of the object
+static size_t heap_usage(const std::string &str) {
+    static const size_t SSO_CAPACITY = std::string().capacity();
+    return (str.capacity() > SSO_CAPACITY) ? str.capacity() + 1 : 0;
+}
+
+size_t VpnConnection::memory_usage() const {
+    size_t usage = VPN_CONNECTION_MAX_SIZE + heap_usage(this->domain_extractor_result.domain);
+    if (const auto *dst = std::get_if<NamePort>(&this->addr.dst); dst != nullptr) {
+        usage += heap_usage(dst->name);
+    }
+    if (m_setup != nullptr) {
+        usage += sizeof(VpnConnectionSetup) + m_setup->domain_extractor.memory_usage() + heap_usage(m_setup->app_name);
+        for (const DataRef &packet : m_setup->buffered_packets) {
+            // A list node holds two pointers besides the element
+            usage += sizeof(DataRef) + 2 * sizeof(void *) + (packet.is_owned() ? packet.size() : 0);
+        }
+    }
+    return usage;
 }
 
 } // namespace ag
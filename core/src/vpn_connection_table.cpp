@@ -0,0 +1,167 @@
+#include "vpn/internal/vpn_connection_table.h"
+
+#include <bit>
+#include <cassert>
+#include <utility>
+
+namespace ag {
+
+static constexpr uint64_t ALL_SLOTS_FREE = UINT64_MAX;
+static_assert(VpnConnectionSlab::SLOTS_PER_SLAB == 64, "Free slots of a slab are tracked in a 64-bit mask");
+
+VpnConnectionSlab::~VpnConnectionSlab() {
+    for_each([](VpnConnection *conn) {
+        conn->~VpnConnection();
+    });
+}
+
+VpnConnection *VpnConnectionSlab::make(uint64_t client_id, TunnelAddressPair addr, int proto) {
+    uint32_t slot = allocate_slot();
+    VpnConnection *conn = VpnConnection::make(slot_ptr(slot), client_id, std::move(addr), proto);
+    conn->handle = {slot, m_generations[slot]};
+    ++m_size;
+    return conn;
+}
+
+void VpnConnectionSlab::destroy(VpnConnection *conn) {
+    VpnConnectionHandle handle = conn->handle;
+    assert(get(handle) == conn);
+    conn->~VpnConnection();
+    // Skip 0 on overflow, so that a default handle never matches
+    if (++m_generations[handle.slot] == 0) {
+        m_generations[handle.slot] = 1;
+    }
+    --m_size;
+    release_slot(handle.slot);
+}
+
+size_t VpnConnectionSlab::memory_usage() const {
+    size_t slabs = m_slabs.size() - m_released.size();
+    return slabs * sizeof(Slab) + m_slabs.capacity() * sizeof(SlabInfo) + m_generations.capacity() * sizeof(uint32_t)
+            + (m_partial.capacity() + m_released.capacity()) * sizeof(uint32_t);
+}
+
+uint32_t VpnConnectionSlab::allocate_slot() {
+    while (!m_partial.empty()) {
+        SlabInfo &info = m_slabs[m_partial.back()];
+        if (info.memory != nullptr && info.free_mask != 0) {
+            break;
+        }
+        info.partial = false;
+        m_partial.pop_back();
+    }
+
+    if (m_partial.empty()) {
+        uint32_t s;
+        if (!m_released.empty()) {
+            s = m_released.back();
+            m_released.pop_back();
+        } else {
+            s = uint32_t(m_slabs.size());
+            m_slabs.emplace_back();
+            m_generations.resize(m_generations.size() + SLOTS_PER_SLAB, 1);
+        }
+        SlabInfo &info = m_slabs[s];
+        info.memory = std::make_unique<Slab>();
+        info.free_mask = ALL_SLOTS_FREE;
+        info.partial = true;
+        m_partial.push_back(s);
+        m_free_slots += SLOTS_PER_SLAB;
+    }
+
+    uint32_t s = m_partial.back();
+    SlabInfo &info = m_slabs[s];
+    int i = std::countr_zero(info.free_mask);
+    info.free_mask &= ~(uint64_t(1) << i);
+    --m_free_slots;
+    return uint32_t(s * SLOTS_PER_SLAB + i);
+}
+
+void VpnConnectionSlab::release_slot(uint32_t slot) {
+    uint32_t s = slot / SLOTS_PER_SLAB;
+    SlabInfo &info = m_slabs[s];
+    info.free_mask |= uint64_t(1) << (slot % SLOTS_PER_SLAB);
+    ++m_free_slots;
+
+    // Keep one slab worth of free slots to avoid reallocating on a connection churn around the boundary
+    if (info.free_mask == ALL_SLOTS_FREE && m_free_slots >= 2 * SLOTS_PER_SLAB) {
+        info.memory.reset();
+        info.free_mask = 0;
+        m_free_slots -= SLOTS_PER_SLAB;
+        m_released.push_back(s);
+        // It's dropped from `m_partial` once it gets to the top
+        return;
+    }
+
+    if (!info.partial) {
+        info.partial = true;
+        m_partial.push_back(s);
+    }
+}
+
+void VpnConnectionIndex::put(uint64_t id, const VpnConnection *conn) {
+    assert(id != NON_ID);
+    if (size_t i = find(id); i != m_entries.size()) {
+        m_entries[i].handle = conn->handle;
+        return;
+    }
+
+    if (MAX_LOAD_DEN * (m_size + m_tombstones + 1) > MAX_LOAD_NUM * m_entries.size()) {
+        // Only drop the tombstones if that leaves enough room for the following insertions,
+        // otherwise the table would be rebuilt again and again on a connection churn
+        size_t capacity = std::max(MIN_CAPACITY, m_entries.size());
+        if (MAX_LIVE_LOAD_DEN * (m_size + 1) > MAX_LIVE_LOAD_NUM * capacity) {
+            capacity *= 2;
+        }
+        rehash(capacity);
+    }
+
+    size_t mask = m_entries.size() - 1;
+    size_t step = 0;
+    for (size_t i = home_index(id);; i = (i + ++step) & mask) {
+        Entry &entry = m_entries[i];
+        if (entry.id == NON_ID || entry.handle.slot == TOMBSTONE) {
+            m_tombstones -= (entry.id != NON_ID);
+            entry = {id, conn->handle};
+            ++m_size;
+            return;
+        }
+    }
+}
+
+void VpnConnectionIndex::remove(uint64_t id) {
+    if (size_t i = find(id); i != m_entries.size()) {
+        m_entries[i].handle.slot = TOMBSTONE;
+        --m_size;
+        ++m_tombstones;
+    }
+}
+
+void VpnConnectionIndex::rehash(size_t capacity) {
+    std::vector<Entry> old = std::exchange(m_entries, std::vector<Entry>(capacity));
+    m_hash_shift = 64 - std::countr_zero(capacity);
+    size_t mask = capacity - 1;
+    for (const Entry &entry : old) {
+        if (entry.id == NON_ID || entry.handle.slot == TOMBSTONE) {
+            continue;
+        }
+        size_t step = 0;
+        size_t i = home_index(entry.id);
+        while (m_entries[i].id != NON_ID) {
+            i = (i + ++step) & mask;
+        }
+        m_entries[i] = entry;
+    }
+    m_tombstones = 0;
+}
+
+size_t VpnConnections::memory_usage() const {
+    size_t usage = slab.memory_usage() + by_client_id.memory_usage() + by_server_id.memory_usage();
+    // The slots are counted in the slab's usage
+    slab.for_each([&usage](const VpnConnection *conn) {
+        usage += conn->memory_usage() - VPN_CONNECTION_MAX_SIZE;
+    });
+    return usage;
+}
+
+} // namespace ag
@@ -41,6 +41,7 @@ struct ProfilingVpnHandlerCtx {
 static int ssl_verify_callback(const char *host_name, const sockaddr *host_ip, const CertVerifyCtx &ctx, void *arg);
 static void client_handler(void *arg, vpn_client::Event what, void *data);
 static void shutdown_cb(Vpn *vpn);
+static void process_queued_client_packets(void *arg, VpnPackets packets);
 static const char *check_address(const SocketAddress &addr);
 static void profiling_vpn_handler(void *arg, VpnEvent what, void *data);
 
@@ -55,7 +56,11 @@ static FsmParameters make_fsm_params(Vpn *vpn) {
 Vpn::Vpn()
         : fsm(make_fsm_params(this))
         , client(make_client_parameters())
+        , client_packets(vpn_manager::CLIENT_PACKET_QUEUE_CAPACITY, process_queued_client_packets, this)
         , id(g_next_id++) {
+    if (this->ev_loop != nullptr && !this->client_packets.start(this->ev_loop.get())) {
+        log_vpn(this, err, "Failed to start client packet queue");
+    }
 }
 
 Vpn::~Vpn() = default;
@@ -119,6 +124,8 @@ vpn_client::EndpointConnectionConfig Vpn::make_client_upstream_config() const {
             .password = this->upstream_config->password,
             .ip_availability = ip_availability,
             .anti_dpi = this->upstream_config->anti_dpi,
+            .traffic_classifier = TrafficClassifier{std::span{this->upstream_config->traffic_class_rules.data,
+                    this->upstream_config->traffic_class_rules.size}},
     };
 }
 
@@ -158,6 +165,11 @@ bool Vpn::run_event_loop() {
             log_vpn(this, err, "Failed to create event loop");
             return false;
         }
+        if (!this->client_packets.start(this->ev_loop.get())) {
+            log_vpn(this, err, "Failed to start client packet queue");
+            this->ev_loop.reset();
+            return false;
+        }
     }
 
     this->executor_thread = std::thread([this]() {
@@ -423,6 +435,7 @@ void vpn_stop(Vpn *vpn) {
     socket_manager_complete_all(vpn->network_manager->socket);
     vpn->stop_pinging();
     vpn->postponement_window_timer.reset();
+    vpn->client_packets.stop();
     vpn->ev_loop.reset();
 
     vpn->recovery = {};
@@ -681,20 +694,22 @@ VpnDnsUpstreamValidationStatus vpn_validate_dns_upstream(const char *address) {
 }
 
 bool vpn_process_client_packets(Vpn *vpn, VpnPackets packets) {
-    std::unique_lock l(vpn->stop_guard);
-
-    auto packets_holder = VpnPacketsHolder{packets};
-
-    if (!vpn->ev_loop) {
-        return false;
+    VpnProcessClientPacketsResult result = vpn_try_process_client_packets(vpn, &packets);
+    if (result == VPN_PCPR_QUEUE_FULL) {
+        log_vpn(vpn, dbg, "Client packet queue is full, dropping {} packets", packets.size);
     }
+    // Release the packets which were not taken
+    VpnPacketsHolder holder{packets};
+    return result != VPN_PCPR_STOPPED;
+}
 
-    vpn->submit([vpn, packets_holder = std::move(packets_holder)]() mutable {
-        auto packets = packets_holder.release();
-        vpn->client.process_client_packets({packets.data(), (uint32_t) packets.size()});
-    });
+VpnProcessClientPacketsResult vpn_try_process_client_packets(Vpn *vpn, VpnPackets *packets) {
+    return vpn->client_packets.push(packets);
+}
 
-    return true;
+static void process_queued_client_packets(void *arg, VpnPackets packets) {
+    auto *vpn = (Vpn *) arg;
+    vpn->client.process_client_packets(packets);
 }
 
 static int ssl_verify_callback(const char *host_name, const sockaddr *host_ip, const CertVerifyCtx &ctx, void *arg) {
@@ -754,6 +769,9 @@ static void client_handler(void *arg, vpn_client::Event what, void *data) {
     case vpn_client::EVENT_OUTPUT:
         vpn->handler.func(vpn->handler.arg, VPN_EVENT_CLIENT_OUTPUT, data);
         break;
+    case vpn_client::EVENT_OUTPUT_BATCH:
+        vpn->handler.func(vpn->handler.arg, VPN_EVENT_CLIENT_OUTPUT_BATCH, data);
+        break;
     case vpn_client::EVENT_CONNECT_REQUEST:
         vpn->handler.func(vpn->handler.arg, VPN_EVENT_CONNECT_REQUEST, data);
         break;
@@ -868,9 +886,13 @@ SocketAddressStorage vpn_get_socks_listener_address(Vpn *vpn) {
     return ret;
 }
 
+size_t vpn_get_conn_buffers_usage(Vpn *vpn) {
+    return vpn->client.buffer_governor.usage();
+}
+
 void profiling_vpn_handler(void *arg, VpnEvent what, void *data) {
     auto *ctx = (ProfilingVpnHandlerCtx *) arg;
-    if (what == VPN_EVENT_CLIENT_OUTPUT) {
+    if (what == VPN_EVENT_CLIENT_OUTPUT || what == VPN_EVENT_CLIENT_OUTPUT_BATCH) {
         ctx->handler.func(ctx->handler.arg, what, data);
         return;
     }
@@ -8,6 +8,7 @@
 #include <variant>
 #include <vector>
 
+#include "client_packet_queue.h"
 #include "common/defs.h"
 #include "common/logger.h"
 #include "common/move_only_function.h"
@@ -50,6 +51,9 @@ struct SelectedEndpointInfo {
 
 static constexpr const char *LOG_NAME = "VPNCORE";
 
+/** Maximum number of client packets waiting to be processed on the event loop */
+static constexpr size_t CLIENT_PACKET_QUEUE_CAPACITY = 4096;
+
 struct ConnectSeveralAttempts {
     size_t attempts_left = ag::VPN_DEFAULT_CONNECT_ATTEMPTS_NUM;
 };
@@ -112,6 +116,8 @@ struct Vpn {
 
     vpn_manager::ClientConnectionState client_state = vpn_manager::CLIS_DISCONNECTED;
     VpnClient client;
+    /** Client packets passed in by `vpn_process_client_packets()`, started whenever `ev_loop` exists */
+    ClientPacketQueue client_packets;
 
     vpn_manager::ConnectRetryInfo connect_retry_info;
 
@@ -0,0 +1,116 @@
+#include <gtest/gtest.h>
+
+#include <map>
+
+#include "vpn/internal/buffer_governor.h"
+
+using namespace ag;
+
+static constexpr size_t BUDGET = 1000;
+
+class BufferGovernorTest : public testing::Test {
+protected:
+    BufferGovernor governor{nullptr};
+    std::map<uint64_t, bool> notifications; // connection id -> last reported state
+
+    void SetUp() override {
+        governor.set_budget(BUDGET);
+    }
+
+    BufferGovernor::Account open(uint64_t id) {
+        return governor.open_account(id,
+                {
+                        [](void *arg, uint64_t conn_id, bool throttled) {
+                            (*(std::map<uint64_t, bool> *) arg)[conn_id] = throttled;
+                        },
+                        &notifications,
+                });
+    }
+};
+
+TEST_F(BufferGovernorTest, ThrottlesLargestBuffers) {
+    BufferGovernor::Account small = open(1);
+    BufferGovernor::Account medium = open(2);
+    BufferGovernor::Account large = open(3);
+
+    small.set_size(100);
+    medium.set_size(300);
+    large.set_size(500);
+    ASSERT_EQ(governor.usage(), 900);
+    ASSERT_EQ(governor.throttled_num(), 0);
+    ASSERT_TRUE(notifications.empty());
+
+    // 1100 over budget, throttling the largest leaves 600 which fits in the low watermark
+    large.set_size(700);
+    ASSERT_EQ(governor.usage(), 1100);
+    ASSERT_EQ(governor.throttled_num(), 1);
+    ASSERT_TRUE(large.throttled());
+    ASSERT_FALSE(medium.throttled());
+    ASSERT_FALSE(small.throttled());
+    ASSERT_EQ(notifications, (std::map<uint64_t, bool>{{3, true}}));
+
+    // 1500 over budget, 800 not throttled is still above the low watermark
+    medium.set_size(700);
+    ASSERT_EQ(governor.throttled_num(), 2);
+    ASSERT_TRUE(medium.throttled());
+    ASSERT_FALSE(small.throttled());
+}
+
+TEST_F(BufferGovernorTest, ReleasesAtLowWatermark) {
+    BufferGovernor::Account a = open(1);
+    BufferGovernor::Account b = open(2);
+
+    a.set_size(600);
+    b.set_size(500);
+    ASSERT_TRUE(a.throttled());
+    ASSERT_FALSE(b.throttled());
+
+    // Under the budget, but above the low watermark
+    a.set_size(400);
+    ASSERT_TRUE(a.throttled());
+    ASSERT_EQ(notifications[1], true);
+
+    a.set_size(250);
+    ASSERT_FALSE(a.throttled());
+    ASSERT_EQ(governor.throttled_num(), 0);
+    ASSERT_EQ(notifications[1], false);
+}
+
+TEST_F(BufferGovernorTest, ReleasesDrainedConnection) {
+    BufferGovernor::Account a = open(1);
+    BufferGovernor::Account b = open(2);
+
+    a.set_size(600);
+    b.set_size(500);
+    ASSERT_TRUE(a.throttled());
+
+    // The other one keeps the total above the low watermark
+    b.set_size(900);
+    a.set_size(0);
+    ASSERT_FALSE(a.throttled());
+    ASSERT_EQ(notifications[1], false);
+}
+
+TEST_F(BufferGovernorTest, ClosedAccountIsNotCounted) {
+    BufferGovernor::Account a = open(1);
+    a.set_size(600);
+    {
+        BufferGovernor::Account b = open(2);
+        b.set_size(500);
+        ASSERT_EQ(governor.usage(), 1100);
+        ASSERT_EQ(governor.throttled_num(), 1);
+    }
+    ASSERT_EQ(governor.usage(), 600);
+    ASSERT_EQ(governor.throttled_num(), 1);
+
+    // Moving the account does not register it twice
+    BufferGovernor::Account moved = std::move(a);
+    ASSERT_FALSE(a.is_open()); // NOLINT(bugprone-use-after-move)
+    ASSERT_TRUE(moved.throttled());
+    moved.set_size(100);
+    ASSERT_EQ(governor.usage(), 100);
+    ASSERT_FALSE(moved.throttled());
+
+    moved = BufferGovernor::Account{};
+    ASSERT_EQ(governor.usage(), 0);
+}
@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "client_packet_queue.h"
+
+using namespace ag;
+
+class ClientPacketQueueTest : public testing::Test {
+protected:
+    static constexpr size_t CAPACITY = 256;
+
+    DeclPtr<VpnEventLoop, &vpn_event_loop_destroy> m_loop{vpn_event_loop_create()};
+    std::vector<VpnPacket> m_received;
+    size_t m_calls = 0;
+    std::atomic<size_t> m_destroyed = 0;
+
+    static void on_packets(void *arg, VpnPackets packets) {
+        auto *self = (ClientPacketQueueTest *) arg;
+        ++self->m_calls;
+        EXPECT_LE(packets.size, ClientPacketQueue::BATCH_SIZE);
+        self->m_received.insert(self->m_received.end(), packets.data, packets.data + packets.size);
+    }
+
+    static void destroy_packet(void *arg, uint8_t *) {
+        auto *self = (ClientPacketQueueTest *) arg;
+        self->m_destroyed.fetch_add(1);
+    }
+
+    VpnPacket make_packet(uint32_t producer, uint32_t seqno) {
+        // The packet contents are not touched by the queue, so encode the origin in the pointer
+        return {(uint8_t *) (uintptr_t(producer) << 32 | seqno), 1, destroy_packet, this};
+    }
+
+    void run_loop_once() {
+        event_base_loop(vpn_event_loop_get_base(m_loop.get()), EVLOOP_NONBLOCK);
+    }
+};
+
+TEST_F(ClientPacketQueueTest, DeliversAllPacketsInOrderFromManyProducers) {
+    static constexpr uint32_t PRODUCERS = 4;
+    static constexpr uint32_t PACKETS_PER_PRODUCER = 20000;
+    static constexpr uint32_t PACKETS_PER_CALL = 16;
+    ClientPacketQueue queue(CAPACITY, on_packets, this);
+    ASSERT_TRUE(queue.start(m_loop.get()));
+
+    std::vector<std::thread> producers;
+    for (uint32_t p = 0; p < PRODUCERS; ++p) {
+        producers.emplace_back([this, &queue, p]() {
+            VpnPacket batch[PACKETS_PER_CALL];
+            for (uint32_t seqno = 0; seqno < PACKETS_PER_PRODUCER;) {
+                for (uint32_t i = 0; i < PACKETS_PER_CALL; ++i) {
+                    batch[i] = make_packet(p, seqno + i);
+                }
+                VpnPackets packets = {batch, PACKETS_PER_CALL};
+                while (queue.push(&packets) == VPN_PCPR_QUEUE_FULL) {
+                    std::this_thread::yield();
+                }
+                seqno += PACKETS_PER_CALL;
+            }
+        });
+    }
+
+    while (m_received.size() < PRODUCERS * PACKETS_PER_PRODUCER) {
+        run_loop_once();
+    }
+    for (std::thread &t : producers) {
+        t.join();
+    }
+    run_loop_once();
+
+    ASSERT_EQ(m_received.size(), PRODUCERS * PACKETS_PER_PRODUCER);
+    ASSERT_EQ(queue.size(), 0);
+    // Wakeups are coalesced, so there are fewer handler calls than pushes
+    ASSERT_LT(m_calls, PRODUCERS * PACKETS_PER_PRODUCER / PACKETS_PER_CALL);
+    std::vector<uint32_t> next_seqno(PRODUCERS, 0);
+    for (const VpnPacket &packet : m_received) {
+        auto producer = uint32_t(uintptr_t(packet.data) >> 32);
+        auto seqno = uint32_t(uintptr_t(packet.data));
+        ASSERT_LT(producer, PRODUCERS);
+        ASSERT_EQ(seqno, next_seqno[producer]++);
+    }
+    ASSERT_EQ(m_destroyed, 0);
+}
+
+TEST_F(ClientPacketQueueTest, ReportsBackpressureWhenFull) {
+    ClientPacketQueue queue(CAPACITY, on_packets, this);
+    ASSERT_TRUE(queue.start(m_loop.get()));
+
+    std::vector<VpnPacket> batch;
+    for (uint32_t i = 0; i < CAPACITY + 10; ++i) {
+        batch.push_back(make_packet(0, i));
+    }
+    VpnPackets packets = {batch.data(), uint32_t(batch.size())};
+    ASSERT_EQ(queue.push(&packets), VPN_PCPR_QUEUE_FULL);
+    ASSERT_EQ(packets.size, 10);
+    ASSERT_EQ(packets.data, batch.data() + CAPACITY);
+    ASSERT_EQ(queue.push(&packets), VPN_PCPR_QUEUE_FULL);
+    ASSERT_EQ(packets.size, 10);
+    ASSERT_EQ(m_destroyed, 0);
+
+    // The loop drains a limited number of packets per iteration, then the rest fits
+    run_loop_once();
+    ASSERT_FALSE(m_received.empty());
+    ASSERT_EQ(queue.push(&packets), VPN_PCPR_OK);
+    ASSERT_EQ(packets.size, 0);
+    while (m_received.size() < batch.size()) {
+        run_loop_once();
+    }
+    ASSERT_EQ(m_received.size(), batch.size());
+}
+
+TEST_F(ClientPacketQueueTest, StopReleasesQueuedPackets) {
+    ClientPacketQueue queue(CAPACITY, on_packets, this);
+    VpnPacket packet = make_packet(0, 0);
+    VpnPackets packets = {&packet, 1};
+    ASSERT_EQ(queue.push(&packets), VPN_PCPR_STOPPED);
+    ASSERT_EQ(packets.size, 1);
+
+    ASSERT_TRUE(queue.start(m_loop.get()));
+    std::vector<VpnPacket> batch;
+    for (uint32_t i = 0; i < 100; ++i) {
+        batch.push_back(make_packet(0, i));
+    }
+    packets = {batch.data(), uint32_t(batch.size())};
+    ASSERT_EQ(queue.push(&packets), VPN_PCPR_OK);
+    ASSERT_EQ(queue.size(), batch.size());
+
+    queue.stop();
+    ASSERT_EQ(m_destroyed, batch.size());
+    ASSERT_EQ(queue.size(), 0);
+    packets = {&packet, 1};
+    ASSERT_EQ(queue.push(&packets), VPN_PCPR_STOPPED);
+
+    // Restarting after stop works
+    ASSERT_TRUE(queue.start(m_loop.get()));
+    ASSERT_EQ(queue.push(&packets), VPN_PCPR_OK);
+    run_loop_once();
+    ASSERT_EQ(m_received.size(), 1);
+    ASSERT_EQ(m_received[0].data, packet.data);
+}
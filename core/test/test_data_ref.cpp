@@ -0,0 +1,64 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <list>
+#include <string_view>
+
+#include <event2/buffer.h>
+
+#include "common/defs.h"
+#include "vpn/internal/data_ref.h"
+
+using namespace ag;
+
+static constexpr std::string_view TEST_DATA = "tratatalalala";
+
+static U8View as_view(std::string_view s) {
+    return {(const uint8_t *) s.data(), s.size()};
+}
+
+TEST(DataRef, BorrowedIsCopiedWhenOwned) {
+    std::string data(TEST_DATA);
+    DataRef borrowed(as_view(data));
+    ASSERT_FALSE(borrowed.is_owned());
+    ASSERT_EQ(borrowed.data(), (const uint8_t *) data.data());
+
+    DataRef owned = borrowed.to_owned();
+    ASSERT_TRUE(owned.is_owned());
+    ASSERT_NE(owned.data(), borrowed.data());
+    data.assign(data.size(), 'x');
+    ASSERT_EQ(owned.view(), as_view(TEST_DATA));
+}
+
+TEST(DataRef, OwnedIsShared) {
+    DataRef first = DataRef::copy_of(as_view(TEST_DATA));
+    DataRef second = first.to_owned();
+    ASSERT_EQ(first.data(), second.data());
+
+    second.remove_prefix(7);
+    ASSERT_EQ(second.view(), as_view(TEST_DATA.substr(7)));
+    ASSERT_EQ(first.view(), as_view(TEST_DATA));
+
+    // The storage outlives the reference it was taken from
+    std::list<DataRef> queue;
+    queue.emplace_back(std::move(first));
+    first = DataRef{};
+    ASSERT_TRUE(first.empty());
+    ASSERT_EQ(queue.front().view(), as_view(TEST_DATA));
+}
+
+TEST(DataRef, RetainedUntilBufferDrained) {
+    DeclPtr<evbuffer, &evbuffer_free> buffer{evbuffer_new()};
+    const uint8_t *data;
+    {
+        DataRef chunk = DataRef::copy_of(as_view(TEST_DATA));
+        data = chunk.data();
+        DataRef::Retained retained = chunk.retain();
+        ASSERT_EQ(0, evbuffer_add_reference(buffer.get(), chunk.data(), chunk.size(), retained.cleanup, retained.arg));
+    }
+
+    // Not copied, and still valid after the reference is gone
+    ASSERT_EQ(evbuffer_pullup(buffer.get(), -1), data);
+    ASSERT_EQ(0, memcmp(data, TEST_DATA.data(), TEST_DATA.size()));
+    ASSERT_EQ(0, evbuffer_drain(buffer.get(), TEST_DATA.size()));
+}
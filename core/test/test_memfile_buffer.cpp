@@ -1,9 +1,20 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+
 #include "common/file.h"
 #include "memfile_buffer.h"
 #include "vpn/utils.h"
 
+#ifdef __linux__
+#include <sys/stat.h>
+#endif
+
 using namespace ag;
 
 // NOLINTBEGIN(bugprone-unchecked-optional-access))
@@ -14,37 +25,46 @@ protected:
     const std::string TEST_DATA_2 = "tratatata";
     const std::string COMPLETE_TEST_DATA = TEST_DATA_1 + TEST_DATA_2;
 
+    std::unique_ptr<SpillArena> arena;
     std::unique_ptr<DataBuffer> buffer;
 
     void SetUp() override {
-        buffer = std::make_unique<MemfileBuffer>("./test.dat", TEST_DATA_1.size());
+        arena = std::make_unique<SpillArena>(FILE_PATH);
+        buffer = std::make_unique<MemfileBuffer>(arena.get(), TEST_DATA_1.size());
         std::optional<std::string> err = buffer->init();
         ASSERT_FALSE(err.has_value()) << err.value();
 
         err = buffer->push({(uint8_t *) TEST_DATA_1.data(), TEST_DATA_1.size()});
         ASSERT_FALSE(err.has_value()) << err.value();
         ASSERT_EQ(buffer->size(), TEST_DATA_1.size());
-        ASSERT_FALSE(fs::exists(FILE_PATH));
+        ASSERT_EQ(arena->segments_in_use(), 0);
 
         err = buffer->push({(uint8_t *) TEST_DATA_2.data(), TEST_DATA_2.size()});
         ASSERT_FALSE(err.has_value()) << err.value();
         ASSERT_EQ(buffer->size(), TEST_DATA_1.size() + TEST_DATA_2.size());
-        ASSERT_TRUE(fs::exists(FILE_PATH));
+        ASSERT_EQ(arena->segments_in_use(), 1);
     }
 
     void TearDown() override {
         buffer.reset();
+        ASSERT_EQ(arena->segments_in_use(), 0);
+        arena.reset();
         ASSERT_FALSE(fs::exists(FILE_PATH));
     }
 
-    void check_file_content(file::Handle fd, const std::string &expected) {
-        ssize_t sz = file::get_size(fd);
-        ASSERT_GE(sz, 0) << sys::strerror(sys::last_error());
-
+    std::string read_all() {
         std::string content;
-        content.resize(sz);
-        ASSERT_EQ(file::read(fd, content.data(), content.size()), sz) << sys::strerror(sys::last_error());
-        ASSERT_EQ(content, expected);
+        while (buffer->size() > 0) {
+            BufferPeekResult res = buffer->peek();
+            EXPECT_FALSE(res.err.has_value()) << res.err.value();
+            EXPECT_FALSE(res.data.empty());
+            if (res.err.has_value() || res.data.empty()) {
+                break;
+            }
+            content.append((char *) res.data.data(), res.data.size());
+            buffer->drain(res.data.size());
+        }
+        return content;
     }
 };
 
@@ -90,43 +110,129 @@ TEST_F(MemfileBufferTest, Drain1) {
 }
 
 TEST_F(MemfileBufferTest, Drain2) {
-    std::string expected_data = COMPLETE_TEST_DATA;
+    ASSERT_EQ(read_all(), COMPLETE_TEST_DATA);
+}
 
-    while (0 != buffer->size()) {
-        BufferPeekResult res = buffer->peek();
-        ASSERT_FALSE(res.err.has_value()) << res.err.value();
-        ASSERT_FALSE(res.data.empty());
-        ASSERT_EQ(expected_data.substr(0, res.data.size()), (std::string{(char *) res.data.data(), res.data.size()}));
-        buffer->drain(res.data.size());
-        expected_data.erase(0, res.data.size());
-    }
+// Check that the data keeps its order when the memory part gets free space while some data is spilled
+TEST_F(MemfileBufferTest, Order) {
+    buffer->drain(TEST_DATA_1.size());
+    std::optional<std::string> err = buffer->push({(uint8_t *) TEST_DATA_1.data(), TEST_DATA_1.size()});
+    ASSERT_FALSE(err.has_value()) << err.value();
+    ASSERT_EQ(read_all(), TEST_DATA_2 + TEST_DATA_1);
+    ASSERT_EQ(arena->segments_in_use(), 0);
+}
 
-    ASSERT_TRUE(expected_data.empty()) << expected_data;
+TEST_F(MemfileBufferTest, SpilledSegments) {
+    std::string big(SpillArena::SEGMENT_SIZE * 2 + 1, '\0');
+    std::iota(big.begin(), big.end(), 'a');
+    std::optional<std::string> err = buffer->push({(uint8_t *) big.data(), big.size()});
+    ASSERT_FALSE(err.has_value()) << err.value();
+    ASSERT_EQ(buffer->size(), COMPLETE_TEST_DATA.size() + big.size());
+    ASSERT_EQ(arena->segments_in_use(), 3);
+
+    // Drained segments are freed right away
+    buffer->drain(TEST_DATA_1.size() + SpillArena::SEGMENT_SIZE);
+    ASSERT_EQ(arena->segments_in_use(), 2);
+
+    std::string expected = (TEST_DATA_2 + big).substr(SpillArena::SEGMENT_SIZE);
+    ASSERT_EQ(read_all(), expected);
+    ASSERT_EQ(arena->segments_in_use(), 0);
 }
 
-TEST_F(MemfileBufferTest, FileContent) {
-    file::Handle fd = file::open(FILE_PATH, file::RDONLY);
-    ASSERT_NE(fd, file::INVALID_HANDLE) << sys::strerror(sys::last_error());
+TEST_F(MemfileBufferTest, SpillLimit) {
+    buffer = std::make_unique<MemfileBuffer>(arena.get(), TEST_DATA_1.size(), TEST_DATA_2.size() + 1);
+    ASSERT_FALSE(buffer->init().has_value());
 
-    // using EXPECT_* just to let it get to the end and close the descriptor
+    std::optional<std::string> err = buffer->push({(uint8_t *) COMPLETE_TEST_DATA.data(), COMPLETE_TEST_DATA.size()});
+    ASSERT_FALSE(err.has_value()) << err.value();
 
-    EXPECT_EQ(file::get_size(fd), TEST_DATA_2.size()) << sys::strerror(sys::last_error());
-    EXPECT_NO_FATAL_FAILURE(check_file_content(fd, TEST_DATA_2));
+    // The data exceeding the limit is truncated
+    err = buffer->push({(uint8_t *) TEST_DATA_1.data(), TEST_DATA_1.size()});
+    ASSERT_FALSE(err.has_value()) << err.value();
+    ASSERT_EQ(buffer->size(), COMPLETE_TEST_DATA.size() + 1);
 
-    file::close(fd);
-    buffer->drain(TEST_DATA_1.size());
-    std::optional<std::string> err = buffer->push({(uint8_t *) TEST_DATA_2.data(), TEST_DATA_2.size()});
-    EXPECT_FALSE(err.has_value()) << err.value();
+    err = buffer->push({(uint8_t *) TEST_DATA_1.data(), TEST_DATA_1.size()});
+    ASSERT_TRUE(err.has_value());
+    ASSERT_EQ(read_all(), COMPLETE_TEST_DATA + TEST_DATA_1.substr(0, 1));
+}
+
+TEST(SpillArena, TrimsFreeRegions) {
+    SpillArena arena("./test-arena.dat");
+    std::vector<uint32_t> segments;
+    for (size_t i = 0; i < 3 * SpillArena::SEGMENTS_PER_REGION; ++i) {
+        SpillArena::AllocateResult r = arena.allocate();
+        ASSERT_FALSE(r.err.has_value()) << r.err.value();
+        segments.push_back(r.segment);
+    }
+    ASSERT_EQ(arena.file_size(), 3 * SpillArena::REGION_SIZE);
 
-    // re-open as the old file should've been removed
-    fd = file::open(FILE_PATH, 0);
-    EXPECT_NE(fd, file::INVALID_HANDLE) << sys::strerror(sys::last_error());
+    // A spare free region is kept after the used ones
+    for (size_t i = SpillArena::SEGMENTS_PER_REGION; i < segments.size(); ++i) {
+        arena.free(segments[i]);
+    }
+    ASSERT_EQ(arena.file_size(), 2 * SpillArena::REGION_SIZE);
+
+    // The lowest free segment is reused first
+    arena.free(segments[1]);
+    SpillArena::AllocateResult r = arena.allocate();
+    ASSERT_EQ(r.segment, segments[1]);
+
+    for (size_t i = 0; i < SpillArena::SEGMENTS_PER_REGION; ++i) {
+        arena.free(segments[i]);
+    }
+    ASSERT_EQ(arena.segments_in_use(), 0);
+    ASSERT_EQ(arena.file_size(), SpillArena::REGION_SIZE);
+}
+
+#ifdef __linux__
+/** Number of the disk bytes allocated for the spill file opened by the process */
+static size_t allocated_bytes(const std::string &file_name) {
+    for (const auto &entry : std::filesystem::directory_iterator("/proc/self/fd")) {
+        std::error_code err;
+        std::string target = std::filesystem::read_symlink(entry.path(), err).string();
+        struct stat st {};
+        if (!err && target.find(file_name) != std::string::npos && 0 == stat(entry.path().c_str(), &st)) {
+            return size_t(st.st_blocks) * 512;
+        }
+    }
+    ADD_FAILURE() << "No open file " << file_name;
+    return 0;
+}
+
+TEST(SpillArena, ReservesDiskSpace) {
+    const std::string file_name = "test-arena-space.dat";
+    SpillArena arena("./" + file_name);
+    std::vector<uint32_t> segments;
+    for (size_t i = 0; i < 3 * SpillArena::SEGMENTS_PER_REGION; ++i) {
+        SpillArena::AllocateResult r = arena.allocate();
+        ASSERT_FALSE(r.err.has_value()) << r.err.value();
+        segments.push_back(r.segment);
+    }
+    // Nothing is written, still the space is there
+    ASSERT_GE(allocated_bytes(file_name), 3 * SpillArena::REGION_SIZE);
+
+    // A free region in the middle gives the space back...
+    for (size_t i = SpillArena::SEGMENTS_PER_REGION; i < 2 * SpillArena::SEGMENTS_PER_REGION; ++i) {
+        arena.free(segments[i]);
+    }
+    ASSERT_EQ(arena.file_size(), 3 * SpillArena::REGION_SIZE);
+    size_t discarded = allocated_bytes(file_name);
+    if (discarded >= 3 * SpillArena::REGION_SIZE) {
+        GTEST_SKIP() << "The file system can't punch holes";
+    }
 
-    // at the moment 2 `TEST_DATA_2` are in buffer, as the memory cap is `TEST_DATA_1.size()`
-    // file size should be:
-    EXPECT_EQ(file::get_size(fd), 2 * TEST_DATA_2.size() - TEST_DATA_1.size()) << sys::strerror(sys::last_error());
-    EXPECT_NO_FATAL_FAILURE(check_file_content(fd, TEST_DATA_2.substr(TEST_DATA_1.size()) + TEST_DATA_2));
+    // ...and takes it again once reused
+    SpillArena::AllocateResult r = arena.allocate();
+    ASSERT_FALSE(r.err.has_value()) << r.err.value();
+    ASSERT_EQ(r.segment, segments[SpillArena::SEGMENTS_PER_REGION]);
+    ASSERT_GE(allocated_bytes(file_name), 3 * SpillArena::REGION_SIZE);
 
-    file::close(fd);
+    arena.free(r.segment);
+    for (size_t i = 0; i < segments.size(); ++i) {
+        if (i / SpillArena::SEGMENTS_PER_REGION != 1) {
+            arena.free(segments[i]);
+        }
+    }
 }
+#endif // __linux__
 // NOLINTEND(bugprone-unchecked-optional-access)
@@ -1,5 +1,8 @@
 #include <gtest/gtest.h>
 
+#include <array>
+
+#include "alloc_hooks.h"
 #include "memory_buffer.h"
 
 using namespace ag;
@@ -87,4 +90,70 @@ TEST_F(MemoryBufferTest, Drain2) {
 
     ASSERT_TRUE(expected_data.empty()) << expected_data;
 }
+
+// Check that small chunks are coalesced
+TEST_F(MemoryBufferTest, Coalesce) {
+    BufferPeekResult res = m_buffer->peek();
+    ASSERT_FALSE(res.err.has_value()) << res.err.value();
+    ASSERT_EQ(COMPLETE_TEST_DATA, (std::string{(char *) res.data.data(), res.data.size()}));
+}
+
+TEST_F(MemoryBufferTest, PeekChunks) {
+    std::string expected_data = COMPLETE_TEST_DATA;
+    std::vector<uint8_t> large;
+    large.reserve(2 * MemoryBuffer::BLOCK_SIZE);
+    large.resize(MemoryBuffer::BLOCK_SIZE + 1, 'x');
+    const uint8_t *large_data = large.data();
+    ASSERT_FALSE(m_buffer->push(std::move(large)).has_value());
+    expected_data.append(MemoryBuffer::BLOCK_SIZE + 1, 'x');
+    ASSERT_FALSE(m_buffer->push({(uint8_t *) TEST_DATA_1.data(), TEST_DATA_1.size()}).has_value());
+    expected_data += TEST_DATA_1;
+    ASSERT_EQ(m_buffer->size(), expected_data.size());
+
+    std::array<U8View, DataBuffer::PEEK_CHUNKS_NUM> chunks;
+    size_t chunks_num = m_buffer->peek(chunks);
+    ASSERT_EQ(chunks_num, 2);
+    // The large vector is taken over without copying, and the following data is appended to it
+    ASSERT_EQ(chunks[1].data(), large_data);
+
+    // The peeked chunks remain valid after pushing more data
+    ASSERT_FALSE(m_buffer->push({(uint8_t *) TEST_DATA_2.data(), TEST_DATA_2.size()}).has_value());
+    std::string peeked;
+    for (size_t i = 0; i < chunks_num; ++i) {
+        peeked.append((char *) chunks[i].data(), chunks[i].size());
+    }
+    ASSERT_EQ(peeked, expected_data);
+
+    m_buffer->drain(COMPLETE_TEST_DATA.size() + 1);
+    chunks_num = m_buffer->peek(std::span{chunks.data(), 1});
+    ASSERT_EQ(chunks_num, 1);
+    ASSERT_EQ(chunks[0].data(), large_data + 1);
+    ASSERT_EQ(chunks[0].size(), MemoryBuffer::BLOCK_SIZE + TEST_DATA_1.size() + TEST_DATA_2.size());
+}
+
+TEST(MemoryBuffer, SmallDataTakesSmallBlock) {
+    int64_t initial_bytes = test::heap_bytes();
+    MemoryBuffer buffer;
+    DataBuffer &data_buffer = buffer;
+    uint8_t byte = 'x';
+    ASSERT_FALSE(data_buffer.push({&byte, 1}).has_value());
+    // The block and the bookkeeping of the queue of blocks
+    ASSERT_LT(test::heap_bytes() - initial_bytes, MemoryBuffer::BLOCK_SIZE / 8);
+
+    // The next blocks grow, so that a stream of data is still peeked in a few large chunks
+    std::vector<uint8_t> data(2 * MemoryBuffer::BLOCK_SIZE, 'x');
+    for (size_t i = 0; i < data.size(); i += 100) {
+        ASSERT_FALSE(data_buffer.push({data.data() + i, std::min<size_t>(100, data.size() - i)}).has_value());
+    }
+    ASSERT_EQ(data_buffer.size(), data.size() + 1);
+    std::array<U8View, DataBuffer::PEEK_CHUNKS_NUM> chunks;
+    size_t chunks_num = data_buffer.peek(chunks);
+    ASSERT_LT(chunks_num, DataBuffer::PEEK_CHUNKS_NUM);
+    size_t peeked = 0;
+    for (size_t i = 0; i < chunks_num; ++i) {
+        peeked += chunks[i].size();
+    }
+    ASSERT_EQ(peeked, data_buffer.size());
+    ASSERT_EQ(chunks[chunks_num - 2].size(), MemoryBuffer::BLOCK_SIZE);
+}
 // NOLINTEND(bugprone-unchecked-optional-access)
@@ -9,7 +9,8 @@ MockedVpnClient g_client = {};
 constexpr int DUMMY_UPSTREAM_ID = 42;
 
 VpnClient::VpnClient(vpn_client::Parameters parameters)
-        : fsm({})
+        : buffer_governor(parameters.ev_loop)
+        , fsm({})
         , parameters(parameters) {
 }
 VpnClient::~VpnClient() = default;
@@ -67,7 +68,7 @@ void VpnClient::handle_wake() {
 VpnConnectionStats VpnClient::get_connection_stats() const {
     return {};
 }
-std::unique_ptr<DataBuffer> VpnClient::make_buffer(uint64_t) const {
+std::unique_ptr<DataBuffer> VpnClient::make_buffer() const {
     return nullptr;
 }
 bool VpnClient::may_send_icmp_request() const {
@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <bitset>
+#include <vector>
+
+#include "vpn/internal/traffic_classifier.h"
+
+using namespace ag;
+
+static constexpr uint8_t DSCP_EF = 46;
+static constexpr uint8_t DSCP_CS1 = 8;
+static constexpr uint8_t DSCP_AF11 = 10;
+
+TEST(TrafficClassifier, BuiltInRules) {
+    TrafficClassifier classifier;
+    ASSERT_EQ(classifier.classify({.proto = IPPROTO_TCP, .dst_port = 443}), VPN_TC_DEFAULT);
+    ASSERT_EQ(classifier.classify({.proto = IPPROTO_TCP, .dst_port = 22}), VPN_TC_INTERACTIVE);
+    ASSERT_EQ(classifier.classify({.proto = IPPROTO_UDP, .dst_port = 3478}), VPN_TC_INTERACTIVE);
+
+    // The DSCP set by the application takes precedence over the port
+    ASSERT_EQ(classifier.classify({.proto = IPPROTO_TCP, .dst_port = 443, .dscp = DSCP_EF}), VPN_TC_INTERACTIVE);
+    ASSERT_EQ(classifier.classify({.proto = IPPROTO_TCP, .dst_port = 22, .dscp = DSCP_CS1}), VPN_TC_BULK);
+    ASSERT_EQ(classifier.classify({.proto = IPPROTO_TCP, .dst_port = 443, .dscp = DSCP_AF11}), VPN_TC_DEFAULT);
+}
+
+TEST(TrafficClassifier, UserRules) {
+    std::vector<VpnTrafficClassRule> rules = {
+            {.app_name = "Backup", .traffic_class = VPN_TC_BULK},
+            {.port_min = 8000, .port_max = 8999, .traffic_class = VPN_TC_INTERACTIVE},
+            {.match_dscp = true, .dscp = DSCP_EF, .traffic_class = VPN_TC_DEFAULT},
+            {.app_name = "game", .port_min = 443, .port_max = 443, .traffic_class = VPN_TC_INTERACTIVE},
+    };
+    TrafficClassifier classifier(rules);
+
+    // The first matching rule is applied
+    ASSERT_EQ(classifier.classify({.proto = IPPROTO_TCP, .dst_port = 8080, .app_name = "backup"}), VPN_TC_BULK);
+    ASSERT_EQ(classifier.classify({.proto = IPPROTO_TCP, .dst_port = 8080, .app_name = "browser"}), VPN_TC_INTERACTIVE);
+    ASSERT_EQ(classifier.classify({.proto = IPPROTO_UDP, .dst_port = 53, .dscp = DSCP_EF}), VPN_TC_DEFAULT);
+
+    // All the criteria of a rule must match
+    ASSERT_EQ(classifier.classify({.proto = IPPROTO_TCP, .dst_port = 443, .app_name = "Game"}), VPN_TC_INTERACTIVE);
+    ASSERT_EQ(classifier.classify({.proto = IPPROTO_TCP, .dst_port = 80, .app_name = "Game"}), VPN_TC_DEFAULT);
+
+    // Falls back to the built-in rules
+    ASSERT_EQ(classifier.classify({.proto = IPPROTO_TCP, .dst_port = 22}), VPN_TC_INTERACTIVE);
+}
+
+TEST(TrafficClassifier, Policies) {
+    TrafficClassPolicy interactive = traffic_class_policy(VPN_TC_INTERACTIVE);
+    TrafficClassPolicy normal = traffic_class_policy(VPN_TC_DEFAULT);
+    TrafficClassPolicy bulk = traffic_class_policy(VPN_TC_BULK);
+    ASSERT_GT(interactive.weight, normal.weight);
+    ASSERT_GT(normal.weight, bulk.weight);
+    ASSERT_LE(interactive.weight, 256);
+    ASSERT_GE(bulk.weight, 1);
+    ASSERT_GT(interactive.send_queue_limit, normal.send_queue_limit);
+    ASSERT_GT(normal.send_queue_limit, bulk.send_queue_limit);
+}
+
+static const size_t BULK_LIMIT = traffic_class_policy(VPN_TC_BULK).send_queue_limit;
+static const size_t DEFAULT_LIMIT = traffic_class_policy(VPN_TC_DEFAULT).send_queue_limit;
+
+TEST(TrafficClassSendQueue, QueuesFramedData) {
+    TrafficClassSendQueue queue;
+    ASSERT_EQ(queue.available(VPN_TC_BULK), BULK_LIMIT);
+
+    queue.push(VPN_TC_BULK, 1000, 1009);
+    queue.push(VPN_TC_DEFAULT, 2000, 3018);
+    queue.push(VPN_TC_BULK, 3000, 6027);
+    ASSERT_EQ(queue.queued(VPN_TC_BULK), 4000);
+    ASSERT_EQ(queue.queued(VPN_TC_DEFAULT), 2000);
+    ASSERT_EQ(queue.queued(VPN_TC_INTERACTIVE), 0);
+    ASSERT_EQ(queue.available(VPN_TC_BULK), BULK_LIMIT - 4000);
+    ASSERT_EQ(queue.available(VPN_TC_DEFAULT), DEFAULT_LIMIT - 2000);
+}
+
+TEST(TrafficClassSendQueue, BlocksOnlyClassAtLimit) {
+    TrafficClassSendQueue queue;
+    queue.push(VPN_TC_BULK, BULK_LIMIT, BULK_LIMIT);
+    ASSERT_EQ(queue.available(VPN_TC_BULK), 0);
+    ASSERT_EQ(queue.available(VPN_TC_DEFAULT), DEFAULT_LIMIT);
+    ASSERT_EQ(queue.available(VPN_TC_INTERACTIVE), traffic_class_policy(VPN_TC_INTERACTIVE).send_queue_limit);
+}
+
+TEST(TrafficClassSendQueue, SaturatedClassesLeaveRoomForInteractive) {
+    // What the TCP socket keeps in its write buffer at most
+    static constexpr size_t SOCKET_WRITE_LIMIT = 128 * 1024;
+
+    TrafficClassSendQueue queue;
+    uint64_t output = 0;
+    for (VpnTrafficClass traffic_class : {VPN_TC_BULK, VPN_TC_DEFAULT}) {
+        for (size_t available = queue.available(traffic_class); available > 0;
+                available = queue.available(traffic_class)) {
+            size_t length = std::min<size_t>(available, 16 * 1024);
+            output += length;
+            queue.push(traffic_class, length, output);
+        }
+    }
+    ASSERT_EQ(queue.queued(VPN_TC_BULK), BULK_LIMIT);
+    ASSERT_EQ(queue.queued(VPN_TC_DEFAULT), DEFAULT_LIMIT);
+
+    size_t socket_room = SOCKET_WRITE_LIMIT - std::min<size_t>(output, SOCKET_WRITE_LIMIT);
+    ASSERT_GE(socket_room, 32 * 1024);
+    ASSERT_GE(queue.available(VPN_TC_INTERACTIVE), socket_room);
+}
+
+TEST(TrafficClassSendQueue, ReleasesWrittenData) {
+    TrafficClassSendQueue queue;
+    queue.push(VPN_TC_DEFAULT, 1000, 1009);
+    queue.push(VPN_TC_BULK, 2000, 3018);
+    queue.push(VPN_TC_DEFAULT, 3000, 6027);
+
+    // A frame is released once it is written out completely
+    ASSERT_TRUE(queue.release(3017, false).none());
+    ASSERT_EQ(queue.queued(VPN_TC_DEFAULT), 3000);
+    ASSERT_EQ(queue.queued(VPN_TC_BULK), 2000);
+    queue.release(3018, false);
+    ASSERT_EQ(queue.queued(VPN_TC_BULK), 0);
+    ASSERT_EQ(queue.queued(VPN_TC_DEFAULT), 3000);
+
+    // Everything is released once the write buffer is empty
+    queue.release(4000, true);
+    ASSERT_EQ(queue.queued(VPN_TC_DEFAULT), 0);
+}
+
+TEST(TrafficClassSendQueue, ResumesBlockedClass) {
+    TrafficClassSendQueue queue;
+    queue.push(VPN_TC_BULK, BULK_LIMIT / 2, BULK_LIMIT / 2);
+    queue.push(VPN_TC_DEFAULT, DEFAULT_LIMIT, BULK_LIMIT / 2 + DEFAULT_LIMIT);
+    queue.push(VPN_TC_BULK, BULK_LIMIT / 2, BULK_LIMIT + DEFAULT_LIMIT);
+    ASSERT_EQ(queue.available(VPN_TC_BULK), 0);
+
+    // The class is reported once it gets below the limit, and only once
+    std::bitset<TRAFFIC_CLASSES_NUM> unblocked = queue.release(BULK_LIMIT / 2, false);
+    ASSERT_EQ(unblocked, std::bitset<TRAFFIC_CLASSES_NUM>().set(VPN_TC_BULK));
+    ASSERT_EQ(queue.available(VPN_TC_BULK), BULK_LIMIT / 2);
+    ASSERT_TRUE(queue.release(BULK_LIMIT / 2 + DEFAULT_LIMIT, false).none());
+    ASSERT_EQ(queue.queued(VPN_TC_DEFAULT), 0);
+
+    // Not reported if nothing asked for the class while it was at the limit
+    queue.push(VPN_TC_DEFAULT, DEFAULT_LIMIT, 2 * BULK_LIMIT + DEFAULT_LIMIT);
+    ASSERT_TRUE(queue.release(0, true).none());
+}
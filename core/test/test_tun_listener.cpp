@@ -0,0 +1,267 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "tun_device_listener.h"
+#include "vpn/event_loop.h"
+#include "vpn/internal/vpn_client.h"
+
+using namespace ag;
+
+static constexpr size_t IP_HEADER_SIZE = 20;
+static constexpr size_t UDP_HEADER_SIZE = 8;
+static constexpr uint8_t CLIENT_ADDR[] = {172, 16, 0, 2};
+static constexpr uint8_t SERVER_ADDR[] = {8, 8, 8, 8};
+static constexpr uint16_t CLIENT_PORT = 50000;
+static constexpr uint16_t SERVER_PORT = 443;
+
+static void put_u16(uint8_t *dst, uint16_t value) {
+    dst[0] = uint8_t(value >> 8);
+    dst[1] = uint8_t(value);
+}
+
+/** IPv4 datagram from the client to the server, with no UDP checksum */
+static std::vector<uint8_t> make_client_datagram(size_t payload_size) {
+    std::vector<uint8_t> packet(IP_HEADER_SIZE + UDP_HEADER_SIZE + payload_size);
+    uint8_t *ip = packet.data();
+    ip[0] = 0x45;
+    put_u16(&ip[2], uint16_t(packet.size()));
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    std::memcpy(&ip[12], CLIENT_ADDR, 4);
+    std::memcpy(&ip[16], SERVER_ADDR, 4);
+    uint32_t sum = 0;
+    for (size_t i = 0; i < IP_HEADER_SIZE; i += 2) {
+        sum += (ip[i] << 8) | ip[i + 1];
+    }
+    while (sum > 0xffff) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    put_u16(&ip[10], uint16_t(~sum));
+
+    uint8_t *udp = ip + IP_HEADER_SIZE;
+    put_u16(&udp[0], CLIENT_PORT);
+    put_u16(&udp[2], SERVER_PORT);
+    put_u16(&udp[4], uint16_t(UDP_HEADER_SIZE + payload_size));
+    return packet;
+}
+
+/** Payload which tells the replies apart */
+static std::vector<uint8_t> make_payload(size_t size, uint8_t seed) {
+    std::vector<uint8_t> payload(size);
+    for (size_t i = 0; i < size; ++i) {
+        payload[i] = uint8_t(i * 7 + seed);
+    }
+    return payload;
+}
+
+/**
+ * Drives a TUN listener in batched output mode through a UDP flow: the test sends replies to the client
+ * and checks how they are grouped into `CLIENT_EVENT_OUTPUT_BATCH` events
+ */
+class TunListenerBatchOutput : public ::testing::Test {
+protected:
+    UniquePtr<VpnEventLoop, vpn_event_loop_destroy> m_loop{vpn_event_loop_create()};
+    VpnClient m_vpn{vpn_client::Parameters{.ev_loop = m_loop.get()}};
+    std::unique_ptr<ClientListener> m_listener;
+    uint64_t m_conn_id = 0;
+    std::vector<std::vector<std::vector<uint8_t>>> m_batches; // packets of each batch
+    std::vector<size_t> m_max_chunks;                         // maximum number of chunks of a packet in each batch
+    size_t m_unbatched = 0;                                   // number of `CLIENT_EVENT_OUTPUT` events
+    bool m_in_batch = false;
+    bool m_nested_batch = false;
+    std::vector<std::vector<uint8_t>> m_replies_from_batch; // sent by the handler of the next batch
+
+    void open(uint32_t mtu) {
+        VpnTunListenerConfig config{};
+        config.fd = -1;
+        config.mtu_size = mtu;
+        config.batch_output = true;
+        m_listener = std::make_unique<TunListener>(&config);
+        ASSERT_EQ(m_listener->init(&m_vpn, {&TunListenerBatchOutput::handler, this}),
+                ClientListener::InitResult::SUCCESS);
+
+        std::vector<uint8_t> first = make_client_datagram(100);
+        auto *data = new uint8_t[first.size()];
+        std::memcpy(data, first.data(), first.size());
+        VpnPacket packet{data, first.size(), [](void *, uint8_t *data) {
+                             delete[] data;
+                         }};
+        m_listener->process_client_packets({&packet, 1});
+        ASSERT_NE(m_conn_id, 0);
+    }
+
+    void TearDown() override {
+        if (m_listener != nullptr) {
+            m_listener->deinit();
+        }
+    }
+
+    void run_event_loop_once() { // NOLINT(readability-make-member-function-const)
+        vpn_event_loop_exit(m_loop.get(), Millis{0});
+        vpn_event_loop_run(m_loop.get());
+    }
+
+    void send(const std::vector<uint8_t> &reply) {
+        ASSERT_EQ(m_listener->send(m_conn_id, reply.data(), reply.size()), ssize_t(reply.size()));
+    }
+
+    static void handler(void *arg, ClientEvent what, void *data) {
+        auto *self = (TunListenerBatchOutput *) arg;
+        switch (what) {
+        case CLIENT_EVENT_CONNECT_REQUEST:
+            self->m_conn_id = ((ClientConnectRequest *) data)->id;
+            self->m_listener->complete_connect_request(self->m_conn_id, CCR_PASS);
+            break;
+        case CLIENT_EVENT_CONNECTION_ACCEPTED:
+            self->m_listener->turn_read(*(uint64_t *) data, true);
+            break;
+        case CLIENT_EVENT_READ: {
+            auto *event = (ClientRead *) data;
+            event->result = int(event->length);
+            break;
+        }
+        case CLIENT_EVENT_OUTPUT:
+            ++self->m_unbatched;
+            break;
+        case CLIENT_EVENT_OUTPUT_BATCH: {
+            self->m_nested_batch |= self->m_in_batch;
+            self->m_in_batch = true;
+            const auto *event = (VpnClientOutputBatchEvent *) data;
+            auto &batch = self->m_batches.emplace_back();
+            size_t &max_chunks = self->m_max_chunks.emplace_back(0);
+            for (size_t i = 0; i < event->packets_num; ++i) {
+                const VpnClientOutputEvent &packet = event->packets[i];
+                ASSERT_EQ(packet.family, AF_INET);
+                max_chunks = std::max(max_chunks, packet.packet.chunks_num);
+                std::vector<uint8_t> &bytes = batch.emplace_back();
+                for (size_t j = 0; j < packet.packet.chunks_num; ++j) {
+                    const iovec &chunk = packet.packet.chunks[j];
+                    bytes.insert(bytes.end(), (uint8_t *) chunk.iov_base, (uint8_t *) chunk.iov_base + chunk.iov_len);
+                }
+            }
+            for (const std::vector<uint8_t> &reply : std::exchange(self->m_replies_from_batch, {})) {
+                self->send(reply);
+            }
+            self->m_in_batch = false;
+            break;
+        }
+        case CLIENT_EVENT_CONNECTION_CLOSED:
+        case CLIENT_EVENT_DATA_SENT:
+        case CLIENT_EVENT_ICMP_ECHO_REQUEST:
+            break;
+        }
+    }
+
+    static std::vector<uint8_t> payload_of(const std::vector<uint8_t> &packet) {
+        return {packet.begin() + IP_HEADER_SIZE + UDP_HEADER_SIZE, packet.end()};
+    }
+};
+
+TEST_F(TunListenerBatchOutput, FlushesAtPacketLimit) {
+    ASSERT_NO_FATAL_FAILURE(open(DEFAULT_MTU_SIZE));
+
+    std::vector<std::vector<uint8_t>> replies;
+    for (size_t i = 0; i < 300; ++i) {
+        replies.emplace_back(make_payload(100, uint8_t(i)));
+        ASSERT_NO_FATAL_FAILURE(send(replies.back()));
+    }
+    // A full batch goes out right away, the rest waits for the event loop
+    ASSERT_EQ(m_batches.size(), 1);
+    ASSERT_EQ(m_batches[0].size(), 256);
+    run_event_loop_once();
+    ASSERT_EQ(m_batches.size(), 2);
+    ASSERT_EQ(m_batches[1].size(), 44);
+
+    for (size_t i = 0; i < replies.size(); ++i) {
+        ASSERT_EQ(payload_of(m_batches[i / 256][i % 256]), replies[i]) << i;
+    }
+    ASSERT_EQ(m_unbatched, 0);
+}
+
+TEST_F(TunListenerBatchOutput, FlushesAtByteLimit) {
+    static constexpr size_t REPLY_SIZE = 60000;
+    ASSERT_NO_FATAL_FAILURE(open(64000));
+
+    std::vector<std::vector<uint8_t>> replies;
+    for (size_t i = 0; i < 20; ++i) {
+        replies.emplace_back(make_payload(REPLY_SIZE, uint8_t(i)));
+        ASSERT_NO_FATAL_FAILURE(send(replies.back()));
+    }
+    // The 18th packet would take the batch over 1 MiB
+    ASSERT_EQ(m_batches.size(), 1);
+    ASSERT_EQ(m_batches[0].size(), 17);
+    run_event_loop_once();
+    ASSERT_EQ(m_batches.size(), 2);
+    ASSERT_EQ(m_batches[1].size(), 3);
+
+    for (size_t i = 0; i < replies.size(); ++i) {
+        ASSERT_EQ(payload_of(m_batches[i / 17][i % 17]), replies[i]) << i;
+    }
+}
+
+TEST_F(TunListenerBatchOutput, OutputFromHandlerGoesToNextBatch) {
+    ASSERT_NO_FATAL_FAILURE(open(DEFAULT_MTU_SIZE));
+
+    std::vector<uint8_t> first = make_payload(100, 1);
+    std::vector<uint8_t> second = make_payload(200, 2);
+    m_replies_from_batch.push_back(second);
+    ASSERT_NO_FATAL_FAILURE(send(first));
+    ASSERT_TRUE(m_batches.empty());
+
+    run_event_loop_once();
+    ASSERT_FALSE(m_batches.empty());
+    run_event_loop_once();
+    ASSERT_EQ(m_batches.size(), 2);
+    ASSERT_FALSE(m_nested_batch);
+    ASSERT_EQ(m_batches[0].size(), 1);
+    ASSERT_EQ(payload_of(m_batches[0][0]), first);
+    ASSERT_EQ(m_batches[1].size(), 1);
+    ASSERT_EQ(payload_of(m_batches[1][0]), second);
+}
+
+TEST_F(TunListenerBatchOutput, DeinitFlushesPendingBatch) {
+    ASSERT_NO_FATAL_FAILURE(open(DEFAULT_MTU_SIZE));
+
+    std::vector<uint8_t> small = make_payload(100, 1);
+    std::vector<uint8_t> large = make_payload(3000, 2);
+    ASSERT_NO_FATAL_FAILURE(send(small));
+    ASSERT_NO_FATAL_FAILURE(send(large));
+    ASSERT_TRUE(m_batches.empty());
+
+    m_listener->deinit();
+    m_listener.reset();
+    ASSERT_EQ(m_batches.size(), 1);
+    ASSERT_EQ(m_batches[0].size(), 4);
+    ASSERT_EQ(payload_of(m_batches[0][0]), small);
+}
+
+TEST_F(TunListenerBatchOutput, ReferencesStackBuffers) {
+    ASSERT_NO_FATAL_FAILURE(open(DEFAULT_MTU_SIZE));
+
+    // Fragmented by the stack, the fragments stay in its buffers until the flush.
+    // Without a reference the buffers of the first reply would be reused for the second one.
+    std::vector<std::vector<uint8_t>> replies = {make_payload(3000, 3), make_payload(3000, 4)};
+    for (const std::vector<uint8_t> &reply : replies) {
+        ASSERT_NO_FATAL_FAILURE(send(reply));
+    }
+    ASSERT_TRUE(m_batches.empty());
+
+    run_event_loop_once();
+    ASSERT_EQ(m_batches.size(), 1);
+    ASSERT_EQ(m_batches[0].size(), 6);
+    ASSERT_GT(m_max_chunks[0], 1);
+
+    for (size_t i = 0; i < replies.size(); ++i) {
+        const std::vector<uint8_t> *fragments = &m_batches[0][i * 3];
+        std::vector<uint8_t> reassembled = payload_of(fragments[0]);
+        for (size_t j = 1; j < 3; ++j) {
+            reassembled.insert(reassembled.end(), fragments[j].begin() + IP_HEADER_SIZE, fragments[j].end());
+        }
+        ASSERT_EQ(reassembled, replies[i]) << i;
+    }
+}
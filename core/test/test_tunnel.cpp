@@ -267,6 +267,32 @@ TEST_F(TunnelTest, LocalhostConnection) {
     ASSERT_GT(bypass_upstream->connections.size(), 0);
 }
 
+TEST_F(TunnelTest, ConnectionMemoryDropsWhenSetupReleased) {
+    size_t idle_usage = tun.connections_memory_usage();
+    uint64_t client_id = vpn.listener_conn_id_generator.get();
+    ASSERT_NO_FATAL_FAILURE(raise_client_connection(client_id));
+
+    std::optional<VpnConnectAction> action = tun.finalize_connect_action({client_id, VPN_CA_DEFAULT, "some", 1});
+    tun.complete_connect_request(client_id, action);
+    ASSERT_FALSE(redirect_upstream->connections.empty());
+    uint64_t redirect_id = redirect_upstream->connections.back();
+    tun.upstream_handler(redirect_upstream, SERVER_EVENT_CONNECTION_OPENED, &redirect_id);
+    tun.listener_handler(client_listener, CLIENT_EVENT_CONNECTION_ACCEPTED, &client_id);
+
+    // The connection keeps its setup state until the domain is found in the first packet
+    const VpnConnection *conn = tun.connections.by_client_id.get(client_id);
+    ASSERT_NE(conn, nullptr);
+    ASSERT_TRUE(conn->has_setup());
+    size_t setup_usage = tun.connections_memory_usage();
+    ASSERT_GT(setup_usage, idle_usage + VPN_CONNECTION_MAX_SIZE + sizeof(VpnConnectionSetup));
+
+    ClientRead read_event = {client_id, CLIENT_HELLO, std::size(CLIENT_HELLO), 0};
+    tun.listener_handler(client_listener, CLIENT_EVENT_READ, &read_event);
+    ASSERT_EQ(redirect_upstream->last_send, std::size(CLIENT_HELLO));
+    ASSERT_FALSE(conn->has_setup());
+    ASSERT_LE(tun.connections_memory_usage() + sizeof(VpnConnectionSetup), setup_usage);
+}
+
 class MigrationTest : public TunnelTest {
 public:
     uint64_t client_id = NON_ID;
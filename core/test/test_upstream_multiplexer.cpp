@@ -16,6 +16,7 @@ static int cert_verify_handler(
 struct TestUpstreamInfo {
     ServerHandler handler;
     std::unordered_set<uint64_t> connections;
+    std::unordered_map<uint64_t, VpnTrafficClass> traffic_classes;
 };
 
 class TestUpstream : public MultiplexableUpstream {
@@ -38,6 +39,7 @@ public:
             uint64_t conn_id, const TunnelAddressPair *addr, int proto, std::string_view app_name) override;
     void close_connection(uint64_t conn_id, bool graceful, bool async) override;
     ssize_t send(uint64_t id, const uint8_t *data, size_t length) override;
+    void set_traffic_class(uint64_t id, VpnTrafficClass traffic_class) override;
     void consume(uint64_t id, size_t length) override;
     size_t available_to_send(uint64_t id) override;
     void update_flow_control(uint64_t id, TcpFlowCtrlInfo info) override;
@@ -64,6 +66,7 @@ protected:
 
     DeclPtr<VpnEventLoop, &vpn_event_loop_destroy> ev_loop{vpn_event_loop_create()};
     VpnClient vpn;
+    UpstreamMultiplexer::PoolParameters pool_parameters{};
     int events = 0;
 
     static void upstream_handler(void *arg, ServerEvent what, void *) {
@@ -75,7 +78,8 @@ protected:
         g_open_session_result = true;
 
         this->vpn.parameters.cert_verify_handler = {&cert_verify_handler, this};
-        this->vpn.endpoint_upstream = std::make_unique<UpstreamMultiplexer>(0, VpnUpstreamProtocolConfig{}, 0,
+        this->vpn.endpoint_upstream = std::make_unique<UpstreamMultiplexer>(0, VpnUpstreamProtocolConfig{},
+                this->pool_parameters,
                 [](const VpnUpstreamProtocolConfig &, int id, VpnClient *vpn,
                         ServerHandler handler) -> std::unique_ptr<MultiplexableUpstream> {
                     return std::make_unique<TestUpstream>(id, vpn, handler);
@@ -111,6 +115,20 @@ protected:
         handler->func(handler->arg, SERVER_EVENT_SESSION_OPENED, nullptr);
     }
 
+    // Complete the handshakes of the upstreams opened after the first one
+    void open_pool_sessions() {
+        int first_id = std::min_element(g_upstreams.begin(), g_upstreams.end(), COMPARE_UPSTREAM_IDS)->first;
+        for (auto &[id, _] : g_upstreams) {
+            if (id != first_id) {
+                ASSERT_NO_FATAL_FAILURE(notify_session_opened(id));
+            }
+        }
+    }
+
+    static constexpr auto COMPARE_UPSTREAM_IDS = [](const auto &lh, const auto &rh) -> bool {
+        return lh.first < rh.first;
+    };
+
     void notify_session_closed(int id) {
         ASSERT_EQ(g_upstreams.count(id), 1);
 
@@ -199,6 +217,11 @@ protected:
         vpn_event_loop_exit(this->ev_loop.get(), Millis{0});
         vpn_event_loop_run(this->ev_loop.get());
     }
+
+    void run_event_loop_for(Millis period) { // NOLINT(readability-make-member-function-const)
+        vpn_event_loop_exit(this->ev_loop.get(), period);
+        vpn_event_loop_run(this->ev_loop.get());
+    }
 };
 
 std::unordered_map<int, TestUpstreamInfo> UpstreamMuxTest::g_upstreams;
@@ -222,6 +245,9 @@ void TestUpstream::close_connection(uint64_t conn_id, bool, bool) {
 ssize_t TestUpstream::send(uint64_t, const uint8_t *, size_t) {
     return 0;
 }
+void TestUpstream::set_traffic_class(uint64_t id, VpnTrafficClass traffic_class) {
+    UpstreamMuxTest::g_upstreams[m_id].traffic_classes[id] = traffic_class;
+}
 void TestUpstream::consume(uint64_t id, size_t length) {
 }
 size_t TestUpstream::available_to_send(uint64_t) {
@@ -460,3 +486,112 @@ TEST_F(UpstreamMuxTest, FallbackToUnconnectedUpstream) {
     // check that `open_connection` was not called as the upstream is still not connected
     ASSERT_EQ(g_upstreams[first_upstream_id].connections.size(), 0) << first_upstream_id;
 }
+
+// Check that the traffic class of a connection reaches its upstream, even if it is set while the upstream
+// session is being established
+TEST_F(UpstreamMuxTest, TrafficClassForwarded) {
+    int first_upstream_id = g_upstreams.begin()->first;
+    uint64_t conn_id = initiate_connection();
+    this->vpn.endpoint_upstream->set_traffic_class(conn_id, VPN_TC_INTERACTIVE);
+    ASSERT_EQ(g_upstreams[first_upstream_id].traffic_classes[conn_id], VPN_TC_INTERACTIVE);
+
+    for (size_t i = 1; i < UpstreamMultiplexer::NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD; ++i) {
+        ASSERT_NO_FATAL_FAILURE(initiate_connection());
+    }
+    conn_id = initiate_connection();
+    ASSERT_EQ(g_upstreams.size(), 2);
+    int second_upstream_id = std::max_element(g_upstreams.begin(), g_upstreams.end(), COMPARE_UPSTREAM_IDS)->first;
+    this->vpn.endpoint_upstream->set_traffic_class(conn_id, VPN_TC_BULK);
+    ASSERT_TRUE(g_upstreams[second_upstream_id].traffic_classes.empty());
+
+    ASSERT_NO_FATAL_FAILURE(notify_session_opened(second_upstream_id));
+    ASSERT_EQ(g_upstreams[second_upstream_id].connections.count(conn_id), 1);
+    ASSERT_EQ(g_upstreams[second_upstream_id].traffic_classes[conn_id], VPN_TC_BULK);
+}
+
+class UpstreamMuxPoolTest : public UpstreamMuxTest {
+public:
+    static constexpr Millis IDLE_TIMEOUT{20};
+
+    UpstreamMuxPoolTest() {
+        this->pool_parameters = {
+                .min_upstreams_num = 1,
+                .spare_upstreams_num = 1,
+                .idle_timeout = IDLE_TIMEOUT,
+        };
+    }
+};
+
+// Check that a spare upstream is established ahead of demand and takes the connection which does not fit
+// in the existing upstreams without waiting for a handshake
+TEST_F(UpstreamMuxPoolTest, SpareUpstreamTakesOverflow) {
+    ASSERT_EQ(g_upstreams.size(), 2);
+    int spare_upstream_id = std::max_element(g_upstreams.begin(), g_upstreams.end(), COMPARE_UPSTREAM_IDS)->first;
+    ASSERT_NO_FATAL_FAILURE(open_pool_sessions());
+
+    // the spare one is not used while the first one has room
+    for (size_t i = 0; i < UpstreamMultiplexer::NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD; ++i) {
+        ASSERT_NE(initiate_connection(), NON_ID);
+        ASSERT_EQ(g_upstreams.size(), 2);
+        ASSERT_TRUE(g_upstreams[spare_upstream_id].connections.empty());
+    }
+
+    // the connection is opened on the spare upstream right away and a new spare one is started
+    ASSERT_NE(initiate_connection(), NON_ID);
+    ASSERT_EQ(g_upstreams[spare_upstream_id].connections.size(), 1);
+    ASSERT_EQ(g_upstreams.size(), 3);
+}
+
+// Check that unused upstreams above the minimum are closed after the idle timeout
+TEST_F(UpstreamMuxPoolTest, IdleUpstreamsClosed) {
+    ASSERT_EQ(g_upstreams.size(), 2);
+    ASSERT_NO_FATAL_FAILURE(open_pool_sessions());
+
+    // an upstream with connections is kept even if it is not needed
+    for (size_t i = 0; i < UpstreamMultiplexer::NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD + 1; ++i) {
+        ASSERT_NO_FATAL_FAILURE(open_connection());
+    }
+    ASSERT_EQ(g_upstreams.size(), 3);
+    int busy_upstream_id = std::find_if(g_upstreams.begin(), g_upstreams.end(), [](const auto &i) {
+        return i.second.connections.size() == 1;
+    })->first;
+    for (auto &[id, info] : g_upstreams) {
+        if (id != busy_upstream_id) {
+            while (!info.connections.empty()) {
+                ASSERT_NO_FATAL_FAILURE(close_connection(id, *info.connections.begin()));
+            }
+        }
+    }
+
+    run_event_loop_for(10 * IDLE_TIMEOUT);
+    ASSERT_EQ(g_upstreams.size(), 1);
+    ASSERT_EQ(g_upstreams.count(busy_upstream_id), 1);
+    ASSERT_FALSE(is_raised(SERVER_EVENT_SESSION_CLOSED)) << std::hex << events;
+
+    // the last connection is gone, but the minimum number of upstreams is kept
+    ASSERT_NO_FATAL_FAILURE(close_connection(busy_upstream_id, *g_upstreams[busy_upstream_id].connections.begin()));
+    run_event_loop_for(5 * IDLE_TIMEOUT);
+    ASSERT_EQ(g_upstreams.size(), 1);
+    ASSERT_FALSE(is_raised(SERVER_EVENT_SESSION_CLOSED)) << std::hex << events;
+}
+
+class UpstreamMuxMinPoolTest : public UpstreamMuxTest {
+public:
+    static constexpr size_t MIN_UPSTREAMS_NUM = 3;
+
+    UpstreamMuxMinPoolTest() {
+        this->pool_parameters = {
+                .min_upstreams_num = MIN_UPSTREAMS_NUM,
+                .idle_timeout = UpstreamMuxPoolTest::IDLE_TIMEOUT,
+        };
+    }
+};
+
+// Check that the minimum number of upstreams is opened with the session and kept while unused
+TEST_F(UpstreamMuxMinPoolTest, MinUpstreamsKept) {
+    ASSERT_EQ(g_upstreams.size(), MIN_UPSTREAMS_NUM);
+    ASSERT_NO_FATAL_FAILURE(open_pool_sessions());
+
+    run_event_loop_for(5 * UpstreamMuxPoolTest::IDLE_TIMEOUT);
+    ASSERT_EQ(g_upstreams.size(), MIN_UPSTREAMS_NUM);
+}
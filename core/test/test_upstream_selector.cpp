@@ -0,0 +1,292 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "upstream_selector.h"
+
+using namespace ag;
+using namespace std::chrono_literals;
+
+static constexpr uint32_t RTT_US = 50'000;
+
+TEST(ThroughputMeter, AveragesIntervals) {
+    ThroughputMeter meter;
+    ThroughputMeter::Clock::time_point now{1s};
+    ASSERT_EQ(meter.get(now), 0);
+
+    // 1 MB per 100 ms
+    meter.account(1'000'000, now + 50ms);
+    ASSERT_EQ(meter.get(now + 50ms), 0);
+    ASSERT_EQ(meter.get(now + 100ms), 10'000'000);
+
+    // Nothing for the next 100 ms halves it
+    ASSERT_EQ(meter.get(now + 200ms), 5'000'000);
+
+    // A long silence resets it
+    meter.account(1000, now + 1200ms);
+    ASSERT_EQ(meter.get(now + 1200ms), 0);
+}
+
+TEST(ConnectionCountSelector, FillsUpstreamsOneByOne) {
+    ConnectionCountSelector selector;
+    std::vector<UpstreamSelector::Candidate> candidates = {
+            {1, {.connections_num = UpstreamSelector::NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD}},
+            {2, {.connections_num = 3}},
+            {3, {.connections_num = 1}},
+    };
+    ASSERT_EQ(selector.select(candidates, true), 2);
+
+    candidates[1].load.connections_num = UpstreamSelector::NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD + 1;
+    candidates[2].load.connections_num = UpstreamSelector::NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD + 1;
+    ASSERT_EQ(selector.select(candidates, true), std::nullopt);
+    ASSERT_EQ(selector.select(candidates, false), 1);
+    ASSERT_EQ(selector.select({}, false), std::nullopt);
+}
+
+TEST(LatencyAwareSelector, EstimatesDelay) {
+    // Idle
+    ASSERT_EQ(LatencyAwareSelector::estimate_delay_us({.rtt_us = RTT_US}, 0), RTT_US);
+    ASSERT_EQ(LatencyAwareSelector::estimate_delay_us({}, RTT_US), RTT_US);
+
+    // Busy: 1 MB queued at 10 MB/s
+    UpstreamLoad busy = {.rtt_us = RTT_US, .bytes_in_flight = 500'000, .send_queue_size = 500'000,
+            .throughput = 10'000'000};
+    ASSERT_EQ(LatencyAwareSelector::estimate_queueing_delay_us(busy), 100'000);
+    ASSERT_EQ(LatencyAwareSelector::estimate_delay_us(busy, 0), RTT_US + 100'000);
+
+    // The queue is drained at least at `MIN_DRAIN_RATE`
+    UpstreamLoad stalled = {.rtt_us = RTT_US, .send_queue_size = LatencyAwareSelector::MIN_DRAIN_RATE};
+    ASSERT_EQ(LatencyAwareSelector::estimate_delay_us(stalled, 0), RTT_US + 1'000'000);
+}
+
+TEST(LatencyAwareSelector, AvoidsBusyUpstreams) {
+    LatencyAwareSelector selector;
+    std::vector<UpstreamSelector::Candidate> candidates = {
+            {1,
+                    {.connections_num = 1, .rtt_us = RTT_US, .bytes_in_flight = 500'000, .send_queue_size = 500'000,
+                            .throughput = 10'000'000}},
+            {2, {.connections_num = 4, .rtt_us = RTT_US, .throughput = 10'000}},
+    };
+    // The idle one, even though it has more connections
+    ASSERT_EQ(selector.select(candidates, true), 2);
+
+    // All are congested or full, so a new one is preferred
+    candidates[1].load.connections_num = UpstreamSelector::NEW_UPSTREAM_CONNECTIONS_NUM_THRESHOLD;
+    ASSERT_EQ(selector.select(candidates, true), std::nullopt);
+    ASSERT_EQ(selector.select(candidates, false), 2);
+
+    // An upstream which has not measured RTT yet competes with the best known one
+    candidates.push_back({3, {.connections_num = 0}});
+    ASSERT_EQ(selector.select(candidates, true), 3);
+
+    // Equal upstreams are balanced by the number of connections
+    std::vector<UpstreamSelector::Candidate> equal = {
+            {1, {.connections_num = 3}},
+            {2, {.connections_num = 2}},
+    };
+    ASSERT_EQ(selector.select(equal, true), 2);
+}
+
+TEST(LatencyAwareSelector, BusyUpstreamIsNotCongested) {
+    LatencyAwareSelector selector;
+    // The pipe is full: a round trip worth of data is in flight at 10 MB/s, and nothing waits to be sent
+    std::vector<UpstreamSelector::Candidate> candidates = {
+            {1, {.connections_num = 1, .rtt_us = RTT_US, .bytes_in_flight = 500'000, .throughput = 10'000'000}},
+    };
+    ASSERT_EQ(selector.select(candidates, true), 1);
+
+    // Data waiting for the pipe makes it congested
+    candidates[0].load.send_queue_size = 100'000;
+    ASSERT_EQ(selector.select(candidates, true), std::nullopt);
+}
+
+TEST(LatencyAwareSelector, UpstreamWithoutRttIsNotCongested) {
+    LatencyAwareSelector selector;
+    // No upstream has measured the round-trip time yet
+    std::vector<UpstreamSelector::Candidate> candidates = {
+            {1, {.connections_num = 1, .bytes_in_flight = 64 * 1024, .send_queue_size = 64 * 1024}},
+    };
+    ASSERT_EQ(selector.select(candidates, true), 1);
+
+    // Neither if the others have
+    candidates.push_back({2,
+            {.connections_num = 1, .rtt_us = RTT_US, .send_queue_size = 1024 * 1024, .throughput = 1'000'000}});
+    ASSERT_EQ(selector.select(candidates, true), 1);
+}
+
+/**
+ * Simulates upstreams sharing a link under a mix of bulk uploads and small interactive requests.
+ * The link is shared evenly by the upstreams having data to send, the data of an upstream is sent in order.
+ */
+class UpstreamSelectionSimulation {
+public:
+    static constexpr auto TICK = 1ms;
+    static constexpr size_t LINK_RATE = 10'000'000;           // bytes per second
+    static constexpr size_t BULK_SEND_BUFFER = 1024 * 1024;    // data the bulk uploads keep queued
+    static constexpr size_t INTERACTIVE_REQUEST_SIZE = 2 * 1024;
+    static constexpr size_t MAX_UPSTREAMS = 4;
+
+    explicit UpstreamSelectionSimulation(std::unique_ptr<UpstreamSelector> selector)
+            : m_selector(std::move(selector)) {
+    }
+
+    /** Start a bulk upload */
+    void start_bulk() {
+        int id = select_upstream();
+        m_upstreams[id].connections_num += 1;
+        m_bulk_upstreams.push_back(id);
+    }
+
+    /** Open a connection which sits idle */
+    void open_idle() {
+        m_upstreams[select_upstream()].connections_num += 1;
+    }
+
+    /** Send a request on a new connection which is closed after the request is sent */
+    void send_interactive() {
+        int id = select_upstream();
+        Upstream &upstream = m_upstreams[id];
+        upstream.connections_num += 1;
+        upstream.queue.push_back({INTERACTIVE_REQUEST_SIZE, m_now});
+        upstream.queued += INTERACTIVE_REQUEST_SIZE;
+    }
+
+    /** Advance time by a tick */
+    void tick() {
+        m_now += TICK;
+
+        for (int id : m_bulk_upstreams) {
+            Upstream &upstream = m_upstreams[id];
+            if (upstream.queued < BULK_SEND_BUFFER) {
+                size_t size = BULK_SEND_BUFFER - upstream.queued;
+                upstream.queue.push_back({size, std::nullopt});
+                upstream.queued += size;
+            }
+        }
+
+        size_t busy = std::count_if(m_upstreams.begin(), m_upstreams.end(), [](const auto &i) {
+            return i.second.queued > 0;
+        });
+        if (busy == 0) {
+            return;
+        }
+
+        size_t share = LINK_RATE * std::chrono::microseconds(TICK).count() / 1'000'000 / busy;
+        for (auto &[_, upstream] : m_upstreams) {
+            size_t budget = share;
+            while (budget > 0 && !upstream.queue.empty()) {
+                Chunk &chunk = upstream.queue.front();
+                size_t n = std::min(budget, chunk.size);
+                chunk.size -= n;
+                upstream.queued -= n;
+                budget -= n;
+                upstream.meter.account(n, m_now);
+                if (chunk.size == 0) {
+                    if (chunk.sent_at.has_value()) {
+                        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(m_now - *chunk.sent_at);
+                        m_latencies_us.push_back(latency.count() + RTT_US);
+                        upstream.connections_num -= 1;
+                    }
+                    upstream.queue.pop_front();
+                }
+            }
+        }
+    }
+
+    /** Get the latency of the interactive requests at the given percentile */
+    [[nodiscard]] int64_t latency_percentile_us(double p) const {
+        std::vector<int64_t> latencies = m_latencies_us;
+        std::sort(latencies.begin(), latencies.end());
+        return latencies.at(size_t(p * double(latencies.size() - 1)));
+    }
+
+    [[nodiscard]] size_t upstreams_num() const {
+        return m_upstreams.size();
+    }
+
+private:
+    struct Chunk {
+        size_t size;
+        std::optional<ThroughputMeter::Clock::time_point> sent_at; // set for interactive requests
+    };
+
+    struct Upstream {
+        size_t connections_num = 0;
+        std::deque<Chunk> queue;
+        size_t queued = 0;
+        ThroughputMeter meter;
+    };
+
+    std::unique_ptr<UpstreamSelector> m_selector;
+    std::map<int, Upstream> m_upstreams;
+    std::vector<int> m_bulk_upstreams;
+    std::vector<int64_t> m_latencies_us;
+    ThroughputMeter::Clock::time_point m_now{1s};
+    int m_next_upstream_id = 0;
+
+    int select_upstream() {
+        std::vector<UpstreamSelector::Candidate> candidates;
+        for (auto &[id, upstream] : m_upstreams) {
+            // What the socket would report: the congestion window is filled with the link share
+            size_t in_flight = std::min(upstream.queued, size_t(LINK_RATE * RTT_US / 1'000'000));
+            candidates.push_back({id,
+                    {
+                            .connections_num = upstream.connections_num,
+                            .rtt_us = RTT_US,
+                            .bytes_in_flight = in_flight,
+                            .send_queue_size = upstream.queued - in_flight,
+                            .throughput = upstream.meter.get(m_now),
+                    }});
+        }
+
+        std::optional<int> id = m_selector->select(candidates, m_upstreams.size() < MAX_UPSTREAMS);
+        return id.has_value() ? *id : m_next_upstream_id++;
+    }
+};
+
+static UpstreamSelectionSimulation simulate_mixed_load(std::unique_ptr<UpstreamSelector> selector) {
+    UpstreamSelectionSimulation sim(std::move(selector));
+    sim.open_idle();
+    sim.open_idle();
+    sim.start_bulk();
+    sim.start_bulk();
+    for (int i = 0; i < 500; ++i) {
+        sim.tick();
+    }
+
+    // A request every 20 ms for 10 seconds, another bulk upload starts in the middle
+    for (int i = 0; i < 10'000; ++i) {
+        if (i % 20 == 0) {
+            sim.send_interactive();
+        }
+        if (i == 5000) {
+            sim.start_bulk();
+        }
+        sim.tick();
+    }
+    return sim;
+}
+
+// Check that the interactive requests are not stuck behind the bulk uploads
+TEST(UpstreamSelectionSimulation, TailLatencyUnderMixedLoad) {
+    UpstreamSelectionSimulation by_count = simulate_mixed_load(std::make_unique<ConnectionCountSelector>());
+    UpstreamSelectionSimulation by_latency = simulate_mixed_load(std::make_unique<LatencyAwareSelector>());
+
+    int64_t by_count_p50 = by_count.latency_percentile_us(0.5);
+    int64_t by_count_p99 = by_count.latency_percentile_us(0.99);
+    int64_t by_latency_p50 = by_latency.latency_percentile_us(0.5);
+    int64_t by_latency_p99 = by_latency.latency_percentile_us(0.99);
+    RecordProperty("by_count_p99_us", std::to_string(by_count_p99));
+    RecordProperty("by_latency_p99_us", std::to_string(by_latency_p99));
+
+    ASSERT_LE(by_latency.upstreams_num(), UpstreamSelectionSimulation::MAX_UPSTREAMS);
+    ASSERT_LE(by_latency_p50, by_count_p50);
+    ASSERT_LT(2 * by_latency_p99, by_count_p99);
+    ASSERT_LT(by_latency_p99, 2 * RTT_US);
+}
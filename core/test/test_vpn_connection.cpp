@@ -0,0 +1,52 @@
+#include <gtest/gtest.h>
+
+#include <string_view>
+
+#include "vpn/internal/vpn_connection_table.h"
+
+using namespace ag;
+
+static constexpr std::string_view TEST_DATA = "tratatalalala";
+
+class VpnConnectionTest : public testing::Test {
+protected:
+    VpnConnectionSlab slab;
+    VpnConnection *conn = slab.make(1, {SocketAddress("10.0.0.2", 1024), SocketAddress("1.2.3.4", 443)}, IPPROTO_TCP);
+};
+
+TEST_F(VpnConnectionTest, SetupIsAllocatedLazily) {
+    ASSERT_FALSE(conn->has_setup());
+    size_t hot_usage = conn->memory_usage();
+    ASSERT_EQ(hot_usage, VPN_CONNECTION_MAX_SIZE);
+
+    conn->setup().app_name = "some application with a long enough name";
+    ASSERT_TRUE(conn->has_setup());
+    ASSERT_GT(conn->memory_usage(), hot_usage + sizeof(VpnConnectionSetup) + conn->setup().app_name.size());
+    ASSERT_EQ(conn->make_tag().appname, conn->setup().app_name);
+}
+
+TEST_F(VpnConnectionTest, SetupIsReleasedWhenDone) {
+    conn->setup().buffered_packets.emplace_back(
+            DataRef::copy_of({(const uint8_t *) TEST_DATA.data(), TEST_DATA.size()}));
+    size_t setup_usage = conn->memory_usage();
+    ASSERT_TRUE(conn->has_buffered_packets());
+
+    // Not connected yet
+    ASSERT_FALSE(conn->release_setup_if_done());
+
+    // Still looking up the domain
+    conn->state = CONNS_CONNECTED;
+    conn->flags.set(CONNF_LOOKINGUP_DOMAIN);
+    ASSERT_FALSE(conn->release_setup_if_done());
+    conn->flags.reset(CONNF_LOOKINGUP_DOMAIN);
+
+    // There is buffered data to send
+    ASSERT_FALSE(conn->release_setup_if_done());
+    conn->setup().buffered_packets.clear();
+
+    ASSERT_TRUE(conn->release_setup_if_done());
+    ASSERT_FALSE(conn->has_setup());
+    ASSERT_FALSE(conn->has_buffered_packets());
+    ASSERT_LT(conn->memory_usage(), setup_usage);
+    ASSERT_TRUE(conn->make_tag().appname.empty());
+}
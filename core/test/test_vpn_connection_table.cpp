@@ -0,0 +1,290 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <new>
+#include <random>
+#include <vector>
+
+#include <khash.h>
+
+#include "alloc_hooks.h"
+#include "vpn/internal/vpn_connection_table.h"
+
+/*
+ * Besides the unit tests, prints the memory used per connection and the lookup latency of the connection table
+ * compared to the previous scheme (every connection allocated with `new`, indexed by two khash tables).
+ */
+
+using namespace ag;
+
+using Clock = std::chrono::steady_clock;
+
+static TunnelAddressPair make_addr(uint64_t i) {
+    return {SocketAddress("10.0.0.2", uint16_t(1024 + i % 60000)), SocketAddress("1.2.3.4", 443)};
+}
+
+TEST(VpnConnectionSlab, DestroyedConnectionIsNotResolved) {
+    VpnConnectionSlab slab;
+    VpnConnection *conn = slab.make(1, make_addr(1), IPPROTO_TCP);
+    ASSERT_NE(dynamic_cast<TcpVpnConnection *>(conn), nullptr);
+    VpnConnectionHandle handle = conn->handle;
+    ASSERT_EQ(slab.get(handle), conn);
+    ASSERT_EQ(slab.size(), 1);
+
+    slab.destroy(conn);
+    ASSERT_EQ(slab.get(handle), nullptr);
+    ASSERT_EQ(slab.size(), 0);
+
+    // The slot is reused by the next connection, but the old handle still doesn't match
+    VpnConnection *next = slab.make(2, make_addr(2), IPPROTO_UDP);
+    ASSERT_NE(dynamic_cast<UdpVpnConnection *>(next), nullptr);
+    ASSERT_EQ(next->handle.slot, handle.slot);
+    ASSERT_EQ(slab.get(handle), nullptr);
+    ASSERT_EQ(slab.get(next->handle), next);
+    ASSERT_EQ(slab.get(VpnConnectionHandle{}), nullptr);
+}
+
+TEST(VpnConnectionSlab, ReleasesEmptySlabs) {
+    static constexpr size_t SLABS = 10;
+    VpnConnectionSlab slab;
+    size_t initial_usage = slab.memory_usage();
+    std::vector<VpnConnection *> conns;
+    for (uint64_t i = 0; i < SLABS * VpnConnectionSlab::SLOTS_PER_SLAB; ++i) {
+        conns.push_back(slab.make(i, make_addr(i), IPPROTO_TCP));
+    }
+    size_t full_usage = slab.memory_usage();
+
+    for (VpnConnection *conn : conns) {
+        slab.destroy(conn);
+    }
+    ASSERT_LT(slab.memory_usage() - initial_usage, 2 * (full_usage - initial_usage) / SLABS);
+
+    // The released slabs are allocated again
+    conns.clear();
+    for (uint64_t i = 0; i < SLABS * VpnConnectionSlab::SLOTS_PER_SLAB; ++i) {
+        conns.push_back(slab.make(i, make_addr(i), IPPROTO_TCP));
+    }
+    ASSERT_EQ(slab.size(), conns.size());
+    for (VpnConnection *conn : conns) {
+        ASSERT_EQ(slab.get(conn->handle), conn);
+    }
+    // The rest are destroyed by the slab
+}
+
+TEST(VpnConnections, MemoryUsageCountsSetupOfEveryConnection) {
+    VpnConnections connections;
+    VpnConnection *indexed = connections.slab.make(1, make_addr(1), IPPROTO_TCP);
+    connections.by_client_id.put(indexed->client_id, indexed);
+    // Not indexed yet, like a connection being switched to another upstream
+    VpnConnection *switching = connections.slab.make(NON_ID, make_addr(2), IPPROTO_TCP);
+    size_t hot_usage = connections.memory_usage();
+    ASSERT_GE(hot_usage, connections.slab.memory_usage() + connections.by_client_id.memory_usage());
+
+    indexed->setup().app_name = "some application with a long enough name";
+    switching->setup();
+    size_t setup_usage = connections.memory_usage();
+    ASSERT_GT(setup_usage, hot_usage + 2 * sizeof(VpnConnectionSetup));
+
+    indexed->state = CONNS_CONNECTED;
+    ASSERT_TRUE(indexed->release_setup_if_done());
+    ASSERT_LT(connections.memory_usage(), setup_usage - sizeof(VpnConnectionSetup));
+}
+
+TEST(VpnConnectionIndex, PutGetRemove) {
+    static constexpr uint64_t CONNECTIONS = 10000;
+    VpnConnectionSlab slab;
+    VpnConnectionIndex index(&slab);
+    std::vector<VpnConnection *> conns;
+    for (uint64_t id = 0; id < CONNECTIONS; ++id) {
+        conns.push_back(slab.make(id, make_addr(id), IPPROTO_TCP));
+        index.put(id, conns.back());
+    }
+    ASSERT_EQ(index.size(), CONNECTIONS);
+    ASSERT_EQ(index.get(CONNECTIONS), nullptr);
+    for (uint64_t id = 0; id < CONNECTIONS; ++id) {
+        ASSERT_EQ(index.get(id), conns[id]);
+    }
+
+    // Replacing
+    index.put(0, conns[1]);
+    ASSERT_EQ(index.get(0), conns[1]);
+    ASSERT_EQ(index.size(), CONNECTIONS);
+    index.put(0, conns[0]);
+
+    // Removing every other one, including while iterating
+    index.for_each([&index](VpnConnection *conn) {
+        if (conn->client_id % 2 == 0) {
+            index.remove(conn->client_id);
+        }
+    });
+    ASSERT_EQ(index.size(), CONNECTIONS / 2);
+    for (uint64_t id = 0; id < CONNECTIONS; ++id) {
+        ASSERT_EQ(index.get(id), (id % 2 == 0) ? nullptr : conns[id]) << id;
+    }
+    index.remove(0);
+    ASSERT_EQ(index.size(), CONNECTIONS / 2);
+
+    // An entry of a destroyed connection finds nothing
+    slab.destroy(conns[1]);
+    ASSERT_EQ(index.get(1), nullptr);
+    size_t visited = 0;
+    index.for_each([&visited](VpnConnection *) {
+        ++visited;
+    });
+    ASSERT_EQ(visited, CONNECTIONS / 2 - 1);
+    index.remove(1);
+
+    // Removed identifiers can be added again
+    for (uint64_t id = 0; id < CONNECTIONS; id += 2) {
+        index.put(id, conns[id]);
+    }
+    ASSERT_EQ(index.size(), CONNECTIONS - 1);
+    for (uint64_t id = 2; id < CONNECTIONS; ++id) {
+        ASSERT_EQ(index.get(id), conns[id]) << id;
+    }
+}
+
+KHASH_MAP_INIT_INT64(baseline_by_id, VpnConnection *) // NOLINT(hicpp-use-auto,modernize-use-auto)
+
+struct TableStats {
+    double bytes_per_connection;
+    double lookup_ns;
+};
+
+// Connections are created and destroyed in waves, as with a real load, so that the heap is not one contiguous run.
+// The allocator's own overhead per block is not counted, which is in favour of the baseline.
+template <typename Table>
+static TableStats measure(size_t connections) {
+    static constexpr size_t LOOKUPS = 1000000;
+
+    int64_t heap_before = test::heap_bytes();
+    Table table;
+    std::vector<uint64_t> ids;
+    uint64_t next_id = 0;
+    for (size_t wave = 0; wave < 4; ++wave) {
+        while (ids.size() < connections) {
+            ids.push_back(next_id);
+            table.add(next_id, make_addr(next_id));
+            ++next_id;
+        }
+        for (size_t i = wave % 2; i < ids.size(); i += 2) {
+            table.remove(ids[i]);
+            ids[i] = NON_ID;
+        }
+        std::erase(ids, NON_ID);
+    }
+    while (ids.size() < connections) {
+        ids.push_back(next_id);
+        table.add(next_id, make_addr(next_id));
+        ++next_id;
+    }
+    int64_t heap_used = test::heap_bytes() - heap_before + int64_t(table.malloc_usage());
+
+    std::mt19937_64 rng(connections); // NOLINT(cert-msc32-c,cert-msc51-cpp)
+    std::vector<uint64_t> keys(LOOKUPS);
+    for (uint64_t &key : keys) {
+        key = ids[rng() % ids.size()];
+    }
+    uint64_t checksum = 0;
+    Clock::time_point start = Clock::now();
+    for (uint64_t key : keys) {
+        checksum += table.get(key)->client_id;
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start);
+    EXPECT_NE(checksum, 0);
+
+    return {double(heap_used) / double(connections), elapsed.count() / LOOKUPS};
+}
+
+struct SlabTable {
+    VpnConnections connections;
+
+    void add(uint64_t id, TunnelAddressPair addr) {
+        VpnConnection *conn = connections.slab.make(id, std::move(addr), IPPROTO_TCP);
+        conn->server_id = id;
+        connections.by_client_id.put(id, conn);
+        connections.by_server_id.put(id, conn);
+    }
+    void remove(uint64_t id) {
+        VpnConnection *conn = connections.by_client_id.get(id);
+        connections.by_client_id.remove(id);
+        connections.by_server_id.remove(id);
+        connections.slab.destroy(conn);
+    }
+    [[nodiscard]] VpnConnection *get(uint64_t id) const {
+        return connections.by_client_id.get(id);
+    }
+    [[nodiscard]] static size_t malloc_usage() {
+        return 0;
+    }
+};
+
+struct BaselineTable {
+    khash_t(baseline_by_id) *by_client_id = kh_init(baseline_by_id);
+    khash_t(baseline_by_id) *by_server_id = kh_init(baseline_by_id);
+
+    BaselineTable() = default;
+    ~BaselineTable() {
+        for (khiter_t i = kh_begin(by_client_id); i != kh_end(by_client_id); ++i) {
+            if (kh_exist(by_client_id, i)) {
+                destroy(kh_value(by_client_id, i));
+            }
+        }
+        kh_destroy(baseline_by_id, by_client_id);
+        kh_destroy(baseline_by_id, by_server_id);
+    }
+    BaselineTable(const BaselineTable &) = delete;
+    BaselineTable &operator=(const BaselineTable &) = delete;
+    BaselineTable(BaselineTable &&) = delete;
+    BaselineTable &operator=(BaselineTable &&) = delete;
+
+    static void destroy(VpnConnection *conn) {
+        conn->~VpnConnection();
+        operator delete(conn);
+    }
+    void add(uint64_t id, TunnelAddressPair addr) {
+        VpnConnection *conn =
+                VpnConnection::make(operator new(VPN_CONNECTION_MAX_SIZE), id, std::move(addr), IPPROTO_TCP);
+        conn->server_id = id;
+        int r;
+        khiter_t i = kh_put(baseline_by_id, by_client_id, id, &r);
+        kh_value(by_client_id, i) = conn;
+        i = kh_put(baseline_by_id, by_server_id, id, &r);
+        kh_value(by_server_id, i) = conn;
+    }
+    void remove(uint64_t id) {
+        khiter_t i = kh_get(baseline_by_id, by_client_id, id);
+        VpnConnection *conn = kh_value(by_client_id, i);
+        kh_del(baseline_by_id, by_client_id, i);
+        kh_del(baseline_by_id, by_server_id, kh_get(baseline_by_id, by_server_id, id));
+        destroy(conn);
+    }
+    [[nodiscard]] VpnConnection *get(uint64_t id) const {
+        return kh_value(by_client_id, kh_get(baseline_by_id, by_client_id, id));
+    }
+    // The tables are allocated with `malloc()`, so they are not seen by the `operator new()` counter
+    [[nodiscard]] size_t malloc_usage() const {
+        auto table_size = [](const khash_t(baseline_by_id) *h) {
+            return h->n_buckets * (sizeof(*h->keys) + sizeof(*h->vals)) + (h->n_buckets / 16 + 1) * sizeof(*h->flags);
+        };
+        return table_size(by_client_id) + table_size(by_server_id);
+    }
+};
+
+class VpnConnectionTableBenchmark : public testing::TestWithParam<size_t> {};
+
+TEST_P(VpnConnectionTableBenchmark, MemoryAndLookup) {
+    size_t connections = GetParam();
+    TableStats baseline = measure<BaselineTable>(connections);
+    TableStats slab = measure<SlabTable>(connections);
+    printf("%zu connections: new+khash: %.0f bytes/connection, %.1f ns/lookup; "
+           "slab+index: %.0f bytes/connection, %.1f ns/lookup\n",
+            connections, baseline.bytes_per_connection, baseline.lookup_ns, slab.bytes_per_connection,
+            slab.lookup_ns);
+    // The connection objects themselves take the same space, so a slab can only save the allocator overhead
+    ASSERT_GT(slab.bytes_per_connection, double(VPN_CONNECTION_MAX_SIZE));
+}
+
+INSTANTIATE_TEST_SUITE_P(Connections, VpnConnectionTableBenchmark, testing::Values(10000, 100000));
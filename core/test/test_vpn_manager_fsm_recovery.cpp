@@ -104,6 +104,7 @@ struct ConnectingVpnManagerTest : MockedTest {
         case VPN_EVENT_PROTECT_SOCKET:
         case VPN_EVENT_VERIFY_CERTIFICATE:
         case VPN_EVENT_CLIENT_OUTPUT:
+        case VPN_EVENT_CLIENT_OUTPUT_BATCH:
         case VPN_EVENT_CONNECT_REQUEST:
         case VPN_EVENT_ENDPOINT_CONNECTION_STATS:
         case VPN_EVENT_DNS_UPSTREAM_UNAVAILABLE:
@@ -47,7 +47,8 @@ typedef struct {
 
 typedef struct {
     int stream_id;
-    size_t length; // if 0, then stream polls for send resuming
+    size_t length;         // if 0, then stream polls for send resuming
+    size_t pending_output; // bytes of the frame carrying the data to be raised in `HTTP_EVENT_OUTPUT` after this event
 } HttpDataSentEvent;
 
 typedef struct {
@@ -55,9 +56,18 @@ typedef struct {
     int error_code;
 } HttpGoawayEvent;
 
+/**
+ * Function releasing the data passed to `http_session_send_data_ref()` or referenced by `HttpOutputEvent`
+ */
+typedef void (*HttpDataCleanup)(const void *data, size_t len, void *arg);
+
 typedef struct {
     const uint8_t *data;
     size_t length;
+    // If set, the data may be referenced until `cleanup` is called instead of being copied.
+    // The handler must call it exactly once, as soon as the data is not needed anymore.
+    HttpDataCleanup cleanup;
+    void *cleanup_arg;
 } HttpOutputEvent;
 
 typedef struct {
@@ -70,8 +80,15 @@ typedef struct {
     HttpSessionHandler handler; // session events handler
     size_t stream_window_size;  // initial stream local window size
     HttpVersion version;        // protocol version
+    uint32_t min_window_size;   // lower bound of the adaptive receive window (HTTP/2, 0 means default)
+    uint32_t max_window_size;   // upper bound of the adaptive receive window (HTTP/2, 0 means default)
 } HttpSessionParams;
 
+typedef struct {
+    uint32_t rtt_us;           // round-trip time measured with PINGs (0 if not measured yet)
+    uint32_t recv_window_size; // current connection receive window
+} HttpSessionStats;
+
 typedef struct {
     union {
         Http1Session *h1;
@@ -137,6 +154,20 @@ int http_session_send_headers(HttpSession *session, int32_t stream_id, const Htt
  */
 int http_session_send_data(HttpSession *session, int32_t stream_id, const uint8_t *data, size_t len, bool eof);
 
+/**
+ * Send HTTP Data referencing it instead of copying, if the protocol version allows it.
+ * The data must stay valid until `cleanup` is called.
+ * @param session HTTP session
+ * @param stream_id Stream ID
+ * @param data Pointer to plain data to send
+ * @param len Length of data
+ * @param cleanup Called once the data is not needed anymore (including the case of error)
+ * @param arg Cleanup argument
+ * @return 0 if success
+ */
+int http_session_send_data_ref(HttpSession *session, int32_t stream_id, const uint8_t *data, size_t len,
+        HttpDataCleanup cleanup, void *arg);
+
 /**
  * Send HTTP/2 settings
  * @param session HTTP session
@@ -153,6 +184,15 @@ int http_session_send_settings(HttpSession *session);
  */
 int http_session_reset_stream(HttpSession *session, int32_t stream_id, int error_code);
 
+/**
+ * Set HTTP2 stream weight. The data of the streams is sent in proportion to their weights.
+ * @param session HTTP session
+ * @param stream_id Stream ID
+ * @param weight Stream weight (1-256)
+ * @return 0 if success
+ */
+int http_session_set_stream_weight(HttpSession *session, int32_t stream_id, int32_t weight);
+
 /**
  * Shutdown HTTP session with the following error code
  * @param session HTTP session
@@ -180,6 +220,12 @@ int http_session_data_consume(HttpSession *session, int32_t stream_id, size_t le
  */
 int http_session_set_recv_window(HttpSession *session, int32_t stream_id, size_t size);
 
+/**
+ * Get HTTP2 flow control statistics
+ * @param session HTTP session
+ */
+HttpSessionStats http_session_get_stats(const HttpSession *session);
+
 /**
  * Get number of bytes available to send through stream/session
  * @param session HTTP session
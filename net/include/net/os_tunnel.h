@@ -55,6 +55,12 @@ struct VpnOsTunnelSettings {
      *  instead of creating a new one. Requires `device_name` to be
      *  non-empty. Linux only. */
     bool use_existing;
+    /** Number of queues to open on the TUN device (`IFF_MULTI_QUEUE`).
+     *  0 or 1 means a single-queue device. Linux only. */
+    uint32_t queues_num;
+    /** Open the TUN device with `IFF_VNET_HDR` and enable segmentation offloads (`TUNSETOFFLOAD`),
+     *  so that the kernel exchanges GSO super-packets with the stack. Linux only. */
+    bool offload;
 };
 
 #ifdef _WIN32
@@ -221,10 +227,16 @@ public:
     void deinit() override;
     /** Get result of setup system DNS */
     bool get_system_dns_setup_success() const override;
+    /**
+     * Get descriptors of the queues opened in addition to `get_fd()` (empty for a single-queue device).
+     * They stay owned by the tunnel and are closed in `deinit()`.
+     */
+    std::vector<evutil_socket_t> get_queue_fds() const;
     ~VpnLinuxTunnel() override = default;
 
 private:
     evutil_socket_t tun_open();
+    void enable_offload(evutil_socket_t fd);
     void setup_if();
     void setup_dns();
     bool check_sport_rule_support();
@@ -232,6 +244,7 @@ private:
     void teardown_routes(int16_t table_id);
 
     evutil_socket_t m_tun_fd{-1};
+    std::vector<evutil_socket_t> m_queue_fds{};
     std::string m_tun_name{};
     bool m_sport_supported{false};
     std::string m_netns{};
@@ -136,6 +136,12 @@ bool tcp_socket_is_read_enabled(TcpSocket *socket);
  */
 size_t tcp_socket_available_to_write(const TcpSocket *socket);
 
+/**
+ * Get size of data waiting in write buffer
+ * @param socket socket
+ */
+size_t tcp_socket_get_write_queue_size(const TcpSocket *socket);
+
 /**
  * Send data via socket
  * @param socket socket
@@ -145,6 +151,24 @@ size_t tcp_socket_available_to_write(const TcpSocket *socket);
  */
 VpnError tcp_socket_write(TcpSocket *socket, const uint8_t *data, size_t length);
 
+/**
+ * Function releasing the data passed to `tcp_socket_write_ref()`
+ */
+typedef void (*TcpSocketDataCleanup)(const void *data, size_t length, void *arg);
+
+/**
+ * Send data via socket referencing it instead of copying into the write buffer.
+ * The data must stay valid until `cleanup` is called.
+ * @param socket socket
+ * @param data data to send
+ * @param length data length
+ * @param cleanup called once the data is not needed anymore (including the case of error)
+ * @param arg cleanup argument
+ * @return 0 in case of success, non-zero value otherwise
+ */
+VpnError tcp_socket_write_ref(
+        TcpSocket *socket, const uint8_t *data, size_t length, TcpSocketDataCleanup cleanup, void *arg);
+
 /**
  * Get underlying descriptor
  * @param socket socket
@@ -3,12 +3,14 @@
 #include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <iterator>
 #include <string>
 
 #include <event2/buffer.h>
 #include <nghttp2/nghttp2.h>
 
 #include "util.h"
+#include "vpn/utils.h"
 
 namespace ag {
 
@@ -21,23 +23,49 @@ static ag::Logger g_logger{"HTTP2"};
 #define DATA_QUEUE_CHUNK_SIZE 4096
 #define DATA_QUEUE_SIZE (10 * 1024 * 1024)
 
-// taken from CoreLibs
-static const uint32_t SESSION_LOCAL_WINDOW_SIZE = 8 * 1024 * 1024;
+// Bounds of the connection receive window if not specified in the session parameters
+static constexpr uint32_t DEFAULT_MIN_WINDOW_SIZE = 1024 * 1024;
+static constexpr uint32_t DEFAULT_MAX_WINDOW_SIZE = 32 * 1024 * 1024;
+// The window is grown if a sample of the bandwidth-delay product reaches this fraction of it
+static constexpr uint32_t WINDOW_GROW_THRESHOLD_NUM = 2;
+static constexpr uint32_t WINDOW_GROW_THRESHOLD_DEN = 3;
+// The window is shrunk if this many successive samples are less than a quarter of it
+static constexpr uint32_t WINDOW_SHRINK_SAMPLES_NUM = 4;
+// Minimum interval between the starts of two successive probes
+static constexpr int64_t WINDOW_PROBE_INTERVAL_NS = 100'000'000;
+// Opaque data of the PING frames sent to estimate the bandwidth-delay product
+static constexpr uint8_t WINDOW_PROBE_PAYLOAD[8] = {'B', 'D', 'P', 'P', 'R', 'O', 'B', 'E'};
+
+// Payload chunks of DATA frames at least this large are passed to the output by reference.
+// The smaller ones are copied, so that they are coalesced in the output buffer instead of being sent one by one.
+static constexpr size_t DATA_FRAME_REF_MIN_CHUNK_SIZE = 4096;
+static constexpr size_t FRAME_HEADER_SIZE = 9;
 
 typedef struct {
     struct evbuffer *buf;
+    size_t copied_len; // length of the data copied into the buffer (not added by reference) which is not sent yet
     bool has_eof : 1;
     bool scheduled : 1;
 } DataSource;
 
+// Payload of a DATA frame taken out of a data source. Lives until all the chunks referenced by the output are sent.
+typedef struct {
+    struct evbuffer *buf;
+    size_t refs;
+} FramePayload;
+
 static void on_end_headers(const nghttp2_frame *frame, HttpSession *session, HttpStream *stream);
 static void on_end_stream(HttpSession *session, HttpStream *stream);
 static DataSource *data_source_create();
 static nghttp2_data_provider data_source_provider(void *source);
 static ssize_t data_source_readcb(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
         uint32_t *data_flags, nghttp2_data_source *source, void *user_data);
+static int data_source_send_frame(nghttp2_session *ngsession, nghttp2_frame *frame, const uint8_t *framehd,
+        size_t length, nghttp2_data_source *source, void *user_data);
 static void data_source_free(DataSource *source);
 static int data_source_add(HttpStream *stream, const uint8_t *data, size_t len, bool eof);
+static int data_source_add_reference(
+        HttpStream *stream, const uint8_t *data, size_t len, HttpDataCleanup cleanup, void *arg);
 static int data_source_schedule_send(nghttp2_session *session, int32_t stream_id, DataSource *source);
 static void stream_destroy(HttpStream *stream);
 
@@ -137,6 +165,83 @@ static ssize_t on_send_callback(
     return static_cast<ssize_t>(length);
 }
 
+void http2_window_tuner_init(Http2WindowTuner *tuner, uint32_t min_window, uint32_t max_window) {
+    *tuner = {};
+    tuner->max_window = std::min((max_window != 0) ? max_window : DEFAULT_MAX_WINDOW_SIZE, uint32_t(INT32_MAX));
+    tuner->min_window = std::min((min_window != 0) ? min_window : DEFAULT_MIN_WINDOW_SIZE, tuner->max_window);
+    tuner->window = tuner->min_window;
+}
+
+bool http2_window_tuner_on_data(Http2WindowTuner *tuner, size_t length, int64_t now_ns) {
+    if (tuner->probe_sent_ns != 0) {
+        tuner->probe_bytes += length;
+        return false;
+    }
+    if (now_ns < tuner->next_probe_ns) {
+        return false;
+    }
+
+    // The data which triggered the probe was sent before it, so it does not count
+    tuner->probe_sent_ns = now_ns;
+    tuner->next_probe_ns = now_ns + WINDOW_PROBE_INTERVAL_NS;
+    tuner->probe_bytes = 0;
+    return true;
+}
+
+bool http2_window_tuner_on_probe_ack(Http2WindowTuner *tuner, int64_t now_ns) {
+    if (tuner->probe_sent_ns == 0) {
+        return false;
+    }
+
+    auto rtt_us = uint32_t(std::max(now_ns - tuner->probe_sent_ns, int64_t(0)) / 1000);
+    tuner->rtt_us = (tuner->rtt_us == 0) ? rtt_us : uint32_t((uint64_t(tuner->rtt_us) * 7 + rtt_us) / 8);
+    tuner->probe_sent_ns = 0;
+
+    // The bytes received during the round trip is the bandwidth-delay product, unless the window
+    // did not let the peer send more. In the latter case the window is doubled.
+    uint64_t bdp = tuner->probe_bytes;
+    uint32_t window = tuner->window;
+    if (bdp * WINDOW_GROW_THRESHOLD_DEN >= uint64_t(window) * WINDOW_GROW_THRESHOLD_NUM) {
+        tuner->small_samples = 0;
+        window = uint32_t(std::min(std::max(bdp * 2, uint64_t(window)), uint64_t(tuner->max_window)));
+    } else if (bdp * 4 >= window) {
+        tuner->small_samples = 0;
+    } else if (++tuner->small_samples >= WINDOW_SHRINK_SAMPLES_NUM) {
+        tuner->small_samples = 0;
+        window = uint32_t(std::max(std::max(bdp * 2, uint64_t(window / 2)), uint64_t(tuner->min_window)));
+    }
+
+    if (window == tuner->window) {
+        return false;
+    }
+    tuner->window = window;
+    return true;
+}
+
+// Apply the tuned connection window. The windows of the streams limited by the previous one are changed too.
+static void apply_recv_window(HttpSession *session, uint32_t old_window) {
+    Http2Session *h2_session = session->h2;
+    nghttp2_session *ngsession = h2_session->ngsession;
+    auto new_window = int32_t(h2_session->window_tuner.window);
+    log_sess(session, dbg, "Receive window: {} -> {} (RTT={}us)", old_window, new_window,
+            h2_session->window_tuner.rtt_us);
+
+    int r = nghttp2_session_set_local_window_size(ngsession, NGHTTP2_FLAG_NONE, 0, new_window);
+    for (khiter_t iter = kh_begin(h2_session->streams); r == 0 && iter != kh_end(h2_session->streams); ++iter) {
+        if (!kh_exist(h2_session->streams, iter)) {
+            continue;
+        }
+        int32_t stream_id = kh_value(h2_session->streams, iter)->id;
+        int32_t stream_window = nghttp2_session_get_stream_effective_local_window_size(ngsession, stream_id);
+        if (stream_window == int32_t(old_window) || stream_window > new_window) {
+            r = nghttp2_session_set_local_window_size(ngsession, NGHTTP2_FLAG_NONE, stream_id, new_window);
+        }
+    }
+    if (r != 0) {
+        log_sess(session, dbg, "Failed to set window: {} ({})", nghttp2_strerror(r), r);
+    }
+}
+
 static int on_frame_recv_callback(nghttp2_session *ngsession, const nghttp2_frame *frame, void *user_data) {
     auto *session = (HttpSession *) user_data;
     log_frsid(session, frame, trace, "(type={}, ngsession={})", frame->hd.type, (void *) ngsession);
@@ -235,6 +340,15 @@ static int on_frame_recv_callback(nghttp2_session *ngsession, const nghttp2_fram
             callbacks->handler(callbacks->arg, HTTP_EVENT_DATA_SENT, &event);
         }
 
+        break;
+    case NGHTTP2_PING:
+        if ((frame->hd.flags & NGHTTP2_FLAG_ACK)
+                && 0 == memcmp(frame->ping.opaque_data, WINDOW_PROBE_PAYLOAD, sizeof(WINDOW_PROBE_PAYLOAD))) {
+            uint32_t old_window = h2_session->window_tuner.window;
+            if (http2_window_tuner_on_probe_ack(&h2_session->window_tuner, get_time_monotonic_nanos())) {
+                apply_recv_window(session, old_window);
+            }
+        }
         break;
     default:
         // do nothing
@@ -320,6 +434,15 @@ static int on_data_chunk_recv_callback(nghttp2_session *ngsession, uint8_t flags
     Http2Session *h2_session = session->h2;
     int r = 0;
 
+    if (http2_window_tuner_on_data(&h2_session->window_tuner, len, get_time_monotonic_nanos())) {
+        r = nghttp2_submit_ping(ngsession, NGHTTP2_FLAG_NONE, WINDOW_PROBE_PAYLOAD);
+        if (r != 0) {
+            log_sid(session, stream_id, dbg, "Failed to submit PING: {} ({})", nghttp2_strerror(r), r);
+            h2_session->window_tuner.probe_sent_ns = 0;
+            r = 0;
+        }
+    }
+
     khiter_t iter = kh_get(h2_streams_ht, h2_session->streams, (khint32_t) stream_id);
     bool found = (iter != kh_end(h2_session->streams));
     if (found) {
@@ -436,6 +559,8 @@ Http2Session *http2_session_init(HttpSession *ctx) {
     nghttp2_session_callbacks_set_error_callback(ngcallbacks, error_callback);
     // output callback
     nghttp2_session_callbacks_set_send_callback(ngcallbacks, on_send_callback);
+    // DATA frames output callback
+    nghttp2_session_callbacks_set_send_data_callback(ngcallbacks, data_source_send_frame);
 
     // Session options
     nghttp2_option_new(&ngoption);
@@ -457,6 +582,7 @@ Http2Session *http2_session_init(HttpSession *ctx) {
     session = (Http2Session *) calloc(1, sizeof(Http2Session));
     session->ngsession = ngsession;
     session->streams = kh_init(h2_streams_ht);
+    http2_window_tuner_init(&session->window_tuner, ctx->params.min_window_size, ctx->params.max_window_size);
 
 finish:
     return session;
@@ -525,7 +651,8 @@ int http_session_send_settings(HttpSession *session) {
     }
 
     // Set window size for connection after sending SETTINGS to remote server
-    r = nghttp2_session_set_local_window_size(ngsession, NGHTTP2_FLAG_NONE, 0, SESSION_LOCAL_WINDOW_SIZE);
+    r = nghttp2_session_set_local_window_size(
+            ngsession, NGHTTP2_FLAG_NONE, 0, int32_t(session->h2->window_tuner.window));
     if (r != 0) {
         goto finish;
     }
@@ -617,6 +744,39 @@ finish:
     return rv;
 }
 
+int http2_session_send_data_ref(HttpSession *session, int32_t stream_id, const uint8_t *data, size_t len,
+        HttpDataCleanup cleanup, void *arg) {
+    log_sid(session, stream_id, trace, "len={}", len);
+
+    Http2Session *h2_session = session->h2;
+    nghttp2_session *ngsession = h2_session->ngsession;
+    HttpStream *stream;
+    int rv;
+
+    khiter_t iter = kh_get(h2_streams_ht, h2_session->streams, (khint32_t) stream_id);
+    bool found = (iter != kh_end(h2_session->streams));
+    if (!found) {
+        cleanup(data, len, arg);
+        rv = NGHTTP2_ERR_INVALID_STREAM_STATE;
+        goto finish;
+    }
+
+    stream = kh_value(h2_session->streams, iter);
+    rv = data_source_add_reference(stream, data, len, cleanup, arg);
+    if (rv != 0) {
+        goto finish;
+    }
+    rv = data_source_schedule_send(ngsession, stream_id, (DataSource *) stream->data_source);
+    if (rv != 0) {
+        goto finish;
+    }
+    rv = nghttp2_session_send(ngsession);
+
+finish:
+    log_sid(session, stream_id, trace, "returned {}", rv);
+    return rv;
+}
+
 int http_session_reset_stream(HttpSession *session, int32_t stream_id, int error_code) {
     log_sid(session, stream_id, trace, "error_code={}", error_code);
     nghttp2_session *ngsession = session->h2->ngsession;
@@ -631,6 +791,23 @@ finish:
     return r;
 }
 
+int http_session_set_stream_weight(HttpSession *session, int32_t stream_id, int32_t weight) {
+    log_sid(session, stream_id, trace, "weight={}", weight);
+    nghttp2_session *ngsession = session->h2->ngsession;
+    // The weight decides the share of the session the stream's data gets among its siblings
+    nghttp2_priority_spec pri_spec;
+    nghttp2_priority_spec_init(&pri_spec, 0, std::clamp(weight, NGHTTP2_MIN_WEIGHT, NGHTTP2_MAX_WEIGHT), 0);
+    int r = nghttp2_submit_priority(ngsession, NGHTTP2_FLAG_NONE, stream_id, &pri_spec);
+    if (r != 0) {
+        goto finish;
+    }
+    r = nghttp2_session_send(ngsession);
+
+finish:
+    log_sid(session, stream_id, trace, "returned {}", r);
+    return r;
+}
+
 int http_session_send_goaway(HttpSession *session, int last_stream_id, int error_code) {
     log_sess(session, trace, "error_code={}", error_code);
     nghttp2_session *ngsession = session->h2->ngsession;
@@ -735,12 +912,11 @@ int http_session_set_recv_window(http_session_t *session, int32_t stream_id, siz
 int http_session_set_recv_window(HttpSession *session, int32_t stream_id, size_t size) {
     nghttp2_session *ngsession = session->h2->ngsession;
 
-    static const int32_t MAX_STREAM_WINDOW_SIZE = 4 * 1024 * 1024;
-
-    // don't reduce window, but don't let it be more than `MAX_STREAM_WINDOW_SIZE`
+    // don't reduce window, but don't let it be more than the connection one
+    auto max_window = int32_t(session->h2->window_tuner.window);
     int32_t current_window = nghttp2_session_get_stream_effective_local_window_size(ngsession, stream_id);
     int32_t new_window =
-            std::min(std::max(current_window, size > INT32_MAX ? INT32_MAX : int32_t(size)), MAX_STREAM_WINDOW_SIZE);
+            std::min(std::max(current_window, size > INT32_MAX ? INT32_MAX : int32_t(size)), max_window);
     log_sid(session, stream_id, trace, "Requested={} current={} new={}", size, current_window, new_window);
 
     int r = nghttp2_session_set_local_window_size(ngsession, NGHTTP2_FLAG_NONE, stream_id, new_window);
@@ -781,37 +957,71 @@ static nghttp2_data_provider data_source_provider(void *source) {
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 #endif
 
+/**
+ * Get the length of the whole buffer chains at the beginning of the data source which fit in `length`
+ */
+static size_t data_source_whole_chains_length(const DataSource *ds, size_t length) {
+    struct evbuffer_iovec chunks[16];
+    int n = std::min(evbuffer_peek(ds->buf, ssize_t(length), nullptr, chunks, std::size(chunks)),
+            int(std::size(chunks)));
+    size_t whole = 0;
+    for (int i = 0; i < n && whole + chunks[i].iov_len <= length; ++i) {
+        whole += chunks[i].iov_len;
+    }
+    return whole;
+}
+
 /**
  * Data source read callback. Called by nghttp2 when it is ready to send data.
  * Returns data if it is in output buffer or ERR_DEFERRED if buffer is empty and no EOF flag set.
  * If ERR_DEFERRED is set, nghttp2_session_resume_data() is called on next http2_data_provider_write() call.
+ * If the frame can be made of the whole buffer chains, the data is left in the buffer to be passed
+ * to the output by `data_source_send_frame()`.
  */
 static ssize_t data_source_readcb(nghttp2_session *ngsession, int32_t stream_id, uint8_t *buf, size_t length,
         uint32_t *data_flags, nghttp2_data_source *source, void *user_data) {
     HttpSession *session = (HttpSession *) user_data;
     DataSource *ds = (DataSource *) source->ptr;
+    size_t available = evbuffer_get_length(ds->buf);
 
     // Pause and destroy data source if no work on current buffer.
-    if (!ds->has_eof && 0 == evbuffer_get_length(ds->buf)) {
+    if (!ds->has_eof && 0 == available) {
         log_sid(session, stream_id, trace, "no work on current buffer");
         return NGHTTP2_ERR_DEFERRED;
     }
 
-    ssize_t n = evbuffer_remove(ds->buf, buf, length);
-    log_sid(session, stream_id, trace, "{} bytes", n);
-    if (n < 0) {
-        return NGHTTP2_ERR_BUFFER_ERROR;
+    size_t n = std::min(length, available);
+    // Only the data added by reference is worth passing on as is. The copied data buffer would be
+    // just released later, which makes the allocator trim and fault in the heap memory over and over.
+    // A chain split by the frame boundary would have to be copied anyway, and a frame made of many
+    // small chains is better off being copied at once.
+    size_t whole = (ds->copied_len == 0) ? data_source_whole_chains_length(ds, n) : 0;
+    if (whole > 0 && whole >= n / 2) {
+        n = whole;
+        *data_flags |= NGHTTP2_DATA_FLAG_NO_COPY;
+        log_sid(session, stream_id, trace, "{} bytes to pass by reference", n);
+    } else {
+        int r = evbuffer_remove(ds->buf, buf, n);
+        log_sid(session, stream_id, trace, "{} bytes", r);
+        if (r < 0) {
+            return NGHTTP2_ERR_BUFFER_ERROR;
+        }
+        n = r;
+        ds->copied_len -= std::min(ds->copied_len, n);
     }
 
     // If eof, set flag and destroy data source
-    if (ds->has_eof && 0 == evbuffer_get_length(ds->buf)) {
+    if (ds->has_eof && n == available) {
         log_sid(session, stream_id, trace, "no data left in buffers -- set eof flag");
         *data_flags |= NGHTTP2_DATA_FLAG_EOF;
     }
 
-    HttpSessionHandler *callbacks = &session->params.handler;
-    HttpDataSentEvent event = {stream_id, (size_t) n};
-    callbacks->handler(callbacks->arg, HTTP_EVENT_DATA_SENT, &event);
+    if (!(*data_flags & NGHTTP2_DATA_FLAG_NO_COPY)) {
+        HttpSessionHandler *callbacks = &session->params.handler;
+        // The frame is output once nghttp2 gets it from this callback
+        HttpDataSentEvent event = {stream_id, n, FRAME_HEADER_SIZE + n};
+        callbacks->handler(callbacks->arg, HTTP_EVENT_DATA_SENT, &event);
+    }
 
     log_sid(session, stream_id, trace, "remote window size: session={} stream={}",
             (unsigned int) nghttp2_session_get_remote_window_size(ngsession),
@@ -820,7 +1030,72 @@ static ssize_t data_source_readcb(nghttp2_session *ngsession, int32_t stream_id,
             (unsigned int) nghttp2_session_get_local_window_size(ngsession),
             (unsigned int) nghttp2_session_get_stream_local_window_size(ngsession, stream_id));
 
-    return static_cast<ssize_t>(event.length);
+    return static_cast<ssize_t>(n);
+}
+
+static void frame_payload_release(const void *, size_t, void *arg) {
+    FramePayload *payload = (FramePayload *) arg;
+    if (--payload->refs == 0) {
+        evbuffer_free(payload->buf);
+        free(payload); // NOLINT(cppcoreguidelines-no-malloc,hicpp-no-malloc)
+    }
+}
+
+/**
+ * Data send callback. Called by nghttp2 to send a DATA frame prepared by `data_source_readcb()`.
+ * Passes the frame header and the payload to the output right from the data source buffer.
+ */
+static int data_source_send_frame(nghttp2_session *ngsession, nghttp2_frame *frame, const uint8_t *framehd,
+        size_t length, nghttp2_data_source *source, void *user_data) {
+    HttpSession *session = (HttpSession *) user_data;
+    DataSource *ds = (DataSource *) source->ptr;
+    int32_t stream_id = frame->hd.stream_id;
+    log_sid(session, stream_id, trace, "(ngsession={}, length={})", (void *) ngsession, length);
+    // Padding is never requested, so the payload goes right after the header
+    assert(frame->data.padlen == 0);
+
+    HttpSessionHandler *callbacks = &session->params.handler;
+    HttpOutputEvent output = {framehd, FRAME_HEADER_SIZE};
+    callbacks->handler(callbacks->arg, HTTP_EVENT_OUTPUT, &output);
+
+    // Moving the payload to a separate buffer lets the output keep referencing it after the data source is
+    // gone. The payload consists of whole chains, so they are moved as is.
+    static_assert(std::is_trivial_v<FramePayload>);
+    // NOLINTNEXTLINE(cppcoreguidelines-no-malloc,hicpp-no-malloc)
+    FramePayload *payload = (FramePayload *) calloc(1, sizeof(FramePayload));
+    payload->buf = evbuffer_new();
+    payload->refs = 1; // released once the payload is passed to the output
+    if (length != (size_t) evbuffer_remove_buffer(ds->buf, payload->buf, length)) {
+        log_sid(session, stream_id, err, "Failed to take {} bytes out of data source", length);
+        frame_payload_release(nullptr, 0, payload);
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+
+    struct evbuffer_ptr pos;
+    evbuffer_ptr_set(payload->buf, &pos, 0, EVBUFFER_PTR_SET);
+    for (size_t left = length; left > 0;) {
+        struct evbuffer_iovec chunks[8];
+        int n = std::min(evbuffer_peek(payload->buf, -1, &pos, chunks, std::size(chunks)), int(std::size(chunks)));
+        for (int i = 0; i < n; ++i) {
+            output = {(uint8_t *) chunks[i].iov_base, chunks[i].iov_len};
+            if (chunks[i].iov_len >= DATA_FRAME_REF_MIN_CHUNK_SIZE) {
+                output.cleanup = frame_payload_release;
+                output.cleanup_arg = payload;
+                ++payload->refs;
+            }
+            callbacks->handler(callbacks->arg, HTTP_EVENT_OUTPUT, &output);
+            evbuffer_ptr_set(payload->buf, &pos, chunks[i].iov_len, EVBUFFER_PTR_ADD);
+            left -= chunks[i].iov_len;
+        }
+    }
+    frame_payload_release(nullptr, 0, payload);
+
+    // Raised after the payload is taken out of the data source, as the handler may close the stream
+    HttpDataSentEvent event = {stream_id, length, 0};
+    callbacks->handler(callbacks->arg, HTTP_EVENT_DATA_SENT, &event);
+
+    log_sid(session, stream_id, trace, "returned 0");
+    return 0;
 }
 
 static int data_source_add(HttpStream *stream, const uint8_t *data, size_t len, bool eof) {
@@ -832,6 +1107,25 @@ static int data_source_add(HttpStream *stream, const uint8_t *data, size_t len,
     }
     source->has_eof |= eof;
     int rv = evbuffer_add(source->buf, data, len);
+    if (rv == 0) {
+        source->copied_len += len;
+    }
+    return rv;
+}
+
+static int data_source_add_reference(
+        HttpStream *stream, const uint8_t *data, size_t len, HttpDataCleanup cleanup, void *arg) {
+    DataSource *source = (DataSource *) stream->data_source;
+    if (source == nullptr) {
+        // Lazy init source
+        source = data_source_create();
+        stream->data_source = source;
+    }
+    // The chunk is released by the buffer once nghttp2 has read it out into a frame
+    int rv = evbuffer_add_reference(source->buf, data, len, cleanup, arg);
+    if (rv != 0) {
+        cleanup(data, len, arg);
+    }
     return rv;
 }
 
@@ -874,6 +1168,11 @@ static void stream_destroy(HttpStream *stream) {
     http_stream_destroy(stream);
 }
 
+HttpSessionStats http_session_get_stats(const HttpSession *session) {
+    const Http2WindowTuner *tuner = &session->h2->window_tuner;
+    return {tuner->rtt_us, tuner->window};
+}
+
 size_t http_session_available_to_write(HttpSession *session, int32_t stream_id) {
     int32_t r;
 
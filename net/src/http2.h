@@ -15,12 +15,50 @@ int http2_session_input(HttpSession *context, const uint8_t *data, size_t length
 int http2_session_close(HttpSession *context);
 int http2_session_send_headers(HttpSession *session, int32_t stream_id, const HttpHeaders *headers, bool eof);
 int http2_session_send_data(HttpSession *session, int32_t stream_id, const uint8_t *data, size_t len, bool eof);
+int http2_session_send_data_ref(HttpSession *session, int32_t stream_id, const uint8_t *data, size_t len,
+        HttpDataCleanup cleanup, void *arg);
+
+/**
+ * Sizes the connection receive window after the bandwidth-delay product of the connection.
+ * The product is estimated by sending a PING on incoming data and counting the bytes received until
+ * the PING is acknowledged.
+ */
+struct Http2WindowTuner {
+    uint32_t min_window;    // lower bound of the window
+    uint32_t max_window;    // upper bound of the window
+    uint32_t window;        // current window
+    uint32_t rtt_us;        // smoothed round-trip time of the probes (0 if not measured yet)
+    int64_t probe_sent_ns;  // time the probe in flight was sent at (0 if there is none)
+    int64_t next_probe_ns;  // a probe is not started before this time
+    uint64_t probe_bytes;   // number of bytes received since the probe in flight was sent
+    uint32_t small_samples; // number of successive samples much smaller than the window
+};
+
+/**
+ * Initialize the tuner
+ * @param min_window lower bound of the window (if 0, default value will be used)
+ * @param max_window upper bound of the window (if 0, default value will be used)
+ */
+void http2_window_tuner_init(Http2WindowTuner *tuner, uint32_t min_window, uint32_t max_window);
+
+/**
+ * Account incoming DATA
+ * @return true if a probe should be sent
+ */
+bool http2_window_tuner_on_data(Http2WindowTuner *tuner, size_t length, int64_t now_ns);
+
+/**
+ * Account the probe acknowledgement
+ * @return true if the window has changed
+ */
+bool http2_window_tuner_on_probe_ack(Http2WindowTuner *tuner, int64_t now_ns);
 
 KHASH_MAP_INIT_INT(h2_streams_ht, HttpStream *);
 
 struct Http2Session {
     nghttp2_session *ngsession;
     khash_t(h2_streams_ht) * streams;
+    Http2WindowTuner window_tuner;
 };
 
 } // namespace ag
@@ -105,4 +105,22 @@ int http_session_send_data(HttpSession *session, int32_t stream_id, const uint8_
     return -1;
 }
 
+int http_session_send_data_ref(HttpSession *session, int32_t stream_id, const uint8_t *data, size_t len,
+        HttpDataCleanup cleanup, void *arg) {
+    int r = -1;
+    switch (session->params.version) {
+    case HTTP_VER_1_1:
+        // The HTTP/1 codec frames the body into its own buffer anyway
+        r = http1_session_send_data(session, stream_id, data, len, false);
+        break;
+    case HTTP_VER_2_0:
+        return http2_session_send_data_ref(session, stream_id, data, len, cleanup, arg);
+    case HTTP_VER_3_0:
+        assert(0);
+        break;
+    }
+    cleanup(data, len, arg);
+    return r;
+}
+
 } // namespace ag
@@ -176,6 +176,8 @@ ag::VpnOsTunnelSettings *ag::vpn_os_tunnel_settings_clone(const ag::VpnOsTunnelS
     }
     dst->device_name = safe_strdup(settings->device_name);
     dst->use_existing = settings->use_existing;
+    dst->queues_num = settings->queues_num;
+    dst->offload = settings->offload;
     return dst;
 }
 
@@ -220,6 +222,8 @@ const ag::VpnOsTunnelSettings *ag::vpn_os_tunnel_settings_defaults() {
             .device_name = "",
 #endif
             .use_existing = false,
+            .queues_num = 1,
+            .offload = false,
     };
     return &settings;
 }
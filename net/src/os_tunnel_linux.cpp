@@ -2,6 +2,7 @@
 #include "net/os_tunnel.h"
 #include "vpn/utils.h"
 
+#include <algorithm>
 #include <cstring>
 #include <net/if.h> // should be included before linux/if.h
 
@@ -11,6 +12,14 @@
 
 static const ag::Logger logger("OS_TUNNEL_LINUX");
 
+// Since Linux 6.2
+#ifndef TUN_F_USO4
+#define TUN_F_USO4 0x20
+#endif
+#ifndef TUN_F_USO6
+#define TUN_F_USO6 0x40
+#endif
+
 static constexpr auto TABLE_ID = 880;
 static constexpr std::string_view PRIVILEGED_PORTS = "1-1024";
 static constexpr std::string_view VNC_PORTS = "5900-5920";
@@ -104,6 +113,9 @@ ag::VpnError ag::VpnLinuxTunnel::init(const ag::VpnOsTunnelSettings *settings, s
 
 void ag::VpnLinuxTunnel::deinit() {
     close(m_tun_fd);
+    for (evutil_socket_t fd : std::exchange(m_queue_fds, {})) {
+        close(fd);
+    }
     if (m_settings->included_routes.size > 0) {
         teardown_routes(TABLE_ID);
     }
@@ -114,6 +126,10 @@ evutil_socket_t ag::VpnLinuxTunnel::get_fd() {
     return m_tun_fd;
 }
 
+std::vector<evutil_socket_t> ag::VpnLinuxTunnel::get_queue_fds() const {
+    return m_queue_fds;
+}
+
 std::string ag::VpnLinuxTunnel::get_name() {
     return m_tun_name;
 }
@@ -142,31 +158,71 @@ evutil_socket_t ag::VpnLinuxTunnel::tun_open() {
         return -1;
     }
 
-    evutil_socket_t fd = open("/dev/net/tun", O_RDWR);
-    if (fd == -1) {
-        errlog(logger, "Failed to open /dev/net/tun: {}", strerror(errno));
-        return -1;
-    }
+    const uint32_t queues_num = std::max(m_settings->queues_num, 1u);
 
     struct ifreq ifr = {};
     ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    if (queues_num > 1) {
+        // An existing device must have been created with `multi_queue` too
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+    if (m_settings->offload) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
     if (has_name) {
         // Copy bounded by IFNAMSIZ - 1; kernel enforces max 15 chars.
         std::strncpy(ifr.ifr_name, requested_name, IFNAMSIZ - 1);
     }
 
-    if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
-        evutil_closesocket(fd);
-        errlog(logger, "ioctl TUNSETIFF failed: {}", strerror(errno));
+    // Every queue is attached by a separate open of the clone device. The first TUNSETIFF
+    // fills in the kernel-assigned name, so the rest attach to the same interface.
+    std::vector<evutil_socket_t> fds;
+    for (uint32_t i = 0; i < queues_num; ++i) {
+        evutil_socket_t fd = open("/dev/net/tun", O_RDWR);
+        if (fd == -1) {
+            errlog(logger, "Failed to open /dev/net/tun: {}", strerror(errno));
+            break;
+        }
+        if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+            evutil_closesocket(fd);
+            errlog(logger, "ioctl TUNSETIFF failed (queue {}): {}", i, strerror(errno));
+            break;
+        }
+        fds.push_back(fd);
+    }
+    if (fds.size() != queues_num) {
+        for (evutil_socket_t fd : fds) {
+            evutil_closesocket(fd);
+        }
         return -1;
     }
-    m_tun_fd = fd;
+
+    if (m_settings->offload) {
+        enable_offload(fds.front());
+    }
+
+    m_tun_fd = fds.front();
+    m_queue_fds.assign(std::next(fds.begin()), fds.end());
     m_tun_name = ifr.ifr_name;
     m_if_index = if_nametoindex(ifr.ifr_name);
 
-    infolog(logger, "Device {} {} (use_existing = {})", ifr.ifr_name, use_existing ? "attached" : "opened",
-            use_existing);
-    return fd;
+    infolog(logger, "Device {} {} (use_existing = {}, queues = {})", ifr.ifr_name,
+            use_existing ? "attached" : "opened", use_existing, queues_num);
+    return m_tun_fd;
+}
+
+void ag::VpnLinuxTunnel::enable_offload(evutil_socket_t fd) {
+    // Packets carry `virtio_net_hdr` anyway, so a failure here only means no super-packets
+    unsigned int offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_USO4 | TUN_F_USO6;
+    if (ioctl(fd, TUNSETOFFLOAD, offloads) == -1) {
+        dbglog(logger, "ioctl TUNSETOFFLOAD with UDP segmentation failed: {}", strerror(errno));
+        offloads &= ~(TUN_F_USO4 | TUN_F_USO6);
+        if (ioctl(fd, TUNSETOFFLOAD, offloads) == -1) {
+            warnlog(logger, "ioctl TUNSETOFFLOAD failed: {}", strerror(errno));
+            return;
+        }
+    }
+    infolog(logger, "Segmentation offload enabled (UDP = {})", (offloads & TUN_F_USO4) != 0);
 }
 
 void ag::VpnLinuxTunnel::setup_if() {
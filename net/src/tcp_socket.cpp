@@ -278,11 +278,30 @@ VpnError tcp_socket_write(TcpSocket *socket, const uint8_t *data, size_t length)
     return error;
 }
 
+VpnError tcp_socket_write_ref(
+        TcpSocket *socket, const uint8_t *data, size_t length, TcpSocketDataCleanup cleanup, void *arg) {
+    struct bufferevent *bev = socket->bev;
+
+    VpnError error = {evbuffer_add_reference(bufferevent_get_output(bev), data, length, cleanup, arg), ""};
+    if (error.code == 0) {
+        tcp_socket_update_timeout(socket);
+    } else {
+        cleanup(data, length, arg);
+        error = make_vpn_error_from_fd(bufferevent_getfd(bev));
+    }
+
+    return error;
+}
+
 size_t tcp_socket_available_to_write(const TcpSocket *socket) {
     size_t write_queue_size = evbuffer_get_length(bufferevent_get_output(socket->bev));
     return (write_queue_size <= MAX_WRITE_BUFFER_LEN) ? MAX_WRITE_BUFFER_LEN - write_queue_size : 0;
 }
 
+size_t tcp_socket_get_write_queue_size(const TcpSocket *socket) {
+    return evbuffer_get_length(bufferevent_get_output(socket->bev));
+}
+
 static void on_read(struct bufferevent *bev, void *ctx) {
     auto *socket = (TcpSocket *) ctx;
 
@@ -808,6 +827,7 @@ VpnConnectionStats tcp_socket_get_stats(const TcpSocket *socket) {
     if (r == 0) {
         stats.rtt_us = ti.tcpi_rtt;
         stats.packet_loss_ratio = (ti.tcpi_segs_out > 0) ? (double) ti.tcpi_lost / ti.tcpi_segs_out : 0;
+        stats.bytes_in_flight = ti.tcpi_unacked * ti.tcpi_snd_mss;
     } else {
         int err = evutil_socket_geterror(tcp_socket_get_fd(socket));
         log_sock(socket, dbg, "Failed to get TCP socket info from system: {} ({})", evutil_socket_error_to_string(err),
@@ -863,6 +883,8 @@ VpnConnectionStats tcp_socket_get_stats(const TcpSocket *socket) {
         stats.rtt_us = ti.tcpi_srtt * 1000;
         stats.packet_loss_ratio =
                 (ti.tcpi_txbytes > 0) ? (double) ti.tcpi_txretransmitbytes / (double) ti.tcpi_txbytes : 0;
+        // Includes the data not sent yet, the closest available estimate
+        stats.bytes_in_flight = ti.tcpi_snd_sbbytes;
     } else if (r < 0) {
         int err = evutil_socket_geterror(tcp_socket_get_fd(socket));
         log_sock(socket, dbg, "Failed to get TCP socket info from system: {} ({})", evutil_socket_error_to_string(err),
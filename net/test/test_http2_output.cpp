@@ -0,0 +1,419 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/util.h>
+#include <gtest/gtest.h>
+#include <nghttp2/nghttp2.h>
+
+#include "net/http_session.h"
+#include "vpn/platform.h"
+#include "vpn/utils.h"
+
+using namespace ag;
+
+static constexpr int32_t STREAM_ID = 1;
+static constexpr int32_t SERVER_WINDOW_SIZE = 16 * 1024 * 1024;
+
+/**
+ * Server side of an HTTP/2 connection which receives a single upload stream
+ */
+class StandInServer {
+public:
+    std::string received;
+    size_t received_size = 0;
+    bool end_stream = false;
+    bool keep_data = true;
+
+    StandInServer() {
+        nghttp2_session_callbacks *callbacks = nullptr;
+        nghttp2_session_callbacks_new(&callbacks);
+        nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks,
+                [](nghttp2_session *, uint8_t, int32_t, const uint8_t *data, size_t len, void *arg) {
+                    auto *self = (StandInServer *) arg;
+                    self->received_size += len;
+                    if (self->keep_data) {
+                        self->received.append((char *) data, len);
+                    }
+                    return 0;
+                });
+        nghttp2_session_callbacks_set_on_frame_recv_callback(
+                callbacks, [](nghttp2_session *, const nghttp2_frame *frame, void *arg) {
+                    auto *self = (StandInServer *) arg;
+                    self->end_stream |= frame->hd.stream_id == STREAM_ID && (frame->hd.flags & NGHTTP2_FLAG_END_STREAM);
+                    return 0;
+                });
+        nghttp2_session_server_new(&m_session, callbacks, this);
+        nghttp2_session_callbacks_del(callbacks);
+
+        nghttp2_settings_entry settings[] = {{NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, SERVER_WINDOW_SIZE}};
+        nghttp2_submit_settings(m_session, NGHTTP2_FLAG_NONE, settings, std::size(settings));
+        nghttp2_session_set_local_window_size(m_session, NGHTTP2_FLAG_NONE, 0, SERVER_WINDOW_SIZE);
+    }
+
+    ~StandInServer() {
+        nghttp2_session_del(m_session);
+    }
+
+    StandInServer(const StandInServer &) = delete;
+    StandInServer &operator=(const StandInServer &) = delete;
+    StandInServer(StandInServer &&) = delete;
+    StandInServer &operator=(StandInServer &&) = delete;
+
+    void input(const uint8_t *data, size_t length) {
+        ASSERT_EQ(length, nghttp2_session_mem_recv(m_session, data, length));
+    }
+
+    /** Get the next chunk of the server output, empty if there is nothing to send */
+    U8View output() {
+        const uint8_t *data = nullptr;
+        ssize_t r = nghttp2_session_mem_send(m_session, &data);
+        return {data, size_t(std::max(r, ssize_t(0)))};
+    }
+
+private:
+    nghttp2_session *m_session = nullptr;
+};
+
+static HttpHeaders make_request() {
+    HttpHeaders headers{};
+    headers.version = HTTP_VER_2_0;
+    headers.method = "POST";
+    headers.scheme = "https";
+    headers.authority = "localhost";
+    headers.path = "/upload";
+    return headers;
+}
+
+static std::string make_chunk(size_t size, size_t seed) {
+    std::string chunk(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+        chunk[i] = char((seed * 31 + i) % 251);
+    }
+    return chunk;
+}
+
+// NOLINTBEGIN(cppcoreguidelines-pro-type-member-init)
+class Http2OutputTest : public testing::Test {
+protected:
+    StandInServer server;
+    HttpSession *client = nullptr;
+    evbuffer *wire = nullptr; // client output which is not yet passed to the server
+    size_t sent = 0;
+    size_t released = 0;
+    std::vector<std::pair<int32_t, size_t>> sent_frames; // stream id and length of the sent data
+    size_t output_size = 0;
+    std::vector<size_t> output_ends; // output size after each output event
+    std::vector<size_t> frame_ends;  // output size the sent frames end at, as told by the data sent events
+
+    void SetUp() override {
+        wire = evbuffer_new();
+        HttpSessionParams params = {1, {on_client_event, this}, 64 * 1024, HTTP_VER_2_0};
+        client = http_session_open(&params);
+        ASSERT_NE(client, nullptr);
+        ASSERT_EQ(0, http_session_send_settings(client));
+        HttpHeaders request = make_request();
+        ASSERT_EQ(0, http_session_send_headers(client, STREAM_ID, &request, false));
+    }
+
+    void TearDown() override {
+        http_session_close(client);
+        evbuffer_free(wire);
+    }
+
+    static void on_client_event(void *arg, HttpEventId id, void *data) {
+        auto *self = (Http2OutputTest *) arg;
+        switch (id) {
+        case HTTP_EVENT_OUTPUT: {
+            const auto *event = (HttpOutputEvent *) data;
+            // Same as the TCP socket does
+            if (event->cleanup != nullptr) {
+                evbuffer_add_reference(self->wire, event->data, event->length, event->cleanup, event->cleanup_arg);
+            } else {
+                evbuffer_add(self->wire, event->data, event->length);
+            }
+            self->output_size += event->length;
+            self->output_ends.push_back(self->output_size);
+            break;
+        }
+        case HTTP_EVENT_DATA_SENT: {
+            const auto *event = (HttpDataSentEvent *) data;
+            self->sent += event->length;
+            if (event->length > 0) {
+                self->sent_frames.emplace_back(event->stream_id, event->length);
+                self->frame_ends.push_back(self->output_size + event->pending_output);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    static void on_released(const void *, size_t length, void *arg) {
+        ((Http2OutputTest *) arg)->released += length;
+    }
+
+    /** Exchange the data between the client and the server until both are idle */
+    void pump() {
+        for (bool progress = true; progress;) {
+            progress = false;
+            if (size_t length = evbuffer_get_length(wire); length > 0) {
+                server.input(evbuffer_pullup(wire, -1), length);
+                evbuffer_drain(wire, length);
+                progress = true;
+            }
+            for (U8View out = server.output(); !out.empty(); out = server.output()) {
+                ASSERT_EQ(out.size(), http_session_input(client, out.data(), out.size()));
+                progress = true;
+            }
+        }
+    }
+};
+// NOLINTEND(cppcoreguidelines-pro-type-member-init)
+
+TEST_F(Http2OutputTest, SendsDataByReference) {
+    // Not multiples of the frame size, so some chunks are split between frames
+    std::vector<std::string> chunks;
+    for (size_t i = 0; i < 64; ++i) {
+        chunks.emplace_back(make_chunk(10000, i));
+    }
+    std::string expected;
+    size_t referenced = 0;
+    for (const std::string &chunk : chunks) {
+        http_session_send_data_ref(
+                client, STREAM_ID, (uint8_t *) chunk.data(), chunk.size(), on_released, (Http2OutputTest *) this);
+        expected += chunk;
+        referenced += chunk.size();
+    }
+    std::string tail = make_chunk(100, 0);
+    http_session_send_data(client, STREAM_ID, (uint8_t *) tail.data(), tail.size(), true);
+    expected += tail;
+
+    // The sent data is still referenced by the output
+    ASSERT_GT(sent, 0);
+    ASSERT_LT(released, sent);
+
+    pump();
+    ASSERT_TRUE(server.end_stream);
+    ASSERT_EQ(server.received.size(), expected.size());
+    ASSERT_EQ(server.received, expected);
+    ASSERT_EQ(sent, expected.size());
+    ASSERT_EQ(released, referenced);
+}
+
+TEST_F(Http2OutputTest, SendsCopiedData) {
+    std::string expected;
+    for (size_t i = 0; i < 200; ++i) {
+        std::string chunk = make_chunk(1000 + i, i);
+        http_session_send_data(client, STREAM_ID, (uint8_t *) chunk.data(), chunk.size(), i == 199);
+        expected += chunk;
+        pump();
+    }
+    ASSERT_TRUE(server.end_stream);
+    ASSERT_EQ(server.received, expected);
+    ASSERT_EQ(sent, expected.size());
+}
+
+TEST_F(Http2OutputTest, TellsWhereSentFramesEnd) {
+    // Both the frames passed by reference and the copied ones
+    std::vector<std::string> referenced;
+    for (size_t i = 0; i < 8; ++i) {
+        const std::string &chunk = referenced.emplace_back(make_chunk(8000, i));
+        http_session_send_data_ref(
+                client, STREAM_ID, (uint8_t *) chunk.data(), chunk.size(), on_released, (Http2OutputTest *) this);
+    }
+    std::string copied = make_chunk(1000, 8);
+    http_session_send_data(client, STREAM_ID, (uint8_t *) copied.data(), copied.size(), true);
+
+    pump();
+    ASSERT_TRUE(server.end_stream);
+    ASSERT_EQ(sent, 8 * 8000 + copied.size());
+    ASSERT_GT(released, 0);
+    ASSERT_GT(frame_ends.size(), 1);
+    for (size_t end : frame_ends) {
+        ASSERT_NE(std::ranges::find(output_ends, end), output_ends.end()) << end;
+    }
+}
+
+TEST_F(Http2OutputTest, WeightedStreams) {
+    static constexpr int32_t HEAVY_STREAM_ID = STREAM_ID + 2;
+    static constexpr size_t UPLOAD_SIZE = 256 * 1024;
+    HttpHeaders request = make_request();
+    ASSERT_EQ(0, http_session_send_headers(client, HEAVY_STREAM_ID, &request, false));
+    ASSERT_EQ(0, http_session_set_stream_weight(client, STREAM_ID, 4));
+    ASSERT_EQ(0, http_session_set_stream_weight(client, HEAVY_STREAM_ID, 256));
+
+    // The first stream takes up the initial connection window before the second one has any data
+    std::string chunk = make_chunk(UPLOAD_SIZE, 0);
+    http_session_send_data(client, STREAM_ID, (uint8_t *) chunk.data(), chunk.size(), true);
+    http_session_send_data(client, HEAVY_STREAM_ID, (uint8_t *) chunk.data(), chunk.size(), true);
+    size_t sent_before_window_update = sent;
+
+    pump();
+    ASSERT_EQ(sent, 2 * UPLOAD_SIZE);
+
+    // Once the window is open, the heavier stream gets nearly all of it until it's done
+    size_t light_sent = 0;
+    size_t heavy_sent = 0;
+    for (auto [stream_id, length] : sent_frames) {
+        (stream_id == STREAM_ID ? light_sent : heavy_sent) += length;
+        if (heavy_sent == UPLOAD_SIZE) {
+            break;
+        }
+    }
+    ASSERT_EQ(heavy_sent, UPLOAD_SIZE);
+    ASSERT_LE(light_sent - sent_before_window_update, 32 * 1024);
+}
+
+/**
+ * Uploads data through a loopback TCP connection to a stand-in server running in a separate thread
+ */
+class Http2OutputBenchmark : public testing::TestWithParam<std::tuple<size_t, bool>> {
+protected:
+    static constexpr size_t TOTAL_SIZE = 64 * 1024 * 1024;
+    static constexpr size_t QUEUE_LIMIT = 1024 * 1024;
+
+    HttpSession *client = nullptr;
+    bufferevent *bev = nullptr;
+    std::string chunk;
+    bool by_reference = false;
+    size_t pushed = 0;
+    size_t sent = 0;
+
+    static void on_client_event(void *arg, HttpEventId id, void *data) {
+        auto *self = (Http2OutputBenchmark *) arg;
+        switch (id) {
+        case HTTP_EVENT_OUTPUT: {
+            const auto *event = (HttpOutputEvent *) data;
+            if (event->cleanup != nullptr) {
+                evbuffer_add_reference(bufferevent_get_output(self->bev), event->data, event->length,
+                        event->cleanup, event->cleanup_arg);
+            } else {
+                bufferevent_write(self->bev, event->data, event->length);
+            }
+            break;
+        }
+        case HTTP_EVENT_DATA_SENT:
+            self->sent += ((HttpDataSentEvent *) data)->length;
+            break;
+        default:
+            break;
+        }
+    }
+
+    void top_up() {
+        while (pushed < TOTAL_SIZE && pushed - sent < QUEUE_LIMIT) {
+            size_t length = std::min(chunk.size(), TOTAL_SIZE - pushed);
+            bool eof = pushed + length == TOTAL_SIZE;
+            pushed += length;
+            if (by_reference) {
+                http_session_send_data_ref(
+                        client, STREAM_ID, (uint8_t *) chunk.data(), length, [](const void *, size_t, void *) {},
+                        nullptr);
+                if (eof) {
+                    http_session_send_data(client, STREAM_ID, nullptr, 0, true);
+                }
+            } else {
+                http_session_send_data(client, STREAM_ID, (uint8_t *) chunk.data(), length, eof);
+            }
+        }
+    }
+
+    static void on_read(bufferevent *bev, void *arg) {
+        auto *self = (Http2OutputBenchmark *) arg;
+        evbuffer *input = bufferevent_get_input(bev);
+        size_t length = evbuffer_get_length(input);
+        http_session_input(self->client, evbuffer_pullup(input, -1), length);
+        evbuffer_drain(input, length);
+        self->top_up();
+    }
+
+    static void on_write(bufferevent *, void *arg) {
+        ((Http2OutputBenchmark *) arg)->top_up();
+    }
+
+    static void on_event(bufferevent *bev, short what, void *) {
+        if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+            event_base_loopbreak(bufferevent_get_base(bev));
+        }
+    }
+
+    static void serve(evutil_socket_t listener, size_t *received) {
+        evutil_socket_t fd = accept(listener, nullptr, nullptr);
+        ASSERT_GE(fd, 0);
+        StandInServer server;
+        server.keep_data = false;
+        std::vector<uint8_t> buffer(256 * 1024);
+        while (!server.end_stream) {
+            for (U8View out = server.output(); !out.empty(); out = server.output()) {
+                while (!out.empty()) {
+                    ssize_t r = send(fd, (char *) out.data(), out.size(), 0);
+                    ASSERT_GT(r, 0);
+                    out.remove_prefix(r);
+                }
+            }
+            ssize_t r = recv(fd, (char *) buffer.data(), buffer.size(), 0);
+            if (r <= 0) {
+                break;
+            }
+            server.input(buffer.data(), r);
+        }
+        *received = server.received_size;
+        evutil_closesocket(fd);
+    }
+};
+
+TEST_P(Http2OutputBenchmark, Throughput) {
+    auto [chunk_size, reference] = GetParam();
+    chunk = make_chunk(chunk_size, 0);
+    by_reference = reference;
+
+    evutil_socket_t listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(0, bind(listener, (sockaddr *) &addr, sizeof(addr)));
+    ASSERT_EQ(0, listen(listener, 1));
+    ev_socklen_t addr_len = sizeof(addr);
+    ASSERT_EQ(0, getsockname(listener, (sockaddr *) &addr, &addr_len));
+    size_t received = 0;
+    std::thread server_thread(serve, listener, &received);
+
+    event_base *base = event_base_new();
+    bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+    ASSERT_EQ(0, bufferevent_socket_connect(bev, (sockaddr *) &addr, sizeof(addr)));
+    bufferevent_setcb(bev, on_read, on_write, on_event, this);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+
+    HttpSessionParams params = {1, {on_client_event, this}, 64 * 1024, HTTP_VER_2_0};
+    client = http_session_open(&params);
+    ASSERT_NE(client, nullptr);
+    http_session_send_settings(client);
+    HttpHeaders request = make_request();
+    http_session_send_headers(client, STREAM_ID, &request, false);
+
+    auto start = std::chrono::steady_clock::now();
+    top_up();
+    event_base_dispatch(base);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    server_thread.join();
+
+    http_session_close(client);
+    bufferevent_free(bev);
+    event_base_free(base);
+    evutil_closesocket(listener);
+
+    ASSERT_EQ(received, TOTAL_SIZE);
+    printf("%zu byte chunks %s: %.0f MB/s\n", chunk_size, by_reference ? "by reference" : "copied",
+            double(TOTAL_SIZE) / seconds / 1e6);
+}
+
+INSTANTIATE_TEST_SUITE_P(Chunks, Http2OutputBenchmark,
+        testing::Combine(testing::Values(1400, 16 * 1024, 64 * 1024), testing::Bool()));
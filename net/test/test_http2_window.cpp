@@ -0,0 +1,118 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+
+#include "http2.h"
+
+using namespace ag;
+
+static constexpr uint32_t MIN_WINDOW = 64 * 1024;
+static constexpr uint32_t MAX_WINDOW = 4 * 1024 * 1024;
+static constexpr int64_t MS = 1'000'000;
+
+class Http2WindowTunerTest : public testing::Test {
+protected:
+    Http2WindowTuner tuner{};
+    int64_t now_ns = 1000 * MS;
+
+    void SetUp() override {
+        http2_window_tuner_init(&tuner, MIN_WINDOW, MAX_WINDOW);
+    }
+
+    /** Receive `bytes` during a probe round trip of `rtt_ms` and return whether the window has changed */
+    bool round_trip(uint64_t bytes, int64_t rtt_ms) {
+        now_ns += 200 * MS;
+        EXPECT_TRUE(http2_window_tuner_on_data(&tuner, 1000, now_ns));
+        http2_window_tuner_on_data(&tuner, bytes, now_ns + rtt_ms * MS / 2);
+        now_ns += rtt_ms * MS;
+        return http2_window_tuner_on_probe_ack(&tuner, now_ns);
+    }
+};
+
+TEST_F(Http2WindowTunerTest, Defaults) {
+    http2_window_tuner_init(&tuner, 0, 0);
+    ASSERT_GT(tuner.min_window, 0U);
+    ASSERT_GE(tuner.max_window, tuner.min_window);
+    ASSERT_EQ(tuner.window, tuner.min_window);
+
+    // The lower bound does not exceed the upper one
+    http2_window_tuner_init(&tuner, MAX_WINDOW, MIN_WINDOW);
+    ASSERT_EQ(tuner.min_window, MIN_WINDOW);
+    ASSERT_EQ(tuner.window, MIN_WINDOW);
+}
+
+TEST_F(Http2WindowTunerTest, OneProbeInFlight) {
+    ASSERT_TRUE(http2_window_tuner_on_data(&tuner, 1000, now_ns));
+    ASSERT_FALSE(http2_window_tuner_on_data(&tuner, 1000, now_ns + 300 * MS));
+    ASSERT_EQ(tuner.probe_bytes, 1000U);
+
+    // An ack without a probe is ignored
+    ASSERT_FALSE(http2_window_tuner_on_probe_ack(&tuner, now_ns + 300 * MS));
+    ASSERT_FALSE(http2_window_tuner_on_probe_ack(&tuner, now_ns + 400 * MS));
+    ASSERT_EQ(tuner.rtt_us, 300'000U);
+
+    // Next probe is started right away as the interval has passed
+    ASSERT_TRUE(http2_window_tuner_on_data(&tuner, 1000, now_ns + 400 * MS));
+}
+
+TEST_F(Http2WindowTunerTest, ProbesAreSpaced) {
+    ASSERT_TRUE(http2_window_tuner_on_data(&tuner, 1000, now_ns));
+    http2_window_tuner_on_probe_ack(&tuner, now_ns + 1 * MS);
+    ASSERT_FALSE(http2_window_tuner_on_data(&tuner, 1000, now_ns + 2 * MS));
+    ASSERT_TRUE(http2_window_tuner_on_data(&tuner, 1000, now_ns + 100 * MS));
+}
+
+TEST_F(Http2WindowTunerTest, GrowsWhenWindowLimited) {
+    // A fast long-haul link: the peer sends as much as the window allows on each round trip
+    while (tuner.window < MAX_WINDOW) {
+        uint32_t window = tuner.window;
+        ASSERT_TRUE(round_trip(window, 200));
+        ASSERT_EQ(tuner.window, std::min(2 * window, MAX_WINDOW));
+    }
+    ASSERT_FALSE(round_trip(MAX_WINDOW, 200));
+    ASSERT_EQ(tuner.window, MAX_WINDOW);
+    ASSERT_EQ(tuner.rtt_us, 200'000U);
+}
+
+TEST_F(Http2WindowTunerTest, StaysOnSteadyBdp) {
+    ASSERT_TRUE(round_trip(MIN_WINDOW, 50));
+    ASSERT_TRUE(round_trip(2 * MIN_WINDOW, 50));
+    ASSERT_EQ(tuner.window, 4 * MIN_WINDOW);
+
+    // The samples are under the growth threshold but not small enough to shrink
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_FALSE(round_trip(2 * MIN_WINDOW, 50));
+    }
+    ASSERT_EQ(tuner.window, 4 * MIN_WINDOW);
+}
+
+TEST_F(Http2WindowTunerTest, ShrinksWhenMostlyUnused) {
+    while (tuner.window < MAX_WINDOW) {
+        round_trip(tuner.window, 100);
+    }
+
+    // A single small sample is not enough
+    ASSERT_FALSE(round_trip(1000, 100));
+    ASSERT_FALSE(round_trip(MAX_WINDOW / 2, 100));
+
+    uint32_t shrinks = 0;
+    for (int i = 0; i < 100 && tuner.window > MIN_WINDOW; ++i) {
+        uint32_t window = tuner.window;
+        if (round_trip(1000, 100)) {
+            ++shrinks;
+            ASSERT_EQ(tuner.window, std::max(window / 2, MIN_WINDOW));
+        }
+    }
+    ASSERT_EQ(tuner.window, MIN_WINDOW);
+    ASSERT_EQ(shrinks, 6U);
+
+    ASSERT_FALSE(round_trip(0, 100));
+    ASSERT_EQ(tuner.window, MIN_WINDOW);
+}
+
+TEST_F(Http2WindowTunerTest, SmoothsRtt) {
+    round_trip(0, 100);
+    ASSERT_EQ(tuner.rtt_us, 100'000U);
+    round_trip(0, 180);
+    ASSERT_EQ(tuner.rtt_us, 110'000U);
+}
@@ -202,17 +202,25 @@ static void NSData_VpnPacket_destructor(void *arg, uint8_t *) {
                     ? 0
                     : -1;
             },
-            .client_output_handler = [self](ag::VpnClientOutputEvent *event) {
+            .client_output_batch_handler = [self](ag::VpnClientOutputBatchEvent *event) {
                 @autoreleasepool {
-                    size_t length = 0;
-                    for (size_t i = 0; i < event->packet.chunks_num; ++i) {
-                        length += event->packet.chunks[i].iov_len;
+                    NSMutableArray<NSData *> *packets = [NSMutableArray arrayWithCapacity:event->packets_num];
+                    NSMutableArray<NSNumber *> *protocols = [NSMutableArray arrayWithCapacity:event->packets_num];
+                    for (size_t i = 0; i < event->packets_num; ++i) {
+                        const ag::VpnClientOutputEvent *output = &event->packets[i];
+                        size_t length = 0;
+                        for (size_t j = 0; j < output->packet.chunks_num; ++j) {
+                            length += output->packet.chunks[j].iov_len;
+                        }
+                        NSMutableData *packet = [[NSMutableData alloc] initWithCapacity:length];
+                        for (size_t j = 0; j < output->packet.chunks_num; ++j) {
+                            [packet appendBytes:output->packet.chunks[j].iov_base
+                                         length:output->packet.chunks[j].iov_len];
+                        }
+                        [packets addObject:packet];
+                        [protocols addObject:@(output->family)];
                     }
-                    NSMutableData *packet = [[NSMutableData alloc] initWithCapacity:length];
-                    for (size_t i = 0; i < event->packet.chunks_num; ++i) {
-                        [packet appendBytes:event->packet.chunks[i].iov_base length:event->packet.chunks[i].iov_len];
-                    }
-                    [self->_tunnelFlow writePackets:@[packet] withProtocols:@[@(event->family)]];
+                    [self->_tunnelFlow writePackets:packets withProtocols:protocols];
                 }
             },
             .state_changed_handler = [stateChangeHandler](ag::VpnStateChangedEvent *event) {
@@ -28,6 +28,15 @@ namespace ag {
 
 #define TCPIP_UDP_TIMEOUT_S (5 * 60) // 5 minutes
 
+// Receive window a TCP connection starts with and falls back to when idle or draining slowly
+#define TCPIP_TCP_MIN_RECV_WND (64 * 1024)
+// Largest receive window of a TCP connection, as the window scale option allows (about 1 MB)
+#define TCPIP_TCP_MAX_RECV_WND (0xffff << 4)
+// Default limit of the sum of receive windows of all TCP connections
+#define TCPIP_DEFAULT_TCP_RECV_BUF_BUDGET (32 * 1024 * 1024)
+// Default size of the packet capture buffer
+#define TCPIP_DEFAULT_PCAP_BUFFER_SIZE (8 * 1024 * 1024)
+
 typedef struct TcpipCtx TcpipCtx;
 
 /**
@@ -67,13 +76,26 @@ typedef struct {
     int proto;                /**< connection protocol */
     const SocketAddress *src; /**< source address of connection */
     const SocketAddress *dst; /**< destination address of connection */
+    uint8_t dscp;             /**< DSCP of the packet initiated the connection (0 if unknown) */
 } TcpipConnectRequestEvent;
 
+/**
+ * Reference-counted storage of the data raised with `TCPIP_EVENT_READ` or `TCPIP_EVENT_TUN_OUTPUT`.
+ * Taking a reference lets the data be used after the callback returns instead of copying it.
+ * Must be used on the event loop thread only.
+ */
+typedef struct TcpipBuffer TcpipBuffer;
+
 typedef struct {
     uint64_t id;                      /**< generated identifier of request for connection */
     size_t iovlen;                    /**< message vector size */
     const struct evbuffer_iovec *iov; /**< message vector */
     int result; /**< operation result - filled by caller: >= 0 if successful, negative otherwise */
+    /**
+     * Storage of the first chunk of the message vector (NULL if it can't be referenced).
+     * Each chunk has its own storage, see `tcpip_buffer_next()`.
+     */
+    TcpipBuffer *buffer;
 } TcpipReadEvent;
 
 typedef struct {
@@ -93,6 +115,8 @@ typedef struct {
         size_t chunks_num;                   /**< message vector size */
         const struct evbuffer_iovec *chunks; /**< message vector */
     } packet;                                /**< note, that it's a single packet which should be sent in one piece */
+    TcpipBuffer *buffer; /**< storage of the packet (NULL if it can't be referenced, then the chunks are valid
+                              only during the call) */
 } TcpipTunOutputEvent;
 
 /**
@@ -104,16 +128,117 @@ typedef struct {
     void *arg;                                             /**< User-provided argument */
 } TcpipHandler;
 
+/**
+ * Usage statistics of a memory pool backing the TCP/IP stack
+ */
+typedef struct {
+    const char *name;    /**< LWIP object type or pbuf size class, "HEAP" for allocations not fitting any pool */
+    size_t element_size; /**< Element size in bytes (0 for the heap) */
+    size_t used;         /**< Number of elements in use */
+    size_t high_water;   /**< Maximum number of elements in use at once */
+    size_t chunks;       /**< Number of chunks currently mapped from the OS */
+    size_t chunk_size;   /**< Size of a chunk in bytes (0 for the heap) */
+    uint64_t allocs;     /**< Total number of allocations */
+} TcpipMemPoolStats;
+
+/**
+ * Connection table statistics
+ */
+typedef struct {
+    const char *name;         /**< Table name ("TCP", "UDP" or "ICMP") */
+    size_t size;              /**< Number of flows in the table */
+    size_t capacity;          /**< Number of slots */
+    size_t tombstones;        /**< Number of slots of removed flows not yet reclaimed */
+    double load_factor;       /**< `size / capacity` */
+    double mean_probe_length; /**< Average number of slots inspected by a lookup */
+    size_t max_displacement;  /**< Maximum distance of a flow from its home slot */
+    size_t memory_size;       /**< Memory taken by the table in bytes */
+    uint64_t lookups;         /**< Total number of lookups */
+} TcpipFlowTableStats;
+
+/**
+ * I/O backend for TUN device
+ */
+typedef enum {
+    TCPIP_TUN_IO_SYSCALL, /**< A `read()` and a `writev()` per packet */
+    /**
+     * io_uring with a ring of pre-posted reads and writes batched per event loop iteration (Linux only).
+     * Falls back to `TCPIP_TUN_IO_SYSCALL` if io_uring is not available.
+     */
+    TCPIP_TUN_IO_URING,
+} TcpipTunIoBackend;
+
+/**
+ * Packet capture filter. A packet is captured if it matches every set field, the endpoints
+ * are matched in either direction.
+ */
+typedef struct {
+    uint8_t proto;            /**< IP protocol number (0 matches any) */
+    SocketAddress endpoint_a; /**< One endpoint of the flow (unset address or zero port matches any) */
+    SocketAddress endpoint_b; /**< The other endpoint of the flow (unset address or zero port matches any) */
+} TcpipPcapFilter;
+
+/**
+ * Packet capture settings. Packets are copied into a buffer on the event loop thread
+ * and written out by a background thread, so a slow disk costs dropped packets, not throughput.
+ */
+typedef struct {
+    uint32_t snaplen;   /**< Maximum number of bytes saved per packet (if 0, whole packets are saved) */
+    size_t buffer_size; /**< Capture buffer size in bytes (if 0, `TCPIP_DEFAULT_PCAP_BUFFER_SIZE` is used) */
+    /**
+     * Keep only the most recent `buffer_size` bytes of packets in memory instead of writing
+     * them to `pcap_filename`. The buffer is saved with `tcpip_dump_pcap`.
+     */
+    bool rolling;
+    TcpipPcapFilter filter; /**< Only the matching packets are captured */
+} TcpipPcapParameters;
+
+/**
+ * Packet capture statistics
+ */
+typedef struct {
+    uint64_t packets;  /**< Number of captured packets */
+    uint64_t bytes;    /**< Number of captured bytes (after truncation to `snaplen`) */
+    uint64_t dropped;  /**< Number of packets dropped because the writer could not keep up */
+    uint64_t filtered; /**< Number of packets not matching the filter */
+    uint64_t evicted;  /**< Number of packets evicted from the rolling buffer */
+} TcpipPcapStats;
+
 /**
  * This structure holds TCP/IP stack configuration parameters
  */
 typedef struct {
     evutil_socket_t tun_fd; /**< File descriptor of TUN device */
+    /**
+     * Additional queues of a multi-queue TUN device (Linux `IFF_MULTI_QUEUE`). They are serviced
+     * together with `tun_fd`. Unlike `tun_fd`, they are not closed by the stack: the caller must keep
+     * them open until `tcpip_close` and close them afterwards. Ignored if `tun_fd` is -1.
+     */
+    AG_ARRAY_OF(const evutil_socket_t) tun_queue_fds;
+    /**
+     * TUN descriptors were opened with `IFF_VNET_HDR` (Linux only): every packet is preceded
+     * by `virtio_net_hdr`, and the kernel may exchange GSO super-packets with the stack if
+     * `TUNSETOFFLOAD` succeeded.
+     */
+    bool tun_offload;
+    TcpipTunIoBackend tun_io_backend; /**< I/O backend for TUN device. Ignored if `tun_fd` is -1. */
     VpnEventLoop *event_loop;
-    uint32_t mtu_size;          /**< Maximum transfer unit for TCP protocol (if 0 `DEFAULT_MTU_SIZE` will be used) */
-    uint32_t tcp_recv_buf_size; /**< TCP receive window size in bytes (if 0, compile-time default is used) */
+    uint32_t mtu_size; /**< Maximum transfer unit for TCP protocol (if 0 `DEFAULT_MTU_SIZE` will be used) */
+    /**
+     * Maximum TCP receive window of a connection in bytes (if 0 or above, `TCPIP_TCP_MAX_RECV_WND`).
+     * A window starts at `TCPIP_TCP_MIN_RECV_WND` and grows while the data is consumed fast enough.
+     * If the client does not support the window scale option, the window is fixed at this size
+     * but not above 64 KB.
+     */
+    uint32_t tcp_recv_buf_size;
+    /**
+     * Limit of the sum of TCP receive windows of all connections in bytes
+     * (if 0, `TCPIP_DEFAULT_TCP_RECV_BUF_BUDGET` is used)
+     */
+    uint32_t tcp_recv_buf_budget;
     uint32_t tcp_send_buf_size; /**< TCP send buffer size in bytes (if 0, compile-time default is used) */
-    const char *pcap_filename;  /**< Pcap file name */
+    const char *pcap_filename;  /**< Pcap file name (packets are not captured if NULL and `pcap.rolling` is unset) */
+    TcpipPcapParameters pcap;   /**< Packet capture settings */
     TcpipHandler handler;       /**< callbacks structure for TCP connection (@see tcpip_callbacks_t) */
 } TcpipParameters;
 
@@ -199,6 +324,45 @@ void tcpip_close_connection(TcpipCtx *ctx, uint64_t id, bool graceful);
  */
 TcpFlowCtrlInfo tcpip_flow_ctrl_info(const TcpipCtx *ctx, uint64_t id);
 
+/**
+ * Get usage statistics of the memory pools backing the TCP/IP stack.
+ * The pools are shared by all the stack instances, like LWIP itself.
+ * Must be called from the event loop thread.
+ *
+ * @param ctx context of TCP/IP stack
+ * @param stats (out) statistics of each pool
+ * @param max_num capacity of `stats`
+ * @return number of pools (if greater than `max_num`, only the first `max_num` entries were filled in)
+ */
+size_t tcpip_get_mem_pool_stats(const TcpipCtx *ctx, TcpipMemPoolStats *stats, size_t max_num);
+
+/**
+ * Get statistics of the connection tables
+ * @param ctx context of TCP/IP stack
+ * @param stats (out) statistics of each table
+ * @param max_num capacity of `stats`
+ * @return number of tables (if greater than `max_num`, only the first `max_num` entries were filled in)
+ */
+size_t tcpip_get_flow_table_stats(const TcpipCtx *ctx, TcpipFlowTableStats *stats, size_t max_num);
+
+/**
+ * Save the packets held in the rolling capture buffer to a pcap file.
+ * Must be called from the event loop thread.
+ *
+ * @param ctx context of TCP/IP stack
+ * @param filename name of the output file
+ * @return true if successful, false if the rolling capture is off or the file could not be written
+ */
+bool tcpip_dump_pcap(TcpipCtx *ctx, const char *filename);
+
+/**
+ * Get packet capture statistics
+ * @param ctx context of TCP/IP stack
+ * @param stats (out) the statistics
+ * @return false if the capture is off
+ */
+bool tcpip_get_pcap_stats(const TcpipCtx *ctx, TcpipPcapStats *stats);
+
 /**
  * Process ICMP echo reply
  * @param ctx context of TCP/IP stack
@@ -206,4 +370,23 @@ TcpFlowCtrlInfo tcpip_flow_ctrl_info(const TcpipCtx *ctx, uint64_t id);
  */
 void tcpip_process_icmp_echo_reply(TcpipCtx *ctx, const IcmpEchoReply *reply);
 
+/**
+ * Take a reference to the storage of received data
+ * @param buffer the storage (see `TcpipReadEvent::buffer` and `TcpipTunOutputEvent::buffer`)
+ */
+void tcpip_buffer_ref(TcpipBuffer *buffer);
+
+/**
+ * Release a reference taken with `tcpip_buffer_ref()`
+ * @param buffer the storage
+ */
+void tcpip_buffer_unref(TcpipBuffer *buffer);
+
+/**
+ * Get the storage of the next chunk of a message vector raised with `TCPIP_EVENT_READ`
+ * @param buffer the storage of the current chunk
+ * @return the storage, or NULL if the chunk is the last one
+ */
+TcpipBuffer *tcpip_buffer_next(TcpipBuffer *buffer);
+
 } // namespace ag
@@ -0,0 +1,317 @@
+#include "flow_table.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+namespace ag {
+
+static constexpr size_t MIN_CAPACITY = 16;
+static constexpr size_t NPOS = SIZE_MAX;
+static constexpr uint32_t ID_EMPTY = UINT32_MAX;
+static constexpr uint32_t ID_DELETED = UINT32_MAX - 1;
+
+static_assert(sizeof(FlowKey) == 38, "Flow key must not have padding, as it is compared and hashed bytewise");
+
+/** MurmurHash3 finalizer */
+static uint64_t hash_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t flow_key_hash(const FlowKey &key) {
+    uint64_t words[5] = {};
+    memcpy(words, &key, sizeof(key));
+    uint64_t h = 0;
+    for (uint64_t w : words) {
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h = (h << 31) | (h >> 33);
+    }
+    return hash_mix(h);
+}
+
+static bool flow_key_equals(const FlowKey &lh, const FlowKey &rh) {
+    return 0 == memcmp(&lh, &rh, sizeof(FlowKey));
+}
+
+/** The lowest bits of a hash select the home slot, the highest ones make the tag */
+static uint8_t hash_tag(uint64_t hash) {
+    return uint8_t(0x80 | (hash >> 57));
+}
+
+/** Keep the load (including tombstones) under 3/4 */
+static bool is_overloaded(size_t used, size_t capacity) {
+    return used * 4 > capacity * 3;
+}
+
+static size_t capacity_for(size_t size) {
+    size_t capacity = MIN_CAPACITY;
+    while (is_overloaded(size, capacity)) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+static void copy_ip(uint8_t *dst, uint8_t *family, const ip_addr_t *addr) {
+    if (addr == nullptr) {
+        return;
+    }
+    if (IP_IS_V4(addr)) {
+        memcpy(dst, &ip_2_ip4(addr)->addr, 4);
+        *family = IPADDR_TYPE_V4;
+    } else {
+        memcpy(dst, ip_2_ip6(addr)->addr, 16);
+        *family = IPADDR_TYPE_V6;
+    }
+}
+
+FlowKey flow_key_make(
+        uint8_t proto, const ip_addr_t *src_addr, uint16_t src_port, const ip_addr_t *dst_addr, uint16_t dst_port) {
+    FlowKey key;
+    memset(&key, 0, sizeof(key));
+    copy_ip(key.src_ip, &key.family, src_addr);
+    copy_ip(key.dst_ip, &key.family, dst_addr);
+    key.src_port = src_port;
+    key.dst_port = dst_port;
+    key.proto = proto;
+    return key;
+}
+
+FlowTable::~FlowTable() {
+    clear();
+}
+
+bool FlowTable::insert(const FlowKey &key, void *value) {
+    return do_insert(key, false, 0, value);
+}
+
+bool FlowTable::insert(const FlowKey &key, uint64_t id, void *value) {
+    return do_insert(key, true, id, value);
+}
+
+bool FlowTable::do_insert(const FlowKey &key, bool has_id, uint64_t id, void *value) {
+    if (find_slot(key) != NPOS || (has_id && find_id_slot(id) != NPOS)) {
+        return false;
+    }
+    size_t used = m_size + std::max(m_deleted, m_ids_deleted) + 1;
+    if (m_capacity == 0 || is_overloaded(used, m_capacity)) {
+        // Grow if live entries need it, otherwise just purge tombstones
+        if (!rehash(capacity_for(m_size + 1))) {
+            return false;
+        }
+    }
+
+    size_t mask = m_capacity - 1;
+    uint64_t hash = flow_key_hash(key);
+    size_t i = hash & mask;
+    while (m_tags[i] >= TAG_FULL) {
+        i = (i + 1) & mask;
+    }
+    if (m_tags[i] == TAG_DELETED) {
+        --m_deleted;
+    }
+    m_tags[i] = hash_tag(hash);
+    m_slots[i] = {key, has_id, id, value};
+    ++m_size;
+
+    if (has_id) {
+        size_t j = hash_mix(id) & mask;
+        while (m_ids[j].slot != ID_EMPTY && m_ids[j].slot != ID_DELETED) {
+            j = (j + 1) & mask;
+        }
+        if (m_ids[j].slot == ID_DELETED) {
+            --m_ids_deleted;
+        }
+        m_ids[j] = {id, uint32_t(i)};
+    }
+
+    return true;
+}
+
+size_t FlowTable::find_slot(const FlowKey &key) const {
+    if (m_size == 0) {
+        return NPOS;
+    }
+    ++m_lookups;
+    size_t mask = m_capacity - 1;
+    uint64_t hash = flow_key_hash(key);
+    uint8_t tag = hash_tag(hash);
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        ++m_probes;
+        if (m_tags[i] == TAG_EMPTY) {
+            return NPOS;
+        }
+        if (m_tags[i] == tag && flow_key_equals(m_slots[i].key, key)) {
+            return i;
+        }
+    }
+}
+
+size_t FlowTable::find_id_slot(uint64_t id) const {
+    if (m_size == 0) {
+        return NPOS;
+    }
+    size_t mask = m_capacity - 1;
+    for (size_t j = hash_mix(id) & mask;; j = (j + 1) & mask) {
+        if (m_ids[j].slot == ID_EMPTY) {
+            return NPOS;
+        }
+        if (m_ids[j].slot != ID_DELETED && m_ids[j].id == id) {
+            return j;
+        }
+    }
+}
+
+void *FlowTable::find(const FlowKey &key) const {
+    size_t i = find_slot(key);
+    return (i != NPOS) ? m_slots[i].value : nullptr;
+}
+
+void *FlowTable::find_by_id(uint64_t id) const {
+    size_t j = find_id_slot(id);
+    return (j != NPOS) ? m_slots[m_ids[j].slot].value : nullptr;
+}
+
+void *FlowTable::remove(const FlowKey &key) {
+    size_t i = find_slot(key);
+    if (i == NPOS) {
+        return nullptr;
+    }
+    void *value = m_slots[i].value;
+    erase(i);
+    return value;
+}
+
+void *FlowTable::remove_by_id(uint64_t id) {
+    size_t j = find_id_slot(id);
+    if (j == NPOS) {
+        return nullptr;
+    }
+    size_t i = m_ids[j].slot;
+    void *value = m_slots[i].value;
+    erase(i);
+    return value;
+}
+
+void FlowTable::erase(size_t slot) {
+    size_t mask = m_capacity - 1;
+    // A slot followed by an empty one does not lie on any probe sequence, so it needs no tombstone
+    if (m_tags[(slot + 1) & mask] == TAG_EMPTY) {
+        m_tags[slot] = TAG_EMPTY;
+    } else {
+        m_tags[slot] = TAG_DELETED;
+        ++m_deleted;
+    }
+
+    if (m_slots[slot].has_id) {
+        size_t j = find_id_slot(m_slots[slot].id);
+        if (m_ids[(j + 1) & mask].slot == ID_EMPTY) {
+            m_ids[j].slot = ID_EMPTY;
+        } else {
+            m_ids[j].slot = ID_DELETED;
+            ++m_ids_deleted;
+        }
+    }
+
+    --m_size;
+    maybe_shrink();
+}
+
+bool FlowTable::rehash(size_t capacity) {
+    auto *tags = new (std::nothrow) uint8_t[capacity]{};
+    auto *slots = new (std::nothrow) Slot[capacity];
+    auto *ids = new (std::nothrow) IdSlot[capacity];
+    if (tags == nullptr || slots == nullptr || ids == nullptr) {
+        delete[] tags;
+        delete[] slots;
+        delete[] ids;
+        return false;
+    }
+    std::fill_n(ids, capacity, IdSlot{0, ID_EMPTY});
+
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < m_capacity; ++i) {
+        if (m_tags[i] < TAG_FULL) {
+            continue;
+        }
+        const Slot &entry = m_slots[i];
+        size_t k = flow_key_hash(entry.key) & mask;
+        while (tags[k] != TAG_EMPTY) {
+            k = (k + 1) & mask;
+        }
+        tags[k] = m_tags[i];
+        slots[k] = entry;
+        if (entry.has_id) {
+            size_t j = hash_mix(entry.id) & mask;
+            while (ids[j].slot != ID_EMPTY) {
+                j = (j + 1) & mask;
+            }
+            ids[j] = {entry.id, uint32_t(k)};
+        }
+    }
+
+    delete[] m_tags;
+    delete[] m_slots;
+    delete[] m_ids;
+    m_tags = tags;
+    m_slots = slots;
+    m_ids = ids;
+    m_capacity = capacity;
+    m_deleted = 0;
+    m_ids_deleted = 0;
+    return true;
+}
+
+void FlowTable::maybe_shrink() {
+    if (m_iterating != 0) {
+        return;
+    }
+    if (m_size == 0) {
+        clear();
+        return;
+    }
+    if (m_capacity <= MIN_CAPACITY || m_size * 8 >= m_capacity) {
+        return;
+    }
+    // Leave room for the table to grow twice before it has to be rehashed again
+    rehash(capacity_for(2 * m_size));
+}
+
+void FlowTable::clear() {
+    delete[] m_tags;
+    delete[] m_slots;
+    delete[] m_ids;
+    m_tags = nullptr;
+    m_slots = nullptr;
+    m_ids = nullptr;
+    m_capacity = 0;
+    m_size = 0;
+    m_deleted = 0;
+    m_ids_deleted = 0;
+}
+
+TcpipFlowTableStats FlowTable::get_stats() const {
+    TcpipFlowTableStats stats{};
+    stats.size = m_size;
+    stats.capacity = m_capacity;
+    stats.tombstones = m_deleted;
+    stats.load_factor = (m_capacity != 0) ? double(m_size) / double(m_capacity) : 0;
+    stats.mean_probe_length = (m_lookups != 0) ? double(m_probes) / double(m_lookups) : 0;
+    stats.memory_size = m_capacity * (sizeof(*m_tags) + sizeof(*m_slots) + sizeof(*m_ids));
+    stats.lookups = m_lookups;
+    size_t mask = m_capacity - 1;
+    for (size_t i = 0; i < m_capacity; ++i) {
+        if (m_tags[i] >= TAG_FULL) {
+            size_t home = flow_key_hash(m_slots[i].key) & mask;
+            stats.max_displacement = std::max(stats.max_displacement, (i - home) & mask);
+        }
+    }
+    return stats;
+}
+
+} // namespace ag
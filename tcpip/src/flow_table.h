@@ -0,0 +1,156 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lwipopts.h" // Include before LWIP headers
+
+#include <lwip/ip_addr.h>
+
+#include "tcpip/tcpip.h"
+
+namespace ag {
+
+/**
+ * Flow 5-tuple stored inline in the table
+ */
+struct FlowKey {
+    uint8_t src_ip[16]; /**< Source address (IPv4 addresses occupy the first 4 bytes) */
+    uint8_t dst_ip[16]; /**< Destination address */
+    uint16_t src_port;  /**< Source port (ICMP echo identifier) */
+    uint16_t dst_port;  /**< Destination port (ICMP echo sequence number) */
+    uint8_t proto;      /**< IP protocol number */
+    uint8_t family;     /**< `IPADDR_TYPE_V4` or `IPADDR_TYPE_V6` */
+};
+
+/**
+ * Make a flow key
+ * @param proto IP protocol number
+ * @param src_addr source address (may be null for address-less flows)
+ * @param src_port source port
+ * @param dst_addr destination address (may be null for address-less flows)
+ * @param dst_port destination port
+ */
+FlowKey flow_key_make(
+        uint8_t proto, const ip_addr_t *src_addr, uint16_t src_port, const ip_addr_t *dst_addr, uint16_t dst_port);
+
+/**
+ * Open-addressing hash table of flows.
+ * Keys are stored inline next to the values, and a separate array of 1-byte hash tags is scanned
+ * on lookups, so that a miss rarely touches the keys. Removed entries leave tombstones, which
+ * are purged when the table is rehashed. Entries may be additionally indexed by a 64-bit ID.
+ * Entries must not be added while iterating with `for_each()`, but may be removed.
+ */
+class FlowTable {
+public:
+    FlowTable() = default;
+    ~FlowTable();
+
+    FlowTable(const FlowTable &) = delete;
+    FlowTable &operator=(const FlowTable &) = delete;
+
+    /**
+     * Add an entry which may be found only by its key
+     * @return false if the key is already present or there is no memory
+     */
+    bool insert(const FlowKey &key, void *value);
+
+    /**
+     * Add an entry which may be found by its key and by its ID
+     * @return false if the key or the ID is already present or there is no memory
+     */
+    bool insert(const FlowKey &key, uint64_t id, void *value);
+
+    /**
+     * Find an entry by key
+     * @return the value, or null if not found
+     */
+    [[nodiscard]] void *find(const FlowKey &key) const;
+
+    /**
+     * Find an entry by ID
+     * @return the value, or null if not found
+     */
+    [[nodiscard]] void *find_by_id(uint64_t id) const;
+
+    /**
+     * Remove an entry by key
+     * @return the value of the removed entry, or null if not found
+     */
+    void *remove(const FlowKey &key);
+
+    /**
+     * Remove an entry by ID
+     * @return the value of the removed entry, or null if not found
+     */
+    void *remove_by_id(uint64_t id);
+
+    /**
+     * Remove all entries and release the memory
+     */
+    void clear();
+
+    /**
+     * Get the number of entries
+     */
+    [[nodiscard]] size_t size() const {
+        return m_size;
+    }
+
+    /**
+     * Get table statistics (`name` is not filled in)
+     */
+    [[nodiscard]] TcpipFlowTableStats get_stats() const;
+
+    /**
+     * Call `fn(value)` for each entry
+     */
+    template <typename Fn>
+    void for_each(Fn &&fn) {
+        ++m_iterating;
+        for (size_t i = 0; i < m_capacity; ++i) {
+            if (m_tags[i] >= TAG_FULL) {
+                fn(m_slots[i].value);
+            }
+        }
+        --m_iterating;
+        maybe_shrink();
+    }
+
+private:
+    static constexpr uint8_t TAG_EMPTY = 0;
+    static constexpr uint8_t TAG_DELETED = 1;
+    static constexpr uint8_t TAG_FULL = 0x80;
+
+    struct Slot {
+        FlowKey key;
+        bool has_id;
+        uint64_t id;
+        void *value;
+    };
+
+    struct IdSlot {
+        uint64_t id;
+        uint32_t slot;
+    };
+
+    uint8_t *m_tags = nullptr;
+    Slot *m_slots = nullptr;
+    IdSlot *m_ids = nullptr;
+    size_t m_capacity = 0;
+    size_t m_size = 0;
+    size_t m_deleted = 0;
+    size_t m_ids_deleted = 0;
+    size_t m_iterating = 0;
+    mutable uint64_t m_lookups = 0;
+    mutable uint64_t m_probes = 0;
+
+    bool do_insert(const FlowKey &key, bool has_id, uint64_t id, void *value);
+    [[nodiscard]] size_t find_slot(const FlowKey &key) const;
+    [[nodiscard]] size_t find_id_slot(uint64_t id) const;
+    void erase(size_t slot);
+    bool rehash(size_t capacity);
+    void maybe_shrink();
+};
+
+} // namespace ag
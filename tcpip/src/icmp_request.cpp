@@ -13,14 +13,6 @@ IcmpRequestKey icmp_request_key_create(u16_t id, u16_t seqno) {
     return key;
 }
 
-uint64_t icmp_request_key_hash(const IcmpRequestKey *key) {
-    return hash_pair_combine(key->id, key->seqno);
-}
-
-bool icmp_request_key_equals(const IcmpRequestKey *lh, const IcmpRequestKey *rh) {
-    return lh->id == rh->id && lh->seqno == rh->seqno;
-}
-
 IcmpRequestDescriptor *icmp_request_create(
         const ip_addr_t *src, const ip_addr_t *dst, u16_t id, u16_t seqno, u8_t ttl, struct pbuf *buffer) {
     static_assert(std::is_trivial_v<IcmpRequestDescriptor>);
@@ -30,16 +30,6 @@ typedef struct {
  */
 IcmpRequestKey icmp_request_key_create(u16_t id, u16_t seqno);
 
-/**
- * Get hash of a key
- */
-uint64_t icmp_request_key_hash(const IcmpRequestKey *key);
-
-/**
- * Check whether 2 keys are equal
- */
-bool icmp_request_key_equals(const IcmpRequestKey *lh, const IcmpRequestKey *rh);
-
 /**
  * Create an ICMP request descriptor
  */
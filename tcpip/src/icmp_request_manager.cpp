@@ -15,40 +15,34 @@
 
 namespace ag {
 
+static FlowKey request_flow_key(const IcmpRequestKey *key) {
+    return flow_key_make(IP_PROTO_ICMP, nullptr, key->id, nullptr, key->seqno);
+}
+
 static bool register_new_request(TcpipCtx *ctx, IcmpRequestDescriptor *request) {
-    int ret = 0;
-    khiter_t req_it = kh_put(icmp_requests, ctx->icmp.requests, &request->key, &ret);
-    if (ret < 0) {
+    if (!ctx->icmp.requests.insert(request_flow_key(&request->key), request)) {
         log_req(ctx, request, warn, "Failed to put new entry in table");
         return false;
     }
-    kh_value(ctx->icmp.requests, req_it) = request;
     return true;
 }
 
-bool icmp_rm_init(TcpipCtx *ctx) {
-    ctx->icmp.requests = kh_init(icmp_requests);
+bool icmp_rm_init(TcpipCtx *) {
     return true;
 }
 
 void icmp_rm_close(TcpipCtx *ctx) {
     icmp_rm_clean_up(ctx);
 
-    kh_destroy(icmp_requests, ctx->icmp.requests);
-    ctx->icmp.requests = nullptr;
+    ctx->icmp.requests.clear();
 
     log_manager(ctx, dbg, "Closed");
 }
 
 void icmp_rm_clean_up(TcpipCtx *ctx) {
-    if (ctx->icmp.requests == nullptr) {
-        return;
-    }
-    for (khiter_t i = kh_begin(ctx->icmp.requests); i != kh_end(ctx->icmp.requests); ++i) {
-        while (kh_exist(ctx->icmp.requests, i)) {
-            icmp_rm_close_descriptor(ctx, kh_val(ctx->icmp.requests, i));
-        }
-    }
+    ctx->icmp.requests.for_each([ctx](void *value) {
+        icmp_rm_close_descriptor(ctx, (IcmpRequestDescriptor *) value);
+    });
 }
 
 IcmpRequestDescriptor *icmp_rm_create_descriptor(TcpipCtx *ctx, const ip_addr_t *src, const ip_addr_t *dst, u16_t id,
@@ -75,18 +69,12 @@ IcmpRequestDescriptor *icmp_rm_create_descriptor(TcpipCtx *ctx, const ip_addr_t
 
 IcmpRequestDescriptor *icmp_rm_find_descriptor(const TcpipCtx *ctx, u16_t id, u16_t seqno) {
     IcmpRequestKey key = icmp_request_key_create(id, seqno);
-    khiter_t req_it = kh_get(icmp_requests, ctx->icmp.requests, &key);
-    if (req_it == kh_end(ctx->icmp.requests)) {
-        return nullptr;
-    }
-
-    return kh_value(ctx->icmp.requests, req_it);
+    return (IcmpRequestDescriptor *) ctx->icmp.requests.find(request_flow_key(&key));
 }
 
 void icmp_rm_close_descriptor(TcpipCtx *ctx, IcmpRequestDescriptor *request) {
-    khiter_t req_it = kh_get(icmp_requests, ctx->icmp.requests, &request->key);
-    if (req_it != kh_end(ctx->icmp.requests)) {
-        kh_del(icmp_requests, ctx->icmp.requests, req_it);
+    if (ctx->icmp.requests.find(request_flow_key(&request->key)) == request) {
+        ctx->icmp.requests.remove(request_flow_key(&request->key));
     }
     icmp_request_destroy(request);
 }
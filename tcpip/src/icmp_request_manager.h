@@ -4,20 +4,18 @@
 
 #include "lwipopts.h" // Include before LWIP headers
 
-#include <khash.h>
 #include <lwip/prot/icmp.h>
 #include <lwip/prot/icmp6.h>
 
 #include "common/logger.h"
+#include "flow_table.h"
 #include "icmp_request.h"
 #include "tcpip/tcpip.h"
 
 namespace ag {
 
-KHASH_INIT(icmp_requests, IcmpRequestKey *, IcmpRequestDescriptor *, 1, icmp_request_key_hash, icmp_request_key_equals)
-
 typedef struct IcmpCtx {
-    khash_t(icmp_requests) * requests;
+    FlowTable requests; /**< Requests by ICMP id-seqno pair */
     ag::Logger log{"TCPIP.ICMPMNGR"};
 } IcmpCtx;
 
@@ -23,6 +23,7 @@
 #include <lwip/timeouts.h>
 
 #include "common/logger.h"
+#include "lwip_mem_pools.h"
 #include "tcpip/tcpip.h"
 
 namespace ag {
@@ -97,6 +98,7 @@ int libevent_lwip_init(TcpipCtx *ctx) {
             lwip_timer_new_started(run_lwip_timer, (void *) ip6_reass_tmr, IP6_REASS_TMR_INTERVAL);
     g_lwip->nd6_tmr_event = lwip_timer_new_started(run_lwip_timer, (void *) nd6_tmr, ND6_TMR_INTERVAL);
 
+    lwip_mem_pools_configure(ctx->parameters);
     lwip_init();
 
     return ERR_OK;
@@ -116,6 +118,8 @@ void libevent_lwip_free() {
 
     delete g_lwip;
     g_lwip = nullptr;
+
+    lwip_mem_pools_release_idle();
 }
 
 // NOLINTBEGIN(cert-dcl50-cpp)
@@ -0,0 +1,364 @@
+#include "lwip_mem_pools.h"
+
+#include "vpn/platform.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "lwipopts.h" // Include before LWIP headers
+
+#include <lwip/mem.h>
+#include <lwip/memp.h>
+#include <lwip/pbuf.h>
+#include <lwip/tcp.h>
+
+namespace ag {
+
+/** Chunk size of the pools of LWIP objects */
+static constexpr size_t OBJECT_CHUNK_SIZE = 64 * 1024;
+/** Bounds of the chunk size of the pbuf pools */
+static constexpr size_t MIN_PBUF_CHUNK_SIZE = 64 * 1024;
+static constexpr size_t MAX_PBUF_CHUNK_SIZE = 1024 * 1024;
+/** Size classes of pbufs allocated together with the payload, besides the one fitting a whole packet */
+static constexpr size_t PBUF_SIZE_CLASSES[] = {128, 256, 512, 1024};
+
+static constexpr const char *MEMP_NAMES[] = {
+#define LWIP_MEMPOOL(name, num, size, desc) #name,
+#include <lwip/priv/memp_std.h>
+};
+static_assert(std::size(MEMP_NAMES) == MEMP_MAX);
+
+struct Pool;
+
+struct alignas(std::max_align_t) ElementHeader {
+    struct Chunk *chunk; /**< Null if the element is allocated on the heap */
+};
+
+struct FreeElement {
+    FreeElement *next;
+};
+
+/**
+ * A piece of memory mapped from the OS and split into elements of one pool.
+ * Layout: `Chunk | (ElementHeader | element)...`
+ */
+struct alignas(std::max_align_t) Chunk {
+    Pool *pool = nullptr;
+    Chunk *prev = nullptr;            /**< Previous chunk in the pool's list of chunks with free elements */
+    Chunk *next = nullptr;            /**< Next chunk in the pool's list of chunks with free elements */
+    bool has_free = false;            /**< The chunk is in the list of chunks with free elements */
+    FreeElement *free_list = nullptr; /**< Freed elements */
+    size_t carved = 0;                /**< Number of elements carved out of the chunk so far */
+    size_t used = 0;                  /**< Number of elements in use */
+    size_t size = 0;                  /**< Size of the mapping */
+};
+
+struct Pool {
+    std::string name;
+    size_t element_size = 0;
+    size_t stride = 0;
+    size_t chunk_size = 0;
+    Chunk *with_free = nullptr; /**< Chunks with free elements */
+    size_t idle_chunks = 0;     /**< Number of chunks without elements in use */
+    TcpipMemPoolStats stats{};
+
+    void set_chunk_size(size_t size) {
+        chunk_size = std::max(size, sizeof(Chunk) + stride);
+    }
+};
+
+struct PoolSet {
+    std::vector<Pool *> objects;    /**< Pools of LWIP objects (exact size match) */
+    std::vector<Pool *> pbufs;      /**< Pools of pbufs with payload (sorted by element size) */
+    TcpipMemPoolStats heap_stats{}; /**< Allocations not fitting any pool */
+};
+
+static PoolSet *g_pools;
+
+static void *map_chunk(size_t size) {
+#ifdef _WIN32
+    return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (ptr != MAP_FAILED) ? ptr : nullptr;
+#endif
+}
+
+static void unmap_chunk(Chunk *chunk) {
+#ifdef _WIN32
+    VirtualFree(chunk, 0, MEM_RELEASE);
+#else
+    munmap(chunk, chunk->size);
+#endif
+}
+
+static size_t round_up(size_t value, size_t granularity) {
+    return (value + granularity - 1) / granularity * granularity;
+}
+
+static Pool *make_pool(std::string name, size_t element_size, size_t chunk_size) {
+    auto *pool = new Pool{
+            .name = std::move(name),
+            .element_size = element_size,
+            .stride = round_up(sizeof(ElementHeader) + element_size, alignof(std::max_align_t)),
+    };
+    pool->set_chunk_size(chunk_size);
+    pool->stats.element_size = element_size;
+    return pool;
+}
+
+/**
+ * Pool set with the default configuration, used until `lwip_mem_pools_configure()` is called
+ */
+static PoolSet *get_pools() {
+    if (g_pools != nullptr) {
+        return g_pools;
+    }
+
+    g_pools = new PoolSet{};
+    for (size_t i = 0; i < MEMP_MAX; ++i) {
+        // `memp_malloc()` asks `mem_malloc()` for exactly this much
+        size_t size = LWIP_MEM_ALIGN_SIZE(memp_pools[i]->size);
+        auto it = std::find_if(g_pools->objects.begin(), g_pools->objects.end(), [size](const Pool *pool) {
+            return pool->element_size == size;
+        });
+        if (it != g_pools->objects.end()) {
+            (*it)->name.append("/").append(MEMP_NAMES[i]);
+        } else {
+            g_pools->objects.push_back(make_pool(MEMP_NAMES[i], size, OBJECT_CHUNK_SIZE));
+        }
+    }
+    for (size_t size : PBUF_SIZE_CLASSES) {
+        g_pools->pbufs.push_back(make_pool("PBUF_RAM_" + std::to_string(size), size, MIN_PBUF_CHUNK_SIZE));
+    }
+    g_pools->heap_stats.name = "HEAP";
+    for (Pool *pool : g_pools->objects) {
+        pool->stats.name = pool->name.c_str();
+    }
+    for (Pool *pool : g_pools->pbufs) {
+        pool->stats.name = pool->name.c_str();
+    }
+    return g_pools;
+}
+
+static Pool *find_pool(PoolSet *pools, size_t size) {
+    for (Pool *pool : pools->objects) {
+        if (pool->element_size == size) {
+            return pool;
+        }
+    }
+    auto it = std::lower_bound(pools->pbufs.begin(), pools->pbufs.end(), size, [](const Pool *pool, size_t size) {
+        return pool->element_size < size;
+    });
+    return (it != pools->pbufs.end()) ? *it : nullptr;
+}
+
+static void link_with_free(Pool *pool, Chunk *chunk) {
+    chunk->prev = nullptr;
+    chunk->next = pool->with_free;
+    if (pool->with_free != nullptr) {
+        pool->with_free->prev = chunk;
+    }
+    pool->with_free = chunk;
+    chunk->has_free = true;
+}
+
+static void unlink_with_free(Pool *pool, Chunk *chunk) {
+    if (chunk->prev != nullptr) {
+        chunk->prev->next = chunk->next;
+    } else {
+        pool->with_free = chunk->next;
+    }
+    if (chunk->next != nullptr) {
+        chunk->next->prev = chunk->prev;
+    }
+    chunk->has_free = false;
+}
+
+static void release_chunk(Pool *pool, Chunk *chunk) {
+    unlink_with_free(pool, chunk);
+    --pool->idle_chunks;
+    --pool->stats.chunks;
+    unmap_chunk(chunk);
+}
+
+static void *pool_alloc(Pool *pool) {
+    Chunk *chunk = pool->with_free;
+    if (chunk == nullptr) {
+        chunk = (Chunk *) map_chunk(pool->chunk_size);
+        if (chunk == nullptr) {
+            return nullptr;
+        }
+        new (chunk) Chunk{.pool = pool, .size = pool->chunk_size};
+        link_with_free(pool, chunk);
+        ++pool->idle_chunks;
+        ++pool->stats.chunks;
+    }
+
+    auto *element = (uint8_t *) chunk->free_list;
+    if (element != nullptr) {
+        chunk->free_list = chunk->free_list->next;
+    } else {
+        // Carve lazily, so that untouched pages of a fresh chunk are not committed
+        auto *header = (ElementHeader *) ((uint8_t *) (chunk + 1) + chunk->carved * pool->stride);
+        header->chunk = chunk;
+        element = (uint8_t *) (header + 1);
+        ++chunk->carved;
+    }
+
+    if (chunk->used++ == 0) {
+        --pool->idle_chunks;
+    }
+    // The pool's chunk size may have changed since the chunk was mapped
+    if (chunk->used == (chunk->size - sizeof(Chunk)) / pool->stride) {
+        unlink_with_free(pool, chunk);
+    }
+    ++pool->stats.allocs;
+    pool->stats.high_water = std::max(pool->stats.high_water, ++pool->stats.used);
+    return element;
+}
+
+static void pool_free(Chunk *chunk, void *ptr) {
+    Pool *pool = chunk->pool;
+    auto *element = (FreeElement *) ptr;
+    element->next = chunk->free_list;
+    chunk->free_list = element;
+    --pool->stats.used;
+
+    if (!chunk->has_free) {
+        link_with_free(pool, chunk);
+    }
+    if (--chunk->used == 0) {
+        ++pool->idle_chunks;
+        // Keep one idle chunk to absorb bursts
+        if (pool->idle_chunks > 1) {
+            release_chunk(pool, chunk);
+        }
+    }
+}
+
+void lwip_mem_pools_configure(const TcpipParameters &params) {
+    PoolSet *pools = get_pools();
+
+    for (Pool *pool : pools->objects) {
+        pool->set_chunk_size(OBJECT_CHUNK_SIZE);
+    }
+
+    // A chunk holds about a window worth of data, receive windows are tuned up to `TCPIP_TCP_MAX_RECV_WND`
+    size_t window = std::max(params.tcp_recv_buf_size ? params.tcp_recv_buf_size : TCPIP_TCP_MAX_RECV_WND,
+            params.tcp_send_buf_size ? params.tcp_send_buf_size : TCP_SND_BUF);
+    size_t chunk_size = round_up(std::clamp(window, MIN_PBUF_CHUNK_SIZE, MAX_PBUF_CHUNK_SIZE), MIN_PBUF_CHUNK_SIZE);
+
+    // The largest class fits a full-sized packet with all the headroom `pbuf_alloc()` reserves
+    uint32_t mtu = params.mtu_size ? params.mtu_size : DEFAULT_MTU_SIZE;
+    size_t packet_class = LWIP_MEM_ALIGN_SIZE(sizeof(struct pbuf) + PBUF_LINK_ENCAPSULATION_HLEN + PBUF_LINK_HLEN
+                                  + PBUF_IP_HLEN + PBUF_TRANSPORT_HLEN)
+            + LWIP_MEM_ALIGN_SIZE(mtu);
+    if (std::none_of(pools->pbufs.begin(), pools->pbufs.end(), [packet_class](const Pool *pool) {
+            return pool->element_size == packet_class;
+        })) {
+        // Existing classes stay, as there may be elements allocated from them
+        Pool *pool = make_pool("PBUF_RAM_" + std::to_string(packet_class), packet_class, chunk_size);
+        pool->stats.name = pool->name.c_str();
+        pools->pbufs.insert(std::lower_bound(pools->pbufs.begin(), pools->pbufs.end(), pool,
+                                    [](const Pool *l, const Pool *r) {
+                                        return l->element_size < r->element_size;
+                                    }),
+                pool);
+    }
+    for (Pool *pool : pools->pbufs) {
+        pool->set_chunk_size(chunk_size);
+    }
+}
+
+void lwip_mem_pools_release_idle() {
+    if (g_pools == nullptr) {
+        return;
+    }
+    for (const std::vector<Pool *> *list : {&g_pools->objects, &g_pools->pbufs}) {
+        for (Pool *pool : *list) {
+            for (Chunk *chunk = pool->with_free; chunk != nullptr && pool->idle_chunks > 0;) {
+                Chunk *next = chunk->next;
+                if (chunk->used == 0) {
+                    release_chunk(pool, chunk);
+                }
+                chunk = next;
+            }
+        }
+    }
+}
+
+size_t lwip_mem_pools_get_stats(TcpipMemPoolStats *stats, size_t max_num) {
+    PoolSet *pools = get_pools();
+    size_t num = 0;
+    auto put = [&](const TcpipMemPoolStats &s) {
+        if (num < max_num) {
+            stats[num] = s;
+        }
+        ++num;
+    };
+    for (const std::vector<Pool *> *list : {&pools->objects, &pools->pbufs}) {
+        for (const Pool *pool : *list) {
+            TcpipMemPoolStats s = pool->stats;
+            s.chunk_size = pool->chunk_size;
+            put(s);
+        }
+    }
+    put(pools->heap_stats);
+    return num;
+}
+
+} // namespace ag
+
+using namespace ag;
+
+extern "C" void *lwip_mem_pools_malloc(size_t size) {
+    PoolSet *pools = get_pools();
+    if (Pool *pool = find_pool(pools, size); pool != nullptr) {
+        return pool_alloc(pool);
+    }
+
+    auto *header = (ElementHeader *) std::malloc(sizeof(ElementHeader) + size); // NOLINT(hicpp-no-malloc)
+    if (header == nullptr) {
+        return nullptr;
+    }
+    header->chunk = nullptr;
+    TcpipMemPoolStats &stats = pools->heap_stats;
+    ++stats.allocs;
+    stats.high_water = std::max(stats.high_water, ++stats.used);
+    return header + 1;
+}
+
+extern "C" void *lwip_mem_pools_calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        return nullptr;
+    }
+    void *ptr = lwip_mem_pools_malloc(count * size);
+    if (ptr != nullptr) {
+        std::memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+extern "C" void lwip_mem_pools_free(void *ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    ElementHeader *header = (ElementHeader *) ptr - 1;
+    if (header->chunk != nullptr) {
+        pool_free(header->chunk, ptr);
+    } else {
+        --g_pools->heap_stats.used;
+        std::free(header); // NOLINT(hicpp-no-malloc)
+    }
+}
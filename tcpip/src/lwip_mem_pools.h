@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "tcpip/tcpip.h"
+
+namespace ag {
+
+/**
+ * Set up the pools backing LWIP memory allocations (`mem_malloc()`, and `memp_malloc()` on top of it).
+ * There is a pool per LWIP object type (pbuf headers, TCP PCBs, TCP segments, etc.)
+ * and per size class of pbufs allocated together with their payload, the largest class fitting
+ * a packet of `params.mtu_size`. Larger allocations go to the heap.
+ * Pools grow in chunks sized after the TCP buffer sizes and return a chunk to the OS
+ * as soon as it is idle, so that RSS follows the actual usage without `malloc_trim()`.
+ * Pools are process-wide like LWIP itself, so reconfiguring affects the chunks allocated from now on.
+ *
+ * @param params TCP/IP stack parameters
+ */
+void lwip_mem_pools_configure(const TcpipParameters &params);
+
+/**
+ * Return all idle chunks (including the spare ones kept to absorb bursts) to the OS
+ */
+void lwip_mem_pools_release_idle();
+
+/**
+ * Get usage statistics of the pools
+ * @param stats (out) statistics of each pool (the last entry is for the heap)
+ * @param max_num capacity of `stats`
+ * @return number of pools (may exceed `max_num`)
+ */
+size_t lwip_mem_pools_get_stats(TcpipMemPoolStats *stats, size_t max_num);
+
+} // namespace ag
@@ -11,6 +11,21 @@
 #define MEMP_MEM_MALLOC 1
 #define MEM_LIBC_MALLOC 1
 
+// Route allocations to the pools (implementation in lwip_mem_pools.cpp)
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+void *lwip_mem_pools_malloc(size_t size);
+void *lwip_mem_pools_calloc(size_t count, size_t size);
+void lwip_mem_pools_free(void *ptr);
+#ifdef __cplusplus
+}
+#endif
+#define mem_clib_malloc lwip_mem_pools_malloc
+#define mem_clib_calloc lwip_mem_pools_calloc
+#define mem_clib_free lwip_mem_pools_free
+
 // Disable unneeded LWIP subsystems
 #define LWIP_SOCKET 0
 #define LWIP_NETCONN 0
@@ -0,0 +1,347 @@
+#include "pcap_capture.h"
+
+#include "vpn/platform.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+
+#include <common/utils.h>
+#include <lwip/def.h>
+#include <lwip/prot/ip.h>
+#include <lwip/prot/ip4.h>
+#include <lwip/prot/ip6.h>
+
+#include "pcap_savefile.h"
+#include "tcpip_util.h"
+
+namespace ag {
+
+/** How often the writer looks into the ring if nobody wakes it up */
+static constexpr auto WRITER_PERIOD = std::chrono::milliseconds(50);
+/** Maximum size of a single write to the output file */
+static constexpr size_t MAX_WRITE_SIZE = 1024 * 1024;
+/** Enough of a packet to get its addresses and ports */
+static constexpr size_t FILTER_HEADERS_SIZE = IP6_HLEN + 4;
+
+static size_t ring_capacity_for(size_t size) {
+    size_t capacity = 4096;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+static int open_output_file(const char *filename) {
+#ifdef _WIN32
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_BINARY;
+    return _wopen(ag::utils::to_wstring(filename).c_str(), flags, 0664);
+#else
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    return open(filename, flags, 0664);
+#endif
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        // NOLINTNEXTLINE(bugprone-narrowing-conversions,cppcoreguidelines-narrowing-conversions)
+        int r = write(fd, data, std::min(len, MAX_WRITE_SIZE));
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        data += r;
+        len -= r;
+    }
+    return true;
+}
+
+PcapCapture::PcapCapture(const TcpipPcapParameters &params)
+        : m_snaplen(params.snaplen)
+        , m_rolling(params.rolling)
+        , m_proto(params.filter.proto)
+        , m_head(0)
+        , m_tail(0)
+        , m_failed(false) {
+    socket_address_to_ip_addr(params.filter.endpoint_a, &m_endpoint_a.addr, &m_endpoint_a.port);
+    socket_address_to_ip_addr(params.filter.endpoint_b, &m_endpoint_b.addr, &m_endpoint_b.port);
+    if (ip_addr_isany_val(m_endpoint_a.addr)) {
+        m_endpoint_a.port = params.filter.endpoint_a.valid() ? params.filter.endpoint_a.port() : 0;
+    }
+    if (ip_addr_isany_val(m_endpoint_b.addr)) {
+        m_endpoint_b.port = params.filter.endpoint_b.valid() ? params.filter.endpoint_b.port() : 0;
+    }
+    m_has_filter = m_proto != 0 || !ip_addr_isany_val(m_endpoint_a.addr) || m_endpoint_a.port != 0
+            || !ip_addr_isany_val(m_endpoint_b.addr) || m_endpoint_b.port != 0;
+
+    size_t buffer_size = (params.buffer_size != 0) ? params.buffer_size : TCPIP_DEFAULT_PCAP_BUFFER_SIZE;
+    size_t capacity = ring_capacity_for(buffer_size);
+    m_ring.reset(new (std::nothrow) uint8_t[capacity]);
+    if (m_ring == nullptr) {
+        errlog(m_log, "No memory for capture buffer of {} bytes", capacity);
+        return;
+    }
+    m_capacity = capacity;
+}
+
+PcapCapture::~PcapCapture() {
+    if (m_writer.joinable()) {
+        {
+            std::scoped_lock l(m_mutex);
+            m_stopping = true;
+        }
+        m_wakeup.notify_one();
+        m_writer.join();
+    }
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+    if (m_capacity != 0) {
+        dbglog(m_log, "Captured {} packets ({} bytes), dropped {}, filtered out {}, evicted {}", m_stats.packets,
+                m_stats.bytes, m_stats.dropped, m_stats.filtered, m_stats.evicted);
+    }
+}
+
+bool PcapCapture::start(const char *filename) {
+    if (m_capacity == 0 || m_rolling) {
+        return false;
+    }
+
+    m_fd = open_output_file(filename);
+    if (m_fd == -1) {
+        errlog(m_log, "Can't open output file: {}", strerror(errno));
+        return false;
+    }
+    if (pcap_write_header(m_fd, m_snaplen) < 0) {
+        errlog(m_log, "Failed to write file header: {}", strerror(errno));
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    m_writer = std::thread([this] {
+        run_writer();
+    });
+    return true;
+}
+
+bool PcapCapture::is_active() const {
+    return m_capacity != 0 && (m_rolling || m_fd != -1) && !m_failed.load(std::memory_order_relaxed);
+}
+
+void PcapCapture::ring_write(size_t pos, const void *data, size_t len) {
+    size_t offset = pos & (m_capacity - 1);
+    size_t first = std::min(len, m_capacity - offset);
+    memcpy(&m_ring[offset], data, first);
+    memcpy(&m_ring[0], (const uint8_t *) data + first, len - first);
+}
+
+void PcapCapture::ring_read(size_t pos, void *data, size_t len) const {
+    size_t offset = pos & (m_capacity - 1);
+    size_t first = std::min(len, m_capacity - offset);
+    memcpy(data, &m_ring[offset], first);
+    memcpy((uint8_t *) data + first, &m_ring[0], len - first);
+}
+
+void PcapCapture::evict(size_t needed) {
+    size_t head = m_head.load(std::memory_order_relaxed);
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    while (m_capacity - (head - tail) < needed) {
+        pcap_sf_pkthdr rec; // NOLINT(cppcoreguidelines-pro-type-member-init)
+        ring_read(tail, &rec, sizeof(rec));
+        tail += sizeof(rec) + rec.caplen;
+        ++m_stats.evicted;
+    }
+    m_tail.store(tail, std::memory_order_relaxed);
+}
+
+void PcapCapture::capture(const timeval &tv, std::span<const evbuffer_iovec> chunks) {
+    if (!is_active()) {
+        return;
+    }
+    if (m_has_filter && !matches(chunks)) {
+        ++m_stats.filtered;
+        return;
+    }
+
+    size_t len = 0;
+    for (const evbuffer_iovec &chunk : chunks) {
+        len += chunk.iov_len;
+    }
+    size_t caplen = (m_snaplen != 0) ? std::min<size_t>(len, m_snaplen) : len;
+    size_t needed = sizeof(pcap_sf_pkthdr) + caplen;
+    if (needed > m_capacity) {
+        ++m_stats.dropped;
+        return;
+    }
+
+    size_t head = m_head.load(std::memory_order_relaxed);
+    size_t used = head - m_tail.load(std::memory_order_acquire);
+    if (m_capacity - used < needed) {
+        if (!m_rolling) {
+            ++m_stats.dropped;
+            return;
+        }
+        evict(needed);
+    }
+
+    pcap_sf_pkthdr rec = {.ts = {.tv_sec = (int32_t) tv.tv_sec, .tv_usec = (int32_t) tv.tv_usec},
+            .caplen = uint32_t(caplen),
+            .len = uint32_t(len)};
+    size_t pos = head;
+    ring_write(pos, &rec, sizeof(rec));
+    pos += sizeof(rec);
+    for (const evbuffer_iovec &chunk : chunks) {
+        size_t n = std::min(chunk.iov_len, caplen);
+        if (n == 0) {
+            break;
+        }
+        ring_write(pos, chunk.iov_base, n);
+        pos += n;
+        caplen -= n;
+    }
+    m_head.store(pos, std::memory_order_release);
+
+    ++m_stats.packets;
+    m_stats.bytes += pos - head - sizeof(rec);
+
+    // Do not let the writer sleep through a burst
+    if (!m_rolling && used < m_capacity / 2 && used + needed >= m_capacity / 2) {
+        m_wakeup.notify_one();
+    }
+}
+
+bool PcapCapture::endpoint_matches(const Endpoint &endpoint, const ip_addr_t &addr, uint16_t port) {
+    return (ip_addr_isany_val(endpoint.addr) || ip_addr_cmp(&endpoint.addr, &addr))
+            && (endpoint.port == 0 || endpoint.port == port);
+}
+
+bool PcapCapture::matches(std::span<const evbuffer_iovec> chunks) const {
+    uint8_t headers[FILTER_HEADERS_SIZE];
+    size_t len = 0;
+    for (const evbuffer_iovec &chunk : chunks) {
+        size_t n = std::min(chunk.iov_len, sizeof(headers) - len);
+        memcpy(headers + len, chunk.iov_base, n);
+        len += n;
+        if (len == sizeof(headers)) {
+            break;
+        }
+    }
+    if (len < IP_HLEN) {
+        return false;
+    }
+
+    uint8_t proto; // NOLINT(cppcoreguidelines-init-variables)
+    size_t ports_offset = 0;
+    ip_addr_t src;
+    ip_addr_t dst;
+    switch (IPH_V((const struct ip_hdr *) headers)) {
+    case 4: {
+        const auto *hdr = (const struct ip_hdr *) headers;
+        proto = IPH_PROTO(hdr);
+        ip_addr_copy_from_ip4(src, hdr->src);
+        ip_addr_copy_from_ip4(dst, hdr->dest);
+        // Non-first fragments have no transport header
+        if ((IPH_OFFSET(hdr) & PP_HTONS(IP_OFFMASK)) == 0) {
+            ports_offset = IPH_HL_BYTES(hdr);
+        }
+        break;
+    }
+    case 6: {
+        if (len < IP6_HLEN) {
+            return false;
+        }
+        const auto *hdr = (const struct ip6_hdr *) headers;
+        // Extension headers are not followed, so such packets only match filters without ports
+        proto = IP6H_NEXTH(hdr);
+        ip_addr_copy_from_ip6_packed(src, hdr->src);
+        ip_addr_copy_from_ip6_packed(dst, hdr->dest);
+        ports_offset = IP6_HLEN;
+        break;
+    }
+    default:
+        return false;
+    }
+
+    if (m_proto != 0 && proto != m_proto) {
+        return false;
+    }
+
+    uint16_t src_port = 0;
+    uint16_t dst_port = 0;
+    if ((proto == IP_PROTO_TCP || proto == IP_PROTO_UDP) && ports_offset != 0 && ports_offset + 4 <= len) {
+        src_port = (uint16_t(headers[ports_offset]) << 8) | headers[ports_offset + 1];
+        dst_port = (uint16_t(headers[ports_offset + 2]) << 8) | headers[ports_offset + 3];
+    }
+
+    return (endpoint_matches(m_endpoint_a, src, src_port) && endpoint_matches(m_endpoint_b, dst, dst_port))
+            || (endpoint_matches(m_endpoint_a, dst, dst_port) && endpoint_matches(m_endpoint_b, src, src_port));
+}
+
+void PcapCapture::run_writer() {
+    for (;;) {
+        size_t head = m_head.load(std::memory_order_acquire);
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (head == tail) {
+            std::unique_lock l(m_mutex);
+            if (m_stopping) {
+                break;
+            }
+            m_wakeup.wait_for(l, WRITER_PERIOD);
+            continue;
+        }
+
+        // The ring holds ready records, so it can be written out as is up to the wrap point
+        size_t offset = tail & (m_capacity - 1);
+        size_t len = std::min(head - tail, m_capacity - offset);
+        if (!write_all(m_fd, &m_ring[offset], len)) {
+            errlog(m_log, "Failed to write packets to file, stopping capture: {}", strerror(errno));
+            m_failed.store(true, std::memory_order_relaxed);
+            break;
+        }
+        m_tail.store(tail + len, std::memory_order_release);
+    }
+}
+
+bool PcapCapture::dump(const char *filename) const {
+    if (m_capacity == 0 || !m_rolling) {
+        return false;
+    }
+
+    int fd = open_output_file(filename);
+    if (fd == -1) {
+        errlog(m_log, "Can't open dump file: {}", strerror(errno));
+        return false;
+    }
+
+    size_t head = m_head.load(std::memory_order_relaxed);
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    size_t offset = tail & (m_capacity - 1);
+    size_t first = std::min(head - tail, m_capacity - offset);
+    bool ok = pcap_write_header(fd, m_snaplen) >= 0 && write_all(fd, &m_ring[offset], first)
+            && write_all(fd, &m_ring[0], head - tail - first);
+    if (!ok) {
+        errlog(m_log, "Failed to write dump file: {}", strerror(errno));
+    } else {
+        infolog(m_log, "Dumped {} bytes of packets to {}", head - tail, filename);
+    }
+    close(fd);
+    return ok;
+}
+
+TcpipPcapStats PcapCapture::get_stats() const {
+    return m_stats;
+}
+
+} // namespace ag
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+#include "lwipopts.h" // Include before LWIP headers
+
+#include <lwip/ip_addr.h>
+
+#include "common/logger.h"
+#include "tcpip/tcpip.h"
+
+namespace ag {
+
+/**
+ * Packet capture pipeline.
+ *
+ * Packets are copied (truncated to the snap length) into a single-producer single-consumer ring
+ * already in the pcap record format. In file mode a background thread drains the ring into the file,
+ * and the packets which do not fit into the ring are dropped, so the event loop never waits for the disk.
+ * In rolling mode there is no writer: the oldest packets are evicted to make room for the new ones,
+ * and the ring is written out on demand with `dump()`.
+ *
+ * `capture()`, `dump()` and `get_stats()` must be called from the same (event loop) thread.
+ */
+class PcapCapture {
+public:
+    explicit PcapCapture(const TcpipPcapParameters &params);
+    ~PcapCapture();
+
+    PcapCapture(const PcapCapture &) = delete;
+    PcapCapture &operator=(const PcapCapture &) = delete;
+    PcapCapture(PcapCapture &&) = delete;
+    PcapCapture &operator=(PcapCapture &&) = delete;
+
+    /**
+     * Open the output file and start the writer thread (file mode only)
+     * @return false if failed
+     */
+    bool start(const char *filename);
+
+    /**
+     * Check if the capture is working, i.e. the ring was allocated and, in file mode,
+     * the writer is running and has not failed
+     */
+    [[nodiscard]] bool is_active() const;
+
+    /**
+     * Capture a packet if it matches the filter
+     * @param tv packet timestamp
+     * @param chunks packet data starting with IP header
+     */
+    void capture(const timeval &tv, std::span<const evbuffer_iovec> chunks);
+
+    /**
+     * Check if a packet matches the filter
+     * @param chunks packet data starting with IP header
+     */
+    [[nodiscard]] bool matches(std::span<const evbuffer_iovec> chunks) const;
+
+    /**
+     * Write the packets held in the ring to a pcap file (rolling mode only)
+     * @return false if failed
+     */
+    bool dump(const char *filename) const;
+
+    [[nodiscard]] TcpipPcapStats get_stats() const;
+
+private:
+    /** Resolved `TcpipPcapFilter` endpoint */
+    struct Endpoint {
+        ip_addr_t addr; /**< Address (any matches any) */
+        uint16_t port;  /**< Port (0 matches any) */
+    };
+
+    uint32_t m_snaplen;
+    bool m_rolling;
+    uint8_t m_proto;
+    Endpoint m_endpoint_a;
+    Endpoint m_endpoint_b;
+    bool m_has_filter;
+
+    std::unique_ptr<uint8_t[]> m_ring;
+    size_t m_capacity = 0;       /**< Power of two */
+    std::atomic<size_t> m_head;  /**< Total number of bytes written by the producer */
+    std::atomic<size_t> m_tail;  /**< Total number of bytes consumed by the writer (or evicted) */
+    std::atomic<bool> m_failed;  /**< The writer failed and the capture is off */
+
+    int m_fd = -1;
+    std::thread m_writer;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    bool m_stopping = false; /**< Guarded by `m_mutex` */
+
+    TcpipPcapStats m_stats{};
+    ag::Logger m_log{"TCPIP.PCAP"};
+
+    void ring_write(size_t pos, const void *data, size_t len);
+    void ring_read(size_t pos, void *data, size_t len) const;
+    void evict(size_t needed);
+    void run_writer();
+    static bool endpoint_matches(const Endpoint &endpoint, const ip_addr_t &addr, uint16_t port);
+};
+
+} // namespace ag
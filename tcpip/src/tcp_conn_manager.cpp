@@ -4,6 +4,7 @@
 #include <unistd.h>
 #endif
 
+#include <algorithm>
 #include <assert.h>
 #include <cerrno>
 #include <cstdlib>
@@ -76,7 +77,120 @@ static void tcp_refresh_connection_timeout(TcpConnDescriptor *connection) {
         break;
     }
 
-    tcpip_refresh_connection_timeout_with_interval(connection->common.parent_ctx, &connection->common, timeout);
+    tcpip_refresh_connection_timeout_with_interval(
+            &connection->common.parent_ctx->tcp.connections, &connection->common, timeout);
+}
+
+/*
+ * Receive window auto-tuning.
+ *
+ * The receive window of a connection bounds the data received from the client but not yet consumed
+ * by the upstream, i.e. the memory the connection may pin. A connection starts with a small window.
+ * The window is doubled once the upstream has consumed a whole window since the last change while
+ * the window was almost full, i.e. the client was limited by the window rather than by the upstream.
+ * On every timer tick, the window is halved for the connections which consumed less than a quarter of it
+ * during the tick, and is reset to the minimum for the idle ones.
+ * The windows of all connections are kept within the budget, growing ones take only what is left.
+ * Only the connections which had some traffic during the tick or have a window above the minimum
+ * are revisited, so that idle connections cost nothing.
+ */
+
+static_assert(TCPIP_TCP_MAX_RECV_WND == (0xffff << TCP_RCV_SCALE), "Must be the largest window the scale allows");
+
+static uint32_t tcp_wnd_max(const TcpipCtx *ctx) {
+    uint32_t max = TCPIP_TCP_MAX_RECV_WND;
+    return (ctx->parameters.tcp_recv_buf_size > 0) ? std::min(ctx->parameters.tcp_recv_buf_size, max) : max;
+}
+
+static uint32_t tcp_wnd_min(const TcpipCtx *ctx) {
+    return std::min<uint32_t>(TCPIP_TCP_MIN_RECV_WND, tcp_wnd_max(ctx));
+}
+
+static size_t tcp_wnd_budget(const TcpipCtx *ctx) {
+    return (ctx->parameters.tcp_recv_buf_budget > 0) ? ctx->parameters.tcp_recv_buf_budget
+                                                     : TCPIP_DEFAULT_TCP_RECV_BUF_BUDGET;
+}
+
+static void tcp_wnd_mark_tuned(TcpConnDescriptor *connection) {
+    if (!connection->rcv_tuned) {
+        connection->rcv_tuned = true;
+        connection->common.parent_ctx->tcp.rcv_wnd_tuned.push_back(connection->common.id);
+    }
+}
+
+static void tcp_wnd_reset_period(TcpConnDescriptor *connection) {
+    connection->rcv_drained = 0;
+    connection->rcv_wnd_full = false;
+    connection->rcv_active = false;
+}
+
+static void tcp_wnd_set_limit(TcpConnDescriptor *connection, uint32_t limit) {
+    TcpCtx *tcp = &connection->common.parent_ctx->tcp;
+    tcp_pcb *pcb = connection->pcb;
+    uint32_t old_limit = connection->rcv_wnd_limit;
+
+    tcp->rcv_wnd_total = tcp->rcv_wnd_total - old_limit + limit;
+    connection->rcv_wnd_limit = limit;
+    pcb->rcv_wnd_max = limit;
+    if (limit > old_limit) {
+        // Open the window right away instead of waiting for the upstream to consume more data
+        tcp_raw_slide_window(pcb, limit - old_limit);
+    } else if (pcb->rcv_wnd > limit) {
+        // The announced right edge is not retracted, the window closes as the data arrives
+        pcb->rcv_wnd = limit;
+    }
+
+    log_conn(connection, trace, "Receive window limit: {} -> {} (total {})", old_limit, limit, tcp->rcv_wnd_total);
+}
+
+static void tcp_wnd_init(TcpConnDescriptor *connection) {
+    TcpipCtx *ctx = connection->common.parent_ctx;
+    tcp_pcb *pcb = connection->pcb;
+    if (!(pcb->flags & TF_WND_SCALE)) {
+        // Without the window scale option, the window is fixed at 64 KB at most and is not tuned
+        if (ctx->parameters.tcp_recv_buf_size > 0) {
+            auto limit = uint32_t(TCPWND16(ctx->parameters.tcp_recv_buf_size));
+            pcb->rcv_wnd_max = limit;
+            pcb->rcv_wnd = pcb->rcv_ann_wnd = limit;
+        }
+        return;
+    }
+
+    // SYN-ACK has announced no more than 64 KB, so nothing is retracted here
+    uint32_t limit = tcp_wnd_min(ctx);
+    pcb->rcv_wnd_max = limit;
+    pcb->rcv_wnd = pcb->rcv_ann_wnd = limit;
+    connection->rcv_wnd_limit = limit;
+    ctx->tcp.rcv_wnd_total += limit;
+    tcp_wnd_reset_period(connection);
+}
+
+static void tcp_wnd_maybe_grow(TcpConnDescriptor *connection) {
+    if (!connection->rcv_wnd_full || connection->rcv_drained < connection->rcv_wnd_limit) {
+        return;
+    }
+
+    const TcpipCtx *ctx = connection->common.parent_ctx;
+    size_t total = ctx->tcp.rcv_wnd_total;
+    size_t budget = tcp_wnd_budget(ctx);
+    size_t available = (budget > total) ? budget - total : 0;
+    uint32_t limit = connection->rcv_wnd_limit;
+    auto new_limit = uint32_t(std::min<size_t>({size_t(limit) * 2, tcp_wnd_max(ctx), limit + available}));
+    // Start a new period either way, so that the next decision is based on the fresh data
+    tcp_wnd_reset_period(connection);
+    connection->rcv_active = true;
+    if (new_limit > limit) {
+        tcp_wnd_set_limit(connection, new_limit);
+    }
+}
+
+static void tcp_wnd_on_tick(TcpConnDescriptor *connection) {
+    uint32_t limit = connection->rcv_wnd_limit;
+    uint32_t min_limit = tcp_wnd_min(connection->common.parent_ctx);
+    if (limit > min_limit && connection->rcv_drained < limit / 4) {
+        tcp_wnd_set_limit(connection, connection->rcv_active ? std::max(limit / 2, min_limit) : min_limit);
+    }
+    tcp_wnd_reset_period(connection);
 }
 
 static void process_forwarded_connection(TcpConnDescriptor *connection) {
@@ -97,10 +211,27 @@ static void process_forwarded_connection(TcpConnDescriptor *connection) {
 void tcp_cm_sent_to_remote(TcpConnDescriptor *connection, size_t n) {
     if (connection->pcb != nullptr) {
         tcp_raw_slide_window(connection->pcb, n);
+        if (connection->rcv_wnd_limit != 0) {
+            connection->rcv_drained += n;
+            tcp_wnd_mark_tuned(connection);
+            tcp_wnd_maybe_grow(connection);
+        }
     }
     tcp_refresh_connection_timeout(connection);
 }
 
+void tcp_cm_data_received(TcpConnDescriptor *connection) {
+    if (connection->rcv_wnd_limit == 0) {
+        return;
+    }
+    connection->rcv_active = true;
+    tcp_wnd_mark_tuned(connection);
+    // The window has already been decreased by the received data
+    if (connection->pcb->rcv_wnd < connection->rcv_wnd_limit / 4) {
+        connection->rcv_wnd_full = true;
+    }
+}
+
 static void process_and_close(TcpConnDescriptor *connection) {
     struct netif *netif = connection->common.parent_ctx->netif;
     pbuf *buf = std::exchange(connection->buffer, nullptr);
@@ -128,9 +259,7 @@ static void process_unreachable_connection(TcpConnDescriptor *connection) {
 }
 
 bool tcp_cm_init(TcpipCtx *ctx) {
-
-    ctx->tcp.connections.by_id = kh_init(connections_by_id);
-    ctx->tcp.connections.by_addr = kh_init(connections_by_addr);
+    ctx->tcp.connections.proto = IP_PROTO_TCP;
 
     err_t raw_init_result = tcp_raw_init(ctx);
     if (ERR_OK != raw_init_result) {
@@ -147,27 +276,18 @@ void tcp_cm_close(TcpipCtx *ctx) {
 
     tcp_cm_clean_up(ctx);
 
-    kh_destroy(connections_by_id, ctx->tcp.connections.by_id);
-    ctx->tcp.connections.by_id = nullptr;
-    kh_destroy(connections_by_addr, ctx->tcp.connections.by_addr);
-    ctx->tcp.connections.by_addr = nullptr;
+    ctx->tcp.connections.flows.clear();
+    ctx->tcp.connections.timeouts.clear();
+    ctx->tcp.rcv_wnd_tuned.clear();
 
     dbglog(ctx->tcp.log, "Closed");
 }
 
 void tcp_cm_clean_up(TcpipCtx *ctx) {
-    if (ctx->tcp.connections.by_id == nullptr) {
-        return;
-    }
-
-    khash_t(connections_by_id) *table = ctx->tcp.connections.by_id;
-    for (khiter_t it = kh_begin(table); it != kh_end(table); ++it) {
-        if (!kh_exist(table, it)) {
-            continue;
-        }
-        auto *conn = (TcpConnDescriptor *) kh_value(table, it);
+    ctx->tcp.connections.flows.for_each([ctx](void *value) {
+        auto *conn = (TcpConnDescriptor *) value;
         tcp_cm_close_descriptor(ctx, conn->common.id, true);
-    }
+    });
 }
 
 void tcp_cm_complete_connect_request(TcpipCtx *, TcpConnDescriptor *connection, TcpipAction action) {
@@ -244,16 +364,16 @@ void tcp_cm_data_sent_notify(TcpConnDescriptor *connection, size_t length) {
 }
 
 void tcp_cm_close_descriptor(TcpipCtx *ctx, uint64_t id, bool graceful) {
-    khiter_t i = kh_get(connections_by_id, ctx->tcp.connections.by_id, id);
-    if (i == kh_end(ctx->tcp.connections.by_id)) {
+    auto *connection = (TcpConnDescriptor *) tcpip_get_connection_by_id(&ctx->tcp.connections, id);
+    if (connection == nullptr) {
         return;
     }
 
-    auto *connection = (TcpConnDescriptor *) kh_value(ctx->tcp.connections.by_id, i);
     log_conn(connection, trace, "Closing connection {}", (void *) connection);
 
     tcp_raw_close(connection->pcb, graceful);
     connection->pcb = nullptr;
+    ctx->tcp.rcv_wnd_total -= connection->rcv_wnd_limit;
 
     if (nullptr != connection->buffer) {
         pbuf_free(connection->buffer);
@@ -266,16 +386,16 @@ void tcp_cm_close_descriptor(TcpipCtx *ctx, uint64_t id, bool graceful) {
     tcpip_remove_connection(&ctx->tcp.connections, &connection->common);
 
     log_conn(connection, trace, "Connection closed {}, {} active connections left", (void *) connection,
-            kh_size(ctx->tcp.connections.by_id));
+            ctx->tcp.connections.flows.size());
 
     free(connection); // NOLINT(cppcoreguidelines-no-malloc,hicpp-no-malloc)
 }
 
-int tcp_cm_receive(TcpConnDescriptor *connection, size_t iovlen, const evbuffer_iovec *iov) {
+int tcp_cm_receive(TcpConnDescriptor *connection, size_t iovlen, const evbuffer_iovec *iov, const struct pbuf *buffer) {
     TcpipCtx *ctx = connection->common.parent_ctx;
     TcpipHandler *callbacks = &ctx->parameters.handler;
 
-    TcpipReadEvent event = {connection->common.id, iovlen, iov, 0};
+    TcpipReadEvent event = {connection->common.id, iovlen, iov, 0, (TcpipBuffer *) buffer};
     callbacks->handler(callbacks->arg, TCPIP_EVENT_READ, &event);
 
     return event.result;
@@ -298,12 +418,17 @@ TcpConnDescriptor *tcp_cm_create_descriptor(TcpipCtx *ctx, struct pbuf *buffer,
     common->addr = {*src_addr, src_port, *dst_addr, dst_port};
     common->parent_ctx = ctx;
 
+    if (!tcpip_put_connection(&ctx->tcp.connections, common)) {
+        // Either the flow or the ID is taken already, the packet is dropped by the caller
+        log_conn(connection, dbg, "Failed to register connection");
+        free(connection); // NOLINT(cppcoreguidelines-no-malloc,hicpp-no-malloc)
+        return nullptr;
+    }
+
     connection->buffer = buffer;
 
     tcp_refresh_connection_timeout(connection);
 
-    tcpip_put_connection(&ctx->tcp.connections, common);
-
     return connection;
 }
 
@@ -323,11 +448,18 @@ void tcp_cm_request_connection(TcpipCtx *ctx, TcpConnDescriptor *connection) {
     SocketAddress src = ip_addr_to_socket_address(&common->addr.src_ip, common->addr.src_port);
     SocketAddress dst = ip_addr_to_socket_address(&common->addr.dst_ip, common->addr.dst_port);
 
+    // The buffer holds the SYN segment which is passed to the stack once the connection is accepted
+    uint8_t dscp = 0;
+    if (connection->buffer != nullptr) {
+        dscp = ip_packet_dscp((const uint8_t *) connection->buffer->payload, connection->buffer->len);
+    }
+
     TcpipConnectRequestEvent event = {
             common->id,
             IPPROTO_TCP,
             &src,
             &dst,
+            dscp,
     };
 
     TcpipHandler *callbacks = &ctx->parameters.handler;
@@ -348,25 +480,33 @@ void tcp_cm_timer_tick(TcpipCtx *ctx) {
      * For tunneled connections, there is 30 seconds timeout for connecting to remote host.
      */
 
-    timeval now;
-    event_base_gettimeofday_cached(vpn_event_loop_get_base(ctx->parameters.event_loop), &now);
-
-    khash_t(connections_by_id) *table = ctx->tcp.connections.by_id;
-    for (khiter_t it = kh_begin(table); it != kh_end(table); ++it) {
-        if (!kh_exist(table, it)) {
+    std::vector<uint64_t> tuned = std::exchange(ctx->tcp.rcv_wnd_tuned, {});
+    for (uint64_t id : tuned) {
+        auto *conn = (TcpConnDescriptor *) tcpip_get_connection_by_id(&ctx->tcp.connections, id);
+        if (conn == nullptr) {
             continue;
         }
-        auto *conn = (TcpConnDescriptor *) kh_value(table, it);
-        if (timercmp(&conn->common.conn_timeout, &now, <)) {
-            log_conn(conn, dbg, "Connection has timed out in state {}", tcp_conn_state_str(conn->state));
-            tcp_cm_close_descriptor(ctx, conn->common.id, false);
+        conn->rcv_tuned = false;
+        if (conn->pcb != nullptr && conn->rcv_wnd_limit != 0) {
+            tcp_wnd_on_tick(conn);
+            // Keep revisiting the window until it shrinks back to the minimum
+            if (conn->rcv_wnd_limit > tcp_wnd_min(ctx)) {
+                tcp_wnd_mark_tuned(conn);
+            }
         }
     }
+
+    tcpip_expire_connections(ctx, &ctx->tcp.connections, [ctx](TcpipConnection *common) {
+        auto *conn = (TcpConnDescriptor *) common;
+        log_conn(conn, dbg, "Connection has timed out in state {}", tcp_conn_state_str(conn->state));
+        tcp_cm_close_descriptor(ctx, conn->common.id, false);
+    });
 }
 
 bool tcp_cm_accept(TcpConnDescriptor *connection, struct tcp_pcb *newpcb) {
     connection->state = TCP_CONN_STATE_ACCEPTED;
     connection->pcb = newpcb;
+    tcp_wnd_init(connection);
     tcp_refresh_connection_timeout(connection);
 
     TcpipHandler *callbacks = &connection->common.parent_ctx->parameters.handler;
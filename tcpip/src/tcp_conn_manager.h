@@ -3,9 +3,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <vector>
+
 #include "lwipopts.h" // Include before LWIP headers
 
-#include <khash.h>
 #include <lwip/prot/tcp.h>
 
 #include "common/logger.h"
@@ -15,8 +16,10 @@
 namespace ag {
 
 typedef struct TcpCtx {
-    struct tcp_pcb *tun_pcb;      /**< TUN TCP control block */
-    ConnectionTables connections; /**< List of connections */
+    struct tcp_pcb *tun_pcb;             /**< TUN TCP control block */
+    ConnectionTables connections;        /**< List of connections */
+    size_t rcv_wnd_total;                /**< Sum of receive window limits of all connections */
+    std::vector<uint64_t> rcv_wnd_tuned; /**< IDs of the connections whose windows are revised on the next tick */
     ag::Logger log{"TCPIP.TCPMNGR"};
 } TcpCtx;
 
@@ -81,12 +84,14 @@ void tcp_cm_close_descriptor(TcpipCtx *ctx, uint64_t id, bool graceful);
  * Handles received data from TCP/IP stack
  *
  * @param descriptor connection descriptor
- * @param data received data
- * @param size size of received data
+ * @param iovlen message vector size
+ * @param iov received data
+ * @param buffer the pbuf chain the data belongs to (the handler may take references to it)
  *
  * @return     0 if success, -1 otherwise
  */
-int tcp_cm_receive(TcpConnDescriptor *descriptor, size_t iovlen, const struct evbuffer_iovec *iov);
+int tcp_cm_receive(
+        TcpConnDescriptor *descriptor, size_t iovlen, const struct evbuffer_iovec *iov, const struct pbuf *buffer);
 
 /**
  * Creates and initializes new TCP connection descriptor
@@ -139,6 +144,14 @@ bool tcp_cm_accept(TcpConnDescriptor *descriptor, struct tcp_pcb *newpcb);
  */
 void tcp_cm_sent_to_remote(TcpConnDescriptor *descriptor, size_t n);
 
+/**
+ * Notify connection that some data was received from the client and is about to be raised
+ * with `TCPIP_EVENT_READ` callback
+ *
+ * @param descriptor TCP connection descriptor
+ */
+void tcp_cm_data_received(TcpConnDescriptor *descriptor);
+
 /**
  * Get flow control info for connection
  * @param conn connection descriptor
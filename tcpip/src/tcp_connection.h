@@ -28,9 +28,14 @@ typedef enum {
  */
 typedef struct {
     TcpipConnection common;
-    TcpConnState state;  /**< Connection state */
-    struct pbuf *buffer; /**< Raised data buffer */
-    struct tcp_pcb *pcb; /**< TCP control block */
+    TcpConnState state;     /**< Connection state */
+    struct pbuf *buffer;    /**< Raised data buffer */
+    struct tcp_pcb *pcb;    /**< TCP control block */
+    uint32_t rcv_wnd_limit; /**< Current receive window limit (0 if the window is not tuned) */
+    size_t rcv_drained;     /**< Bytes consumed by the upstream during the current tuning period */
+    bool rcv_wnd_full;      /**< The receive window was almost full during the current tuning period */
+    bool rcv_active;        /**< Some data was received during the current tuning period */
+    bool rcv_tuned;         /**< The connection is listed in `TcpCtx::rcv_wnd_tuned` */
 } TcpConnDescriptor;
 
 } // namespace ag
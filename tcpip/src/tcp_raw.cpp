@@ -125,7 +125,7 @@ static err_t process_data(TcpConnDescriptor *conn, const struct pbuf *buffer) {
         });
     }
 
-    int recv_result = tcp_cm_receive(conn, iov.size(), iov.data());
+    int recv_result = tcp_cm_receive(conn, iov.size(), iov.data(), buffer);
     if (0 > recv_result) {
         // Negative result means connection is closed during receive
         return ERR_ABRT;
@@ -155,6 +155,7 @@ static err_t process_recv_event(TcpConnDescriptor *conn, struct pbuf *buffer) {
         if (buffer->flags & PBUF_FLAG_PUSH) {
             tcp_set_flags(conn->pcb, TF_ACK_NOW);
         }
+        tcp_cm_data_received(conn);
         result = process_data(conn, buffer);
         break;
     case TCP_CONN_STATE_CLOSING_BY_CLIENT:
@@ -223,11 +224,8 @@ static err_t tcp_raw_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
     tcp_setprio(newpcb, TCP_PRIO_MIN);
     tcp_nagle_disable(newpcb);
 
-    // Apply runtime TCP buffer size overrides (for constrained devices like routers)
-    if (ctx->parameters.tcp_recv_buf_size > 0) {
-        newpcb->rcv_wnd_max = ctx->parameters.tcp_recv_buf_size;
-        newpcb->rcv_wnd = newpcb->rcv_ann_wnd = ctx->parameters.tcp_recv_buf_size;
-    }
+    // Apply runtime TCP buffer size overrides (for constrained devices like routers).
+    // The receive window is tuned by the connection manager.
     if (ctx->parameters.tcp_send_buf_size > 0) {
         newpcb->snd_buf = ctx->parameters.tcp_send_buf_size;
     }
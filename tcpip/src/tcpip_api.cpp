@@ -16,9 +16,13 @@
 #include <string.h>
 #include <time.h>
 
+#include <algorithm>
+#include <iterator>
+
 #include <event2/util.h>
 
 #include "common/logger.h"
+#include "lwip_mem_pools.h"
 #include "tcp_connection.h"
 #include "tcpip_common.h"
 
@@ -43,6 +47,13 @@ TcpipCtx *tcpip_open(const TcpipParameters *params) {
         return nullptr;
     }
 
+    for (size_t i = 0; params->tun_fd >= 0 && i < params->tun_queue_fds.size; ++i) {
+        if (evutil_make_socket_nonblocking(params->tun_queue_fds.data[i]) == -1) {
+            errlog(g_logger, "open: failed to make tun queue fd non-blocking");
+            return nullptr;
+        }
+    }
+
     TcpipCtx *ctx = tcpip_init_internal(params);
     if (nullptr == ctx) {
         errlog(g_logger, "open: failed");
@@ -137,8 +148,52 @@ TcpFlowCtrlInfo tcpip_flow_ctrl_info(const TcpipCtx *ctx, uint64_t id) {
     return {};
 }
 
+size_t tcpip_get_mem_pool_stats(const TcpipCtx *, TcpipMemPoolStats *stats, size_t max_num) {
+    return lwip_mem_pools_get_stats(stats, max_num);
+}
+
+size_t tcpip_get_flow_table_stats(const TcpipCtx *ctx, TcpipFlowTableStats *stats, size_t max_num) {
+    const struct {
+        const char *name;
+        const FlowTable *table;
+    } tables[] = {
+            {"TCP", &ctx->tcp.connections.flows},
+            {"UDP", &ctx->udp.connections.flows},
+            {"ICMP", &ctx->icmp.requests},
+    };
+    for (size_t i = 0; i < std::min(std::size(tables), max_num); ++i) {
+        stats[i] = tables[i].table->get_stats();
+        stats[i].name = tables[i].name;
+    }
+    return std::size(tables);
+}
+
+bool tcpip_dump_pcap(TcpipCtx *ctx, const char *filename) {
+    return ctx->pcap != nullptr && ctx->pcap->dump(filename);
+}
+
+bool tcpip_get_pcap_stats(const TcpipCtx *ctx, TcpipPcapStats *stats) {
+    if (ctx->pcap == nullptr) {
+        return false;
+    }
+    *stats = ctx->pcap->get_stats();
+    return true;
+}
+
 void tcpip_process_icmp_echo_reply(TcpipCtx *ctx, const IcmpEchoReply *reply) {
     icmp_rm_process_reply(ctx, reply);
 }
 
+void tcpip_buffer_ref(TcpipBuffer *buffer) {
+    pbuf_ref((struct pbuf *) buffer);
+}
+
+void tcpip_buffer_unref(TcpipBuffer *buffer) {
+    pbuf_free((struct pbuf *) buffer);
+}
+
+TcpipBuffer *tcpip_buffer_next(TcpipBuffer *buffer) {
+    return (TcpipBuffer *) ((struct pbuf *) buffer)->next;
+}
+
 } // namespace ag
@@ -3,32 +3,13 @@
 #ifndef _WIN32
 #include <unistd.h>
 #endif
-#ifdef __GLIBC__
-#include <malloc.h>
-#elif defined(__MACH__)
-#include <malloc/malloc.h>
-#elif defined(_WIN32)
-#include <windows.h>
-// HeapOptimizeResources requires NTDDI_VERSION > NTDDI_WINBLUE in SDK headers,
-// but we target Win7 (_WIN32_WINNT=0x0601). Define the constants manually
-// so we can call HeapSetInformation via GetProcAddress at runtime.
-#ifndef HeapOptimizeResources
-#define HeapOptimizeResources static_cast<HEAP_INFORMATION_CLASS>(3)
-#endif
-#ifndef HEAP_OPTIMIZE_RESOURCES_CURRENT_VERSION
-#define HEAP_OPTIMIZE_RESOURCES_CURRENT_VERSION 1
-struct HEAP_OPTIMIZE_RESOURCES_INFORMATION {
-    DWORD Version;
-    DWORD Flags;
-};
-#endif
-#endif
 
 #include <cstdlib>
 #include <cstring>
 #include <errno.h>
 #include <fcntl.h>
 #include <span>
+#include <utility>
 #include <vector>
 
 #include <common/utils.h>
@@ -47,8 +28,11 @@ struct HEAP_OPTIMIZE_RESOURCES_INFORMATION {
 #include "tcpip/tcpip.h"
 #include "tcpip_common.h"
 #include "tcpip_util.h"
+#include "tun_offload.h"
 #include "udp_conn_manager.h"
+#include "udp_fast_path.h"
 #include "vpn/utils.h"
+#include "zerocopy_pbuf.h"
 
 namespace ag {
 
@@ -61,26 +45,37 @@ namespace ag {
 static constexpr size_t TUN_READ_BUDGET = 64;
 
 static constexpr int DEFAULT_PACKET_POOL_SIZE = 25;
+
 static constexpr const char *NETIF_NAME = "tn";
 static constexpr TimerTickNotifyFn TIMER_TICK_NOTIFIERS[] = {
         tcp_cm_timer_tick,
         udp_cm_timer_tick,
 };
 
-static int s_malloc_trim_tick_counter = 0;
-static constexpr int MALLOC_TRIM_INTERVAL_TICKS = 600; // ~30 minutes (tick = TIMER_PERIOD_S = 3s)
-
-static void dump_packet_to_pcap(TcpipCtx *ctx, const uint8_t *data, size_t len);
-static void dump_packet_iovec_to_pcap(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks);
-static void open_pcap_file(TcpipCtx *ctx, const char *pcap_filename);
+static void dump_packet_to_pcap(TcpipCtx *ctx, std::span<const evbuffer_iovec> chunks);
+static void start_pcap_capture(TcpipCtx *ctx);
 static void process_input_packet(TcpipCtx *ctx, VpnPacket *packet);
+static void deliver_input_packet(void *arg, pbuf *buffer);
 #ifdef __MACH__
 static err_t tun_output_to_utun_fd(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks, int family);
 #endif /* __MACH__ */
 #ifndef _WIN32
-static err_t tun_output_to_fd(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks);
+static err_t tun_output_to_fd(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks, struct pbuf *owner);
+static evutil_socket_t tun_select_queue_fd(const TcpipCtx *ctx, std::span<evbuffer_iovec> chunks);
+static err_t tun_writev(evutil_socket_t fd, std::span<evbuffer_iovec> chunks);
+static err_t tun_write(TcpipCtx *ctx, evutil_socket_t fd, std::span<evbuffer_iovec> chunks, struct pbuf *owner);
+#endif
+#ifdef TCPIP_HAVE_IO_URING
+static err_t tun_uring_write(
+        TcpipCtx *ctx, evutil_socket_t fd, std::span<evbuffer_iovec> chunks, struct pbuf *owner);
 #endif
-static err_t tun_output_to_callback(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks, int family);
+#ifdef __linux__
+static err_t tun_output_offloaded(
+        TcpipCtx *ctx, evutil_socket_t fd, std::span<evbuffer_iovec> chunks, struct pbuf *owner);
+static void tso_flush(TcpipCtx *ctx);
+#endif
+static err_t tun_output_to_callback(
+        TcpipCtx *ctx, std::span<evbuffer_iovec> chunks, int family, struct pbuf *owner);
 
 static err_t tun_output(const struct netif *netif, const struct pbuf *packet_buffer, int family) {
     auto *ctx = (TcpipCtx *) netif->state;
@@ -99,28 +94,33 @@ static err_t tun_output(const struct netif *netif, const struct pbuf *packet_buf
 
     tracelog(ctx->logger, "TUN output: {} bytes", (int) packet_buffer->tot_len);
 
+    return tcpip_tun_output(ctx, {chunks.data(), chunks.size()}, family, (struct pbuf *) packet_buffer);
+}
+
+err_t tcpip_tun_output(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks, int family, struct pbuf *owner) {
     err_t err;
     if (ctx->parameters.tun_fd != -1) {
 #ifdef __MACH__
-        err = tun_output_to_utun_fd(ctx, {chunks.data(), chunks.size()}, family);
+        err = tun_output_to_utun_fd(ctx, chunks, family);
 #elif !defined _WIN32
-        err = tun_output_to_fd(ctx, {chunks.data(), chunks.size()});
+        err = tun_output_to_fd(ctx, chunks, owner);
 #else
         err = ERR_ARG;
 #endif
     } else {
-        err = tun_output_to_callback(ctx, {chunks.data(), chunks.size()}, family);
+        err = tun_output_to_callback(ctx, chunks, family, owner);
     }
 
-    if (err == ERR_OK && ctx->pcap_fd != -1) {
-        dump_packet_iovec_to_pcap(ctx, {chunks.data(), chunks.size()});
+    if (err == ERR_OK && ctx->pcap != nullptr) {
+        dump_packet_to_pcap(ctx, chunks);
     }
 
     return err;
 }
 
-static err_t tun_output_to_callback(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks, int family) {
-    TcpipTunOutputEvent info = {family, {chunks.size(), chunks.data()}};
+static err_t tun_output_to_callback(
+        TcpipCtx *ctx, std::span<evbuffer_iovec> chunks, int family, struct pbuf *owner) {
+    TcpipTunOutputEvent info = {family, {chunks.size(), chunks.data()}, (TcpipBuffer *) owner};
 
     TcpipHandler *callbacks = &ctx->parameters.handler;
     callbacks->handler(callbacks->arg, TCPIP_EVENT_TUN_OUTPUT, &info);
@@ -129,11 +129,50 @@ static err_t tun_output_to_callback(TcpipCtx *ctx, std::span<evbuffer_iovec> chu
 }
 
 #ifndef _WIN32
-static err_t tun_output_to_fd(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks) {
+/**
+ * Pin packets of the same flow to the same queue to keep them in order
+ */
+static evutil_socket_t tun_select_queue_fd(const TcpipCtx *ctx, std::span<evbuffer_iovec> chunks) {
+    if (ctx->tun_fds.size() == 1) {
+        return ctx->tun_fds.front();
+    }
+
+    // The chain always starts with the IP header
+    const evbuffer_iovec &header = chunks.front();
+    uint64_t hash = ip_packet_flow_hash((const uint8_t *) header.iov_base, header.iov_len);
+    return ctx->tun_fds[hash % ctx->tun_fds.size()];
+}
+
+static err_t tun_output_to_fd(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks, struct pbuf *owner) {
+    evutil_socket_t fd = tun_select_queue_fd(ctx, chunks);
+#ifdef __linux__
+    if (ctx->parameters.tun_offload) {
+        return tun_output_offloaded(ctx, fd, chunks, owner);
+    }
+#endif
+    return tun_write(ctx, fd, chunks, owner);
+}
+
+/**
+ * Write a packet to a TUN queue
+ * @param chunks the packet (in offload mode, the first chunk is always `VirtioNetHdr`)
+ * @param owner chain backing the rest of the chunks, referenced to write them asynchronously without copying
+ *              (if null, the chunks are valid only during the call)
+ */
+static err_t tun_write(TcpipCtx *ctx, evutil_socket_t fd, std::span<evbuffer_iovec> chunks, struct pbuf *owner) {
+#ifdef TCPIP_HAVE_IO_URING
+    if (ctx->uring != nullptr) {
+        return tun_uring_write(ctx, fd, chunks, owner);
+    }
+#endif
+    return tun_writev(fd, chunks);
+}
+
+static err_t tun_writev(evutil_socket_t fd, std::span<evbuffer_iovec> chunks) {
     err_t err = ERR_OK;
 
     /* Write packet to TUN */
-    ssize_t written = writev(ctx->parameters.tun_fd, chunks.data(), static_cast<int>(chunks.size()));
+    ssize_t written = writev(fd, chunks.data(), static_cast<int>(chunks.size()));
     if (-1 == written) {
         if (errno == EWOULDBLOCK) {
             err = ERR_MEM;
@@ -146,6 +185,57 @@ static err_t tun_output_to_fd(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks) {
 }
 #endif // !defined _WIN32
 
+#ifdef __linux__
+/**
+ * Write a packet to TUN device in offload mode.
+ * TCP data segments are accumulated into a TSO super-segment, which is written out
+ * by `tso_flush_event` once the current event loop iteration has produced everything it could.
+ */
+static err_t tun_output_offloaded(
+        TcpipCtx *ctx, evutil_socket_t fd, std::span<evbuffer_iovec> chunks, struct pbuf *owner) {
+    bool appended = ctx->tso->append(fd, chunks);
+    if (!appended && !ctx->tso->empty()) {
+        tso_flush(ctx);
+        appended = ctx->tso->append(fd, chunks);
+    }
+    if (appended) {
+        event_active(ctx->tso_flush_event, 0, 0);
+        return ERR_OK;
+    }
+
+    // Not coalescable, so write it as is
+    VirtioNetHdr hdr{};
+    std::vector<evbuffer_iovec> &new_chunks = ctx->tso_chunks;
+    new_chunks.clear();
+    new_chunks.push_back({.iov_base = &hdr, .iov_len = sizeof(hdr)});
+    new_chunks.insert(new_chunks.end(), chunks.begin(), chunks.end());
+    return tun_write(ctx, fd, {new_chunks.data(), new_chunks.size()}, owner);
+}
+
+static void tso_flush(TcpipCtx *ctx) {
+    if (ctx->tso == nullptr || ctx->tso->empty()) {
+        return;
+    }
+
+    evutil_socket_t fd = ctx->tso->fd();
+    VirtioNetHdr hdr{};
+    std::span<const uint8_t> segment = ctx->tso->finish(&hdr);
+    evbuffer_iovec chunks[] = {
+            {.iov_base = &hdr, .iov_len = sizeof(hdr)},
+            {.iov_base = (void *) segment.data(), .iov_len = segment.size()},
+    };
+    if (ERR_OK != tun_write(ctx, fd, chunks, nullptr)) {
+        // Segments are already acknowledged to LWIP as sent, they will be retransmitted
+        dbglog(ctx->logger, "TUN output: failed to write TSO super-segment of {} bytes (errno={})", segment.size(),
+                strerror(errno));
+    }
+}
+
+static void tso_flush_callback(evutil_socket_t, short, void *arg) {
+    tso_flush((TcpipCtx *) arg);
+}
+#endif // __linux__
+
 #ifdef __MACH__
 struct UtunHdr {
     int family;
@@ -159,7 +249,7 @@ static err_t tun_output_to_utun_fd(TcpipCtx *ctx, std::span<evbuffer_iovec> chun
     for (const evbuffer_iovec &chunk : chunks) {
         new_chunks.push_back(chunk);
     }
-    return tun_output_to_fd(ctx, {new_chunks.data(), new_chunks.size()});
+    return tun_output_to_fd(ctx, {new_chunks.data(), new_chunks.size()}, nullptr);
 }
 #endif /* __MACH__ */
 
@@ -199,13 +289,13 @@ enum TunReadStatus {
  * @return see TunReadStatus fields description
  */
 #ifdef __MACH__
-static TunReadStatus process_data_from_utun(TcpipCtx *ctx, VpnPacket *packet) {
+static TunReadStatus process_data_from_utun(TcpipCtx *ctx, evutil_socket_t fd, VpnPacket *packet) {
     UtunHdr hdr{};
 
     static constexpr int HDR_SIZE = sizeof(hdr);
     evbuffer_iovec iov[] = {
             {.iov_base = &hdr, .iov_len = HDR_SIZE}, {.iov_base = packet->data, .iov_len = ctx->parameters.mtu_size}};
-    ssize_t bytes_read = readv(ctx->parameters.tun_fd, iov, std::size(iov));
+    ssize_t bytes_read = readv(fd, iov, std::size(iov));
     if (bytes_read <= 0) {
         if (EWOULDBLOCK != errno) {
             errlog(ctx->logger, "data from UTUN: read failed (errno={})", strerror(errno));
@@ -223,57 +313,123 @@ static TunReadStatus process_data_from_utun(TcpipCtx *ctx, VpnPacket *packet) {
     return TRS_OK;
 }
 #else  /* __MACH__ */
-static TunReadStatus process_data_from_tun(TcpipCtx *ctx, VpnPacket *packet) {
+/**
+ * Send data read from tun device to netif driver
+ * @param ctx context holder for tcp/ip stack
+ * @param packet container with the data
+ * @param len number of bytes read
+ * @return see TunReadStatus fields description
+ */
+static TunReadStatus handle_data_from_tun(TcpipCtx *ctx, VpnPacket *packet, size_t len) {
+    packet->size = len;
+    tracelog(ctx->logger, "data from TUN: {} bytes", len);
 
-    ssize_t bytes_read = read(ctx->parameters.tun_fd, packet->data, ctx->parameters.mtu_size);
-    if (bytes_read <= 0) {
-        if (EWOULDBLOCK != errno) {
-            errlog(ctx->logger, "data from TUN: read failed (errno={})", strerror(errno));
+    process_input_packet(ctx, packet);
+    return TRS_OK;
+}
+
+#ifdef __linux__
+/**
+ * Send data read from tun device in offload mode to netif driver
+ * @param ctx context holder for tcp/ip stack
+ * @param hdr virtio header read before the data
+ * @param packet container with the data
+ * @param len number of bytes read (excluding the header)
+ * @return see TunReadStatus fields description
+ */
+static TunReadStatus handle_offloaded_data_from_tun(
+        TcpipCtx *ctx, const VirtioNetHdr &hdr, VpnPacket *packet, size_t len) {
+    tracelog(ctx->logger, "data from TUN: {} bytes (GSO type={}, size={})", len, hdr.gso_type, hdr.gso_size);
+
+    if ((hdr.gso_type & ~VNET_HDR_GSO_ECN) == VNET_HDR_GSO_UDP_L4) {
+        // LWIP can't handle several datagrams in one packet, so pass them on one by one
+        size_t idx = 0;
+        for (;; ++idx) {
+            VpnPacket datagram = ctx->pool->get_packet();
+            datagram.size = tun_offload_udp_segment(hdr, packet->data, len, idx, datagram.data);
+            if (datagram.size == 0) {
+                datagram.destructor(datagram.destructor_arg, datagram.data);
+                break;
+            }
+            process_input_packet(ctx, &datagram);
         }
-        return TRS_STOP;
+        if (idx == 0) {
+            dbglog(ctx->logger, "data from TUN: malformed UDP GSO packet ({} bytes)", len);
+        }
+        packet->destructor(packet->destructor_arg, packet->data);
+        return TRS_OK;
+    }
+
+    if (!tun_offload_prepare_input(hdr, packet->data, len)) {
+        dbglog(ctx->logger, "data from TUN: malformed offloaded packet ({} bytes, GSO type={})", len, hdr.gso_type);
+        return TRS_DROP;
     }
-    packet->size = bytes_read;
-    tracelog(ctx->logger, "data from TUN: {} bytes", bytes_read);
 
+    packet->size = len;
     process_input_packet(ctx, packet);
     return TRS_OK;
 }
-#endif /* else of __MACH__ */
 
-struct ZeroCopyPBuf {
-    pbuf_custom p;
-    VpnPacket v;
-};
+static TunReadStatus process_offloaded_data_from_tun(TcpipCtx *ctx, evutil_socket_t fd, VpnPacket *packet) {
+    VirtioNetHdr hdr{};
 
-static void zerocopy_pbuf_free(struct pbuf *buf) {
-    auto *buf_custom = (ZeroCopyPBuf *) buf;
-    if (buf_custom->v.destructor) {
-        buf_custom->v.destructor(buf_custom->v.destructor_arg, buf_custom->v.data);
+    static constexpr ssize_t HDR_SIZE = sizeof(hdr);
+    evbuffer_iovec iov[] = {{.iov_base = &hdr, .iov_len = HDR_SIZE},
+            {.iov_base = packet->data, .iov_len = TUN_OFFLOAD_MAX_PACKET_SIZE}};
+    ssize_t bytes_read = readv(fd, iov, std::size(iov));
+    if (bytes_read <= 0) {
+        if (EWOULDBLOCK != errno) {
+            errlog(ctx->logger, "data from TUN: read failed (errno={})", strerror(errno));
+        }
+        return TRS_STOP;
+    }
+    if (bytes_read < HDR_SIZE) {
+        errlog(ctx->logger, "data from TUN: read less than virtio header size bytes");
+        return TRS_DROP;
     }
-    delete buf_custom;
+
+    return handle_offloaded_data_from_tun(ctx, hdr, packet, bytes_read - HDR_SIZE);
 }
+#endif /* __linux__ */
 
-static pbuf *zerocopy_pbuf_create(VpnPacket *packet) {
-    auto *buf_custom = new ZeroCopyPBuf{};
-    buf_custom->p.custom_free_function = zerocopy_pbuf_free;
-    buf_custom->v = *packet;
+static TunReadStatus process_data_from_tun(TcpipCtx *ctx, evutil_socket_t fd, VpnPacket *packet) {
+#ifdef __linux__
+    if (ctx->parameters.tun_offload) {
+        return process_offloaded_data_from_tun(ctx, fd, packet);
+    }
+#endif
 
-    pbuf *buffer = pbuf_alloced_custom(
-            PBUF_RAW, buf_custom->v.size, PBUF_REF, &buf_custom->p, buf_custom->v.data, u16_t(buf_custom->v.size));
-    if (buffer == nullptr) {
-        delete buf_custom;
-        return nullptr;
+    ssize_t bytes_read = read(fd, packet->data, ctx->parameters.mtu_size);
+    if (bytes_read <= 0) {
+        if (EWOULDBLOCK != errno) {
+            errlog(ctx->logger, "data from TUN: read failed (errno={})", strerror(errno));
+        }
+        return TRS_STOP;
     }
-    return buffer;
+
+    return handle_data_from_tun(ctx, packet, bytes_read);
 }
+#endif /* else of __MACH__ */
 
 static void process_input_packet(TcpipCtx *ctx, VpnPacket *packet) {
     // Dump to PCap
-    if (ctx->pcap_fd != -1) {
-        dump_packet_to_pcap(ctx, packet->data, packet->size);
+    if (ctx->pcap != nullptr) {
+        evbuffer_iovec chunk = {.iov_base = packet->data, .iov_len = packet->size};
+        dump_packet_to_pcap(ctx, {&chunk, 1});
     }
 
-    pbuf *buffer = zerocopy_pbuf_create(packet);
+    if (udp_fast_path_input(ctx, packet->data, packet->size)) {
+        if (packet->destructor != nullptr) {
+            packet->destructor(packet->destructor_arg, packet->data);
+        }
+        return;
+    }
+
+    ctx->gro->add(zerocopy_pbuf_create(packet));
+}
+
+static void deliver_input_packet(void *arg, pbuf *buffer) {
+    auto *ctx = (TcpipCtx *) arg;
     err_t result = netif_input(buffer, ctx->netif);
 
     if (ERR_OK != result) {
@@ -296,9 +452,9 @@ static void tun_event_callback(evutil_socket_t fd, short ev_flag, void *arg) {
         TunReadStatus status{};
         VpnPacket packet = ctx->pool->get_packet();
 #ifdef __MACH__
-        status = process_data_from_utun(ctx, &packet);
+        status = process_data_from_utun(ctx, fd, &packet);
 #else
-        status = process_data_from_tun(ctx, &packet);
+        status = process_data_from_tun(ctx, fd, &packet);
 #endif
         if (status != TRS_OK && packet.destructor) {
             packet.destructor(packet.destructor_arg, packet.data);
@@ -307,35 +463,381 @@ static void tun_event_callback(evutil_socket_t fd, short ev_flag, void *arg) {
             break;
         }
     }
+    ctx->gro->flush();
 }
 
-static void timer_callback(evutil_socket_t, short, void *arg) {
-    for (auto fn : TIMER_TICK_NOTIFIERS) {
-        fn((TcpipCtx *) arg);
+#ifdef TCPIP_HAVE_IO_URING
+static bool tun_uring_post_read(TcpipCtx *ctx, TunUringOp *op) {
+    io_uring_sqe *sqe = ctx->uring->ring->get_sqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+
+    size_t iov_num = 0;
+    if (ctx->parameters.tun_offload) {
+        op->iov[iov_num++] = {.iov_base = &op->hdr, .iov_len = sizeof(op->hdr)};
+        op->iov[iov_num++] = {.iov_base = op->packet.data, .iov_len = TUN_OFFLOAD_MAX_PACKET_SIZE};
+    } else {
+        op->iov[iov_num++] = {.iov_base = op->packet.data, .iov_len = ctx->parameters.mtu_size};
+    }
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = op->fd;
+    sqe->addr = (uintptr_t) op->iov;
+    sqe->len = iov_num;
+    sqe->user_data = (uintptr_t) op;
+    ++ctx->uring->reads_in_flight;
+    return true;
+}
+
+static void tun_uring_release_buffers(TunUringOp *op) {
+    if (op->packet.destructor != nullptr) {
+        op->packet.destructor(op->packet.destructor_arg, op->packet.data);
+    }
+    op->packet = {};
+    if (op->pbuf != nullptr) {
+        pbuf_free(std::exchange(op->pbuf, nullptr));
+    }
+}
+
+static void tun_uring_complete_read(TcpipCtx *ctx, TunUringOp *op, int res) {
+    TunUringCtx *uring = ctx->uring.get();
+    --uring->reads_in_flight;
+
+    if (uring->stopping) {
+        tun_uring_release_buffers(op);
+        return;
+    }
+    if ((res < 0 && res != -EAGAIN && res != -EINTR) || res == 0) {
+        // The queue is unusable from now on, so there is no point in re-posting the read
+        errlog(ctx->logger, "data from TUN: read failed (errno={})", strerror(res == 0 ? EIO : -res));
+        tun_uring_release_buffers(op);
+        return;
     }
 
-    // Periodically return freed heap pages to the OS.
-    // LWIP uses libc malloc (MEM_LIBC_MALLOC=1) and some allocators don't release pages
-    // automatically, causing RSS to stay high after traffic bursts.
-    // HeapOptimizeResources / malloc_trim only compact free blocks and are safe to call
-    // with active connections — they do not affect live allocations.
-    if (++s_malloc_trim_tick_counter >= MALLOC_TRIM_INTERVAL_TICKS) {
-        s_malloc_trim_tick_counter = 0;
-#ifdef __GLIBC__
-        malloc_trim(0);
-#elif defined(__MACH__)
-        malloc_zone_pressure_relief(NULL, 0);
-#elif defined(_WIN32)
-        // HeapOptimizeResources is available on Windows 8.1+ (NTDDI >= 0x06030000).
-        // Use runtime loading so the binary works on Win7 too.
-        static const auto heap_set_info = reinterpret_cast<decltype(&HeapSetInformation)>(
-                GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "HeapSetInformation"));
-        if (heap_set_info) {
-            HEAP_OPTIMIZE_RESOURCES_INFORMATION heap_opt_info = {};
-            heap_opt_info.Version = HEAP_OPTIMIZE_RESOURCES_CURRENT_VERSION;
-            heap_set_info(NULL, HeapOptimizeResources, &heap_opt_info, sizeof(heap_opt_info));
+    if (res > 0) {
+        TunReadStatus status{};
+        if (!ctx->parameters.tun_offload) {
+            status = handle_data_from_tun(ctx, &op->packet, res);
+        } else if ((size_t) res < sizeof(op->hdr)) {
+            errlog(ctx->logger, "data from TUN: read less than virtio header size bytes");
+            status = TRS_DROP;
+        } else {
+            status = handle_offloaded_data_from_tun(ctx, op->hdr, &op->packet, res - sizeof(op->hdr));
         }
-#endif
+        if (status == TRS_OK) {
+            // The buffer is owned by the netif driver now
+            op->packet = ctx->pool->get_packet();
+        }
+    }
+
+    if (!tun_uring_post_read(ctx, op)) {
+        errlog(ctx->logger, "data from TUN: failed to re-post read");
+        tun_uring_release_buffers(op);
+    }
+}
+
+static void tun_uring_complete_write(TcpipCtx *ctx, TunUringOp *op, int res) {
+    TunUringCtx *uring = ctx->uring.get();
+    --uring->writes_in_flight;
+
+    if (res == -ECANCELED) {
+        dbglog(ctx->logger, "data to TUN: write cancelled by a failed write before it");
+    } else if (res < 0) {
+        dbglog(ctx->logger, "data to TUN: write failed (errno={})", strerror(-res));
+    }
+    tun_uring_release_buffers(op);
+    uring->free_write_ops.push_back(op);
+}
+
+/**
+ * Handle a completion of the TUN ring
+ * @param defer_reads if true, a read completion is put aside until the next call with false, which keeps
+ *                    the stack from being re-entered while an output packet is waiting for a free request
+ */
+static void tun_uring_complete(TcpipCtx *ctx, const io_uring_cqe &cqe, bool defer_reads) {
+    auto *op = (TunUringOp *) (uintptr_t) cqe.user_data;
+    if (op == nullptr) {
+        // Cancellation request
+        --ctx->uring->cancels_in_flight;
+    } else if (op->is_write) {
+        tun_uring_complete_write(ctx, op, cqe.res);
+    } else if (defer_reads) {
+        ctx->uring->deferred_reads.push_back(cqe);
+    } else {
+        tun_uring_complete_read(ctx, op, cqe.res);
+    }
+}
+
+/**
+ * Handle all the available completions of the TUN ring
+ */
+static void tun_uring_reap(TcpipCtx *ctx) {
+    TunUringCtx *uring = ctx->uring.get();
+    for (const io_uring_cqe &cqe : std::exchange(uring->deferred_reads, {})) {
+        tun_uring_complete(ctx, cqe, false);
+    }
+    io_uring_cqe cqe{};
+    while (uring->ring->pop_cqe(&cqe)) {
+        tun_uring_complete(ctx, cqe, false);
+    }
+}
+
+static void tun_uring_submit(TcpipCtx *ctx) {
+    if (int r = ctx->uring->ring->submit(); r < 0) {
+        errlog(ctx->logger, "TUN ring: submit failed (errno={})", strerror(-r));
+    }
+}
+
+/**
+ * Submit the queued writes as a single linked chain once the previous chain has completed.
+ * The kernel may run unlinked requests in any order, while the packets of a flow must reach
+ * the TUN queue in the order they were produced.
+ */
+static void tun_uring_submit_writes(TcpipCtx *ctx) {
+    TunUringCtx *uring = ctx->uring.get();
+    if (uring->writes_in_flight > 0 || uring->queued_writes.empty()) {
+        return;
+    }
+
+    // A chain ends at a submission boundary, so make room for the whole of it first
+    tun_uring_submit(ctx);
+    io_uring_sqe *prev = nullptr;
+    size_t chained = 0;
+    for (TunUringOp *op : uring->queued_writes) {
+        io_uring_sqe *sqe = uring->ring->get_sqe();
+        if (sqe == nullptr) {
+            break;
+        }
+        if (prev != nullptr) {
+            prev->flags |= IOSQE_IO_LINK;
+        }
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = op->fd;
+        sqe->addr = (uintptr_t) op->iov;
+        sqe->len = op->iov_num;
+        sqe->user_data = (uintptr_t) op;
+        prev = sqe;
+        ++chained;
+    }
+    uring->queued_writes.erase(uring->queued_writes.begin(), uring->queued_writes.begin() + ptrdiff_t(chained));
+    uring->writes_in_flight = chained;
+    tun_uring_submit(ctx);
+}
+
+static void tun_uring_completion_callback(evutil_socket_t fd, short, void *arg) {
+    auto *ctx = (TcpipCtx *) arg;
+
+    uint64_t counter = 0;
+    [[maybe_unused]] ssize_t r = read(fd, &counter, sizeof(counter));
+
+    tun_uring_reap(ctx);
+    ctx->gro->flush();
+    tun_uring_submit_writes(ctx);
+    tun_uring_submit(ctx);
+}
+
+static void tun_uring_submit_callback(evutil_socket_t, short, void *arg) {
+    auto *ctx = (TcpipCtx *) arg;
+    tun_uring_submit_writes(ctx);
+    tun_uring_submit(ctx);
+}
+
+/**
+ * Wait until a write request is free. Queued writes go out before the one waiting for a request,
+ * so the order is kept, unlike it would be with a synchronous write.
+ * @return the request, or null if the ring failed
+ */
+static TunUringOp *tun_uring_wait_write_op(TcpipCtx *ctx) {
+    TunUringCtx *uring = ctx->uring.get();
+    while (uring->free_write_ops.empty()) {
+        tun_uring_submit_writes(ctx);
+        if (int r = uring->ring->submit(1); r < 0 && r != -EINTR) {
+            errlog(ctx->logger, "TUN ring: failed to wait for a write (errno={})", strerror(-r));
+            return nullptr;
+        }
+        io_uring_cqe cqe{};
+        while (uring->ring->pop_cqe(&cqe)) {
+            tun_uring_complete(ctx, cqe, true);
+        }
+    }
+    return uring->free_write_ops.back();
+}
+
+/**
+ * Set up the vectors of a write request
+ * @return false if the packet can't be written by the request
+ */
+static bool tun_uring_prepare_write(
+        TcpipCtx *ctx, TunUringOp *op, evutil_socket_t fd, std::span<evbuffer_iovec> chunks, struct pbuf *owner) {
+    op->fd = fd;
+    op->iov_num = 0;
+    if (ctx->parameters.tun_offload) {
+        // The header is on the caller's stack
+        memcpy(&op->hdr, chunks.front().iov_base, sizeof(op->hdr));
+        op->iov[op->iov_num++] = {.iov_base = &op->hdr, .iov_len = sizeof(op->hdr)};
+        chunks = chunks.subspan(1);
+    }
+
+    if (owner != nullptr && op->iov_num + chunks.size() <= std::size(op->iov)) {
+        // The chain is not modified by LWIP while it is referenced (see `tcp_output_segment_busy()`)
+        pbuf_ref(owner);
+        op->pbuf = owner;
+        for (const evbuffer_iovec &chunk : chunks) {
+            op->iov[op->iov_num++] = {.iov_base = chunk.iov_base, .iov_len = chunk.iov_len};
+        }
+        return true;
+    }
+
+    size_t size = 0;
+    for (const evbuffer_iovec &chunk : chunks) {
+        size += chunk.iov_len;
+    }
+    if (size > ctx->uring->write_block_size) {
+        return false;
+    }
+    op->packet = ctx->uring->write_pool->get_packet();
+    op->packet.size = 0;
+    for (const evbuffer_iovec &chunk : chunks) {
+        memcpy(op->packet.data + op->packet.size, chunk.iov_base, chunk.iov_len);
+        op->packet.size += chunk.iov_len;
+    }
+    op->iov[op->iov_num++] = {.iov_base = op->packet.data, .iov_len = op->packet.size};
+    return true;
+}
+
+static err_t tun_uring_write(
+        TcpipCtx *ctx, evutil_socket_t fd, std::span<evbuffer_iovec> chunks, struct pbuf *owner) {
+    TunUringCtx *uring = ctx->uring.get();
+
+    TunUringOp *op = nullptr;
+    if (!uring->free_write_ops.empty()) {
+        op = uring->free_write_ops.back();
+    } else if (uring->queued_writes.size() + uring->writes_in_flight < TUN_URING_MAX_WRITES) {
+        op = uring->ops.emplace_back(new TunUringOp{.is_write = true}).get();
+        uring->free_write_ops.push_back(op);
+    } else {
+        op = tun_uring_wait_write_op(ctx);
+    }
+    if (op == nullptr || !tun_uring_prepare_write(ctx, op, fd, chunks, owner)) {
+        if (uring->queued_writes.empty() && uring->writes_in_flight == 0) {
+            // Nothing is waiting to be written before this packet, so the order is kept
+            return tun_writev(fd, chunks);
+        }
+        dbglog(ctx->logger, "data to TUN: dropping packet which can't be queued after the pending ones");
+        return ERR_MEM;
+    }
+    uring->free_write_ops.pop_back();
+    uring->queued_writes.push_back(op);
+
+    // Submit all the packets written during this loop iteration at once
+    event_active(uring->submit_event, 0, 0);
+    return ERR_OK;
+}
+
+/**
+ * Set up io_uring TUN backend and post the initial reads
+ * @param ctx context holder for tcp/ip stack
+ * @param ev_base event base to drive the ring
+ * @param ring the ring
+ * @return false if failed
+ */
+static bool tun_uring_configure(TcpipCtx *ctx, struct event_base *ev_base, std::unique_ptr<TunUring> ring) {
+    ctx->uring = std::make_unique<TunUringCtx>();
+    TunUringCtx *uring = ctx->uring.get();
+    uring->ring = std::move(ring);
+    uring->write_block_size = ctx->parameters.tun_offload ? TUN_OFFLOAD_MAX_PACKET_SIZE : ctx->parameters.mtu_size;
+    uring->write_pool = std::make_unique<VpnPacketPool>(DEFAULT_PACKET_POOL_SIZE, uring->write_block_size);
+    uring->completion_event =
+            event_new(ev_base, uring->ring->event_fd(), EV_READ | EV_PERSIST, tun_uring_completion_callback, ctx);
+    uring->submit_event = event_new(ev_base, EVENT_WITHOUT_FD, 0, tun_uring_submit_callback, ctx);
+    if (uring->completion_event == nullptr || uring->submit_event == nullptr
+            || -1 == event_add(uring->completion_event, EVENT_WITHOUT_TIMEOUT)) {
+        return false;
+    }
+
+    for (evutil_socket_t fd : ctx->tun_fds) {
+        for (size_t i = 0; i < TUN_URING_READS_PER_QUEUE; ++i) {
+            TunUringOp *op = uring->ops.emplace_back(new TunUringOp{.fd = fd}).get();
+            op->packet = ctx->pool->get_packet();
+            tun_uring_post_read(ctx, op);
+        }
+    }
+    tun_uring_submit(ctx);
+    return true;
+}
+
+/**
+ * Write out the pending packets, cancel the reads in flight and tear down io_uring TUN backend
+ */
+static void tun_uring_clean_up(TcpipCtx *ctx) {
+    TunUringCtx *uring = ctx->uring.get();
+    uring->stopping = true;
+
+    // Unlike a read, a write to TUN always completes
+    while (!uring->queued_writes.empty() || uring->writes_in_flight > 0) {
+        tun_uring_submit_writes(ctx);
+        if (int r = uring->ring->submit(1); r < 0 && r != -EINTR) {
+            errlog(ctx->logger, "TUN ring: failed to wait for writes (errno={})", strerror(-r));
+            break;
+        }
+        tun_uring_reap(ctx);
+    }
+
+    // Reads in flight are the ones holding a buffer
+    for (const std::unique_ptr<TunUringOp> &op : uring->ops) {
+        if (op->is_write || op->packet.data == nullptr) {
+            continue;
+        }
+        io_uring_sqe *sqe = uring->ring->get_sqe();
+        if (sqe == nullptr) {
+            tun_uring_submit(ctx);
+            sqe = uring->ring->get_sqe();
+        }
+        if (sqe != nullptr) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (uintptr_t) op.get();
+            ++uring->cancels_in_flight;
+        }
+    }
+
+    // A cancellation request always completes, unlike a read which may wait for a packet forever
+    while (uring->cancels_in_flight > 0) {
+        if (int r = uring->ring->submit(1); r < 0 && r != -EINTR) {
+            errlog(ctx->logger, "TUN ring: failed to wait for cancellation (errno={})", strerror(-r));
+            break;
+        }
+        tun_uring_reap(ctx);
+    }
+    tun_uring_reap(ctx);
+
+    if (uring->reads_in_flight > 0 || uring->writes_in_flight > 0) {
+        // The kernel may still access the buffers, so leak them rather than risk a use-after-free
+        warnlog(ctx->logger, "TUN ring: {} read(s) and {} write(s) are still in flight", uring->reads_in_flight,
+                uring->writes_in_flight);
+        for (std::unique_ptr<TunUringOp> &op : uring->ops) {
+            if (op->packet.data != nullptr || op->pbuf != nullptr) {
+                (void) op.release();
+            }
+        }
+    }
+    for (TunUringOp *op : uring->queued_writes) {
+        tun_uring_release_buffers(op);
+    }
+
+    if (uring->completion_event != nullptr) {
+        event_free(uring->completion_event);
+    }
+    if (uring->submit_event != nullptr) {
+        event_free(uring->submit_event);
+    }
+    ctx->uring.reset();
+}
+#endif // TCPIP_HAVE_IO_URING
+
+static void timer_callback(evutil_socket_t, short, void *arg) {
+    for (auto fn : TIMER_TICK_NOTIFIERS) {
+        fn((TcpipCtx *) arg);
     }
 }
 
@@ -346,26 +848,54 @@ static bool configure_events(TcpipCtx *ctx) {
         return false;
     }
 
-    if (ctx->parameters.tun_fd != -1) {
-        ctx->tun_event = event_new(ev_base, ctx->parameters.tun_fd, EV_READ | EV_PERSIST, tun_event_callback, ctx);
-        if (nullptr == ctx->tun_event) {
-            errlog(ctx->logger, "configure: failed to create TUN event");
+#ifdef TCPIP_HAVE_IO_URING
+    if (ctx->parameters.tun_io_backend == TCPIP_TUN_IO_URING && !ctx->tun_fds.empty()) {
+        std::unique_ptr<TunUring> ring = TunUring::create(
+                TUN_URING_READS_PER_QUEUE * ctx->tun_fds.size() + TUN_URING_MAX_WRITES);
+        if (ring == nullptr) {
+            warnlog(ctx->logger, "configure: io_uring is not available ({}), falling back to syscalls",
+                    strerror(errno));
+            ctx->parameters.tun_io_backend = TCPIP_TUN_IO_SYSCALL;
+        } else if (!tun_uring_configure(ctx, ev_base, std::move(ring))) {
+            errlog(ctx->logger, "configure: failed to create TUN ring events");
             return false;
         }
+    }
+#else
+    ctx->parameters.tun_io_backend = TCPIP_TUN_IO_SYSCALL;
+#endif
 
-        int add_result = event_add(ctx->tun_event, EVENT_WITHOUT_TIMEOUT);
-        if (-1 == add_result) {
-            errlog(ctx->logger, "configure: failed to add TUN event");
+    if (ctx->parameters.tun_io_backend == TCPIP_TUN_IO_SYSCALL) {
+        for (evutil_socket_t fd : ctx->tun_fds) {
+            struct event *tun_event = event_new(ev_base, fd, EV_READ | EV_PERSIST, tun_event_callback, ctx);
+            if (nullptr == tun_event) {
+                errlog(ctx->logger, "configure: failed to create TUN event");
+                return false;
+            }
+            ctx->tun_events.push_back(tun_event);
+
+            int add_result = event_add(tun_event, EVENT_WITHOUT_TIMEOUT);
+            if (-1 == add_result) {
+                errlog(ctx->logger, "configure: failed to add TUN event");
+                return false;
+            }
+        }
+    }
+
+#ifdef __linux__
+    if (ctx->parameters.tun_offload && !ctx->tun_fds.empty()) {
+        ctx->tso = std::make_unique<TunTsoCoalescer>();
+        ctx->tso_flush_event = event_new(ev_base, EVENT_WITHOUT_FD, 0, tso_flush_callback, ctx);
+        if (nullptr == ctx->tso_flush_event) {
+            errlog(ctx->logger, "configure: failed to create TSO flush event");
             return false;
         }
-    } else {
-        ctx->tun_event = nullptr;
     }
+#endif
 
     ctx->timer_event = event_new(ev_base, EVENT_WITHOUT_FD, EV_PERSIST, timer_callback, ctx);
     if (nullptr == ctx->timer_event) {
         errlog(ctx->logger, "init: failed to create event");
-        event_free(ctx->tun_event);
         return false;
     }
 
@@ -373,8 +903,6 @@ static bool configure_events(TcpipCtx *ctx) {
     int add_result = event_add(ctx->timer_event, &TV);
     if (-1 == add_result) {
         errlog(ctx->logger, "configure: failed to add TUN event");
-        event_free(ctx->tun_event);
-        event_free(ctx->timer_event);
         return false;
     }
 
@@ -383,14 +911,18 @@ static bool configure_events(TcpipCtx *ctx) {
 }
 
 static void release_resources(TcpipCtx *ctx) {
+    if (ctx->pool != nullptr) {
+        VpnPacketPoolStats stats = ctx->pool->get_stats();
+        dbglog(ctx->logger, "packet pool: hits={} misses={} high water={} slabs={}", stats.hits, stats.misses,
+                stats.high_water, stats.slabs);
+    }
     delete ctx->pool;
 
-    if (ctx->parameters.tun_fd != -1) {
-        close(ctx->parameters.tun_fd);
-    }
-    if (ctx->pcap_fd != -1) {
-        close(ctx->pcap_fd);
+    if (!ctx->tun_fds.empty()) {
+        // Only `tun_fd` is owned by the stack, the additional queues are closed by their opener
+        close(ctx->tun_fds.front());
     }
+    ctx->pcap.reset();
 
     free(ctx->tun_input_buffer); // NOLINT(cppcoreguidelines-no-malloc,hicpp-no-malloc)
 
@@ -398,13 +930,27 @@ static void release_resources(TcpipCtx *ctx) {
 }
 
 static void clean_up_events(TcpipCtx *ctx) {
-    if (nullptr != ctx->tun_event) {
-        event_free(ctx->tun_event);
-        ctx->tun_event = nullptr;
+    for (struct event *tun_event : ctx->tun_events) {
+        event_free(tun_event);
     }
+    ctx->tun_events.clear();
+
+#ifdef __linux__
+    if (ctx->tso_flush_event != nullptr) {
+        tso_flush(ctx);
+        event_free(ctx->tso_flush_event);
+        ctx->tso_flush_event = nullptr;
+    }
+#endif
+#ifdef TCPIP_HAVE_IO_URING
+    if (ctx->uring != nullptr) {
+        tun_uring_clean_up(ctx);
+    }
+#endif
 
     if (ctx->timer_event != nullptr) {
         event_free(ctx->timer_event);
+        ctx->timer_event = nullptr;
     }
 }
 
@@ -418,8 +964,32 @@ TcpipCtx *tcpip_init_internal(const TcpipParameters *params) {
     ctx->parameters = *params;
     ctx->parameters.mtu_size = (0 == ctx->parameters.mtu_size) ? DEFAULT_MTU_SIZE : ctx->parameters.mtu_size;
     if (ctx->parameters.tun_fd != -1) {
-        ctx->pool = new VpnPacketPool(DEFAULT_PACKET_POOL_SIZE, ctx->parameters.mtu_size);
+        ctx->tun_fds.push_back(ctx->parameters.tun_fd);
+        ctx->tun_fds.insert(ctx->tun_fds.end(), params->tun_queue_fds.data,
+                params->tun_queue_fds.data + params->tun_queue_fds.size);
+        uint32_t packet_size = ctx->parameters.mtu_size;
+#ifdef __linux__
+        if (ctx->parameters.tun_offload) {
+            // The kernel may hand out GSO super-packets
+            packet_size = TUN_OFFLOAD_MAX_PACKET_SIZE;
+        }
+#else
+        ctx->parameters.tun_offload = false;
+#endif
+        size_t pool_size = DEFAULT_PACKET_POOL_SIZE;
+#ifdef TCPIP_HAVE_IO_URING
+        if (ctx->parameters.tun_io_backend == TCPIP_TUN_IO_URING) {
+            // Every posted read holds a buffer
+            pool_size += TUN_URING_READS_PER_QUEUE * ctx->tun_fds.size();
+        }
+#endif
+        ctx->pool = new VpnPacketPool(pool_size, packet_size);
+        infolog(ctx->logger, "init: servicing {} TUN queue(s) (offload={}, io_uring={})", ctx->tun_fds.size(),
+                ctx->parameters.tun_offload, ctx->parameters.tun_io_backend == TCPIP_TUN_IO_URING);
     }
+    // The caller's array is not kept past init
+    ctx->parameters.tun_queue_fds = {};
+    ctx->gro = std::make_unique<TunGroCoalescer>(deliver_input_packet, ctx);
     if (!configure_events(ctx)) {
         errlog(ctx->logger, "init: failed to create events");
         goto error;
@@ -451,7 +1021,7 @@ TcpipCtx *tcpip_init_internal(const TcpipParameters *params) {
         goto error;
     }
 
-    open_pcap_file(ctx, params->pcap_filename);
+    start_pcap_capture(ctx);
 
     return ctx;
 
@@ -461,6 +1031,7 @@ error:
 }
 
 static void release_lwip_resources(TcpipCtx *ctx) {
+    ctx->gro.reset();
     netif_remove(ctx->netif);
     free(ctx->netif); // NOLINT(cppcoreguidelines-no-malloc,hicpp-no-malloc)
     libevent_lwip_free();
@@ -476,68 +1047,43 @@ void tcpip_close_internal(TcpipCtx *ctx) {
     release_resources(ctx);
 }
 
-void tcpip_refresh_connection_timeout(TcpipCtx *ctx, TcpipConnection *connection) {
-    tcpip_refresh_connection_timeout_with_interval(ctx, connection, TCPIP_DEFAULT_CONNECTION_TIMEOUT_S);
+void tcpip_refresh_connection_timeout(ConnectionTables *tables, TcpipConnection *connection) {
+    tcpip_refresh_connection_timeout_with_interval(tables, connection, TCPIP_DEFAULT_CONNECTION_TIMEOUT_S);
 }
 
-void tcpip_refresh_connection_timeout_with_interval(TcpipCtx *ctx, TcpipConnection *connection, time_t seconds) {
+void tcpip_refresh_connection_timeout_with_interval(
+        ConnectionTables *tables, TcpipConnection *connection, time_t seconds) {
     timeval current_time{};
-    event_base_gettimeofday_cached(vpn_event_loop_get_base(ctx->parameters.event_loop), &current_time);
-
-    timeval timeout_interval{};
-    timeout_interval.tv_sec = seconds ? seconds : TCPIP_DEFAULT_CONNECTION_TIMEOUT_S;
-    timeout_interval.tv_usec = 0;
+    event_base_gettimeofday_cached(
+            vpn_event_loop_get_base(connection->parent_ctx->parameters.event_loop), &current_time);
 
-    evutil_timeradd(&current_time, &timeout_interval, &connection->conn_timeout);
+    time_t timeout = seconds ? seconds : TCPIP_DEFAULT_CONNECTION_TIMEOUT_S;
+    tables->timeouts.schedule(&connection->conn_timeout, current_time.tv_sec, timeout);
 }
 
-static void dump_packet_to_pcap(TcpipCtx *ctx, const uint8_t *data, size_t len) {
+static void dump_packet_to_pcap(TcpipCtx *ctx, std::span<const evbuffer_iovec> chunks) {
     struct timeval tv;
     event_base_gettimeofday_cached(vpn_event_loop_get_base(ctx->parameters.event_loop), &tv);
-    if (pcap_write_packet(ctx->pcap_fd, &tv, data, len) < 0) {
-        dbglog(ctx->logger, "pcap: failed to write packet to file");
-        close(ctx->pcap_fd);
-        ctx->pcap_fd = -1;
-    }
-}
-
-static void dump_packet_iovec_to_pcap(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks) {
-    struct timeval tv;
-    event_base_gettimeofday_cached(vpn_event_loop_get_base(ctx->parameters.event_loop), &tv);
-    if (pcap_write_packet_iovec(ctx->pcap_fd, &tv, chunks.data(), static_cast<int>(chunks.size())) < 0) {
-        dbglog(ctx->logger, "pcap: failed to write packet to file");
-        close(ctx->pcap_fd);
-        ctx->pcap_fd = -1;
-    }
+    ctx->pcap->capture(tv, chunks);
 }
 
-static void open_pcap_file(TcpipCtx *ctx, const char *pcap_filename) {
-    if (pcap_filename == nullptr) {
-        ctx->pcap_fd = -1;
+static void start_pcap_capture(TcpipCtx *ctx) {
+    const TcpipParameters &params = ctx->parameters;
+    if (params.pcap_filename == nullptr && !params.pcap.rolling) {
         return;
     }
 
-#ifdef _WIN32
-    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_BINARY;
-    ctx->pcap_fd = _wopen(ag::utils::to_wstring(pcap_filename).c_str(), flags, 0664);
-#else
-    int flags = O_WRONLY | O_CREAT | O_TRUNC;
-    // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-    ctx->pcap_fd = open(pcap_filename, flags, 0664);
-#endif
-    if (ctx->pcap_fd == -1) {
-        errlog(ctx->logger, "pcap: can't open output file: {}", strerror(errno));
+    ctx->pcap = std::make_unique<PcapCapture>(params.pcap);
+    if (!params.pcap.rolling && !ctx->pcap->start(params.pcap_filename)) {
+        ctx->pcap.reset();
         return;
     }
-
-    if (pcap_write_header(ctx->pcap_fd) < 0) {
-        errlog(ctx->logger, "pcap: failed to write file header: {}", strerror(errno));
-        close(ctx->pcap_fd);
-        ctx->pcap_fd = -1;
+    if (!ctx->pcap->is_active()) {
+        ctx->pcap.reset();
         return;
     }
 
-    infolog(ctx->logger, "started pcap capture");
+    infolog(ctx->logger, "started pcap capture{}", params.pcap.rolling ? " (rolling)" : "");
 }
 
 void tcpip_process_input_packets(TcpipCtx *ctx, VpnPackets *packets) {
@@ -547,87 +1093,30 @@ void tcpip_process_input_packets(TcpipCtx *ctx, VpnPackets *packets) {
         tracelog(ctx->logger, "TUN: packet length {}", packets->data[i].size);
         process_input_packet(ctx, &packets->data[i]);
     }
+    ctx->gro->flush();
 
     tracelog(ctx->logger, "TUN: processed {} input packets", packets->size);
 }
 
 TcpipConnection *tcpip_get_connection_by_id(const ConnectionTables *tables, uint64_t id) {
-    TcpipConnection *conn = nullptr;
-
-    khiter_t iter = kh_get(connections_by_id, tables->by_id, id);
-    if (iter != kh_end(tables->by_id)) {
-        conn = kh_value(tables->by_id, iter);
-    }
-
-    return conn;
-}
-
-uint64_t lwip_ip_addr_hash(const ip_addr_t *addr) {
-    sa_family_t family; // NOLINT(cppcoreguidelines-init-variables)
-    const void *ip;     // NOLINT(cppcoreguidelines-init-variables)
-    if (IP_IS_V4(addr)) {
-        family = AF_INET;
-        ip = &ip_2_ip4(addr)->addr;
-    } else {
-        family = AF_INET6;
-        ip = ip_2_ip6(addr)->addr;
-    }
-    return ip_addr_hash(family, ip);
-}
-
-uint64_t addr_pair_hash(const AddressPair *addr) {
-    uint64_t src_hash = hash_pair_combine(lwip_ip_addr_hash(&addr->src_ip), addr->src_port);
-    uint64_t dst_hash = hash_pair_combine(lwip_ip_addr_hash(&addr->dst_ip), addr->dst_port);
-    return hash_pair_combine(src_hash, dst_hash);
-}
-
-bool addr_pair_equals(const AddressPair *lh, const AddressPair *rh) {
-    return lh->src_port == rh->src_port && lh->dst_port == rh->dst_port && ip_addr_cmp(&lh->src_ip, &rh->src_ip)
-            && ip_addr_cmp(&lh->dst_ip, &rh->dst_ip);
+    return (TcpipConnection *) tables->flows.find_by_id(id);
 }
 
 TcpipConnection *tcpip_get_connection_by_ip(const ConnectionTables *tables, const ip_addr_t *src_addr,
         uint16_t src_port, const ip_addr_t *dst_addr, uint16_t dst_port) {
-    TcpipConnection *conn = nullptr;
-
-    AddressPair key = {*src_addr, src_port, *dst_addr, dst_port};
-
-    khiter_t iter = kh_get(connections_by_addr, tables->by_addr, &key);
-    if (iter != kh_end(tables->by_addr)) {
-        conn = kh_value(tables->by_addr, iter);
-    }
-
-    return conn;
+    FlowKey key = flow_key_make(tables->proto, src_addr, src_port, dst_addr, dst_port);
+    return (TcpipConnection *) tables->flows.find(key);
 }
 
 int tcpip_put_connection(ConnectionTables *tables, TcpipConnection *connection) {
-    int r;
-    khiter_t iter = kh_put(connections_by_id, tables->by_id, connection->id, &r);
-    if (r < 0) {
-        return 0;
-    }
-    kh_value(tables->by_id, iter) = connection;
-
-    iter = kh_put(connections_by_addr, tables->by_addr, &connection->addr, &r);
-    if (r < 0) {
-        kh_del(connections_by_id, tables->by_id, connection->id);
-        return 0;
-    }
-    kh_value(tables->by_addr, iter) = connection;
-
-    return 1;
+    const AddressPair *addr = &connection->addr;
+    FlowKey key = flow_key_make(tables->proto, &addr->src_ip, addr->src_port, &addr->dst_ip, addr->dst_port);
+    return tables->flows.insert(key, connection->id, connection) ? 1 : 0;
 }
 
 void tcpip_remove_connection(ConnectionTables *tables, TcpipConnection *connection) {
-    khiter_t iter = kh_get(connections_by_id, tables->by_id, connection->id);
-    if (iter != kh_end(tables->by_id)) {
-        kh_del(connections_by_id, tables->by_id, iter);
-    }
-
-    iter = kh_get(connections_by_addr, tables->by_addr, &connection->addr);
-    if (iter != kh_end(tables->by_addr)) {
-        kh_del(connections_by_addr, tables->by_addr, iter);
-    }
+    tables->timeouts.cancel(&connection->conn_timeout);
+    tables->flows.remove_by_id(connection->id);
 }
 
 } // namespace ag
@@ -7,6 +7,12 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <memory>
+#include <span>
+#include <vector>
+
+#include <event2/event.h>
+
 #include "lwipopts.h" // Include before LWIP headers
 
 #include <lwip/ip_addr.h>
@@ -14,8 +20,11 @@
 
 #include "common/logger.h"
 #include "icmp_request_manager.h"
+#include "pcap_capture.h"
 #include "tcp_conn_manager.h"
 #include "tcpip/tcpip.h"
+#include "tun_offload.h"
+#include "tun_uring.h"
 #include "udp_conn_manager.h"
 #include "vpn/utils.h"
 #include "vpn_packet_pool.h"
@@ -26,17 +35,68 @@
 
 namespace ag {
 
+#ifdef TCPIP_HAVE_IO_URING
+/** Number of reads kept posted on every TUN queue */
+static constexpr size_t TUN_URING_READS_PER_QUEUE = 32;
+/** Maximum number of writes queued or in flight, the next write waits for one of them to complete */
+static constexpr size_t TUN_URING_MAX_WRITES = 256;
+/** Maximum number of vectors of a request, a packet with more chunks is copied */
+static constexpr size_t TUN_URING_MAX_IOVS = 8;
+
+/**
+ * A read or write request submitted to the TUN ring
+ */
+struct TunUringOp {
+    bool is_write;                        /**< Write if true, read otherwise */
+    evutil_socket_t fd;                   /**< TUN queue descriptor */
+    VpnPacket packet;                     /**< Buffer being read into, or copy of the packet being written */
+    struct pbuf *pbuf;                    /**< Referenced chain being written without copying */
+    VirtioNetHdr hdr;                     /**< Virtio header in offload mode */
+    struct iovec iov[TUN_URING_MAX_IOVS]; /**< Vectors passed to the kernel */
+    size_t iov_num;                       /**< Number of vectors in use */
+};
+
+/**
+ * State of io_uring TUN backend
+ */
+struct TunUringCtx {
+    std::unique_ptr<TunUring> ring;               /**< The ring */
+    std::vector<std::unique_ptr<TunUringOp>> ops; /**< All allocated requests */
+    std::vector<TunUringOp *> free_write_ops;     /**< Write requests not in use */
+    std::vector<TunUringOp *> queued_writes;      /**< Writes waiting for the chain in flight to complete */
+    std::vector<io_uring_cqe> deferred_reads;     /**< Read completions popped while waiting for writes */
+    size_t reads_in_flight;                       /**< Number of submitted reads */
+    size_t writes_in_flight;                      /**< Number of submitted writes (all of them in one chain) */
+    size_t cancels_in_flight;                     /**< Number of submitted cancellation requests */
+    std::unique_ptr<VpnPacketPool> write_pool;    /**< Buffers for outgoing packets which are copied */
+    size_t write_block_size;                      /**< Size of a `write_pool` buffer */
+    struct event *completion_event;               /**< Event for the ring's eventfd */
+    struct event *submit_event;                   /**< Event for submitting the queued requests */
+    bool stopping;                                /**< Reads are not re-posted after completion */
+};
+#endif
+
 struct TcpipCtx {
-    TcpipParameters parameters; /**< Parameters of TCP/IP stack */
-    uint8_t *tun_input_buffer;  /**< Buffer for incoming data of TUN device */
-    struct event *tun_event;    /**< Event for TUN data handling */
-    struct event *timer_event;  /**< General timer event */
-    TcpCtx tcp;                 /**< TCP connections context */
-    UdpCtx udp;                 /**< UDP connections context */
-    IcmpCtx icmp;               /**< ICMP requests context */
-    struct netif *netif;        /**< Network interface */
-    int pcap_fd;                /**< PCap output file descriptor */
-    VpnPacketPool *pool;        /**< Pool with pre-allocated data blocks for VpnPackets */
+    TcpipParameters parameters;             /**< Parameters of TCP/IP stack */
+    uint8_t *tun_input_buffer;              /**< Buffer for incoming data of TUN device */
+    std::vector<evutil_socket_t> tun_fds;   /**< Queues of TUN device (the first one is `parameters.tun_fd`) */
+    std::vector<struct event *> tun_events; /**< Events for TUN data handling (one per queue) */
+    struct event *timer_event;              /**< General timer event */
+    TcpCtx tcp;                             /**< TCP connections context */
+    UdpCtx udp;                             /**< UDP connections context */
+    IcmpCtx icmp;                           /**< ICMP requests context */
+    struct netif *netif;                    /**< Network interface */
+    std::unique_ptr<PcapCapture> pcap;      /**< Packet capture (if enabled) */
+    VpnPacketPool *pool;                    /**< Pool with pre-allocated data blocks for VpnPackets */
+    std::unique_ptr<TunGroCoalescer> gro;   /**< Coalescer of incoming TCP segments of a read batch */
+#ifdef __linux__
+    std::unique_ptr<TunTsoCoalescer> tso;   /**< Coalescer of outgoing TCP segments (offload mode only) */
+    struct event *tso_flush_event;          /**< Event for writing out the pending TSO super-segment */
+    std::vector<evbuffer_iovec> tso_chunks; /**< Reusable chunks of a non-coalesced packet with its header */
+#endif
+#ifdef TCPIP_HAVE_IO_URING
+    std::unique_ptr<TunUringCtx> uring;     /**< io_uring backend state (if `TCPIP_TUN_IO_URING` is used) */
+#endif
     ag::Logger logger{"TCPIP.COMMON"};
 };
 
@@ -62,19 +122,36 @@ void tcpip_close_internal(TcpipCtx *ctx);
 /**
  * Updates timeout for connection
  *
- * @param ctx pointer to TCP/IP context
+ * @param tables connection tables the connection belongs to
  * @param connection connection
  * @param seconds connection timeout in seconds
  */
-void tcpip_refresh_connection_timeout_with_interval(TcpipCtx *ctx, TcpipConnection *connection, time_t seconds);
+void tcpip_refresh_connection_timeout_with_interval(
+        ConnectionTables *tables, TcpipConnection *connection, time_t seconds);
 
 /**
  * Updates timeout for connection
  *
- * @param ctx pointer to TCP/IP context
+ * @param tables connection tables the connection belongs to
  * @param connection connection
  */
-void tcpip_refresh_connection_timeout(TcpipCtx *ctx, TcpipConnection *connection);
+void tcpip_refresh_connection_timeout(ConnectionTables *tables, TcpipConnection *connection);
+
+/**
+ * Expire the connections whose timeouts have passed
+ *
+ * @param ctx pointer to TCP/IP context
+ * @param tables connection tables
+ * @param expire called for each timed out connection
+ */
+template <typename Fn>
+void tcpip_expire_connections(TcpipCtx *ctx, ConnectionTables *tables, Fn &&expire) {
+    timeval now{};
+    event_base_gettimeofday_cached(vpn_event_loop_get_base(ctx->parameters.event_loop), &now);
+    tables->timeouts.advance(now.tv_sec, [&expire](TimerWheelEntry *entry) {
+        expire(tcpip_connection_by_timeout(entry));
+    });
+}
 
 /**
  * Passes incoming packet to native TCP/IP stack and waits synchronously while they'll be processed
@@ -83,15 +160,28 @@ void tcpip_refresh_connection_timeout(TcpipCtx *ctx, TcpipConnection *connection
  */
 void tcpip_process_input_packets(TcpipCtx *ctx, VpnPackets *packets);
 
+/**
+ * Write an IP packet to the TUN device (or pass it to the TUN output handler)
+ * @param ctx pointer to context of TCP/IP stack
+ * @param chunks the packet
+ * @param family address family of the packet
+ * @param owner chain backing the chunks, which may be referenced to write them asynchronously
+ *              (if null, the chunks are valid only during the call)
+ * @return error code of operation
+ */
+err_t tcpip_tun_output(TcpipCtx *ctx, std::span<evbuffer_iovec> chunks, int family, struct pbuf *owner);
+
 TcpipConnection *tcpip_get_connection_by_id(const ConnectionTables *tables, uint64_t id);
 
 TcpipConnection *tcpip_get_connection_by_ip(const ConnectionTables *tables, const ip_addr_t *src_addr,
         uint16_t src_port, const ip_addr_t *dst_addr, uint16_t dst_port);
 
+/**
+ * Register a connection in the tables
+ * @return 1 on success, 0 if either the flow or the ID of the connection is registered already
+ */
 int tcpip_put_connection(ConnectionTables *tables, TcpipConnection *connection);
 
 void tcpip_remove_connection(ConnectionTables *tables, TcpipConnection *connection);
 
-uint64_t lwip_ip_addr_hash(const ip_addr_t *addr);
-
 } // namespace ag
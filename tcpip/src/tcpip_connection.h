@@ -1,14 +1,13 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
-#ifndef _WIN32
-#include <sys/time.h>
-#endif
 
-#include <khash.h>
 #include <lwip/ip_addr.h>
 
+#include "flow_table.h"
 #include "tcpip/tcpip.h"
+#include "timer_wheel.h"
 
 namespace ag {
 
@@ -23,21 +22,26 @@ typedef struct {
  * Common part of TCP/IP connections
  */
 typedef struct {
-    uint64_t id;                 /**< Connection request ID */
-    AddressPair addr;            /**< Source-destination address pair */
-    TcpipCtx *parent_ctx;        /**< Parent tcpip context structure */
-    struct timeval conn_timeout; /**< The moment when connection will be timed out */
+    uint64_t id;                  /**< Connection request ID */
+    AddressPair addr;             /**< Source-destination address pair */
+    TcpipCtx *parent_ctx;         /**< Parent tcpip context structure */
+    TimerWheelEntry conn_timeout; /**< Idle timeout of the connection (in seconds) */
 } TcpipConnection;
 
-uint64_t addr_pair_hash(const AddressPair *addr);
-bool addr_pair_equals(const AddressPair *lh, const AddressPair *rh);
-
-KHASH_MAP_INIT_INT64(connections_by_id, TcpipConnection *);
-KHASH_INIT(connections_by_addr, AddressPair *, TcpipConnection *, 1, addr_pair_hash, addr_pair_equals);
-
+/**
+ * Connections of one protocol indexed by address pair and by ID
+ */
 typedef struct {
-    khash_t(connections_by_id) * by_id;
-    khash_t(connections_by_addr) * by_addr;
+    FlowTable flows;     /**< Connections by address pair and by ID */
+    TimerWheel timeouts; /**< Idle timeouts of the connections */
+    uint8_t proto;       /**< IP protocol of the connections */
 } ConnectionTables;
 
+/**
+ * Get the connection an idle timeout belongs to
+ */
+static inline TcpipConnection *tcpip_connection_by_timeout(TimerWheelEntry *entry) {
+    return (TcpipConnection *) ((uint8_t *) entry - offsetof(TcpipConnection, conn_timeout));
+}
+
 } // namespace ag
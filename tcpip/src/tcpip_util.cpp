@@ -8,11 +8,14 @@
 
 #include <event2/util.h>
 #include <lwip/ip.h>
+#include <lwip/prot/ip4.h>
+#include <lwip/prot/ip6.h>
 #include <lwip/prot/tcp.h>
 #include <lwip/udp.h>
 
 #include "pcap_savefile.h"
 #include "tcpip/tcpip.h"
+#include "vpn/utils.h"
 
 namespace ag {
 
@@ -73,61 +76,93 @@ void ipaddr_ntoa_r_pretty(const ip_addr_t *addr, char *buf, int buflen) {
     }
 }
 
-int pcap_write_header(int fd) {
+int pcap_write_header(int fd, uint32_t snaplen) {
     const struct pcap_file_header pcap_header = {.magic = 0xa1b2c3d4,
             .version_major = 2,
             .version_minor = 4,
             .thiszone = 0,
             .sigfigs = 0,
-            .snaplen = MAX_SUPPORTED_MTU,
+            .snaplen = (snaplen != 0) ? snaplen : MAX_SUPPORTED_MTU,
             .linktype = LINKTYPE_RAW};
     // NOLINTNEXTLINE(bugprone-narrowing-conversions,cppcoreguidelines-narrowing-conversions)
     return write(fd, &pcap_header, sizeof(pcap_header));
 }
 
-int pcap_write_packet(int fd, struct timeval *tv, const void *data, size_t len) {
-    evbuffer_iovec iov = {.iov_base = (void *) data, .iov_len = len};
-    return pcap_write_packet_iovec(fd, tv, &iov, 1);
-}
+size_t get_approx_headers_size(size_t bytes_transfered, uint8_t proto_id, uint16_t mtu_size) {
+    size_t headers_num = (bytes_transfered + mtu_size - 1) / mtu_size;
+    size_t network_header_length = IP_HLEN;
+    size_t transport_header_length = (IP_PROTO_TCP == proto_id) ? TCP_HLEN : UDP_HLEN;
+    size_t headers_size = (headers_num * (network_header_length + transport_header_length));
 
-static inline int writev_file(int fd, const evbuffer_iovec *iov, int iov_cnt) {
-#ifdef _WIN32
-    int r = 0;
-    for (int i = 0; i < iov_cnt; i++) {
-        r = write(fd, iov[i].iov_base, iov[i].iov_len);
-    }
-    return r;
-#else
-    return writev(fd, iov, iov_cnt); // NOLINT(bugprone-narrowing-conversions,cppcoreguidelines-narrowing-conversions)
-#endif
+    return headers_size;
 }
 
-int pcap_write_packet_iovec(int fd, struct timeval *tv, const evbuffer_iovec *iov, int iov_cnt) {
-    struct pcap_sf_pkthdr rec = {.ts = {.tv_sec = (int32_t) tv->tv_sec, .tv_usec = (int32_t) tv->tv_usec}, .caplen = 0};
+uint64_t ip_packet_flow_hash(const uint8_t *data, size_t len) {
+    if (len < IP_HLEN) {
+        return 0;
+    }
 
-    std::vector<evbuffer_iovec> iovec_pcap;
-    iovec_pcap.reserve(iov_cnt + 1);
-    iovec_pcap.push_back({
-            .iov_base = (void *) &rec,
-            .iov_len = sizeof(rec),
-    });
+    sa_family_t family; // NOLINT(cppcoreguidelines-init-variables)
+    const uint8_t *src; // NOLINT(cppcoreguidelines-init-variables)
+    const uint8_t *dst; // NOLINT(cppcoreguidelines-init-variables)
+    uint8_t proto;      // NOLINT(cppcoreguidelines-init-variables)
+    size_t header_len;  // NOLINT(cppcoreguidelines-init-variables)
+    switch (IPH_V((const struct ip_hdr *) data)) {
+    case 4: {
+        const auto *hdr = (const struct ip_hdr *) data;
+        family = AF_INET;
+        src = (const uint8_t *) &hdr->src;
+        dst = (const uint8_t *) &hdr->dest;
+        proto = IPH_PROTO(hdr);
+        header_len = IPH_HL_BYTES(hdr);
+        if ((IPH_OFFSET(hdr) & PP_HTONS(IP_MF | IP_OFFMASK)) != 0) {
+            // Only the first fragment carries the ports, so none of the fragments is hashed by them
+            // to keep a datagram on a single queue
+            header_len = len;
+        }
+        break;
+    }
+    case 6: {
+        if (len < IP6_HLEN) {
+            return 0;
+        }
+        const auto *hdr = (const struct ip6_hdr *) data;
+        family = AF_INET6;
+        src = (const uint8_t *) &hdr->src;
+        dst = (const uint8_t *) &hdr->dest;
+        proto = IP6H_NEXTH(hdr);
+        header_len = IP6_HLEN;
+        break;
+    }
+    default:
+        return 0;
+    }
 
-    for (int i = 0; i < iov_cnt; i++) {
-        iovec_pcap.push_back(iov[i]);
-        rec.caplen += iov[i].iov_len;
+    uint64_t hash = hash_pair_combine(ip_addr_hash(family, src), ip_addr_hash(family, dst));
+    hash = hash_pair_combine(hash, proto);
+    if ((proto == IP_PROTO_TCP || proto == IP_PROTO_UDP) && len >= header_len + 2 * sizeof(uint16_t)) {
+        uint32_t ports; // NOLINT(cppcoreguidelines-init-variables)
+        memcpy(&ports, data + header_len, sizeof(ports));
+        hash = hash_pair_combine(hash, ports);
     }
-    rec.len = rec.caplen;
 
-    return writev_file(fd, iovec_pcap.data(), static_cast<int>(iovec_pcap.size()));
+    return hash;
 }
 
-size_t get_approx_headers_size(size_t bytes_transfered, uint8_t proto_id, uint16_t mtu_size) {
-    size_t headers_num = (bytes_transfered + mtu_size - 1) / mtu_size;
-    size_t network_header_length = IP_HLEN;
-    size_t transport_header_length = (IP_PROTO_TCP == proto_id) ? TCP_HLEN : UDP_HLEN;
-    size_t headers_size = (headers_num * (network_header_length + transport_header_length));
+uint8_t ip_packet_dscp(const uint8_t *data, size_t len) {
+    if (len < IP_HLEN) {
+        return 0;
+    }
 
-    return headers_size;
+    // DSCP is the upper 6 bits of the IPv4 Type of Service or the IPv6 Traffic Class
+    switch (IPH_V((const struct ip_hdr *) data)) {
+    case 4:
+        return IPH_TOS((const struct ip_hdr *) data) >> 2;
+    case 6:
+        return IP6H_TC((const struct ip6_hdr *) data) >> 2;
+    default:
+        return 0;
+    }
 }
 
 } // namespace ag
@@ -53,28 +53,10 @@ bool stat_should_be_notified(struct event_base *event_base, struct timeval *prev
 /**
  * Writes pcap file header
  * @param fd File descriptor
+ * @param snaplen Maximum number of bytes saved per packet (if 0, `MAX_SUPPORTED_MTU`)
  * @return 0 on success
  */
-int pcap_write_header(int fd);
-
-/**
- * Writes packet to pcap file
- * @param event_base Event base
- * @param fd File descriptor
- * @param iovec I/O vectors array
- * @param iov_cnt I/O vectors count
- * @return 0 on success
- */
-int pcap_write_packet(int fd, struct timeval *tv, const void *data, size_t len);
-
-/**
- * Writes packet to pcap file
- * @param fd File descriptor
- * @param iovec I/O vectors array
- * @param iov_cnt I/O vectors count
- * @return 0 on success
- */
-int pcap_write_packet_iovec(int fd, struct timeval *tv, const struct evbuffer_iovec *iov, int iov_cnt);
+int pcap_write_header(int fd, uint32_t snaplen);
 
 /**
  * Calculates approximate size of headers sent with useful payload
@@ -87,4 +69,25 @@ int pcap_write_packet_iovec(int fd, struct timeval *tv, const struct evbuffer_io
  */
 size_t get_approx_headers_size(size_t bytes_transfered, uint8_t proto_id, uint16_t mtu_size);
 
+/**
+ * Calculates hash of the flow (addresses, protocol and ports) of a raw IP packet.
+ * Packets of the same flow always give the same hash.
+ *
+ * @param data packet data starting with IP header
+ * @param len length of the data
+ *
+ * @return flow hash (0 if the packet is malformed)
+ */
+uint64_t ip_packet_flow_hash(const uint8_t *data, size_t len);
+
+/**
+ * Gets the Differentiated Services Code Point of a raw IP packet
+ *
+ * @param data packet data starting with IP header
+ * @param len length of the data
+ *
+ * @return DSCP (0 if the packet is malformed)
+ */
+uint8_t ip_packet_dscp(const uint8_t *data, size_t len);
+
 } // namespace ag
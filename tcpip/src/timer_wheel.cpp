@@ -0,0 +1,105 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+namespace ag {
+
+TimerWheel::TimerWheel() {
+    for (auto &level : m_slots) {
+        for (TimerWheelEntry &head : level) {
+            init_list(&head);
+        }
+    }
+}
+
+void TimerWheel::init_list(TimerWheelEntry *head) {
+    head->prev = head;
+    head->next = head;
+}
+
+void TimerWheel::move_list(TimerWheelEntry *from, TimerWheelEntry *to) {
+    if (from->next == from) {
+        init_list(to);
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    init_list(from);
+}
+
+void TimerWheel::unlink(TimerWheelEntry *entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = nullptr;
+    entry->next = nullptr;
+}
+
+void TimerWheel::insert(TimerWheelEntry *entry) {
+    uint64_t delta = entry->deadline - m_now;
+    size_t level = 0;
+    while (level + 1 < LEVELS && delta >= (uint64_t(1) << (LEVEL_BITS * (level + 1)))) {
+        ++level;
+    }
+    size_t slot = (entry->deadline >> (LEVEL_BITS * level)) & (SLOTS - 1);
+
+    TimerWheelEntry *head = &m_slots[level][slot];
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+void TimerWheel::schedule(TimerWheelEntry *entry, uint64_t now, uint64_t timeout) {
+    cancel(entry);
+    if (m_size == 0) {
+        // Nothing to expire in between, so just jump forward
+        m_now = std::max(m_now, now);
+    }
+    // Timers of the ticks already processed would be missed
+    entry->deadline = std::max(now + std::min(timeout, MAX_TIMEOUT), m_now + 1);
+    entry->deadline = std::min(entry->deadline, m_now + MAX_TIMEOUT);
+    insert(entry);
+    ++m_size;
+}
+
+void TimerWheel::cancel(TimerWheelEntry *entry) {
+    if (is_scheduled(entry)) {
+        unlink(entry);
+        --m_size;
+    }
+}
+
+void TimerWheel::next_tick(TimerWheelEntry *expired) {
+    ++m_now;
+
+    // Move the timers of the slot of an upper level the lower one has just wrapped around into
+    for (size_t level = 1; level < LEVELS; ++level) {
+        if ((m_now & ((uint64_t(1) << (LEVEL_BITS * level)) - 1)) != 0) {
+            break;
+        }
+        TimerWheelEntry pending; // NOLINT(cppcoreguidelines-pro-type-member-init)
+        move_list(&m_slots[level][(m_now >> (LEVEL_BITS * level)) & (SLOTS - 1)], &pending);
+        while (pending.next != &pending) {
+            TimerWheelEntry *entry = pending.next;
+            unlink(entry);
+            insert(entry);
+        }
+    }
+
+    move_list(&m_slots[0][m_now & (SLOTS - 1)], expired);
+}
+
+void TimerWheel::clear() {
+    for (auto &level : m_slots) {
+        for (TimerWheelEntry &head : level) {
+            while (head.next != &head) {
+                unlink(head.next);
+            }
+        }
+    }
+    m_size = 0;
+}
+
+} // namespace ag
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace ag {
+
+/**
+ * Timer embedded into the object it belongs to. Zero-initialized entry is not scheduled.
+ */
+struct TimerWheelEntry {
+    TimerWheelEntry *prev; /**< Previous entry in the slot (null if not scheduled) */
+    TimerWheelEntry *next; /**< Next entry in the slot (null if not scheduled) */
+    uint64_t deadline;     /**< The tick the timer expires at */
+};
+
+/**
+ * Hierarchical timer wheel.
+ *
+ * Level `l` has 64 slots of `64^l` ticks each. A timer is put into the lowest level its deadline
+ * fits in and moves down a level each time the lower level wraps around, so scheduling and
+ * cancelling take constant time, and advancing takes time proportional to the number of ticks
+ * passed plus the number of timers expired (or moved down), regardless of the number of timers.
+ * The unit of a tick is up to the user.
+ */
+class TimerWheel {
+public:
+    /** Maximum timeout, longer ones are truncated */
+    static constexpr uint64_t MAX_TIMEOUT = (uint64_t(1) << 24) - 1;
+
+    TimerWheel();
+    ~TimerWheel() = default;
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+    TimerWheel(TimerWheel &&) = delete;
+    TimerWheel &operator=(TimerWheel &&) = delete;
+
+    /**
+     * Schedule a timer, or reschedule it if it is already scheduled
+     * @param entry the timer
+     * @param now current tick
+     * @param timeout number of ticks after which the timer expires
+     */
+    void schedule(TimerWheelEntry *entry, uint64_t now, uint64_t timeout);
+
+    /**
+     * Cancel a timer (no-op if it is not scheduled)
+     */
+    void cancel(TimerWheelEntry *entry);
+
+    /**
+     * Check if a timer is scheduled
+     */
+    static bool is_scheduled(const TimerWheelEntry *entry) {
+        return entry->prev != nullptr;
+    }
+
+    /**
+     * Advance the wheel expiring the timers with deadlines up to `now`.
+     * The callback may schedule and cancel any timers, including the one being expired.
+     * @param now current tick
+     * @param expire `void(TimerWheelEntry *)` called for each expired timer (it is not scheduled anymore)
+     */
+    template <typename Fn>
+    void advance(uint64_t now, Fn &&expire) {
+        TimerWheelEntry expired; // NOLINT(cppcoreguidelines-pro-type-member-init)
+        while (m_now < now) {
+            if (m_size == 0) {
+                m_now = now;
+                break;
+            }
+            next_tick(&expired);
+            while (expired.next != &expired) {
+                TimerWheelEntry *entry = expired.next;
+                unlink(entry);
+                --m_size;
+                expire(entry);
+            }
+        }
+    }
+
+    /**
+     * Cancel all the timers
+     */
+    void clear();
+
+    /**
+     * Number of scheduled timers
+     */
+    [[nodiscard]] size_t size() const {
+        return m_size;
+    }
+
+private:
+    static constexpr size_t LEVEL_BITS = 6;
+    static constexpr size_t SLOTS = size_t(1) << LEVEL_BITS;
+    static constexpr size_t LEVELS = 4;
+
+    TimerWheelEntry m_slots[LEVELS][SLOTS]; /**< Heads of circular lists of timers */
+    uint64_t m_now = 0;                      /**< The last tick processed */
+    size_t m_size = 0;
+
+    void insert(TimerWheelEntry *entry);
+    void next_tick(TimerWheelEntry *expired);
+    static void init_list(TimerWheelEntry *head);
+    static void move_list(TimerWheelEntry *from, TimerWheelEntry *to);
+    static void unlink(TimerWheelEntry *entry);
+};
+
+} // namespace ag
@@ -0,0 +1,457 @@
+#include "tun_offload.h"
+
+#include "vpn/platform.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <lwip/def.h>
+#include <lwip/inet_chksum.h>
+#include <lwip/pbuf.h>
+#include <lwip/prot/ip.h>
+#include <lwip/prot/ip4.h>
+#include <lwip/prot/ip6.h>
+#include <lwip/prot/tcp.h>
+#include <lwip/prot/udp.h>
+
+namespace ag {
+
+/** Room for a super-segment plus one more packet appended to it */
+static constexpr size_t TSO_BUFFER_SIZE = 2 * TUN_OFFLOAD_MAX_PACKET_SIZE;
+
+/**
+ * Calculate the non-complemented sum of the transport pseudo-header, as the kernel expects
+ * to find it in the checksum field of a packet with a partial checksum
+ */
+static uint16_t pseudo_header_sum(const uint8_t *ip_header, uint8_t proto, size_t l4_len) {
+    uint8_t pseudo[2 * sizeof(ip6_addr_p_t) + 8] = {};
+    size_t pseudo_len; // NOLINT(cppcoreguidelines-init-variables)
+    if (IPH_V((const struct ip_hdr *) ip_header) == 4) {
+        const auto *hdr = (const struct ip_hdr *) ip_header;
+        memcpy(&pseudo[0], &hdr->src, sizeof(hdr->src));
+        memcpy(&pseudo[4], &hdr->dest, sizeof(hdr->dest));
+        pseudo[9] = proto;
+        pseudo[10] = uint8_t(l4_len >> 8);
+        pseudo[11] = uint8_t(l4_len);
+        pseudo_len = 12;
+    } else {
+        const auto *hdr = (const struct ip6_hdr *) ip_header;
+        memcpy(&pseudo[0], &hdr->src, sizeof(hdr->src));
+        memcpy(&pseudo[16], &hdr->dest, sizeof(hdr->dest));
+        pseudo[34] = uint8_t(l4_len >> 8);
+        pseudo[35] = uint8_t(l4_len);
+        pseudo[39] = proto;
+        pseudo_len = 40;
+    }
+    return (uint16_t) ~inet_chksum(pseudo, (u16_t) pseudo_len);
+}
+
+/**
+ * Complete a partial checksum: the field must contain the pseudo-header sum
+ */
+static void complete_checksum(uint8_t *data, size_t len, size_t csum_start, size_t csum_offset) {
+    uint16_t sum = inet_chksum(data + csum_start, u16_t(len - csum_start));
+    if (sum == 0 && csum_offset == offsetof(struct udp_hdr, chksum)) {
+        // Zero means "no checksum" for UDP
+        sum = 0xffff;
+    }
+    memcpy(data + csum_start + csum_offset, &sum, sizeof(sum));
+}
+
+/**
+ * Set the length of the packet in its IP header
+ * @return false if the header is malformed
+ */
+static bool set_ip_length(uint8_t *data, size_t len, uint16_t ipv4_id_increment) {
+    switch (IPH_V((struct ip_hdr *) data)) {
+    case 4: {
+        auto *hdr = (struct ip_hdr *) data;
+        size_t header_len = IPH_HL_BYTES(hdr);
+        if (header_len < IP_HLEN || header_len > len) {
+            return false;
+        }
+        IPH_LEN_SET(hdr, lwip_htons(u16_t(len)));
+        IPH_ID_SET(hdr, lwip_htons(u16_t(lwip_ntohs(IPH_ID(hdr)) + ipv4_id_increment)));
+        IPH_CHKSUM_SET(hdr, 0);
+        IPH_CHKSUM_SET(hdr, inet_chksum(hdr, u16_t(header_len)));
+        return true;
+    }
+    case 6:
+        if (len < IP6_HLEN) {
+            return false;
+        }
+        IP6H_PLEN_SET((struct ip6_hdr *) data, u16_t(len - IP6_HLEN));
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool tun_offload_prepare_input(const VirtioNetHdr &hdr, uint8_t *data, size_t len) {
+    if (len < IP_HLEN || len > TUN_OFFLOAD_MAX_PACKET_SIZE) {
+        return false;
+    }
+    bool needs_csum = (hdr.flags & VNET_HDR_F_NEEDS_CSUM) != 0;
+    if (needs_csum && size_t(hdr.csum_start) + hdr.csum_offset + sizeof(uint16_t) > len) {
+        return false;
+    }
+
+    switch (hdr.gso_type & ~VNET_HDR_GSO_ECN) {
+    case VNET_HDR_GSO_NONE:
+        break;
+    case VNET_HDR_GSO_TCPV4:
+    case VNET_HDR_GSO_TCPV6:
+        if (!needs_csum || hdr.csum_start < IP_HLEN || !set_ip_length(data, len, 0)) {
+            return false;
+        }
+        // The pseudo-header part must account for the whole super-packet length
+        {
+            uint16_t sum = pseudo_header_sum(data, IP_PROTO_TCP, len - hdr.csum_start);
+            memcpy(data + hdr.csum_start + hdr.csum_offset, &sum, sizeof(sum));
+        }
+        break;
+    default:
+        return false;
+    }
+
+    if (needs_csum) {
+        complete_checksum(data, len, hdr.csum_start, hdr.csum_offset);
+    }
+    return true;
+}
+
+size_t tun_offload_udp_segment(const VirtioNetHdr &hdr, const uint8_t *data, size_t len, size_t idx, uint8_t *out) {
+    size_t headers_size = size_t(hdr.csum_start) + UDP_HLEN;
+    if ((hdr.gso_type & ~VNET_HDR_GSO_ECN) != VNET_HDR_GSO_UDP_L4 || hdr.gso_size == 0
+            || hdr.csum_start < IP_HLEN || headers_size > len || len > TUN_OFFLOAD_MAX_PACKET_SIZE) {
+        return 0;
+    }
+    size_t offset = headers_size + idx * hdr.gso_size;
+    if (offset >= len) {
+        return 0;
+    }
+
+    size_t payload_len = std::min<size_t>(hdr.gso_size, len - offset);
+    size_t segment_len = headers_size + payload_len;
+    memcpy(out, data, headers_size);
+    memcpy(out + headers_size, data + offset, payload_len);
+    if (!set_ip_length(out, segment_len, u16_t(idx))) {
+        return 0;
+    }
+
+    auto *udp = (struct udp_hdr *) (out + hdr.csum_start);
+    udp->len = lwip_htons(u16_t(UDP_HLEN + payload_len));
+    udp->chksum = pseudo_header_sum(out, IP_PROTO_UDP, UDP_HLEN + payload_len);
+    complete_checksum(out, segment_len, hdr.csum_start, offsetof(struct udp_hdr, chksum));
+    return segment_len;
+}
+
+struct TcpSegmentInfo {
+    int family;
+    size_t ip_header_size;
+    size_t headers_size;
+    size_t payload_len;
+    uint32_t seq;
+    uint8_t flags;
+};
+
+static bool parse_tcp_segment(const uint8_t *data, size_t len, TcpSegmentInfo *info) {
+    if (len < IP_HLEN) {
+        return false;
+    }
+    switch (IPH_V((const struct ip_hdr *) data)) {
+    case 4: {
+        const auto *hdr = (const struct ip_hdr *) data;
+        if (IPH_HL_BYTES(hdr) != IP_HLEN || IPH_PROTO(hdr) != IP_PROTO_TCP
+                || (IPH_OFFSET(hdr) & PP_HTONS(IP_OFFMASK | IP_MF)) != 0 || lwip_ntohs(IPH_LEN(hdr)) != len) {
+            return false;
+        }
+        info->family = AF_INET;
+        info->ip_header_size = IP_HLEN;
+        break;
+    }
+    case 6: {
+        const auto *hdr = (const struct ip6_hdr *) data;
+        if (len < IP6_HLEN || IP6H_NEXTH(hdr) != IP_PROTO_TCP || size_t(IP6H_PLEN(hdr)) + IP6_HLEN != len) {
+            return false;
+        }
+        info->family = AF_INET6;
+        info->ip_header_size = IP6_HLEN;
+        break;
+    }
+    default:
+        return false;
+    }
+
+    if (len < info->ip_header_size + TCP_HLEN) {
+        return false;
+    }
+    const auto *tcp = (const struct tcp_hdr *) (data + info->ip_header_size);
+    size_t tcp_header_size = TCPH_HDRLEN_BYTES(tcp);
+    if (tcp_header_size < TCP_HLEN || info->ip_header_size + tcp_header_size > len) {
+        return false;
+    }
+    info->headers_size = info->ip_header_size + tcp_header_size;
+    info->payload_len = len - info->headers_size;
+    info->seq = lwip_ntohl(tcp->seqno);
+    info->flags = TCPH_FLAGS(tcp);
+    return true;
+}
+
+TunTsoCoalescer::TunTsoCoalescer()
+        : m_buffer(new uint8_t[TSO_BUFFER_SIZE]) {
+}
+
+bool TunTsoCoalescer::append(evutil_socket_t fd, std::span<const evbuffer_iovec> chunks) {
+    if (!empty() && (m_closed || fd != m_fd)) {
+        return false;
+    }
+
+    size_t len = 0;
+    for (const evbuffer_iovec &chunk : chunks) {
+        len += chunk.iov_len;
+    }
+    if (len > TUN_OFFLOAD_MAX_PACKET_SIZE) {
+        return false;
+    }
+
+    // Copy the packet past the pending data, it is committed only if it fits
+    uint8_t *packet = &m_buffer[m_size];
+    for (size_t offset = 0; const evbuffer_iovec &chunk : chunks) {
+        memcpy(packet + offset, chunk.iov_base, chunk.iov_len);
+        offset += chunk.iov_len;
+    }
+
+    TcpSegmentInfo info{};
+    if (!parse_tcp_segment(packet, len, &info) || info.payload_len == 0
+            || (info.flags & ~(TCP_ACK | TCP_PSH)) != 0 || (info.flags & TCP_ACK) == 0) {
+        return false;
+    }
+
+    if (empty()) {
+        m_fd = fd;
+        m_family = info.family;
+        m_ip_header_size = info.ip_header_size;
+        m_headers_size = info.headers_size;
+        m_gso_size = info.payload_len;
+        m_size = len;
+        m_segments = 1;
+        m_next_seq = info.seq + info.payload_len;
+        m_closed = (info.flags & TCP_PSH) != 0;
+        return true;
+    }
+
+    if (info.family != m_family || info.headers_size != m_headers_size || info.payload_len > m_gso_size
+            || info.seq != m_next_seq || m_size + info.payload_len > TUN_OFFLOAD_MAX_PACKET_SIZE) {
+        return false;
+    }
+
+    // Addresses, ports, acknowledgement number, window and options must match
+    const uint8_t *first = m_buffer.get();
+    size_t addresses_offset = (m_family == AF_INET) ? offsetof(struct ip_hdr, src) : offsetof(struct ip6_hdr, src);
+    const auto *first_tcp = (const struct tcp_hdr *) (first + m_ip_header_size);
+    const auto *tcp = (const struct tcp_hdr *) (packet + m_ip_header_size);
+    if (0 != memcmp(first + addresses_offset, packet + addresses_offset, m_ip_header_size - addresses_offset)
+            || first_tcp->src != tcp->src || first_tcp->dest != tcp->dest || first_tcp->ackno != tcp->ackno
+            || first_tcp->wnd != tcp->wnd
+            || 0 != memcmp(first_tcp + 1, tcp + 1, m_headers_size - m_ip_header_size - TCP_HLEN)) {
+        return false;
+    }
+
+    memmove(packet, packet + m_headers_size, info.payload_len);
+    m_size += info.payload_len;
+    m_next_seq += info.payload_len;
+    ++m_segments;
+    if (info.flags & TCP_PSH) {
+        TCPH_SET_FLAG((struct tcp_hdr *) first_tcp, TCP_PSH);
+        m_closed = true;
+    }
+    if (info.payload_len < m_gso_size) {
+        // Only the last segment may be short
+        m_closed = true;
+    }
+    return true;
+}
+
+bool TunTsoCoalescer::empty() const {
+    return m_segments == 0;
+}
+
+evutil_socket_t TunTsoCoalescer::fd() const {
+    return m_fd;
+}
+
+std::span<const uint8_t> TunTsoCoalescer::finish(VirtioNetHdr *hdr) {
+    *hdr = {};
+    if (m_segments > 1) {
+        uint8_t *data = m_buffer.get();
+        set_ip_length(data, m_size, 0);
+        auto *tcp = (struct tcp_hdr *) (data + m_ip_header_size);
+        tcp->chksum = pseudo_header_sum(data, IP_PROTO_TCP, m_size - m_ip_header_size);
+
+        hdr->flags = VNET_HDR_F_NEEDS_CSUM;
+        hdr->gso_type = (m_family == AF_INET) ? VNET_HDR_GSO_TCPV4 : VNET_HDR_GSO_TCPV6;
+        hdr->hdr_len = uint16_t(m_headers_size);
+        hdr->gso_size = uint16_t(m_gso_size);
+        hdr->csum_start = uint16_t(m_ip_header_size);
+        hdr->csum_offset = offsetof(struct tcp_hdr, chksum);
+    }
+
+    std::span<const uint8_t> segment = {m_buffer.get(), m_size};
+    m_size = 0;
+    m_segments = 0;
+    m_fd = -1;
+    m_closed = false;
+    return segment;
+}
+
+/**
+ * Derive the sum of the payload of a TCP segment from its checksum, assuming the checksum is valid:
+ * the sums of the pseudo-header, the header (including the checksum) and the payload add up to 0xffff.
+ * If it is not, the checksum of the coalesced segment does not match, and LWIP drops the whole segment.
+ */
+static uint32_t tcp_payload_sum(const uint8_t *data, const TcpSegmentInfo &info) {
+    uint32_t sum = pseudo_header_sum(data, IP_PROTO_TCP, info.headers_size - info.ip_header_size + info.payload_len);
+    sum += (u16_t) ~inet_chksum(data + info.ip_header_size, u16_t(info.headers_size - info.ip_header_size));
+    sum = FOLD_U32T(sum);
+    sum = FOLD_U32T(sum);
+    return (u16_t) ~sum;
+}
+
+/**
+ * Check if a TCP segment may be held for coalescing
+ */
+static bool is_gro_candidate(const TcpSegmentInfo &info) {
+    return info.payload_len > 0 && (info.flags & ~(TCP_ACK | TCP_PSH)) == 0 && (info.flags & TCP_ACK) != 0;
+}
+
+TunGroCoalescer::TunGroCoalescer(DeliverFn deliver, void *arg)
+        : m_deliver(deliver)
+        , m_arg(arg) {
+}
+
+TunGroCoalescer::~TunGroCoalescer() {
+    for (size_t i = 0; i < m_flows_num; ++i) {
+        pbuf_free(m_flows[i].head);
+    }
+}
+
+TunGroCoalescer::Flow *TunGroCoalescer::find_flow(const uint8_t *data) {
+    size_t addresses_offset; // NOLINT(cppcoreguidelines-init-variables)
+    size_t ip_header_size;   // NOLINT(cppcoreguidelines-init-variables)
+    if (IPH_V((const struct ip_hdr *) data) == 4) {
+        addresses_offset = offsetof(struct ip_hdr, src);
+        ip_header_size = IP_HLEN;
+    } else {
+        addresses_offset = offsetof(struct ip6_hdr, src);
+        ip_header_size = IP6_HLEN;
+    }
+    const auto *tcp = (const struct tcp_hdr *) (data + ip_header_size);
+
+    for (size_t i = 0; i < m_flows_num; ++i) {
+        Flow &flow = m_flows[i];
+        const auto *flow_data = (const uint8_t *) flow.head->payload;
+        const auto *flow_tcp = (const struct tcp_hdr *) (flow_data + flow.ip_header_size);
+        if (flow.ip_header_size == ip_header_size && flow_tcp->src == tcp->src && flow_tcp->dest == tcp->dest
+                && 0 == memcmp(flow_data + addresses_offset, data + addresses_offset, ip_header_size - addresses_offset)) {
+            return &flow;
+        }
+    }
+    return nullptr;
+}
+
+void TunGroCoalescer::deliver_flow(size_t idx) {
+    Flow flow = m_flows[idx];
+    std::move(&m_flows[idx + 1], &m_flows[m_flows_num], &m_flows[idx]);
+    --m_flows_num;
+
+    if (flow.segments > 1) {
+        auto *data = (uint8_t *) flow.head->payload;
+        set_ip_length(data, flow.len, 0);
+        auto *tcp = (struct tcp_hdr *) (data + flow.ip_header_size);
+        tcp->chksum = 0;
+        uint32_t sum = pseudo_header_sum(data, IP_PROTO_TCP, flow.len - flow.ip_header_size);
+        sum += (u16_t) ~inet_chksum(tcp, u16_t(flow.headers_size - flow.ip_header_size));
+        sum += flow.payload_sum;
+        sum = FOLD_U32T(sum);
+        sum = FOLD_U32T(sum);
+        tcp->chksum = (u16_t) ~sum;
+    }
+    m_deliver(m_arg, flow.head);
+}
+
+void TunGroCoalescer::add(struct pbuf *packet) {
+    const auto *data = (const uint8_t *) packet->payload;
+    TcpSegmentInfo info{};
+    if (packet->next != nullptr || !parse_tcp_segment(data, packet->len, &info)) {
+        m_deliver(m_arg, packet);
+        return;
+    }
+
+    Flow *flow = find_flow(data);
+    if (!is_gro_candidate(info)) {
+        // Keep the order of the segments of a flow
+        if (flow != nullptr) {
+            deliver_flow(flow - m_flows);
+        }
+        m_deliver(m_arg, packet);
+        return;
+    }
+
+    const auto *tcp = (const struct tcp_hdr *) (data + info.ip_header_size);
+    if (flow != nullptr) {
+        const auto *head_tcp = (struct tcp_hdr *) ((uint8_t *) flow->head->payload + flow->ip_header_size);
+        if (!flow->closed && info.headers_size == flow->headers_size && info.seq == flow->next_seq
+                && info.payload_len <= flow->segment_size && flow->len + info.payload_len <= UINT16_MAX
+                && head_tcp->ackno == tcp->ackno
+                && 0 == memcmp(head_tcp + 1, tcp + 1, info.headers_size - info.ip_header_size - TCP_HLEN)) {
+            uint32_t sum = tcp_payload_sum(data, info);
+            if ((flow->len - flow->headers_size) % 2 != 0) {
+                sum = SWAP_BYTES_IN_WORD(sum);
+            }
+            flow->payload_sum = FOLD_U32T(flow->payload_sum + sum);
+            // The latest window and push flag apply to the coalesced segment
+            auto *mutable_head_tcp = (struct tcp_hdr *) head_tcp;
+            mutable_head_tcp->wnd = tcp->wnd;
+            if (info.flags & TCP_PSH) {
+                TCPH_SET_FLAG(mutable_head_tcp, TCP_PSH);
+                flow->closed = true;
+            }
+            if (info.payload_len < flow->segment_size) {
+                flow->closed = true;
+            }
+
+            pbuf_remove_header(packet, info.headers_size);
+            pbuf_cat(flow->head, packet);
+            flow->len += info.payload_len;
+            flow->next_seq += info.payload_len;
+            ++flow->segments;
+            return;
+        }
+        deliver_flow(flow - m_flows);
+    }
+
+    if (m_flows_num == MAX_FLOWS) {
+        deliver_flow(0);
+    }
+    m_flows[m_flows_num++] = {
+            .head = packet,
+            .ip_header_size = info.ip_header_size,
+            .headers_size = info.headers_size,
+            .len = info.headers_size + info.payload_len,
+            .segment_size = info.payload_len,
+            .segments = 1,
+            .next_seq = info.seq + uint32_t(info.payload_len),
+            .payload_sum = tcp_payload_sum(data, info),
+            .closed = (info.flags & TCP_PSH) != 0,
+    };
+}
+
+void TunGroCoalescer::flush() {
+    while (m_flows_num > 0) {
+        deliver_flow(0);
+    }
+}
+
+} // namespace ag
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <span>
+
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+struct pbuf;
+
+namespace ag {
+
+/**
+ * Header preceding every packet on a TUN device opened with `IFF_VNET_HDR`.
+ * Mirrors `struct virtio_net_hdr` from `linux/virtio_net.h`, fields are in host byte order.
+ */
+struct VirtioNetHdr {
+    uint8_t flags;        /**< `VNET_HDR_F_*` */
+    uint8_t gso_type;     /**< `VNET_HDR_GSO_*` */
+    uint16_t hdr_len;     /**< Length of the headers to be replicated in each segment */
+    uint16_t gso_size;    /**< Payload size of each segment */
+    uint16_t csum_start;  /**< Offset of the start of the checksummed data */
+    uint16_t csum_offset; /**< Offset of the checksum field after `csum_start` */
+};
+static_assert(sizeof(VirtioNetHdr) == 10, "Must match the default `TUNSETVNETHDRSZ`");
+
+static constexpr uint8_t VNET_HDR_F_NEEDS_CSUM = 1; /**< Checksum is partial: only pseudo-header is summed */
+static constexpr uint8_t VNET_HDR_GSO_NONE = 0;     /**< Not a GSO packet */
+static constexpr uint8_t VNET_HDR_GSO_TCPV4 = 1;    /**< TCP over IPv4 super-packet */
+static constexpr uint8_t VNET_HDR_GSO_TCPV6 = 4;    /**< TCP over IPv6 super-packet */
+static constexpr uint8_t VNET_HDR_GSO_UDP_L4 = 5;   /**< Several UDP datagrams in one packet */
+static constexpr uint8_t VNET_HDR_GSO_ECN = 0x80;   /**< TCP has ECN set */
+
+/** Maximum size of a packet (excluding `VirtioNetHdr`) passing through a TUN device in offload mode */
+static constexpr size_t TUN_OFFLOAD_MAX_PACKET_SIZE = UINT16_MAX;
+
+/**
+ * Prepare a packet read from a TUN device in offload mode to be passed to LWIP.
+ * Fixes up the IP header of a TCP GSO super-packet, so that it can be processed as a single
+ * large segment, and completes the partial checksum if the kernel left it to us.
+ * UDP GSO super-packets must be split with `tun_offload_udp_segment` instead.
+ *
+ * @param hdr virtio header which preceded the packet
+ * @param data packet data starting with IP header
+ * @param len packet length
+ *
+ * @return true if successful, false if the packet is malformed or of unsupported GSO type
+ */
+bool tun_offload_prepare_input(const VirtioNetHdr &hdr, uint8_t *data, size_t len);
+
+/**
+ * Build a datagram out of a UDP GSO super-packet read from a TUN device in offload mode
+ *
+ * @param hdr virtio header which preceded the packet
+ * @param data super-packet data starting with IP header
+ * @param len super-packet length
+ * @param idx index of the datagram to build
+ * @param out output buffer (must be at least `len` bytes long)
+ *
+ * @return size of the built datagram, 0 if `idx` is out of range or the super-packet is malformed
+ */
+size_t tun_offload_udp_segment(const VirtioNetHdr &hdr, const uint8_t *data, size_t len, size_t idx, uint8_t *out);
+
+/**
+ * Coalesces consecutive TCP segments of a flow written to a TUN device into a TSO super-segment,
+ * which the kernel splits back, so that a burst of segments costs a single write
+ */
+class TunTsoCoalescer {
+public:
+    TunTsoCoalescer();
+
+    /**
+     * Append an outgoing packet to the pending super-segment
+     * @param fd descriptor the packet is to be written to
+     * @param chunks packet data starting with IP header
+     * @return true if appended, false if the packet cannot be coalesced with the pending ones
+     *         (the pending super-segment must be flushed, and the packet either appended
+     *         to the empty coalescer or written as is)
+     */
+    bool append(evutil_socket_t fd, std::span<const evbuffer_iovec> chunks);
+
+    /**
+     * Check if there is no pending super-segment
+     */
+    [[nodiscard]] bool empty() const;
+
+    /**
+     * Get the descriptor the pending super-segment is to be written to
+     */
+    [[nodiscard]] evutil_socket_t fd() const;
+
+    /**
+     * Finish the pending super-segment and reset the coalescer
+     * @param hdr (out) virtio header to be written before the super-segment
+     * @return the super-segment data (valid until the next call to `append`)
+     */
+    std::span<const uint8_t> finish(VirtioNetHdr *hdr);
+
+private:
+    std::unique_ptr<uint8_t[]> m_buffer;
+    size_t m_size = 0;
+    size_t m_segments = 0;
+    evutil_socket_t m_fd = -1;
+    int m_family = 0;
+    size_t m_ip_header_size = 0;
+    size_t m_headers_size = 0;
+    size_t m_gso_size = 0;
+    uint32_t m_next_seq = 0;
+    bool m_closed = false;
+};
+
+/**
+ * Coalesces consecutive in-order TCP segments of a flow read from a TUN device within one read batch
+ * into a single segment carried by a pbuf chain (the software counterpart of GRO),
+ * so that LWIP processes and acknowledges them at once, and raises their data in one read event.
+ * Segments are held until `flush()`, which must be called at the end of every batch.
+ * Works on any platform, regardless of the offload mode.
+ */
+class TunGroCoalescer {
+public:
+    /** Maximum number of flows held at once, the oldest one is delivered to make room for a new one */
+    static constexpr size_t MAX_FLOWS = 8;
+
+    using DeliverFn = void (*)(void *arg, struct pbuf *packet);
+
+    /**
+     * @param deliver function passing a packet to LWIP (takes the ownership of the packet)
+     * @param arg argument of `deliver`
+     */
+    TunGroCoalescer(DeliverFn deliver, void *arg);
+
+    /**
+     * Drop the held segments
+     */
+    ~TunGroCoalescer();
+
+    TunGroCoalescer(const TunGroCoalescer &) = delete;
+    TunGroCoalescer &operator=(const TunGroCoalescer &) = delete;
+
+    /**
+     * Take a packet read from the TUN device.
+     * A packet which can't be held is delivered right away, after the held segments of the same flow.
+     * @param packet packet data starting with IP header
+     */
+    void add(struct pbuf *packet);
+
+    /**
+     * Deliver all the held segments
+     */
+    void flush();
+
+private:
+    struct Flow {
+        struct pbuf *head;     /**< Chain of the segments (the headers of the first one are used) */
+        size_t ip_header_size; /**< Size of IP header */
+        size_t headers_size;   /**< Size of IP and TCP headers */
+        size_t len;            /**< Length of the coalesced segment */
+        size_t segment_size;   /**< Payload size of the first segment, only the last one may be shorter */
+        size_t segments;       /**< Number of coalesced segments */
+        uint32_t next_seq;     /**< Expected sequence number of the next segment */
+        uint32_t payload_sum;  /**< Ones' complement sum of the coalesced payload */
+        bool closed;           /**< Nothing may be appended */
+    };
+
+    DeliverFn m_deliver;
+    void *m_arg;
+    Flow m_flows[MAX_FLOWS] = {};
+    size_t m_flows_num = 0;
+
+    Flow *find_flow(const uint8_t *data);
+    void deliver_flow(size_t idx);
+};
+
+} // namespace ag
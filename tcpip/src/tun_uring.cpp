@@ -0,0 +1,171 @@
+#include "tun_uring.h"
+
+#ifdef TCPIP_HAVE_IO_URING
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace ag {
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+static int io_uring_setup(uint32_t entries, io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, uint32_t opcode, const void *arg, uint32_t nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+#else
+static int io_uring_setup(uint32_t, io_uring_params *) {
+    errno = ENOSYS;
+    return -1;
+}
+
+static int io_uring_enter(int, uint32_t, uint32_t, uint32_t) {
+    errno = ENOSYS;
+    return -1;
+}
+
+static int io_uring_register(int, uint32_t, const void *, uint32_t) {
+    errno = ENOSYS;
+    return -1;
+}
+#endif
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return (ptr != MAP_FAILED) ? ptr : nullptr;
+}
+
+std::unique_ptr<TunUring> TunUring::create(uint32_t entries) {
+    std::unique_ptr<TunUring> ring{new TunUring{}};
+
+    io_uring_params params{};
+    ring->m_ring_fd = io_uring_setup(entries, &params);
+    if (ring->m_ring_fd < 0) {
+        return nullptr;
+    }
+
+    ring->m_sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->m_sq_size = ring->m_cq_size = std::max(ring->m_sq_size, ring->m_cq_size);
+    }
+    ring->m_sq_ptr = map_ring(ring->m_ring_fd, ring->m_sq_size, IORING_OFF_SQ_RING);
+    if (ring->m_sq_ptr == nullptr) {
+        return nullptr;
+    }
+    ring->m_cq_ptr = (params.features & IORING_FEAT_SINGLE_MMAP)
+            ? ring->m_sq_ptr
+            : map_ring(ring->m_ring_fd, ring->m_cq_size, IORING_OFF_CQ_RING);
+    if (ring->m_cq_ptr == nullptr) {
+        return nullptr;
+    }
+    ring->m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    ring->m_sqes = (io_uring_sqe *) map_ring(ring->m_ring_fd, ring->m_sqes_size, IORING_OFF_SQES);
+    if (ring->m_sqes == nullptr) {
+        return nullptr;
+    }
+
+    auto *sq = (uint8_t *) ring->m_sq_ptr;
+    ring->m_sq_head = (uint32_t *) (sq + params.sq_off.head);
+    ring->m_sq_tail = (uint32_t *) (sq + params.sq_off.tail);
+    ring->m_sq_mask = *(uint32_t *) (sq + params.sq_off.ring_mask);
+    ring->m_sq_entries = params.sq_entries;
+    ring->m_sq_array = (uint32_t *) (sq + params.sq_off.array);
+    ring->m_sqe_head = ring->m_sqe_tail = *ring->m_sq_tail;
+
+    auto *cq = (uint8_t *) ring->m_cq_ptr;
+    ring->m_cq_head = (uint32_t *) (cq + params.cq_off.head);
+    ring->m_cq_tail = (uint32_t *) (cq + params.cq_off.tail);
+    ring->m_cq_mask = *(uint32_t *) (cq + params.cq_off.ring_mask);
+    ring->m_cq_entries = params.cq_entries;
+    ring->m_cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    ring->m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->m_event_fd < 0
+            || 0 != io_uring_register(ring->m_ring_fd, IORING_REGISTER_EVENTFD, &ring->m_event_fd, 1)) {
+        return nullptr;
+    }
+
+    return ring;
+}
+
+TunUring::~TunUring() {
+    if (m_sqes != nullptr) {
+        munmap(m_sqes, m_sqes_size);
+    }
+    if (m_cq_ptr != nullptr && m_cq_ptr != m_sq_ptr) {
+        munmap(m_cq_ptr, m_cq_size);
+    }
+    if (m_sq_ptr != nullptr) {
+        munmap(m_sq_ptr, m_sq_size);
+    }
+    if (m_ring_fd >= 0) {
+        close(m_ring_fd);
+    }
+    if (m_event_fd >= 0) {
+        close(m_event_fd);
+    }
+}
+
+io_uring_sqe *TunUring::get_sqe() {
+    uint32_t head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    if (m_sqe_tail - head >= m_sq_entries) {
+        return nullptr;
+    }
+    io_uring_sqe *sqe = &m_sqes[m_sqe_tail & m_sq_mask];
+    ++m_sqe_tail;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int TunUring::submit(uint32_t wait_nr) {
+    uint32_t to_submit = m_sqe_tail - m_sqe_head;
+    for (; m_sqe_head != m_sqe_tail; ++m_sqe_head) {
+        m_sq_array[m_sqe_head & m_sq_mask] = m_sqe_head & m_sq_mask;
+    }
+    __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    int r = io_uring_enter(m_ring_fd, to_submit, wait_nr, (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0);
+    return (r >= 0) ? r : -errno;
+}
+
+bool TunUring::pop_cqe(io_uring_cqe *cqe) {
+    uint32_t head = *m_cq_head;
+    if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *cqe = m_cqes[head & m_cq_mask];
+    __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+int TunUring::event_fd() const {
+    return m_event_fd;
+}
+
+uint32_t TunUring::sq_entries() const {
+    return m_sq_entries;
+}
+
+uint32_t TunUring::cq_entries() const {
+    return m_cq_entries;
+}
+
+} // namespace ag
+
+#endif // TCPIP_HAVE_IO_URING
@@ -0,0 +1,100 @@
+#pragma once
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define TCPIP_HAVE_IO_URING 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <memory>
+
+#include <linux/io_uring.h>
+
+namespace ag {
+
+/**
+ * Minimal io_uring wrapper talking to the kernel directly, without liburing.
+ * Completions are signalled through an eventfd, so the ring can be driven by libevent.
+ * Not thread-safe: must be used from the event loop thread only.
+ */
+class TunUring {
+public:
+    /**
+     * Set up a ring
+     * @param entries minimum number of submission queue entries
+     * @return the ring, or null if io_uring is not available (old kernel, disabled by sysctl or seccomp)
+     */
+    static std::unique_ptr<TunUring> create(uint32_t entries);
+
+    ~TunUring();
+
+    TunUring(const TunUring &) = delete;
+    TunUring &operator=(const TunUring &) = delete;
+
+    /**
+     * Get a zeroed submission queue entry to fill in
+     * @return the entry, or null if the submission queue is full (call `submit()` to drain it)
+     */
+    io_uring_sqe *get_sqe();
+
+    /**
+     * Submit all the entries obtained since the previous submission
+     * @param wait_nr number of completions to wait for
+     * @return number of submitted entries, or negative errno
+     */
+    int submit(uint32_t wait_nr = 0);
+
+    /**
+     * Pop a completion queue entry
+     * @param cqe (out) the entry
+     * @return false if there are no completions
+     */
+    bool pop_cqe(io_uring_cqe *cqe);
+
+    /**
+     * Get the descriptor which becomes readable on completions (must be drained by reading a `uint64_t`)
+     */
+    [[nodiscard]] int event_fd() const;
+
+    /**
+     * Get number of submission queue entries
+     */
+    [[nodiscard]] uint32_t sq_entries() const;
+
+    /**
+     * Get number of completion queue entries
+     */
+    [[nodiscard]] uint32_t cq_entries() const;
+
+private:
+    TunUring() = default;
+
+    int m_ring_fd = -1;
+    int m_event_fd = -1;
+
+    void *m_sq_ptr = nullptr;
+    size_t m_sq_size = 0;
+    void *m_cq_ptr = nullptr;
+    size_t m_cq_size = 0;
+    io_uring_sqe *m_sqes = nullptr;
+    size_t m_sqes_size = 0;
+
+    uint32_t *m_sq_head = nullptr;
+    uint32_t *m_sq_tail = nullptr;
+    uint32_t m_sq_mask = 0;
+    uint32_t m_sq_entries = 0;
+    uint32_t *m_sq_array = nullptr;
+    uint32_t m_sqe_head = 0; /**< First entry not yet submitted */
+    uint32_t m_sqe_tail = 0; /**< Next entry to hand out */
+
+    uint32_t *m_cq_head = nullptr;
+    uint32_t *m_cq_tail = nullptr;
+    uint32_t m_cq_mask = 0;
+    uint32_t m_cq_entries = 0;
+    io_uring_cqe *m_cqes = nullptr;
+};
+
+} // namespace ag
+
+#endif // __linux__ && __has_include(<linux/io_uring.h>)
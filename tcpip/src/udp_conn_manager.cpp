@@ -49,7 +49,7 @@ static void process_forwarded_connection(UdpConnDescriptor *);
 int udp_cm_send_data(UdpConnDescriptor *connection, const uint8_t *data, size_t length) {
     TcpipConnection *common = &connection->common;
     TcpipCtx *ctx = common->parent_ctx;
-    tcpip_refresh_connection_timeout_with_interval(ctx, common, TCPIP_UDP_TIMEOUT_S);
+    tcpip_refresh_connection_timeout_with_interval(&ctx->udp.connections, common, TCPIP_UDP_TIMEOUT_S);
 
     err_t r = udp_raw_send(connection, &common->addr.dst_ip, common->addr.dst_port, data, length);
     if (ERR_OK != r) {
@@ -130,13 +130,18 @@ void udp_cm_receive(TcpipCtx *ctx, const ip_addr_t *src_addr, u16_t src_port, co
         return;
     }
 
+    udp_cm_receive_data(connection, iovlen, iov);
+}
+
+void udp_cm_receive_data(UdpConnDescriptor *connection, size_t iovlen, const evbuffer_iovec *iov) {
+    TcpipCtx *ctx = connection->common.parent_ctx;
     TcpipHandler *callbacks = &ctx->parameters.handler;
 
-    TcpipReadEvent event = {connection->common.id, iovlen, iov, 0};
+    TcpipReadEvent event = {connection->common.id, iovlen, iov, 0, nullptr};
     callbacks->handler(callbacks->arg, TCPIP_EVENT_READ, &event);
 
     if (event.result >= 0) {
-        tcpip_refresh_connection_timeout_with_interval(ctx, &connection->common, TCPIP_UDP_TIMEOUT_S);
+        tcpip_refresh_connection_timeout_with_interval(&ctx->udp.connections, &connection->common, TCPIP_UDP_TIMEOUT_S);
     } else {
         udp_cm_close_descriptor(ctx, event.id);
     }
@@ -149,7 +154,7 @@ void udp_cm_complete_connect_request(TcpipCtx *ctx, UdpConnDescriptor *connectio
         return;
     }
     connection->state = UDP_CONN_STATE_CONFIRMED;
-    tcpip_refresh_connection_timeout_with_interval(ctx, &connection->common, TCPIP_UDP_TIMEOUT_S);
+    tcpip_refresh_connection_timeout_with_interval(&ctx->udp.connections, &connection->common, TCPIP_UDP_TIMEOUT_S);
 
     typedef struct {
         void (*handler)(UdpConnDescriptor *);
@@ -168,6 +173,8 @@ void udp_cm_complete_connect_request(TcpipCtx *ctx, UdpConnDescriptor *connectio
 }
 
 bool udp_cm_init(TcpipCtx *ctx) {
+    ctx->udp.connections.proto = IP_PROTO_UDP;
+
     err_t raw_init_result = udp_raw_init(ctx);
     if (ERR_OK != raw_init_result) {
         errlog(ctx->udp.log, "UDP raw initialization has failed");
@@ -183,9 +190,6 @@ bool udp_cm_init(TcpipCtx *ctx) {
         return false;
     }
 
-    ctx->udp.connections.by_id = kh_init(connections_by_id);
-    ctx->udp.connections.by_addr = kh_init(connections_by_addr);
-
     return true;
 }
 
@@ -196,36 +200,25 @@ void udp_cm_close(TcpipCtx *ctx) {
 
     free(ctx->udp.input_buffer); // NOLINT(cppcoreguidelines-no-malloc,hicpp-no-malloc)
 
-    kh_destroy(connections_by_id, ctx->udp.connections.by_id);
-    ctx->udp.connections.by_id = nullptr;
-    kh_destroy(connections_by_addr, ctx->udp.connections.by_addr);
-    ctx->udp.connections.by_addr = nullptr;
+    ctx->udp.connections.flows.clear();
+    ctx->udp.connections.timeouts.clear();
 
     dbglog(ctx->udp.log, "Closed");
 }
 
 void udp_cm_clean_up(TcpipCtx *ctx) {
-    if (ctx->udp.connections.by_id == nullptr) {
-        return;
-    }
-
-    khash_t(connections_by_id) *table = ctx->udp.connections.by_id;
-    for (khiter_t it = kh_begin(table); it != kh_end(table); ++it) {
-        if (!kh_exist(table, it)) {
-            continue;
-        }
-        auto *conn = (UdpConnDescriptor *) kh_value(table, it);
+    ctx->udp.connections.flows.for_each([ctx](void *value) {
+        auto *conn = (UdpConnDescriptor *) value;
         udp_cm_close_descriptor(ctx, conn->common.id);
-    }
+    });
 }
 
 void udp_cm_close_descriptor(TcpipCtx *ctx, uint64_t id) {
-    khiter_t i = kh_get(connections_by_id, ctx->udp.connections.by_id, id);
-    if (i == kh_end(ctx->udp.connections.by_id)) {
+    auto *connection = (UdpConnDescriptor *) tcpip_get_connection_by_id(&ctx->udp.connections, id);
+    if (connection == nullptr) {
         return;
     }
 
-    auto *connection = (UdpConnDescriptor *) kh_value(ctx->udp.connections.by_id, i);
     log_conn(connection, trace, "Closing connection {}", (void *) connection);
 
     TcpipHandler *callbacks = &ctx->parameters.handler;
@@ -236,7 +229,7 @@ void udp_cm_close_descriptor(TcpipCtx *ctx, uint64_t id) {
     connection->pending_packets.clear();
 
     log_conn(connection, trace, "Connection closed {}, {} active connections left", (void *) connection,
-            kh_size(ctx->udp.connections.by_id));
+            ctx->udp.connections.flows.size());
 
     delete connection;
 }
@@ -269,8 +262,14 @@ UdpConnDescriptor *udp_cm_create_descriptor(TcpipCtx *ctx, struct pbuf *buffer,
     common->addr = {*src_addr, src_port, *dst_addr, dst_port};
     common->parent_ctx = ctx;
 
-    tcpip_refresh_connection_timeout_with_interval(ctx, common, TCPIP_UDP_TIMEOUT_S);
-    tcpip_put_connection(&ctx->udp.connections, common);
+    if (!tcpip_put_connection(&ctx->udp.connections, common)) {
+        // Either the flow or the ID is taken already, the packet is dropped by the caller
+        log_conn(connection, dbg, "Failed to register connection");
+        delete connection;
+        return nullptr;
+    }
+
+    tcpip_refresh_connection_timeout_with_interval(&ctx->udp.connections, common, TCPIP_UDP_TIMEOUT_S);
     udp_cm_enqueue_incoming_packet(connection, buffer, header_len);
 
     return connection;
@@ -304,20 +303,11 @@ void udp_cm_request_connection(TcpipCtx *ctx, UdpConnDescriptor *connection) {
 }
 
 void udp_cm_timer_tick(TcpipCtx *ctx) {
-    struct timeval now;
-    event_base_gettimeofday_cached(vpn_event_loop_get_base(ctx->parameters.event_loop), &now);
-
-    khash_t(connections_by_id) *table = ctx->udp.connections.by_id;
-    for (khiter_t it = kh_begin(table); it != kh_end(table); ++it) {
-        if (!kh_exist(table, it)) {
-            continue;
-        }
-        auto *conn = (UdpConnDescriptor *) kh_value(table, it);
-        if (timercmp(&conn->common.conn_timeout, &now, <)) {
-            log_conn(conn, dbg, "Connection has timed out");
-            udp_cm_close_descriptor(ctx, conn->common.id);
-        }
-    }
+    tcpip_expire_connections(ctx, &ctx->udp.connections, [ctx](TcpipConnection *common) {
+        auto *conn = (UdpConnDescriptor *) common;
+        log_conn(conn, dbg, "Connection has timed out");
+        udp_cm_close_descriptor(ctx, conn->common.id);
+    });
 }
 
 TcpFlowCtrlInfo udp_cm_flow_ctrl_info(const UdpConnDescriptor *connection) {
@@ -26,6 +26,11 @@ typedef struct UdpCtx {
 void udp_cm_receive(TcpipCtx *ctx, const ip_addr_t *src_addr, u16_t src_port, const ip_addr_t *dst_addr, u16_t dst_port,
         size_t iovlen, const struct evbuffer_iovec *iov);
 
+/**
+ * Handles data received on the given connection
+ */
+void udp_cm_receive_data(UdpConnDescriptor *connection, size_t iovlen, const struct evbuffer_iovec *iov);
+
 /**
  * Initializes UDP connection manager
  *
@@ -0,0 +1,183 @@
+#include "udp_fast_path.h"
+
+#include "vpn/platform.h"
+
+#include <string.h>
+
+#include <lwip/def.h>
+#include <lwip/inet_chksum.h>
+#include <lwip/prot/ip.h>
+#include <lwip/prot/ip4.h>
+#include <lwip/udp.h>
+
+#include "tcpip_common.h"
+
+namespace ag {
+
+/** Identification of the outgoing IPv4 packets */
+static uint16_t g_ip_id = 0;
+
+/** Non-complemented one's complement sum of the data */
+static uint32_t data_sum(const void *data, size_t len) {
+    return uint16_t(~inet_chksum(data, u16_t(len)));
+}
+
+static uint32_t pseudo_header_sum(const ip_addr_t *src, const ip_addr_t *dst, size_t udp_len) {
+    uint32_t sum = lwip_htons(IP_PROTO_UDP) + lwip_htons(u16_t(udp_len));
+    if (IP_IS_V4(src)) {
+        sum += data_sum(&ip_2_ip4(src)->addr, sizeof(ip4_addr_t)) + data_sum(&ip_2_ip4(dst)->addr, sizeof(ip4_addr_t));
+    } else {
+        sum += data_sum(ip_2_ip6(src)->addr, sizeof(ip6_addr_p_t)) + data_sum(ip_2_ip6(dst)->addr, sizeof(ip6_addr_p_t));
+    }
+    return sum;
+}
+
+static uint16_t fold_sum(uint32_t sum) {
+    sum = FOLD_U32T(sum);
+    return uint16_t(FOLD_U32T(sum));
+}
+
+bool udp_fast_path_parse(const uint8_t *data, size_t len, UdpDatagram *datagram) {
+    size_t ip_header_len; // NOLINT(cppcoreguidelines-init-variables)
+    size_t udp_len;       // NOLINT(cppcoreguidelines-init-variables)
+    if (len < IP_HLEN) {
+        return false;
+    }
+    switch (IPH_V((const struct ip_hdr *) data)) {
+    case 4: {
+        const auto *hdr = (const struct ip_hdr *) data;
+        // Leave packets with options and fragments to LWIP
+        if (IPH_HL_BYTES(hdr) != IP_HLEN || IPH_PROTO(hdr) != IP_PROTO_UDP
+                || (IPH_OFFSET(hdr) & PP_HTONS(IP_OFFMASK | IP_MF)) != 0) {
+            return false;
+        }
+        size_t total_len = lwip_ntohs(IPH_LEN(hdr));
+        if (total_len < IP_HLEN + UDP_HLEN || total_len > len || inet_chksum(hdr, IP_HLEN) != 0
+                || ip4_addr_isany_val(hdr->src) || ip4_addr_isany_val(hdr->dest)) {
+            return false;
+        }
+        ip_addr_copy_from_ip4(datagram->src_addr, hdr->src);
+        ip_addr_copy_from_ip4(datagram->dst_addr, hdr->dest);
+        ip_header_len = IP_HLEN;
+        udp_len = total_len - IP_HLEN;
+        break;
+    }
+    case 6: {
+        if (len < IP6_HLEN) {
+            return false;
+        }
+        const auto *hdr = (const struct ip6_hdr *) data;
+        // Leave packets with extension headers (including fragments) to LWIP
+        if (IP6H_NEXTH(hdr) != IP6_NEXTH_UDP) {
+            return false;
+        }
+        udp_len = IP6H_PLEN(hdr);
+        if (udp_len < UDP_HLEN || IP6_HLEN + udp_len > len || ip6_addr_isany_val(hdr->src)
+                || ip6_addr_isany_val(hdr->dest)) {
+            return false;
+        }
+        ip_addr_copy_from_ip6_packed(datagram->src_addr, hdr->src);
+        ip_addr_copy_from_ip6_packed(datagram->dst_addr, hdr->dest);
+        ip_header_len = IP6_HLEN;
+        break;
+    }
+    default:
+        return false;
+    }
+
+    const auto *udp = (const struct udp_hdr *) (data + ip_header_len);
+    if (lwip_ntohs(udp->len) != udp_len) {
+        return false;
+    }
+    // Zero means "no checksum", which is allowed for IPv4 only
+    if (udp->chksum != 0 || IP_IS_V6_VAL(datagram->src_addr)) {
+        uint32_t sum = pseudo_header_sum(&datagram->src_addr, &datagram->dst_addr, udp_len) + data_sum(udp, udp_len);
+        if (fold_sum(sum) != 0xffff) {
+            return false;
+        }
+    }
+
+    datagram->src_port = lwip_ntohs(udp->src);
+    datagram->dst_port = lwip_ntohs(udp->dest);
+    datagram->payload = (const uint8_t *) (udp + 1);
+    datagram->payload_len = udp_len - UDP_HLEN;
+    return true;
+}
+
+size_t udp_fast_path_build_headers(const UdpDatagram &datagram, uint8_t ttl, uint8_t *out) {
+    size_t udp_len = UDP_HLEN + datagram.payload_len;
+    size_t ip_header_len; // NOLINT(cppcoreguidelines-init-variables)
+    if (IP_IS_V4_VAL(datagram.src_addr)) {
+        auto *hdr = (struct ip_hdr *) out;
+        IPH_VHL_SET(hdr, 4, IP_HLEN / 4);
+        IPH_TOS_SET(hdr, 0);
+        IPH_LEN_SET(hdr, lwip_htons(u16_t(IP_HLEN + udp_len)));
+        IPH_ID_SET(hdr, lwip_htons(g_ip_id++));
+        IPH_OFFSET_SET(hdr, 0);
+        IPH_TTL_SET(hdr, ttl);
+        IPH_PROTO_SET(hdr, IP_PROTO_UDP);
+        IPH_CHKSUM_SET(hdr, 0);
+        ip4_addr_copy(hdr->src, *ip_2_ip4(&datagram.src_addr));
+        ip4_addr_copy(hdr->dest, *ip_2_ip4(&datagram.dst_addr));
+        IPH_CHKSUM_SET(hdr, inet_chksum(hdr, IP_HLEN));
+        ip_header_len = IP_HLEN;
+    } else {
+        auto *hdr = (struct ip6_hdr *) out;
+        IP6H_VTCFL_SET(hdr, 6, 0, 0);
+        IP6H_PLEN_SET(hdr, u16_t(udp_len));
+        IP6H_NEXTH_SET(hdr, IP6_NEXTH_UDP);
+        IP6H_HOPLIM_SET(hdr, ttl);
+        ip6_addr_copy_to_packed(hdr->src, *ip_2_ip6(&datagram.src_addr));
+        ip6_addr_copy_to_packed(hdr->dest, *ip_2_ip6(&datagram.dst_addr));
+        ip_header_len = IP6_HLEN;
+    }
+
+    auto *udp = (struct udp_hdr *) (out + ip_header_len);
+    udp->src = lwip_htons(datagram.src_port);
+    udp->dest = lwip_htons(datagram.dst_port);
+    udp->len = lwip_htons(u16_t(udp_len));
+    udp->chksum = 0;
+    uint32_t sum = pseudo_header_sum(&datagram.src_addr, &datagram.dst_addr, udp_len) + data_sum(udp, UDP_HLEN)
+            + data_sum(datagram.payload, datagram.payload_len);
+    uint16_t chksum = ~fold_sum(sum);
+    // Zero means "no checksum"
+    udp->chksum = (chksum != 0) ? chksum : 0xffff;
+
+    return ip_header_len + UDP_HLEN;
+}
+
+bool udp_fast_path_input(TcpipCtx *ctx, const uint8_t *data, size_t len) {
+    UdpDatagram datagram; // NOLINT(cppcoreguidelines-pro-type-member-init)
+    if (!udp_fast_path_parse(data, len, &datagram)) {
+        return false;
+    }
+
+    auto *connection = (UdpConnDescriptor *) tcpip_get_connection_by_ip(&ctx->udp.connections, &datagram.src_addr,
+            datagram.src_port, &datagram.dst_addr, datagram.dst_port);
+    if (connection == nullptr || connection->state != UDP_CONN_STATE_CONFIRMED) {
+        return false;
+    }
+
+    evbuffer_iovec iov = {.iov_base = (void *) datagram.payload, .iov_len = datagram.payload_len};
+    udp_cm_receive_data(connection, 1, &iov);
+    return true;
+}
+
+bool udp_fast_path_fits(const TcpipCtx *ctx, const UdpDatagram &datagram) {
+    size_t ip_header_len = IP_IS_V4_VAL(datagram.src_addr) ? IP_HLEN : IP6_HLEN;
+    return ip_header_len + UDP_HLEN + datagram.payload_len <= ctx->parameters.mtu_size;
+}
+
+err_t udp_fast_path_output(TcpipCtx *ctx, const UdpDatagram &datagram) {
+    alignas(uint32_t) uint8_t headers[UDP_FAST_PATH_MAX_HEADERS_SIZE];
+    size_t headers_len = udp_fast_path_build_headers(datagram, ctx->udp.tun_pcb->ttl, headers);
+
+    evbuffer_iovec chunks[] = {
+            {.iov_base = headers, .iov_len = headers_len},
+            {.iov_base = (void *) datagram.payload, .iov_len = datagram.payload_len},
+    };
+    tracelog(ctx->logger, "TUN output: {} bytes (UDP fast path)", headers_len + datagram.payload_len);
+    return tcpip_tun_output(ctx, chunks, IP_IS_V4_VAL(datagram.src_addr) ? AF_INET : AF_INET6, nullptr);
+}
+
+} // namespace ag
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lwipopts.h" // Include before LWIP headers
+
+#include <lwip/err.h>
+#include <lwip/ip_addr.h>
+#include <lwip/prot/ip6.h>
+#include <lwip/prot/udp.h>
+
+#include "tcpip/tcpip.h"
+
+namespace ag {
+
+/** Maximum size of the headers built by `udp_fast_path_build_headers()` */
+static constexpr size_t UDP_FAST_PATH_MAX_HEADERS_SIZE = IP6_HLEN + UDP_HLEN;
+
+/**
+ * UDP datagram as seen by the fast path
+ */
+struct UdpDatagram {
+    ip_addr_t src_addr;     /**< Source address */
+    uint16_t src_port;      /**< Source port */
+    ip_addr_t dst_addr;     /**< Destination address */
+    uint16_t dst_port;      /**< Destination port */
+    const uint8_t *payload; /**< Datagram payload */
+    size_t payload_len;     /**< Size of the payload */
+};
+
+/**
+ * Parse an IPv4/IPv6 packet carrying a UDP datagram and verify its checksums
+ * @param data the packet
+ * @param len size of the packet
+ * @param datagram (out) the datagram (the payload points into `data`)
+ * @return false if the packet is not a UDP datagram the fast path is able to handle (fragments,
+ *         IP options or extension headers, malformed packets), so it has to go through LWIP
+ */
+bool udp_fast_path_parse(const uint8_t *data, size_t len, UdpDatagram *datagram);
+
+/**
+ * Build IP and UDP headers of a datagram, including the UDP checksum over the payload
+ * @param datagram the datagram
+ * @param ttl IP TTL (hop limit)
+ * @param out (out) buffer of at least `UDP_FAST_PATH_MAX_HEADERS_SIZE` bytes
+ * @return size of the headers
+ */
+size_t udp_fast_path_build_headers(const UdpDatagram &datagram, uint8_t ttl, uint8_t *out);
+
+/**
+ * Hand a datagram received from TUN straight to the connection it belongs to, bypassing LWIP.
+ * Only datagrams of the connections allowed to pass are handled, the rest (new connections,
+ * pending ones, etc.) must go through LWIP.
+ * @param ctx TCP/IP context
+ * @param data the packet
+ * @param len size of the packet
+ * @return true if the datagram was delivered (the caller still owns the packet)
+ */
+bool udp_fast_path_input(TcpipCtx *ctx, const uint8_t *data, size_t len);
+
+/**
+ * Check whether a datagram can be sent to TUN without LWIP, i.e. it does not need to be fragmented
+ */
+bool udp_fast_path_fits(const TcpipCtx *ctx, const UdpDatagram &datagram);
+
+/**
+ * Send a datagram to TUN bypassing LWIP (see `udp_fast_path_fits()`)
+ * @return error code of operation
+ */
+err_t udp_fast_path_output(TcpipCtx *ctx, const UdpDatagram &datagram);
+
+} // namespace ag
@@ -11,6 +11,7 @@
 #include "tcpip/tcpip.h"
 #include "tcpip_common.h"
 #include "udp_conn_manager.h"
+#include "udp_fast_path.h"
 #include "udp_raw.h"
 
 namespace ag {
@@ -46,6 +47,13 @@ static void udp_raw_recv(
 err_t udp_raw_send(
         UdpConnDescriptor *descriptor, ip_addr_t *from_ip, uint16_t from_port, const uint8_t *data, size_t length) {
     TcpipConnection *common = &descriptor->common;
+    TcpipCtx *tcpip_ctx = common->parent_ctx;
+    UdpDatagram datagram = {*from_ip, from_port, common->addr.src_ip, common->addr.src_port, data, length};
+    if (udp_fast_path_fits(tcpip_ctx, datagram)) {
+        return udp_fast_path_output(tcpip_ctx, datagram);
+    }
+
+    // Let LWIP fragment the datagram
     struct pbuf *buffer = pbuf_alloc(PBUF_TRANSPORT, u16_t(length), PBUF_RAM);
     if (nullptr == buffer) {
         log_conn(descriptor, err, "Failed to allocate buffer");
@@ -58,7 +66,6 @@ err_t udp_raw_send(
         return result;
     }
 
-    TcpipCtx *tcpip_ctx = common->parent_ctx;
     UdpCtx *udp_ctx = &tcpip_ctx->udp;
     struct udp_pcb *pcb = udp_ctx->tun_pcb;
     pcb->local_port = from_port;
@@ -1,73 +1,205 @@
 #include "vpn_packet_pool.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
 namespace ag {
 
-struct VpnPacketPool::VpnPacketPoolState {
-    VpnPacketPool *pool;
-    std::atomic_size_t refcounter;
-    std::atomic_bool is_alive;
+struct Slab;
+
+/**
+ * Block layout: `BlockHeader | headroom | data`.
+ * While a block is free, its header links it into the free list.
+ */
+struct alignas(std::max_align_t) BlockHeader {
+    Slab *slab;
+    BlockHeader *prev_free;
+    BlockHeader *next_free;
+};
+
+struct Slab {
+    std::unique_ptr<uint8_t[]> memory;
+    size_t free_blocks;
+    Slab *prev;
+    Slab *next;
+};
+
+struct VpnPacketPool::Impl {
+    size_t slab_blocks;
+    size_t block_stride;
+    uint32_t mtu;
+
+    Slab *slabs = nullptr;
+    size_t slabs_num = 0;
+    BlockHeader *free_list = nullptr;
+    size_t free_blocks = 0;
+    VpnPacketPoolStats stats{};
+
+    /** The pool and every packet handed out hold a reference */
+    std::atomic_size_t refcounter{1};
+    std::atomic_bool is_alive{true};
 
     void retain() {
         refcounter.fetch_add(1, std::memory_order_relaxed);
     }
 
     void release() {
-        if (refcounter.fetch_sub(1, std::memory_order_relaxed) == 1) {
+        if (refcounter.fetch_sub(1, std::memory_order_acq_rel) == 1) {
             delete this;
         }
     }
+
+    ~Impl() {
+        while (slabs != nullptr) {
+            Slab *next = slabs->next;
+            delete slabs;
+            slabs = next;
+        }
+    }
+
+    static BlockHeader *block_of(uint8_t *data) {
+        return (BlockHeader *) (data - HEADROOM - sizeof(BlockHeader));
+    }
+
+    static uint8_t *data_of(BlockHeader *block) {
+        return (uint8_t *) (block + 1) + HEADROOM;
+    }
+
+    void push_free(BlockHeader *block) {
+        block->prev_free = nullptr;
+        block->next_free = free_list;
+        if (free_list != nullptr) {
+            free_list->prev_free = block;
+        }
+        free_list = block;
+        ++block->slab->free_blocks;
+        ++free_blocks;
+    }
+
+    void unlink_free(BlockHeader *block) {
+        if (block->prev_free != nullptr) {
+            block->prev_free->next_free = block->next_free;
+        } else {
+            free_list = block->next_free;
+        }
+        if (block->next_free != nullptr) {
+            block->next_free->prev_free = block->prev_free;
+        }
+        --block->slab->free_blocks;
+        --free_blocks;
+    }
+
+    void add_slab() {
+        auto *slab = new Slab{
+                .memory = std::make_unique<uint8_t[]>(slab_blocks * block_stride),
+                .free_blocks = 0,
+                .prev = nullptr,
+                .next = slabs,
+        };
+        if (slabs != nullptr) {
+            slabs->prev = slab;
+        }
+        slabs = slab;
+        ++slabs_num;
+        // Push in reverse, so that blocks are handed out in address order
+        for (size_t i = slab_blocks; i-- > 0;) {
+            auto *block = (BlockHeader *) &slab->memory[i * block_stride];
+            block->slab = slab;
+            push_free(block);
+        }
+        stats.slabs = slabs_num;
+    }
+
+    /**
+     * Release a completely free slab if there are enough free blocks without it
+     */
+    void maybe_remove_slab(Slab *slab) {
+        if (slab->free_blocks != slab_blocks || slabs_num == 1 || free_blocks - slab_blocks < slab_blocks) {
+            return;
+        }
+        for (size_t i = 0; i < slab_blocks; ++i) {
+            unlink_free((BlockHeader *) &slab->memory[i * block_stride]);
+        }
+        if (slab->prev != nullptr) {
+            slab->prev->next = slab->next;
+        } else {
+            slabs = slab->next;
+        }
+        if (slab->next != nullptr) {
+            slab->next->prev = slab->prev;
+        }
+        delete slab;
+        --slabs_num;
+        stats.slabs = slabs_num;
+    }
+
+    static void destructor(void *arg, uint8_t *data) {
+        auto *self = static_cast<Impl *>(arg);
+        if (self->is_alive.load(std::memory_order_acquire)) {
+            BlockHeader *block = block_of(data);
+            self->push_free(block);
+            --self->stats.in_use;
+            self->maybe_remove_slab(block->slab);
+        }
+        self->release();
+    }
 };
 
+static_assert(VpnPacketPool::HEADROOM % alignof(std::max_align_t) == 0);
+
 VpnPacketPool::VpnPacketPool(size_t size, uint32_t mtu)
-        : m_capacity(size)
-        , m_mtu(mtu)
-        , m_state(new VpnPacketPoolState{this, 1, true}) {
-    for (size_t i = 0; i < size; ++i) {
-        m_packets.emplace_back(new uint8_t[m_mtu]);
-    }
+        : m_impl(new Impl{
+                .slab_blocks = std::max<size_t>(size, 1),
+                .block_stride = sizeof(BlockHeader) + HEADROOM
+                        + (mtu + alignof(std::max_align_t) - 1) / alignof(std::max_align_t)
+                                * alignof(std::max_align_t),
+                .mtu = mtu,
+        }) {
+    m_impl->add_slab();
 }
 
 VpnPacketPool::~VpnPacketPool() {
-    m_state->is_alive.store(false, std::memory_order_release);
-    m_state->release();
+    m_impl->is_alive.store(false, std::memory_order_release);
+    m_impl->release();
 }
 
 VpnPacket VpnPacketPool::get_packet() {
-    m_state->retain();
-
-    auto destructor = [](void *arg, uint8_t *data) {
-        auto *state = static_cast<VpnPacketPoolState *>(arg);
-        if (state->is_alive.load(std::memory_order_acquire)) {
-            state->pool->return_packet_data(data);
-        } else {
-            delete[] data;
-            state->release();
-        }
-    };
-
-    uint8_t *data = nullptr;
-    if (m_packets.empty()) {
-        data = new uint8_t[m_mtu];
+    Impl *impl = m_impl;
+    if (impl->free_list == nullptr) {
+        impl->add_slab();
+        ++impl->stats.misses;
     } else {
-        data = m_packets.front().release();
-        m_packets.pop_front();
+        ++impl->stats.hits;
     }
 
+    BlockHeader *block = impl->free_list;
+    impl->unlink_free(block);
+    impl->retain();
+    impl->stats.high_water = std::max(impl->stats.high_water, ++impl->stats.in_use);
+
     return VpnPacket{
-            .data = data, .size = static_cast<size_t>(m_mtu), .destructor = destructor, .destructor_arg = m_state};
+            .data = Impl::data_of(block), .size = impl->mtu, .destructor = &Impl::destructor, .destructor_arg = impl};
 }
 
 void VpnPacketPool::return_packet_data(uint8_t *packet) {
-    std::unique_ptr<uint8_t[]> data{packet};
-    if (m_packets.size() < m_capacity) {
-        m_packets.emplace_back(std::move(data));
-    }
-
-    m_state->release();
+    Impl::destructor(m_impl, packet);
 }
 
 size_t VpnPacketPool::get_size() {
-    return m_packets.size();
+    return m_impl->free_blocks;
+}
+
+VpnPacketPoolStats VpnPacketPool::get_stats() const {
+    return m_impl->stats;
+}
+
+void *VpnPacketPool::headroom(const VpnPacket &packet) {
+    if (packet.destructor != &Impl::destructor) {
+        return nullptr;
+    }
+    return packet.data - HEADROOM;
 }
 
 } // namespace ag
@@ -1,27 +1,50 @@
 #pragma once
 
-#include <list>
-#include <memory>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "tcpip/tcpip.h"
 #include "vpn/utils.h"
 
 namespace ag {
 
+/**
+ * Packet pool statistics
+ */
+struct VpnPacketPoolStats {
+    uint64_t hits;     /**< Number of packets taken from the free list */
+    uint64_t misses;   /**< Number of packets which required a new slab */
+    size_t in_use;     /**< Number of packets currently handed out */
+    size_t high_water; /**< Maximum number of packets handed out at once */
+    size_t slabs;      /**< Number of allocated slabs */
+};
+
+/**
+ * Pool of packet data blocks carved out of contiguous slabs.
+ * Each block reserves `HEADROOM` bytes in front of the data, so that a packet can carry
+ * its LWIP pbuf header without a separate allocation.
+ * Not thread-safe, except for the packet destructor, which may outlive the pool.
+ */
 class VpnPacketPool {
 public:
+    /** Space reserved in front of the data of each block, see `headroom()` */
+    static constexpr size_t HEADROOM = 128;
+
     /**
-     * Init list with pointers to data blocks
-     * @param size number of blocks
-     * @param mtu size of one block
+     * Allocate the first slab
+     * @param size number of blocks in a slab (the pool keeps at least this number of free blocks)
+     * @param mtu size of the data of one block
      */
     VpnPacketPool(size_t size, uint32_t mtu);
 
     ~VpnPacketPool();
 
+    VpnPacketPool(const VpnPacketPool &) = delete;
+    VpnPacketPool &operator=(const VpnPacketPool &) = delete;
+
     /**
      * Return VpnPacket with pointer to data from pool.
-     * If there are no unused data block, create the new one.
+     * If there are no unused data block, allocate a new slab.
      */
     VpnPacket get_packet();
 
@@ -36,13 +59,22 @@ public:
      */
     size_t get_size();
 
+    /**
+     * Get pool statistics
+     */
+    [[nodiscard]] VpnPacketPoolStats get_stats() const;
+
+    /**
+     * Get the space reserved in front of the packet data
+     * @return `HEADROOM` bytes aligned to `alignof(std::max_align_t)`,
+     *         or null if the packet does not come from a pool
+     */
+    static void *headroom(const VpnPacket &packet);
+
 private:
-    struct VpnPacketPoolState;
+    struct Impl;
 
-    size_t m_capacity;
-    uint32_t m_mtu;
-    std::list<std::unique_ptr<uint8_t[]>> m_packets;
-    VpnPacketPoolState *m_state;
+    Impl *m_impl;
 };
 
 } // namespace ag
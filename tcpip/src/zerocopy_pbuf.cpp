@@ -0,0 +1,54 @@
+#include "zerocopy_pbuf.h"
+
+#include <new>
+
+#include "vpn_packet_pool.h"
+
+namespace ag {
+
+struct ZeroCopyPBuf {
+    pbuf_custom p;
+    VpnPacket v;
+    bool embedded; /**< Placed in the headroom of the packet block */
+};
+
+static_assert(sizeof(ZeroCopyPBuf) <= VpnPacketPool::HEADROOM, "Pool headroom must fit the pbuf header");
+
+static void zerocopy_pbuf_free(struct pbuf *buf) {
+    auto *buf_custom = (ZeroCopyPBuf *) buf;
+    VpnPacket packet = buf_custom->v;
+    if (buf_custom->embedded) {
+        // The header lives in the block which is about to be returned
+        buf_custom->~ZeroCopyPBuf();
+    } else {
+        delete buf_custom;
+    }
+    if (packet.destructor) {
+        packet.destructor(packet.destructor_arg, packet.data);
+    }
+}
+
+pbuf *zerocopy_pbuf_create(VpnPacket *packet) {
+    ZeroCopyPBuf *buf_custom = nullptr;
+    if (void *headroom = VpnPacketPool::headroom(*packet); headroom != nullptr) {
+        buf_custom = new (headroom) ZeroCopyPBuf{.embedded = true};
+    } else {
+        buf_custom = new ZeroCopyPBuf{};
+    }
+    buf_custom->p.custom_free_function = zerocopy_pbuf_free;
+    buf_custom->v = *packet;
+
+    pbuf *buffer = pbuf_alloced_custom(
+            PBUF_RAW, buf_custom->v.size, PBUF_REF, &buf_custom->p, buf_custom->v.data, u16_t(buf_custom->v.size));
+    if (buffer == nullptr) {
+        if (buf_custom->embedded) {
+            buf_custom->~ZeroCopyPBuf();
+        } else {
+            delete buf_custom;
+        }
+        return nullptr;
+    }
+    return buffer;
+}
+
+} // namespace ag
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "lwipopts.h" // Include before LWIP headers
+
+#include <lwip/pbuf.h>
+
+#include "vpn/utils.h"
+
+namespace ag {
+
+/**
+ * Wrap a packet into a pbuf without copying the data.
+ * If the packet comes from a `VpnPacketPool`, the pbuf header is placed in the block's headroom,
+ * otherwise it is allocated on the heap.
+ * The packet's destructor is called when the pbuf is freed.
+ *
+ * @param packet the packet
+ * @return the pbuf, or null if failed (the packet is left untouched)
+ */
+pbuf *zerocopy_pbuf_create(VpnPacket *packet);
+
+} // namespace ag
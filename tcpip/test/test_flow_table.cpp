@@ -0,0 +1,178 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <vector>
+
+#include "flow_table.h"
+
+#include <lwip/prot/ip.h>
+
+using namespace ag;
+
+static FlowKey make_key(uint8_t proto, uint32_t src, uint16_t src_port, uint32_t dst, uint16_t dst_port) {
+    ip_addr_t src_addr = IPADDR4_INIT(lwip_htonl(src));
+    ip_addr_t dst_addr = IPADDR4_INIT(lwip_htonl(dst));
+    return flow_key_make(proto, &src_addr, src_port, &dst_addr, dst_port);
+}
+
+/** Flows of a NAT-like workload: few clients, many destinations */
+static FlowKey nth_key(size_t n) {
+    return make_key(IP_PROTO_TCP, 0x0a000002 + n % 16, uint16_t(1024 + n % 60000), 0x5db8d822 + uint32_t(n / 60000),
+            uint16_t(443 + n % 3));
+}
+
+TEST(FlowTable, InsertFindRemove) {
+    FlowTable table;
+    int a = 0;
+    int b = 0;
+    FlowKey key_a = make_key(IP_PROTO_TCP, 0x0a000002, 40000, 0x08080808, 443);
+    FlowKey key_b = make_key(IP_PROTO_UDP, 0x0a000002, 40000, 0x08080808, 443);
+
+    ASSERT_EQ(table.find(key_a), nullptr);
+    ASSERT_TRUE(table.insert(key_a, 1, &a));
+    ASSERT_TRUE(table.insert(key_b, 2, &b));
+    ASSERT_EQ(table.size(), 2);
+
+    // Duplicate key or ID
+    ASSERT_FALSE(table.insert(key_a, 3, &b));
+    ASSERT_FALSE(table.insert(make_key(IP_PROTO_TCP, 0x0a000002, 40001, 0x08080808, 443), 2, &b));
+
+    ASSERT_EQ(table.find(key_a), &a);
+    ASSERT_EQ(table.find(key_b), &b);
+    ASSERT_EQ(table.find_by_id(1), &a);
+    ASSERT_EQ(table.find_by_id(2), &b);
+
+    ASSERT_EQ(table.remove_by_id(1), &a);
+    ASSERT_EQ(table.find(key_a), nullptr);
+    ASSERT_EQ(table.find_by_id(1), nullptr);
+    ASSERT_EQ(table.remove(key_b), &b);
+    ASSERT_EQ(table.find_by_id(2), nullptr);
+    ASSERT_EQ(table.size(), 0);
+}
+
+TEST(FlowTable, AddressFamilies) {
+    FlowTable table;
+    int v4 = 0;
+    int v6 = 0;
+    ip_addr_t src4 = IPADDR4_INIT(0);
+    ip_addr_t dst4 = IPADDR4_INIT(0);
+    ip_addr_t src6 = IPADDR6_INIT(0, 0, 0, 0);
+    ip_addr_t dst6 = IPADDR6_INIT(0, 0, 0, 0);
+    ASSERT_TRUE(table.insert(flow_key_make(IP_PROTO_UDP, &src4, 53, &dst4, 53), &v4));
+    ASSERT_TRUE(table.insert(flow_key_make(IP_PROTO_UDP, &src6, 53, &dst6, 53), &v6));
+    ASSERT_EQ(table.find(flow_key_make(IP_PROTO_UDP, &src4, 53, &dst4, 53)), &v4);
+    ASSERT_EQ(table.find(flow_key_make(IP_PROTO_UDP, &src6, 53, &dst6, 53)), &v6);
+}
+
+TEST(FlowTable, ChurnKeepsTableCompact) {
+    FlowTable table;
+    std::vector<int> values(1000);
+    for (size_t round = 0; round < 100; ++round) {
+        for (size_t i = 0; i < values.size(); ++i) {
+            size_t n = round * values.size() + i;
+            ASSERT_TRUE(table.insert(nth_key(n), n, &values[i]));
+        }
+        for (size_t i = 0; i < values.size(); i += 2) {
+            size_t n = round * values.size() + i;
+            ASSERT_EQ(table.remove_by_id(n), &values[i]);
+        }
+        for (size_t i = 1; i < values.size(); i += 2) {
+            size_t n = round * values.size() + i;
+            ASSERT_EQ(table.find(nth_key(n)), &values[i]);
+            ASSERT_EQ(table.remove(nth_key(n)), &values[i]);
+        }
+        ASSERT_EQ(table.size(), 0);
+    }
+    TcpipFlowTableStats stats = table.get_stats();
+    ASSERT_EQ(stats.capacity, 0);
+    ASSERT_EQ(stats.memory_size, 0);
+
+    for (size_t i = 0; i < values.size(); ++i) {
+        ASSERT_TRUE(table.insert(nth_key(i), i, &values[i]));
+    }
+    for (size_t i = 0; i < values.size() - 10; ++i) {
+        ASSERT_NE(table.remove_by_id(i), nullptr);
+    }
+    stats = table.get_stats();
+    ASSERT_EQ(stats.size, 10);
+    ASSERT_LE(stats.capacity, 8 * stats.size);
+    for (size_t i = values.size() - 10; i < values.size(); ++i) {
+        ASSERT_EQ(table.find_by_id(i), &values[i]);
+    }
+}
+
+TEST(FlowTable, RemoveWhileIterating) {
+    FlowTable table;
+    std::vector<int> values(1000);
+    for (size_t i = 0; i < values.size(); ++i) {
+        values[i] = int(i);
+        ASSERT_TRUE(table.insert(nth_key(i), i, &values[i]));
+    }
+
+    size_t visited = 0;
+    table.for_each([&](void *value) {
+        ++visited;
+        int n = *(int *) value;
+        ASSERT_EQ(table.remove_by_id(n), value);
+    });
+    ASSERT_EQ(visited, values.size());
+    ASSERT_EQ(table.size(), 0);
+}
+
+class FlowTableBenchmark : public ::testing::TestWithParam<size_t> {};
+
+TEST_P(FlowTableBenchmark, Run) {
+    size_t flows = GetParam();
+    std::vector<FlowKey> keys(flows);
+    for (size_t i = 0; i < flows; ++i) {
+        keys[i] = nth_key(i);
+    }
+    FlowTable table;
+    using Clock = std::chrono::steady_clock;
+    using Ns = std::chrono::duration<double, std::nano>;
+
+    auto start = Clock::now();
+    for (size_t i = 0; i < flows; ++i) {
+        ASSERT_TRUE(table.insert(keys[i], i, &keys[i]));
+    }
+    Ns insert_time = Clock::now() - start;
+
+    // Lookups in packet order hit flows randomly
+    constexpr size_t lookups = 1000000;
+    size_t n = 0;
+    start = Clock::now();
+    for (size_t i = 0; i < lookups; ++i) {
+        n = (n + 0x9e3779b1) % flows;
+        ASSERT_EQ(table.find(keys[n]), &keys[n]);
+    }
+    Ns hit_time = Clock::now() - start;
+
+    start = Clock::now();
+    for (size_t i = 0; i < lookups; ++i) {
+        FlowKey key = nth_key(flows + i);
+        ASSERT_EQ(table.find(key), nullptr);
+    }
+    Ns miss_time = Clock::now() - start;
+
+    TcpipFlowTableStats stats = table.get_stats();
+
+    start = Clock::now();
+    for (size_t i = 0; i < flows; ++i) {
+        ASSERT_EQ(table.remove_by_id(i), &keys[i]);
+    }
+    Ns remove_time = Clock::now() - start;
+
+    printf("%zu flows: insert %.1f ns, hit %.1f ns, miss %.1f ns, remove %.1f ns\n", flows,
+            insert_time.count() / flows, hit_time.count() / lookups, miss_time.count() / lookups,
+            remove_time.count() / flows);
+    printf("capacity %zu, load factor %.2f, mean probe length %.2f, max displacement %zu, %.1f MiB\n",
+            stats.capacity, stats.load_factor, stats.mean_probe_length, stats.max_displacement,
+            stats.memory_size / (1024.0 * 1024.0));
+
+    ASSERT_EQ(stats.size, flows);
+    ASSERT_LE(stats.load_factor, 0.75);
+    ASSERT_LT(stats.mean_probe_length, 4);
+    ASSERT_EQ(table.size(), 0);
+}
+
+INSTANTIATE_TEST_SUITE_P(FlowTable, FlowTableBenchmark, ::testing::Values(100000, 1000000));
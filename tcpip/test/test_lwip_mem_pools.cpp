@@ -0,0 +1,101 @@
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <vector>
+
+#include "lwip_mem_pools.h"
+#include "lwipopts.h"
+
+#include <lwip/memp.h>
+#include <lwip/pbuf.h>
+
+using namespace ag;
+
+static TcpipMemPoolStats find_stats(const char *name) {
+    std::vector<TcpipMemPoolStats> stats(64);
+    size_t num = lwip_mem_pools_get_stats(stats.data(), stats.size());
+    EXPECT_LE(num, stats.size());
+    for (size_t i = 0; i < num; ++i) {
+        if (strstr(stats[i].name, name) != nullptr) {
+            return stats[i];
+        }
+    }
+    ADD_FAILURE() << "No pool " << name;
+    return {};
+}
+
+class LwipMemPools : public ::testing::Test {
+protected:
+    void SetUp() override {
+        TcpipParameters params{};
+        params.mtu_size = DEFAULT_MTU_SIZE;
+        lwip_mem_pools_configure(params);
+    }
+
+    void TearDown() override {
+        lwip_mem_pools_release_idle();
+    }
+};
+
+TEST_F(LwipMemPools, ObjectPools) {
+    TcpipMemPoolStats before = find_stats("TCP_PCB");
+
+    void *pcb = memp_malloc(MEMP_TCP_PCB);
+    ASSERT_NE(pcb, nullptr);
+    memset(pcb, 0xa5, memp_pools[MEMP_TCP_PCB]->size);
+    TcpipMemPoolStats after = find_stats("TCP_PCB");
+    ASSERT_EQ(after.used, before.used + 1);
+    ASSERT_EQ(after.allocs, before.allocs + 1);
+    ASSERT_EQ(after.chunks, 1);
+
+    memp_free(MEMP_TCP_PCB, pcb);
+    ASSERT_EQ(find_stats("TCP_PCB").used, before.used);
+}
+
+TEST_F(LwipMemPools, PacketsReturnToOs) {
+    TcpipMemPoolStats heap_before = find_stats("HEAP");
+
+    // Enough packets to take several chunks of the full-sized packet class
+    std::vector<pbuf *> packets;
+    for (size_t i = 0; i < 1000; ++i) {
+        pbuf *p = pbuf_alloc(PBUF_IP, DEFAULT_MTU_SIZE, PBUF_RAM);
+        ASSERT_NE(p, nullptr);
+        memset(p->payload, uint8_t(i), p->len);
+        packets.push_back(p);
+    }
+    std::vector<TcpipMemPoolStats> stats(64);
+    size_t num = lwip_mem_pools_get_stats(stats.data(), stats.size());
+    const TcpipMemPoolStats *packet_pool = nullptr;
+    for (size_t i = 0; i < num; ++i) {
+        if (strncmp(stats[i].name, "PBUF_RAM_", 9) == 0 && stats[i].used == packets.size()) {
+            packet_pool = &stats[i];
+        }
+    }
+    ASSERT_NE(packet_pool, nullptr);
+    ASSERT_GE(packet_pool->element_size, DEFAULT_MTU_SIZE);
+    ASSERT_GT(packet_pool->chunks, 1);
+    ASSERT_GE(packet_pool->high_water, packets.size());
+    std::string name = packet_pool->name;
+    ASSERT_EQ(find_stats("HEAP").used, heap_before.used);
+
+    for (size_t i = 0; i < packets.size(); ++i) {
+        ASSERT_EQ(((uint8_t *) packets[i]->payload)[packets[i]->len - 1], uint8_t(i));
+        pbuf_free(packets[i]);
+    }
+    TcpipMemPoolStats idle = find_stats(name.c_str());
+    ASSERT_EQ(idle.used, 0);
+    ASSERT_EQ(idle.chunks, 1); // A spare one
+
+    lwip_mem_pools_release_idle();
+    ASSERT_EQ(find_stats(name.c_str()).chunks, 0);
+}
+
+TEST_F(LwipMemPools, LargeAllocationsGoToHeap) {
+    TcpipMemPoolStats before = find_stats("HEAP");
+    pbuf *p = pbuf_alloc(PBUF_RAW, 16 * 1024, PBUF_RAM);
+    ASSERT_NE(p, nullptr);
+    ASSERT_EQ(find_stats("HEAP").used, before.used + 1);
+    pbuf_free(p);
+    ASSERT_EQ(find_stats("HEAP").used, before.used);
+}
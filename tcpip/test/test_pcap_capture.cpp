@@ -0,0 +1,212 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "pcap_capture.h"
+
+#include <lwip/inet_chksum.h>
+#include <lwip/prot/ip.h>
+#include <lwip/prot/ip4.h>
+
+using namespace ag;
+
+static constexpr size_t PCAP_FILE_HEADER_SIZE = 24;
+static constexpr size_t PCAP_RECORD_HEADER_SIZE = 16;
+
+struct Record {
+    uint32_t ts_sec;
+    uint32_t caplen;
+    uint32_t len;
+    std::vector<uint8_t> data;
+};
+
+static uint32_t read_u32(const uint8_t *p) {
+    uint32_t v = 0;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static std::vector<Record> read_pcap(const std::string &filename, uint32_t *snaplen = nullptr) {
+    std::ifstream file(filename, std::ios::binary);
+    std::vector<uint8_t> content{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    EXPECT_GE(content.size(), PCAP_FILE_HEADER_SIZE);
+    if (content.size() < PCAP_FILE_HEADER_SIZE) {
+        return {};
+    }
+    EXPECT_EQ(read_u32(content.data()), 0xa1b2c3d4);
+    if (snaplen != nullptr) {
+        *snaplen = read_u32(content.data() + 16);
+    }
+
+    std::vector<Record> records;
+    size_t pos = PCAP_FILE_HEADER_SIZE;
+    while (pos + PCAP_RECORD_HEADER_SIZE <= content.size()) {
+        Record rec{read_u32(&content[pos]), read_u32(&content[pos + 8]), read_u32(&content[pos + 12]), {}};
+        pos += PCAP_RECORD_HEADER_SIZE;
+        EXPECT_LE(pos + rec.caplen, content.size());
+        rec.data.assign(content.begin() + pos, content.begin() + pos + rec.caplen);
+        pos += rec.caplen;
+        records.push_back(std::move(rec));
+    }
+    EXPECT_EQ(pos, content.size());
+    return records;
+}
+
+/** IPv4 packet from 10.0.0.2:`src_port` to 1.1.1.1:443 */
+static std::vector<uint8_t> make_packet(uint8_t proto, uint16_t src_port, size_t payload_len) {
+    std::vector<uint8_t> packet(IP_HLEN + 8 + payload_len);
+    auto *hdr = (ip_hdr *) packet.data();
+    IPH_VHL_SET(hdr, 4, IP_HLEN / 4);
+    IPH_LEN_SET(hdr, lwip_htons(u16_t(packet.size())));
+    IPH_TTL_SET(hdr, 64);
+    IPH_PROTO_SET(hdr, proto);
+    hdr->src.addr = PP_HTONL(0x0a000002);
+    hdr->dest.addr = PP_HTONL(0x01010101);
+    IPH_CHKSUM_SET(hdr, inet_chksum(hdr, IP_HLEN));
+    packet[IP_HLEN] = src_port >> 8;
+    packet[IP_HLEN + 1] = src_port & 0xff;
+    packet[IP_HLEN + 2] = 443 >> 8;
+    packet[IP_HLEN + 3] = 443 & 0xff;
+    for (size_t i = 0; i < payload_len; ++i) {
+        packet[IP_HLEN + 8 + i] = uint8_t(i);
+    }
+    return packet;
+}
+
+/** Swap source and destination */
+static std::vector<uint8_t> reverse(std::vector<uint8_t> packet) {
+    auto *hdr = (ip_hdr *) packet.data();
+    std::swap(hdr->src, hdr->dest);
+    std::swap_ranges(&packet[IP_HLEN], &packet[IP_HLEN + 2], &packet[IP_HLEN + 2]);
+    return packet;
+}
+
+static void capture(PcapCapture &pcap, const std::vector<uint8_t> &packet, time_t sec = 1) {
+    // Split the packet to check that headers spanning several chunks are handled
+    size_t split = std::min<size_t>(10, packet.size());
+    evbuffer_iovec chunks[] = {
+            {.iov_base = (void *) packet.data(), .iov_len = split},
+            {.iov_base = (void *) (packet.data() + split), .iov_len = packet.size() - split},
+    };
+    timeval tv{.tv_sec = sec, .tv_usec = 0};
+    pcap.capture(tv, chunks);
+}
+
+class PcapCaptureTest : public ::testing::Test {
+protected:
+    std::string m_filename = testing::TempDir() + "test_pcap_capture.pcap";
+
+    void TearDown() override {
+        remove(m_filename.c_str());
+    }
+};
+
+TEST_F(PcapCaptureTest, WritesPacketsInBackground) {
+    TcpipPcapParameters params{};
+    params.snaplen = 100;
+    std::vector<uint8_t> small = make_packet(IP_PROTO_UDP, 40000, 10);
+    std::vector<uint8_t> large = make_packet(IP_PROTO_TCP, 40000, 1000);
+    {
+        PcapCapture pcap(params);
+        ASSERT_TRUE(pcap.start(m_filename.c_str()));
+        ASSERT_TRUE(pcap.is_active());
+        for (time_t i = 0; i < 1000; ++i) {
+            capture(pcap, (i % 2 == 0) ? small : large, i);
+        }
+        TcpipPcapStats stats = pcap.get_stats();
+        ASSERT_EQ(stats.packets, 1000);
+        ASSERT_EQ(stats.dropped, 0);
+    }
+
+    uint32_t snaplen = 0;
+    std::vector<Record> records = read_pcap(m_filename, &snaplen);
+    ASSERT_EQ(snaplen, 100);
+    ASSERT_EQ(records.size(), 1000);
+    for (size_t i = 0; i < records.size(); ++i) {
+        const Record &rec = records[i];
+        const std::vector<uint8_t> &packet = (i % 2 == 0) ? small : large;
+        ASSERT_EQ(rec.ts_sec, i);
+        ASSERT_EQ(rec.len, packet.size());
+        ASSERT_EQ(rec.caplen, std::min<size_t>(packet.size(), 100));
+        ASSERT_TRUE(std::equal(rec.data.begin(), rec.data.end(), packet.begin()));
+    }
+}
+
+TEST_F(PcapCaptureTest, DropsWhenBufferIsFull) {
+    TcpipPcapParameters params{};
+    params.buffer_size = 4096;
+    std::vector<uint8_t> packet = make_packet(IP_PROTO_UDP, 40000, 1400);
+    uint64_t captured = 0;
+    {
+        PcapCapture pcap(params);
+        ASSERT_TRUE(pcap.start(m_filename.c_str()));
+        for (size_t i = 0; i < 10000; ++i) {
+            capture(pcap, packet);
+        }
+        TcpipPcapStats stats = pcap.get_stats();
+        ASSERT_EQ(stats.packets + stats.dropped, 10000);
+        captured = stats.packets;
+    }
+    // Whatever was not dropped makes it to the file intact
+    std::vector<Record> records = read_pcap(m_filename);
+    ASSERT_EQ(records.size(), captured);
+    for (const Record &rec : records) {
+        ASSERT_EQ(rec.data, packet);
+    }
+}
+
+TEST_F(PcapCaptureTest, Filter) {
+    TcpipPcapParameters params{};
+    params.rolling = true;
+    params.filter.proto = IP_PROTO_TCP;
+    params.filter.endpoint_a = SocketAddress("10.0.0.2:40000");
+    params.filter.endpoint_b = SocketAddress("1.1.1.1:0");
+    PcapCapture pcap(params);
+
+    std::vector<uint8_t> packet = make_packet(IP_PROTO_TCP, 40000, 10);
+    evbuffer_iovec chunk = {.iov_base = packet.data(), .iov_len = packet.size()};
+    ASSERT_TRUE(pcap.matches({&chunk, 1}));
+    capture(pcap, packet);
+    capture(pcap, reverse(packet));
+    capture(pcap, make_packet(IP_PROTO_UDP, 40000, 10));
+    capture(pcap, make_packet(IP_PROTO_TCP, 40001, 10));
+    capture(pcap, reverse(make_packet(IP_PROTO_TCP, 40001, 10)));
+
+    TcpipPcapStats stats = pcap.get_stats();
+    ASSERT_EQ(stats.packets, 2);
+    ASSERT_EQ(stats.filtered, 3);
+}
+
+TEST_F(PcapCaptureTest, RollingKeepsLatestPackets) {
+    TcpipPcapParameters params{};
+    params.rolling = true;
+    params.buffer_size = 64 * 1024;
+    PcapCapture pcap(params);
+    ASSERT_FALSE(pcap.start(m_filename.c_str()));
+    ASSERT_TRUE(pcap.is_active());
+
+    std::vector<uint8_t> packet = make_packet(IP_PROTO_UDP, 40000, 1000);
+    size_t record_size = PCAP_RECORD_HEADER_SIZE + packet.size();
+    for (time_t i = 0; i < 1000; ++i) {
+        capture(pcap, packet, i);
+    }
+    TcpipPcapStats stats = pcap.get_stats();
+    ASSERT_EQ(stats.packets, 1000);
+    ASSERT_EQ(stats.dropped, 0);
+    ASSERT_GT(stats.evicted, 0);
+
+    ASSERT_TRUE(pcap.dump(m_filename.c_str()));
+    std::vector<Record> records = read_pcap(m_filename);
+    ASSERT_EQ(records.size(), 1000 - stats.evicted);
+    ASSERT_LE(records.size() * record_size, params.buffer_size);
+    ASSERT_GT((records.size() + 1) * record_size, params.buffer_size);
+    for (size_t i = 0; i < records.size(); ++i) {
+        ASSERT_EQ(records[i].ts_sec, stats.evicted + i);
+        ASSERT_EQ(records[i].data, packet);
+    }
+}
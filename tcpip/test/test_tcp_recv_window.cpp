@@ -0,0 +1,314 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "tcp_connection.h"
+#include "tcpip/tcpip.h"
+#include "tcpip_common.h"
+#include "vpn/event_loop.h"
+
+#include <lwip/inet_chksum.h>
+#include <lwip/prot/ip.h>
+#include <lwip/prot/ip4.h>
+#include <lwip/prot/tcp.h>
+
+/*
+ * Drives the stack in callback mode with hand-made clients to check how the receive windows
+ * of the connections are tuned: the test plays the upstream, so it decides when the received data
+ * is consumed (`tcpip_sent_to_remote()`) and when the timer ticks.
+ */
+
+using namespace ag;
+
+static constexpr uint32_t CLIENT_ADDR = 0x0a000002; // 10.0.0.2
+static constexpr uint32_t SERVER_ADDR = 0x01020304; // 1.2.3.4
+static constexpr uint16_t CLIENT_PORT_BASE = 10000;
+static constexpr uint16_t SERVER_PORT = 443;
+static constexpr uint32_t MTU = 1500;
+static constexpr size_t PAYLOAD_SIZE = 1400;
+static constexpr uint8_t CLIENT_WND_SCALE = 7;
+static constexpr uint32_t KB = 1024;
+
+static uint32_t checksum_add(uint32_t sum, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        sum += (uint32_t(data[i]) << 8) | data[i + 1];
+    }
+    if (len % 2 != 0) {
+        sum += uint32_t(data[len - 1]) << 8;
+    }
+    return sum;
+}
+
+static uint16_t checksum_fold(uint32_t sum) {
+    while ((sum >> 16) != 0) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return uint16_t(~sum);
+}
+
+struct Client {
+    uint16_t port;
+    uint64_t conn_id;
+    uint32_t snd_nxt; /**< Next sequence number to send */
+    uint32_t rcv_nxt; /**< Next sequence number expected from the server */
+    bool established;
+};
+
+class TcpRecvWindowTest : public ::testing::Test {
+protected:
+    VpnEventLoop *m_loop = nullptr;
+    TcpipCtx *m_tcpip = nullptr;
+    std::vector<Client> m_clients;
+    uint64_t m_next_conn_id = 1;
+    bool m_closing = false;
+
+    void TearDown() override {
+        m_closing = true;
+        if (m_tcpip != nullptr) {
+            tcpip_close(m_tcpip);
+        }
+        if (m_loop != nullptr) {
+            vpn_event_loop_destroy(m_loop);
+        }
+    }
+
+    void open(uint32_t recv_buf_size, uint32_t recv_buf_budget) {
+        m_loop = vpn_event_loop_create();
+        ASSERT_NE(m_loop, nullptr);
+        TcpipParameters params{};
+        params.tun_fd = -1;
+        params.event_loop = m_loop;
+        params.mtu_size = MTU;
+        params.tcp_recv_buf_size = recv_buf_size;
+        params.tcp_recv_buf_budget = recv_buf_budget;
+        params.handler = {&TcpRecvWindowTest::handler, this};
+        m_tcpip = tcpip_open(&params);
+        ASSERT_NE(m_tcpip, nullptr);
+    }
+
+    static void handler(void *arg, TcpipEvent event, void *data) {
+        auto *self = (TcpRecvWindowTest *) arg;
+        if (self->m_closing) {
+            return;
+        }
+        switch (event) {
+        case TCPIP_EVENT_GENERATE_CONN_ID:
+            *(uint64_t *) data = self->m_next_conn_id++;
+            break;
+        case TCPIP_EVENT_CONNECT_REQUEST: {
+            auto *request = (TcpipConnectRequestEvent *) data;
+            self->m_clients.at(request->src->port() - CLIENT_PORT_BASE).conn_id = request->id;
+            tcpip_complete_connect_request(self->m_tcpip, request->id, TCPIP_ACT_BYPASS);
+            break;
+        }
+        case TCPIP_EVENT_READ: {
+            // Everything is read, but the window slides only once the test reports the data consumed
+            auto *read = (TcpipReadEvent *) data;
+            size_t total = 0;
+            for (size_t i = 0; i < read->iovlen; ++i) {
+                total += read->iov[i].iov_len;
+            }
+            read->result = int(total);
+            break;
+        }
+        case TCPIP_EVENT_TUN_OUTPUT:
+            self->on_tun_output((TcpipTunOutputEvent *) data);
+            break;
+        case TCPIP_EVENT_CONNECTION_CLOSED:
+            ADD_FAILURE() << "Connection " << *(uint64_t *) data << " closed";
+            break;
+        case TCPIP_EVENT_CONNECTION_ACCEPTED:
+        case TCPIP_EVENT_DATA_SENT:
+        case TCPIP_EVENT_STAT_NOTIFY:
+        case TCPIP_EVENT_ICMP_ECHO:
+            break;
+        }
+    }
+
+    void on_tun_output(TcpipTunOutputEvent *event) {
+        std::vector<uint8_t> packet;
+        for (size_t i = 0; i < event->packet.chunks_num; ++i) {
+            const evbuffer_iovec &chunk = event->packet.chunks[i];
+            packet.insert(packet.end(), (uint8_t *) chunk.iov_base, (uint8_t *) chunk.iov_base + chunk.iov_len);
+        }
+        const auto *iph = (const ip_hdr *) packet.data();
+        if (packet.size() < IP_HLEN || IPH_V(iph) != 4 || IPH_PROTO(iph) != IP_PROTO_TCP) {
+            return;
+        }
+        const auto *tcph = (const tcp_hdr *) (packet.data() + IPH_HL_BYTES(iph));
+        size_t idx = lwip_ntohs(tcph->dest) - CLIENT_PORT_BASE;
+        if (idx < m_clients.size() && (TCPH_FLAGS(tcph) & TCP_SYN)) {
+            m_clients[idx].rcv_nxt = lwip_ntohl(tcph->seqno) + 1;
+            m_clients[idx].established = true;
+        }
+    }
+
+    void input(const Client &client, uint8_t flags, size_t payload_len, bool wnd_scale = true) {
+        size_t options_len = (flags & TCP_SYN) ? (wnd_scale ? 8 : 4) : 0;
+        size_t tcp_hlen = TCP_HLEN + options_len;
+        size_t len = IP_HLEN + tcp_hlen + payload_len;
+        auto *packet = new uint8_t[len]{};
+
+        auto *iph = (ip_hdr *) packet;
+        IPH_VHL_SET(iph, 4, IP_HLEN / 4);
+        IPH_LEN_SET(iph, lwip_htons(u16_t(len)));
+        IPH_TTL_SET(iph, 64);
+        IPH_PROTO_SET(iph, IP_PROTO_TCP);
+        iph->src.addr = PP_HTONL(CLIENT_ADDR);
+        iph->dest.addr = PP_HTONL(SERVER_ADDR);
+        IPH_CHKSUM_SET(iph, inet_chksum(iph, IP_HLEN));
+
+        uint8_t *segment = packet + IP_HLEN;
+        auto *tcph = (tcp_hdr *) segment;
+        tcph->src = lwip_htons(client.port);
+        tcph->dest = lwip_htons(SERVER_PORT);
+        tcph->seqno = lwip_htonl(client.snd_nxt);
+        tcph->ackno = (flags & TCP_ACK) ? lwip_htonl(client.rcv_nxt) : 0;
+        TCPH_HDRLEN_FLAGS_SET(tcph, tcp_hlen / 4, flags);
+        tcph->wnd = lwip_htons(0xffff);
+        if (flags & TCP_SYN) {
+            uint16_t mss = MTU - IP_HLEN - TCP_HLEN;
+            const uint8_t options[] = {2, 4, uint8_t(mss >> 8), uint8_t(mss & 0xff), 1, 3, 3, CLIENT_WND_SCALE};
+            memcpy(segment + TCP_HLEN, options, options_len);
+        }
+        memset(segment + tcp_hlen, 'x', payload_len);
+        uint32_t sum = checksum_add(0, packet + 12, 8) + IP_PROTO_TCP + tcp_hlen + payload_len;
+        tcph->chksum = lwip_htons(checksum_fold(checksum_add(sum, segment, tcp_hlen + payload_len)));
+
+        VpnPacket vpn_packet{packet, len, [](void *, uint8_t *data) {
+                                 delete[] data;
+                             }};
+        VpnPackets packets{&vpn_packet, 1};
+        tcpip_tun_input(m_tcpip, &packets);
+    }
+
+    size_t connect(bool wnd_scale = true) {
+        size_t idx = m_clients.size();
+        m_clients.push_back({.port = uint16_t(CLIENT_PORT_BASE + idx), .snd_nxt = 1000});
+        input(m_clients[idx], TCP_SYN, 0, wnd_scale);
+        EXPECT_TRUE(m_clients[idx].established);
+        m_clients[idx].snd_nxt += 1;
+        input(m_clients[idx], TCP_ACK, 0);
+        EXPECT_NE(descriptor(idx), nullptr);
+        return idx;
+    }
+
+    /** Send data to the stack as fast as the client may (i.e. fill the window) */
+    void send(size_t idx, size_t len) {
+        Client &client = m_clients[idx];
+        while (len > 0) {
+            size_t n = std::min(len, PAYLOAD_SIZE);
+            input(client, TCP_ACK | TCP_PSH, n);
+            client.snd_nxt += n;
+            len -= n;
+        }
+    }
+
+    void consume(size_t idx, size_t len) {
+        tcpip_sent_to_remote(m_tcpip, m_clients[idx].conn_id, len);
+    }
+
+    TcpConnDescriptor *descriptor(size_t idx) {
+        return (TcpConnDescriptor *) tcpip_get_connection_by_id(&m_tcpip->tcp.connections, m_clients[idx].conn_id);
+    }
+
+    uint32_t limit(size_t idx) {
+        return descriptor(idx)->rcv_wnd_limit;
+    }
+};
+
+TEST_F(TcpRecvWindowTest, GrowsWhileDrainedFast) {
+    open(512 * KB, 0);
+    size_t idx = connect();
+    ASSERT_EQ(limit(idx), TCPIP_TCP_MIN_RECV_WND);
+    ASSERT_EQ(descriptor(idx)->pcb->rcv_wnd, TCPIP_TCP_MIN_RECV_WND);
+
+    // The window doubles each time the client fills it and the upstream consumes it all
+    for (uint32_t expected : {128 * KB, 256 * KB, 512 * KB, 512 * KB}) {
+        uint32_t window = limit(idx);
+        send(idx, window);
+        ASSERT_EQ(descriptor(idx)->pcb->rcv_wnd, 0);
+        consume(idx, window);
+        ASSERT_EQ(limit(idx), expected);
+        ASSERT_EQ(descriptor(idx)->pcb->rcv_wnd, expected);
+        ASSERT_EQ(descriptor(idx)->pcb->rcv_wnd_max, expected);
+    }
+    ASSERT_EQ(m_tcpip->tcp.rcv_wnd_total, 512 * KB);
+}
+
+TEST_F(TcpRecvWindowTest, ShrinksWhenDrainedSlowly) {
+    open(512 * KB, 0);
+    size_t idx = connect();
+    while (limit(idx) < 512 * KB) {
+        uint32_t window = limit(idx);
+        send(idx, window);
+        consume(idx, window);
+    }
+
+    // Less than a quarter of the window is consumed during a tick: the window is halved
+    send(idx, PAYLOAD_SIZE);
+    consume(idx, PAYLOAD_SIZE);
+    tcp_cm_timer_tick(m_tcpip);
+    ASSERT_EQ(limit(idx), 256 * KB);
+    ASSERT_EQ(descriptor(idx)->pcb->rcv_wnd, 256 * KB);
+    ASSERT_EQ(m_tcpip->tcp.rcv_wnd_total, 256 * KB);
+
+    // A quarter of the window is consumed: the window stays
+    send(idx, 64 * KB);
+    consume(idx, 64 * KB);
+    tcp_cm_timer_tick(m_tcpip);
+    ASSERT_EQ(limit(idx), 256 * KB);
+
+    // Idle during a tick: back to the minimum
+    tcp_cm_timer_tick(m_tcpip);
+    ASSERT_EQ(limit(idx), TCPIP_TCP_MIN_RECV_WND);
+    ASSERT_EQ(descriptor(idx)->pcb->rcv_wnd, TCPIP_TCP_MIN_RECV_WND);
+    ASSERT_EQ(m_tcpip->tcp.rcv_wnd_total, TCPIP_TCP_MIN_RECV_WND);
+    ASSERT_TRUE(m_tcpip->tcp.rcv_wnd_tuned.empty());
+}
+
+TEST_F(TcpRecvWindowTest, StaysWithinBudget) {
+    open(0, 224 * KB);
+    size_t first = connect();
+    size_t second = connect();
+    ASSERT_EQ(m_tcpip->tcp.rcv_wnd_total, 128 * KB);
+
+    // The first connection takes what is left of the budget
+    send(first, 64 * KB);
+    consume(first, 64 * KB);
+    ASSERT_EQ(limit(first), 128 * KB);
+    send(first, 128 * KB);
+    consume(first, 128 * KB);
+    ASSERT_EQ(limit(first), 160 * KB);
+    ASSERT_EQ(m_tcpip->tcp.rcv_wnd_total, 224 * KB);
+
+    // Nothing is left for the second one
+    send(second, 64 * KB);
+    consume(second, 64 * KB);
+    ASSERT_EQ(limit(second), TCPIP_TCP_MIN_RECV_WND);
+    ASSERT_EQ(m_tcpip->tcp.rcv_wnd_total, 224 * KB);
+
+    // Until the first one releases its share
+    tcp_cm_timer_tick(m_tcpip);
+    tcp_cm_timer_tick(m_tcpip);
+    ASSERT_EQ(limit(first), TCPIP_TCP_MIN_RECV_WND);
+    send(second, 64 * KB);
+    consume(second, 64 * KB);
+    ASSERT_EQ(limit(second), 128 * KB);
+    ASSERT_EQ(m_tcpip->tcp.rcv_wnd_total, 192 * KB);
+}
+
+TEST_F(TcpRecvWindowTest, FixedWithoutWindowScale) {
+    open(32 * KB, 0);
+    size_t idx = connect(false);
+    ASSERT_EQ(limit(idx), 0);
+    ASSERT_EQ(descriptor(idx)->pcb->rcv_wnd_max, 32 * KB);
+    ASSERT_EQ(descriptor(idx)->pcb->rcv_wnd, 32 * KB);
+
+    send(idx, 32 * KB);
+    consume(idx, 32 * KB);
+    ASSERT_EQ(descriptor(idx)->pcb->rcv_wnd, 32 * KB);
+    ASSERT_EQ(m_tcpip->tcp.rcv_wnd_total, 0);
+}
@@ -0,0 +1,851 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include <event2/event.h>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "alloc_hooks.h"
+#include "tcpip/tcpip.h"
+#include "tcpip_common.h"
+#include "udp_fast_path.h"
+#include "vpn/event_loop.h"
+
+#include <lwip/inet_chksum.h>
+#include <lwip/prot/ip.h>
+#include <lwip/prot/ip4.h>
+#include <lwip/prot/tcp.h>
+
+/*
+ * Drives the stack in callback mode (no TUN device) with synthetic clients: every flow sends
+ * a stream of data (TCP) or datagrams (UDP) to an echo server implemented by the event handler,
+ * and checks that the same data comes back. Packets/s, Gbit/s, allocations and latency are reported,
+ * so the test doubles as a benchmark to compare LWIP options or changes of the packet path.
+ */
+
+using namespace ag;
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr uint32_t CLIENT_ADDR = 0x0a000002; // 10.0.0.2
+static constexpr uint32_t SERVER_ADDR = 0x01020304; // 1.2.3.4
+static constexpr uint16_t CLIENT_PORT_BASE = 10000;
+static constexpr uint16_t SERVER_PORT = 5201;
+static constexpr uint32_t MTU = 1500;
+static constexpr size_t PAYLOAD_SIZE = 1400;
+static constexpr size_t TCP_SYN_OPTIONS_SIZE = 8;
+static constexpr uint8_t CLIENT_WND_SCALE = 7;
+/** Number of packets passed to `tcpip_tun_input()` at once (as many as a TUN read callback handles) */
+static constexpr size_t BATCH_SIZE = 64;
+/** Number of segments (datagrams) a flow may have sent but not yet got echoed */
+static constexpr size_t FLOW_WINDOW = 8;
+/** Number of connections being set up at once (LWIP drops SYNs above its listen backlog) */
+static constexpr size_t MAX_HANDSHAKES = 128;
+/** Number of data packets sent by all the flows together */
+static constexpr size_t PACKETS_PER_RUN = 40000;
+/** Upper bound of the number of input packets held by the stack at once */
+static constexpr size_t INPUT_BUFFERS_NUM = 4096;
+static constexpr auto STALL_TIMEOUT = std::chrono::seconds(10);
+
+/** Data sent by a flow is `PATTERN[(flow + offset) % PATTERN_PERIOD]` so that the echo can be verified */
+static constexpr size_t PATTERN_PERIOD = 251;
+static constexpr size_t PATTERN_SIZE = PATTERN_PERIOD + 64 * 1024;
+
+static const uint8_t *pattern(size_t flow, uint64_t offset) {
+    static const std::vector<uint8_t> PATTERN = [] {
+        std::vector<uint8_t> p(PATTERN_SIZE);
+        for (size_t i = 0; i < p.size(); ++i) {
+            p[i] = uint8_t(i % PATTERN_PERIOD);
+        }
+        return p;
+    }();
+    return PATTERN.data() + (flow + offset) % PATTERN_PERIOD;
+}
+
+static uint32_t checksum_add(uint32_t sum, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        sum += (uint32_t(data[i]) << 8) | data[i + 1];
+    }
+    if (len % 2 != 0) {
+        sum += uint32_t(data[len - 1]) << 8;
+    }
+    return sum;
+}
+
+static uint16_t checksum_fold(uint32_t sum) {
+    while ((sum >> 16) != 0) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return uint16_t(~sum);
+}
+
+struct Flow {
+    size_t idx;
+    uint64_t conn_id;
+    bool syn_sent;
+    bool established;
+    bool ack_pending;
+    bool in_ack_list;
+    bool in_ready_queue;
+    uint32_t isn;       /**< Client initial sequence number */
+    uint32_t rcv_nxt;   /**< Next sequence number expected from the server */
+    uint64_t sent;      /**< Bytes (TCP) or datagrams (UDP) sent by the client */
+    uint64_t echoed;    /**< Bytes (TCP) or datagrams (UDP) echoed back */
+    uint64_t total;     /**< Bytes (TCP) or datagrams (UDP) to send */
+    uint64_t consumed;  /**< Bytes read by the server not yet reported with `tcpip_sent_to_remote()` */
+    uint64_t backlog;   /**< Bytes read by the server not yet sent back */
+    uint64_t server_tx; /**< Bytes sent back by the server */
+    /** Send times of the segments in flight and the stream offsets they end at */
+    std::array<std::pair<uint64_t, Clock::time_point>, FLOW_WINDOW> in_flight;
+    size_t in_flight_head;
+    size_t in_flight_num;
+};
+
+struct EchoResult {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t heap_allocs;
+    uint64_t pool_allocs;
+    double seconds;
+    std::vector<double> latencies_us;
+};
+
+class TcpipBenchmark : public ::testing::TestWithParam<std::tuple<int, size_t>> {
+protected:
+    VpnEventLoop *m_loop = nullptr;
+    TcpipCtx *m_tcpip = nullptr;
+    int m_proto = 0;
+    std::vector<Flow> m_flows;
+    std::vector<uint32_t> m_flow_by_conn_id; /**< Flow index + 1 (0 if unknown) */
+    uint64_t m_next_conn_id = 1;
+    size_t m_accepted = 0;
+    size_t m_syn_sent = 0;
+    bool m_failed = false;
+    bool m_closing = false;
+
+    std::vector<uint32_t> m_ready; /**< Ring of the flows which may send something */
+    size_t m_ready_head = 0;
+    size_t m_ready_num = 0;
+    std::vector<uint32_t> m_acks;           /**< Flows which have received data to be acked */
+    std::vector<uint32_t> m_server_touched; /**< Flows read by the server during the current batch */
+    std::vector<uint8_t *> m_free_buffers;
+    std::vector<std::vector<uint8_t>> m_buffers;
+    std::vector<uint8_t> m_output; /**< Scratch buffer to gather an output packet */
+    std::vector<VpnPacket> m_batch;
+
+    bool m_measuring = false;
+    uint64_t m_packets = 0;
+    uint64_t m_bytes = 0;
+    std::vector<double> m_latencies_us;
+
+    void SetUp() override {
+        m_proto = std::get<0>(GetParam());
+        size_t flows_num = std::get<1>(GetParam());
+        uint64_t per_flow = std::max<size_t>(2 * FLOW_WINDOW, PACKETS_PER_RUN / flows_num);
+
+        m_flows.resize(flows_num);
+        for (size_t i = 0; i < flows_num; ++i) {
+            Flow &flow = m_flows[i];
+            flow = {};
+            flow.idx = i;
+            flow.isn = uint32_t(1000 + i * 7919);
+            flow.total = (m_proto == IPPROTO_TCP) ? per_flow * PAYLOAD_SIZE : per_flow;
+        }
+        m_flow_by_conn_id.assign(2 * flows_num + 16, 0);
+        m_ready.resize(flows_num);
+        m_acks.reserve(flows_num);
+        m_server_touched.reserve(flows_num);
+        m_buffers.assign(INPUT_BUFFERS_NUM, std::vector<uint8_t>(MTU));
+        for (auto &buffer : m_buffers) {
+            m_free_buffers.push_back(buffer.data());
+        }
+        m_output.resize(64 * 1024);
+        m_batch.reserve(BATCH_SIZE);
+        m_latencies_us.reserve(per_flow * flows_num + FLOW_WINDOW * flows_num);
+
+        m_loop = vpn_event_loop_create();
+        ASSERT_NE(m_loop, nullptr);
+        TcpipParameters params{};
+        params.tun_fd = -1;
+        params.event_loop = m_loop;
+        params.mtu_size = MTU;
+        params.handler = {&TcpipBenchmark::handler, this};
+        m_tcpip = tcpip_open(&params);
+        ASSERT_NE(m_tcpip, nullptr);
+    }
+
+    void TearDown() override {
+        // The stack resets the remaining connections
+        m_closing = true;
+        if (m_tcpip != nullptr) {
+            tcpip_close(m_tcpip);
+        }
+        if (m_loop != nullptr) {
+            vpn_event_loop_destroy(m_loop);
+        }
+    }
+
+    static void handler(void *arg, TcpipEvent event, void *data) {
+        auto *self = (TcpipBenchmark *) arg;
+        if (self->m_closing) {
+            return;
+        }
+        switch (event) {
+        case TCPIP_EVENT_GENERATE_CONN_ID:
+            *(uint64_t *) data = self->m_next_conn_id++;
+            break;
+        case TCPIP_EVENT_CONNECT_REQUEST:
+            self->on_connect_request((TcpipConnectRequestEvent *) data);
+            break;
+        case TCPIP_EVENT_CONNECTION_ACCEPTED:
+            ++self->m_accepted;
+            break;
+        case TCPIP_EVENT_READ:
+            self->on_read((TcpipReadEvent *) data);
+            break;
+        case TCPIP_EVENT_DATA_SENT:
+            if (Flow *flow = self->flow_by_conn_id(((TcpipDataSentEvent *) data)->id); flow != nullptr) {
+                self->server_touch(*flow);
+            }
+            break;
+        case TCPIP_EVENT_CONNECTION_CLOSED:
+            ADD_FAILURE() << "Connection " << *(uint64_t *) data << " closed";
+            self->m_failed = true;
+            break;
+        case TCPIP_EVENT_TUN_OUTPUT:
+            self->on_tun_output((TcpipTunOutputEvent *) data);
+            break;
+        case TCPIP_EVENT_STAT_NOTIFY:
+        case TCPIP_EVENT_ICMP_ECHO:
+            break;
+        }
+    }
+
+    Flow *flow_by_conn_id(uint64_t id) {
+        if (id >= m_flow_by_conn_id.size() || m_flow_by_conn_id[id] == 0) {
+            return nullptr;
+        }
+        return &m_flows[m_flow_by_conn_id[id] - 1];
+    }
+
+    void on_connect_request(TcpipConnectRequestEvent *event) {
+        size_t idx = event->src->port() - CLIENT_PORT_BASE;
+        if (idx >= m_flows.size() || event->id >= m_flow_by_conn_id.size()) {
+            ADD_FAILURE() << "Unexpected connection from port " << event->src->port();
+            m_failed = true;
+            tcpip_complete_connect_request(m_tcpip, event->id, TCPIP_ACT_DROP);
+            return;
+        }
+        m_flows[idx].conn_id = event->id;
+        m_flow_by_conn_id[event->id] = idx + 1;
+        tcpip_complete_connect_request(m_tcpip, event->id, TCPIP_ACT_BYPASS);
+    }
+
+    /** The echo server: sends the data back right away, what does not fit is sent once the client acks */
+    void on_read(TcpipReadEvent *event) {
+        Flow *flow = flow_by_conn_id(event->id);
+        size_t total = 0;
+        for (size_t i = 0; i < event->iovlen; ++i) {
+            total += event->iov[i].iov_len;
+        }
+        event->result = int(total);
+        if (flow == nullptr) {
+            return;
+        }
+
+        if (m_proto == IPPROTO_UDP) {
+            uint8_t datagram[PAYLOAD_SIZE];
+            size_t len = 0;
+            for (size_t i = 0; i < event->iovlen && len + event->iov[i].iov_len <= sizeof(datagram); ++i) {
+                memcpy(datagram + len, event->iov[i].iov_base, event->iov[i].iov_len);
+                len += event->iov[i].iov_len;
+            }
+            if (tcpip_send_to_client(m_tcpip, event->id, datagram, len) < 0) {
+                ADD_FAILURE() << "Failed to echo a datagram";
+                m_failed = true;
+            }
+            return;
+        }
+
+        for (size_t i = 0; i < event->iovlen && flow->backlog == 0; ++i) {
+            const auto *data = (const uint8_t *) event->iov[i].iov_base;
+            size_t len = event->iov[i].iov_len;
+            int sent = tcpip_send_to_client(m_tcpip, event->id, data, len);
+            if (sent < 0) {
+                ADD_FAILURE() << "Failed to echo data";
+                m_failed = true;
+                return;
+            }
+            flow->server_tx += sent;
+            total -= sent;
+            if (size_t(sent) < len) {
+                break;
+            }
+        }
+        flow->backlog += total;
+        flow->consumed += event->result;
+        server_touch(*flow);
+    }
+
+    void server_touch(Flow &flow) {
+        if (flow.consumed == 0 && flow.backlog == 0) {
+            return;
+        }
+        if (std::find(m_server_touched.begin(), m_server_touched.end(), flow.idx) == m_server_touched.end()) {
+            m_server_touched.push_back(flow.idx);
+        }
+    }
+
+    /** Report the consumed data to slide the windows and send the backlog, as a real upstream would */
+    void flush_server() {
+        for (size_t i = 0; i < m_server_touched.size(); ++i) {
+            Flow &flow = m_flows[m_server_touched[i]];
+            while (flow.backlog > 0) {
+                size_t len = std::min<uint64_t>(flow.backlog, PATTERN_SIZE - PATTERN_PERIOD);
+                int sent = tcpip_send_to_client(m_tcpip, flow.conn_id, pattern(flow.idx, flow.server_tx), len);
+                if (sent <= 0) {
+                    break;
+                }
+                flow.server_tx += sent;
+                flow.backlog -= sent;
+            }
+            if (flow.consumed > 0) {
+                tcpip_sent_to_remote(m_tcpip, flow.conn_id, std::exchange(flow.consumed, 0));
+            }
+        }
+        // Those with a backlog are revisited on `TCPIP_EVENT_DATA_SENT`
+        m_server_touched.clear();
+    }
+
+    void make_ready(Flow &flow) {
+        if (!flow.in_ready_queue) {
+            flow.in_ready_queue = true;
+            m_ready[(m_ready_head + m_ready_num++) % m_ready.size()] = flow.idx;
+        }
+    }
+
+    void schedule_ack(Flow &flow) {
+        flow.ack_pending = true;
+        if (!flow.in_ack_list) {
+            flow.in_ack_list = true;
+            m_acks.push_back(flow.idx);
+        }
+    }
+
+    void record_echo(Flow &flow, uint64_t echoed) {
+        Clock::time_point now = Clock::now();
+        flow.echoed = echoed;
+        while (flow.in_flight_num > 0 && flow.in_flight[flow.in_flight_head].first <= echoed) {
+            if (m_measuring) {
+                std::chrono::duration<double, std::micro> latency = now - flow.in_flight[flow.in_flight_head].second;
+                m_latencies_us.push_back(latency.count());
+            }
+            flow.in_flight_head = (flow.in_flight_head + 1) % FLOW_WINDOW;
+            --flow.in_flight_num;
+        }
+        make_ready(flow);
+    }
+
+    void on_tun_output(TcpipTunOutputEvent *event) {
+        size_t len = 0;
+        for (size_t i = 0; i < event->packet.chunks_num; ++i) {
+            const evbuffer_iovec &chunk = event->packet.chunks[i];
+            if (len + chunk.iov_len > m_output.size()) {
+                ADD_FAILURE() << "Output packet is too large";
+                m_failed = true;
+                return;
+            }
+            memcpy(m_output.data() + len, chunk.iov_base, chunk.iov_len);
+            len += chunk.iov_len;
+        }
+        if (m_measuring) {
+            ++m_packets;
+        }
+
+        const uint8_t *packet = m_output.data();
+        const auto *iph = (const ip_hdr *) packet;
+        if (len < IP_HLEN || IPH_V(iph) != 4 || IPH_PROTO(iph) != m_proto) {
+            return;
+        }
+        size_t ip_hlen = IPH_HL_BYTES(iph);
+        size_t ip_len = std::min<size_t>(lwip_ntohs(IPH_LEN(iph)), len);
+        uint16_t dst_port = (packet[ip_hlen + 2] << 8) | packet[ip_hlen + 3];
+        size_t idx = dst_port - CLIENT_PORT_BASE;
+        if (idx >= m_flows.size()) {
+            return;
+        }
+        Flow &flow = m_flows[idx];
+
+        if (m_proto == IPPROTO_UDP) {
+            const uint8_t *payload = packet + ip_hlen + UDP_HLEN;
+            size_t payload_len = ip_len - ip_hlen - UDP_HLEN;
+            if (payload_len != PAYLOAD_SIZE || 0 != memcmp(payload, pattern(flow.idx, flow.echoed), payload_len)) {
+                ADD_FAILURE() << "Unexpected datagram echoed to flow " << idx;
+                m_failed = true;
+                return;
+            }
+            if (m_measuring) {
+                m_bytes += payload_len;
+            }
+            record_echo(flow, flow.echoed + 1);
+            return;
+        }
+
+        const auto *tcph = (const tcp_hdr *) (packet + ip_hlen);
+        size_t tcp_hlen = TCPH_HDRLEN_BYTES(tcph);
+        uint8_t flags = TCPH_FLAGS(tcph);
+        uint32_t seq = lwip_ntohl(tcph->seqno);
+        if (flags & (TCP_RST | TCP_FIN)) {
+            ADD_FAILURE() << "Flow " << idx << " is reset or closed by the stack";
+            m_failed = true;
+            return;
+        }
+        if (flags & TCP_SYN) {
+            flow.rcv_nxt = seq + 1;
+            flow.established = true;
+            schedule_ack(flow);
+            make_ready(flow);
+            return;
+        }
+
+        const uint8_t *payload = packet + ip_hlen + tcp_hlen;
+        size_t payload_len = ip_len - ip_hlen - tcp_hlen;
+        if (payload_len == 0 || seq != flow.rcv_nxt) {
+            // Pure ACKs, window updates and retransmissions of what has been received already
+            return;
+        }
+        if (0 != memcmp(payload, pattern(flow.idx, flow.echoed), payload_len)) {
+            ADD_FAILURE() << "Unexpected data echoed to flow " << idx << " at offset " << flow.echoed;
+            m_failed = true;
+            return;
+        }
+        flow.rcv_nxt += payload_len;
+        schedule_ack(flow);
+        if (m_measuring) {
+            m_bytes += payload_len;
+        }
+        record_echo(flow, flow.echoed + payload_len);
+    }
+
+    uint8_t *build_ip_header(uint8_t *packet, size_t len) {
+        auto *iph = (ip_hdr *) packet;
+        memset(iph, 0, IP_HLEN);
+        IPH_VHL_SET(iph, 4, IP_HLEN / 4);
+        IPH_LEN_SET(iph, lwip_htons(u16_t(len)));
+        IPH_TTL_SET(iph, 64);
+        IPH_PROTO_SET(iph, m_proto);
+        iph->src.addr = PP_HTONL(CLIENT_ADDR);
+        iph->dest.addr = PP_HTONL(SERVER_ADDR);
+        IPH_CHKSUM_SET(iph, inet_chksum(iph, IP_HLEN));
+        return packet + IP_HLEN;
+    }
+
+    size_t build_tcp_segment(Flow &flow, uint8_t *packet, uint8_t flags, size_t payload_len) {
+        size_t tcp_hlen = TCP_HLEN + ((flags & TCP_SYN) ? TCP_SYN_OPTIONS_SIZE : 0);
+        size_t len = IP_HLEN + tcp_hlen + payload_len;
+        uint8_t *segment = build_ip_header(packet, len);
+
+        auto *tcph = (tcp_hdr *) segment;
+        memset(tcph, 0, tcp_hlen);
+        tcph->src = lwip_htons(CLIENT_PORT_BASE + flow.idx);
+        tcph->dest = lwip_htons(SERVER_PORT);
+        tcph->seqno = lwip_htonl(flow.isn + ((flags & TCP_SYN) ? 0 : 1 + uint32_t(flow.sent)));
+        tcph->ackno = (flags & TCP_ACK) ? lwip_htonl(flow.rcv_nxt) : 0;
+        TCPH_HDRLEN_FLAGS_SET(tcph, tcp_hlen / 4, flags);
+        tcph->wnd = lwip_htons(0xffff);
+        if (flags & TCP_SYN) {
+            uint8_t *opts = segment + TCP_HLEN;
+            uint16_t mss = MTU - IP_HLEN - TCP_HLEN;
+            const uint8_t syn_options[TCP_SYN_OPTIONS_SIZE] = {
+                    2, 4, uint8_t(mss >> 8), uint8_t(mss & 0xff), 1, 3, 3, CLIENT_WND_SCALE};
+            memcpy(opts, syn_options, sizeof(syn_options));
+        }
+        if (payload_len > 0) {
+            memcpy(segment + tcp_hlen, pattern(flow.idx, flow.sent), payload_len);
+        }
+
+        // Pseudo header
+        uint32_t sum = checksum_add(0, packet + 12, 8);
+        sum += IP_PROTO_TCP + tcp_hlen + payload_len;
+        tcph->chksum = lwip_htons(checksum_fold(checksum_add(sum, segment, tcp_hlen + payload_len)));
+        flow.ack_pending = false;
+        return len;
+    }
+
+    size_t build_udp_datagram(Flow &flow, uint8_t *packet) {
+        UdpDatagram datagram{};
+        IP_ADDR4(&datagram.src_addr, 10, 0, 0, 2);
+        datagram.src_port = CLIENT_PORT_BASE + flow.idx;
+        IP_ADDR4(&datagram.dst_addr, 1, 2, 3, 4);
+        datagram.dst_port = SERVER_PORT;
+        datagram.payload = packet + IP_HLEN + UDP_HLEN;
+        datagram.payload_len = PAYLOAD_SIZE;
+        memcpy(packet + IP_HLEN + UDP_HLEN, pattern(flow.idx, flow.sent), PAYLOAD_SIZE);
+        return udp_fast_path_build_headers(datagram, 64, packet) + PAYLOAD_SIZE;
+    }
+
+    static void release_buffer(void *arg, uint8_t *data) {
+        ((TcpipBenchmark *) arg)->m_free_buffers.push_back(data);
+    }
+
+    void add_to_batch(uint8_t *buffer, size_t len) {
+        m_batch.push_back({buffer, len, &TcpipBenchmark::release_buffer, this});
+    }
+
+    /**
+     * Emit the packets of a flow until its window or the batch is full
+     * @param limit number of bytes (TCP) or datagrams (UDP) the flow may have sent
+     * @return true if the flow has more to send
+     */
+    bool fill_batch(Flow &flow, uint64_t limit) {
+        uint64_t window = (m_proto == IPPROTO_TCP) ? FLOW_WINDOW * PAYLOAD_SIZE : FLOW_WINDOW;
+        limit = std::min({limit, flow.total, flow.echoed + window});
+        while (m_batch.size() < BATCH_SIZE && !m_free_buffers.empty()) {
+            if (m_proto == IPPROTO_TCP && !flow.syn_sent) {
+                if (m_syn_sent - m_accepted >= MAX_HANDSHAKES) {
+                    return true;
+                }
+                flow.syn_sent = true;
+                ++m_syn_sent;
+                add_to_batch(m_free_buffers.back(), build_tcp_segment(flow, m_free_buffers.back(), TCP_SYN, 0));
+                m_free_buffers.pop_back();
+                return false;
+            }
+            if (m_proto == IPPROTO_TCP && !flow.established) {
+                return false;
+            }
+            if (flow.sent >= limit || flow.in_flight_num == FLOW_WINDOW) {
+                return false;
+            }
+
+            uint8_t *buffer = m_free_buffers.back();
+            m_free_buffers.pop_back();
+            if (m_proto == IPPROTO_TCP) {
+                size_t len = std::min<uint64_t>(PAYLOAD_SIZE, limit - flow.sent);
+                add_to_batch(buffer, build_tcp_segment(flow, buffer, TCP_ACK | TCP_PSH, len));
+                flow.sent += len;
+            } else {
+                add_to_batch(buffer, build_udp_datagram(flow, buffer));
+                flow.sent += 1;
+            }
+            flow.in_flight[(flow.in_flight_head + flow.in_flight_num++) % FLOW_WINDOW] = {flow.sent, Clock::now()};
+        }
+        return true;
+    }
+
+    void inject(Clock::time_point *last_progress) {
+        if (!m_batch.empty()) {
+            if (m_measuring) {
+                m_packets += m_batch.size();
+            }
+            VpnPackets packets{m_batch.data(), uint32_t(m_batch.size())};
+            tcpip_tun_input(m_tcpip, &packets);
+            m_batch.clear();
+            *last_progress = Clock::now();
+        }
+        flush_server();
+    }
+
+    /**
+     * Exchange packets until every flow has sent and got echoed `limit` bytes (datagrams)
+     * @return false if the flows stalled
+     */
+    bool run(uint64_t limit, size_t *accepted_target) {
+        for (Flow &flow : m_flows) {
+            make_ready(flow);
+        }
+        Clock::time_point last_progress = Clock::now();
+        event_base *base = vpn_event_loop_get_base(m_loop);
+        auto done = [&] {
+            if (accepted_target != nullptr && m_accepted < *accepted_target) {
+                return false;
+            }
+            return std::all_of(m_flows.begin(), m_flows.end(), [limit](const Flow &flow) {
+                return flow.echoed >= std::min(limit, flow.total);
+            });
+        };
+
+        while (!m_failed && !done()) {
+            // Every ready flow is visited at most once per batch as some may be waiting for a handshake slot
+            for (size_t n = m_ready_num; n > 0 && m_batch.size() < BATCH_SIZE && !m_free_buffers.empty(); --n) {
+                Flow &flow = m_flows[m_ready[m_ready_head]];
+                m_ready_head = (m_ready_head + 1) % m_ready.size();
+                --m_ready_num;
+                flow.in_ready_queue = false;
+                if (fill_batch(flow, limit)) {
+                    make_ready(flow);
+                }
+            }
+
+            inject(&last_progress);
+
+            // The clients ack the received data right away (which lets the server send more)
+            while (!m_failed && !m_acks.empty() && !m_free_buffers.empty()) {
+                while (!m_acks.empty() && m_batch.size() < BATCH_SIZE && !m_free_buffers.empty()) {
+                    Flow &flow = m_flows[m_acks.back()];
+                    m_acks.pop_back();
+                    flow.in_ack_list = false;
+                    if (flow.ack_pending) {
+                        add_to_batch(m_free_buffers.back(), build_tcp_segment(flow, m_free_buffers.back(), TCP_ACK, 0));
+                        m_free_buffers.pop_back();
+                    }
+                }
+                inject(&last_progress);
+            }
+            event_base_loop(base, EVLOOP_NONBLOCK);
+
+            if (Clock::now() - last_progress > STALL_TIMEOUT) {
+                return false;
+            }
+        }
+        return !m_failed;
+    }
+
+    static uint64_t pool_allocs(const TcpipCtx *ctx) {
+        TcpipMemPoolStats stats[64];
+        size_t n = tcpip_get_mem_pool_stats(ctx, stats, std::size(stats));
+        uint64_t allocs = 0;
+        for (size_t i = 0; i < n; ++i) {
+            allocs += stats[i].allocs;
+        }
+        return allocs;
+    }
+
+    EchoResult measure() {
+        // Set up the connections and warm the pools up
+        size_t accepted_target = (m_proto == IPPROTO_TCP) ? m_flows.size() : 0;
+        EXPECT_TRUE(run(1, &accepted_target)) << "Flows stalled during the setup";
+
+        m_measuring = true;
+        uint64_t heap_allocs = test::heap_allocs();
+        uint64_t pool_allocs_before = pool_allocs(m_tcpip);
+        Clock::time_point start = Clock::now();
+        EXPECT_TRUE(run(UINT64_MAX, nullptr)) << "Flows stalled";
+        EchoResult result{};
+        result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        result.heap_allocs = test::heap_allocs() - heap_allocs;
+        result.pool_allocs = pool_allocs(m_tcpip) - pool_allocs_before;
+        m_measuring = false;
+
+        result.packets = m_packets;
+        result.bytes = m_bytes;
+        result.latencies_us = std::move(m_latencies_us);
+        return result;
+    }
+};
+
+static double percentile(std::vector<double> &values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    auto nth = values.begin() + ptrdiff_t(p * double(values.size() - 1));
+    std::nth_element(values.begin(), nth, values.end());
+    return *nth;
+}
+
+TEST_P(TcpipBenchmark, Echo) {
+    EchoResult result = measure();
+    ASSERT_FALSE(m_failed);
+    ASSERT_GT(result.packets, 0);
+
+    double packets = double(result.packets);
+    printf("%s, %zu flows: %.0f packets/s, %.2f Gbit/s, %.2f heap allocs/packet, %.2f pool allocs/packet, "
+           "latency p50 %.1f us, p99 %.1f us\n",
+            (m_proto == IPPROTO_TCP) ? "TCP" : "UDP", m_flows.size(), packets / result.seconds,
+            double(result.bytes) * 8 / result.seconds / 1e9, double(result.heap_allocs) / packets,
+            double(result.pool_allocs) / packets, percentile(result.latencies_us, 0.5),
+            percentile(result.latencies_us, 0.99));
+}
+
+INSTANTIATE_TEST_SUITE_P(TcpipBenchmark, TcpipBenchmark,
+        ::testing::Combine(::testing::Values(IPPROTO_TCP, IPPROTO_UDP), ::testing::Values(1, 100, 10000)),
+        [](const ::testing::TestParamInfo<std::tuple<int, size_t>> &info) {
+            return std::string((std::get<0>(info.param) == IPPROTO_TCP) ? "Tcp" : "Udp") + "_"
+                    + std::to_string(std::get<1>(info.param));
+        });
+
+#ifdef __linux__
+
+/**
+ * Runs the stack on a TUN device emulated with a datagram socket pair: UDP flows on the other end send
+ * datagrams to an echo server implemented by the event handler, so both TUN I/O backends are measured
+ * on the same workload
+ */
+class TcpipTunBenchmark : public ::testing::TestWithParam<TcpipTunIoBackend> {
+protected:
+    static constexpr size_t FLOWS_NUM = 100;
+    static constexpr size_t DATAGRAMS_NUM = 100000;
+    /** Number of datagrams sent but not yet echoed, well below what the socket buffers hold */
+    static constexpr size_t WINDOW = 512;
+    static constexpr int SOCKET_BUFFER_SIZE = 4 * 1024 * 1024;
+
+    int m_peer = -1;
+    VpnEventLoop *m_loop = nullptr;
+    TcpipCtx *m_tcpip = nullptr;
+    uint64_t m_next_conn_id = 1;
+    bool m_failed = false;
+    bool m_closing = false;
+    uint64_t m_sent = 0;
+    uint64_t m_echoed = 0;
+
+    void SetUp() override {
+        int fds[2] = {-1, -1};
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, fds)) << strerror(errno);
+        for (int fd : fds) {
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &SOCKET_BUFFER_SIZE, sizeof(SOCKET_BUFFER_SIZE));
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &SOCKET_BUFFER_SIZE, sizeof(SOCKET_BUFFER_SIZE));
+        }
+        m_peer = fds[1];
+
+        m_loop = vpn_event_loop_create();
+        ASSERT_NE(m_loop, nullptr);
+        TcpipParameters params{};
+        params.tun_fd = fds[0]; // Closed by the stack
+        params.tun_io_backend = GetParam();
+        params.event_loop = m_loop;
+        params.mtu_size = MTU;
+        params.handler = {&TcpipTunBenchmark::handler, this};
+        m_tcpip = tcpip_open(&params);
+        ASSERT_NE(m_tcpip, nullptr);
+        if (m_tcpip->parameters.tun_io_backend != GetParam()) {
+            GTEST_SKIP() << "io_uring is not available";
+        }
+    }
+
+    void TearDown() override {
+        // The stack closes the remaining connections
+        m_closing = true;
+        if (m_tcpip != nullptr) {
+            tcpip_close(m_tcpip);
+        }
+        if (m_loop != nullptr) {
+            vpn_event_loop_destroy(m_loop);
+        }
+        if (m_peer != -1) {
+            close(m_peer);
+        }
+    }
+
+    static void handler(void *arg, TcpipEvent event, void *data) {
+        auto *self = (TcpipTunBenchmark *) arg;
+        if (self->m_closing) {
+            return;
+        }
+        switch (event) {
+        case TCPIP_EVENT_GENERATE_CONN_ID:
+            *(uint64_t *) data = self->m_next_conn_id++;
+            break;
+        case TCPIP_EVENT_CONNECT_REQUEST:
+            tcpip_complete_connect_request(
+                    self->m_tcpip, ((TcpipConnectRequestEvent *) data)->id, TCPIP_ACT_BYPASS);
+            break;
+        case TCPIP_EVENT_READ: {
+            auto *read_event = (TcpipReadEvent *) data;
+            uint8_t datagram[PAYLOAD_SIZE];
+            size_t len = 0;
+            for (size_t i = 0; i < read_event->iovlen && len + read_event->iov[i].iov_len <= sizeof(datagram); ++i) {
+                memcpy(datagram + len, read_event->iov[i].iov_base, read_event->iov[i].iov_len);
+                len += read_event->iov[i].iov_len;
+            }
+            read_event->result = int(len);
+            if (tcpip_send_to_client(self->m_tcpip, read_event->id, datagram, len) < 0) {
+                ADD_FAILURE() << "Failed to echo a datagram";
+                self->m_failed = true;
+            }
+            break;
+        }
+        case TCPIP_EVENT_CONNECTION_CLOSED:
+            ADD_FAILURE() << "Connection " << *(uint64_t *) data << " closed";
+            self->m_failed = true;
+            break;
+        default:
+            break;
+        }
+    }
+
+    void send_datagram() {
+        size_t flow = m_sent % FLOWS_NUM;
+        UdpDatagram datagram{};
+        IP_ADDR4(&datagram.src_addr, 10, 0, 0, 2);
+        datagram.src_port = CLIENT_PORT_BASE + flow;
+        IP_ADDR4(&datagram.dst_addr, 1, 2, 3, 4);
+        datagram.dst_port = SERVER_PORT;
+        datagram.payload = pattern(flow, m_sent / FLOWS_NUM);
+        datagram.payload_len = PAYLOAD_SIZE;
+        uint8_t packet[UDP_FAST_PATH_MAX_HEADERS_SIZE + PAYLOAD_SIZE];
+        size_t headers_len = udp_fast_path_build_headers(datagram, 64, packet);
+        memcpy(packet + headers_len, datagram.payload, PAYLOAD_SIZE);
+        if (ssize_t(headers_len + PAYLOAD_SIZE) != write(m_peer, packet, headers_len + PAYLOAD_SIZE)) {
+            ADD_FAILURE() << "Failed to write a packet: " << strerror(errno);
+            m_failed = true;
+        }
+        ++m_sent;
+    }
+
+    /** Read out the echoed packets written by the stack */
+    void receive_datagrams() {
+        uint8_t packet[MTU];
+        for (ssize_t r; (r = recv(m_peer, packet, sizeof(packet), MSG_DONTWAIT)) > 0;) {
+            const auto *iph = (const ip_hdr *) packet;
+            if (size_t(r) != IPH_HL_BYTES(iph) + UDP_HLEN + PAYLOAD_SIZE || IPH_PROTO(iph) != IP_PROTO_UDP) {
+                ADD_FAILURE() << "Unexpected packet of " << r << " bytes";
+                m_failed = true;
+                return;
+            }
+            ++m_echoed;
+        }
+    }
+
+    /**
+     * Exchange datagrams until `total` are echoed in all
+     * @return false if the flows stalled
+     */
+    bool run(uint64_t total) {
+        Clock::time_point last_progress = Clock::now();
+        event_base *base = vpn_event_loop_get_base(m_loop);
+        while (!m_failed && m_echoed < total) {
+            while (!m_failed && m_sent < total && m_sent - m_echoed < WINDOW) {
+                send_datagram();
+            }
+            event_base_loop(base, EVLOOP_NONBLOCK);
+            uint64_t echoed = m_echoed;
+            receive_datagrams();
+            if (m_echoed != echoed) {
+                last_progress = Clock::now();
+            } else if (Clock::now() - last_progress > STALL_TIMEOUT) {
+                return false;
+            }
+        }
+        return !m_failed;
+    }
+};
+
+TEST_P(TcpipTunBenchmark, UdpEcho) {
+    // Set the flows up, so that the rest goes through the fast path
+    ASSERT_TRUE(run(FLOWS_NUM)) << "Flows stalled during the setup";
+
+    Clock::time_point start = Clock::now();
+    ASSERT_TRUE(run(FLOWS_NUM + DATAGRAMS_NUM)) << "Flows stalled";
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    // Every datagram passes the TUN device twice
+    printf("%s TUN I/O, %zu flows: %.0f packets/s\n", (GetParam() == TCPIP_TUN_IO_URING) ? "io_uring" : "syscall",
+            FLOWS_NUM, 2 * DATAGRAMS_NUM / seconds);
+}
+
+INSTANTIATE_TEST_SUITE_P(TcpipTunBenchmark, TcpipTunBenchmark,
+        ::testing::Values(TCPIP_TUN_IO_SYSCALL, TCPIP_TUN_IO_URING),
+        [](const ::testing::TestParamInfo<TcpipTunIoBackend> &info) {
+            return std::string((info.param == TCPIP_TUN_IO_URING) ? "IoUring" : "Syscall");
+        });
+
+#endif // __linux__
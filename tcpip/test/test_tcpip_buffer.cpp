@@ -0,0 +1,52 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <vector>
+
+#include "tcpip/tcpip.h"
+
+#include <lwip/pbuf.h>
+
+using namespace ag;
+
+TEST(TcpipBuffer, ChunksOfLongChainAreReferencedSeparately) {
+    // More chunks than the reference counter of a single buffer can count
+    static constexpr size_t CHUNKS_NUM = 300;
+    static constexpr u16_t CHUNK_SIZE = 8;
+
+    pbuf *head = nullptr;
+    for (size_t i = 0; i < CHUNKS_NUM; ++i) {
+        pbuf *chunk = pbuf_alloc(PBUF_RAW, CHUNK_SIZE, PBUF_RAM);
+        ASSERT_NE(chunk, nullptr);
+        memset(chunk->payload, int(i), CHUNK_SIZE);
+        if (head == nullptr) {
+            head = chunk;
+        } else {
+            pbuf_cat(head, chunk);
+        }
+    }
+
+    // What a reader keeping every chunk of the message vector does
+    std::vector<TcpipBuffer *> chunks;
+    for (auto *buffer = (TcpipBuffer *) head; buffer != nullptr; buffer = tcpip_buffer_next(buffer)) {
+        tcpip_buffer_ref(buffer);
+        chunks.push_back(buffer);
+    }
+    ASSERT_EQ(chunks.size(), CHUNKS_NUM);
+
+    // The stack releases the chain after the read event, the chunks stay
+    pbuf_free(head);
+    for (size_t i = 0; i < CHUNKS_NUM; ++i) {
+        auto *chunk = (pbuf *) chunks[i];
+        ASSERT_EQ(chunk->ref, (i == 0) ? 1 : 2) << i;
+        ASSERT_EQ(chunk->len, CHUNK_SIZE);
+        ASSERT_EQ(((uint8_t *) chunk->payload)[CHUNK_SIZE - 1], uint8_t(i)) << i;
+    }
+
+    // Each chunk keeps the rest of the chain, so releasing the first one last frees the whole chain
+    for (size_t i = CHUNKS_NUM - 1; i > 0; --i) {
+        tcpip_buffer_unref(chunks[i]);
+        ASSERT_EQ(((pbuf *) chunks[i])->ref, 1) << i;
+    }
+    tcpip_buffer_unref(chunks[0]);
+}
@@ -0,0 +1,170 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <random>
+#include <vector>
+
+#include "timer_wheel.h"
+
+using namespace ag;
+
+struct Timer {
+    TimerWheelEntry entry;
+    uint64_t deadline;   // Expected deadline (0 if not scheduled)
+    uint64_t expired_at; // Tick passed to `advance()` when the timer expired
+};
+
+static Timer *timer_by_entry(TimerWheelEntry *entry) {
+    return (Timer *) ((uint8_t *) entry - offsetof(Timer, entry));
+}
+
+TEST(TimerWheel, ExpiresAtDeadline) {
+    static constexpr uint64_t START = 1000003;
+    const uint64_t timeouts[] = {1, 2, 63, 64, 65, 127, 128, 4095, 4096, 4097, 262143, 262144, 604800, 9999999};
+    std::vector<Timer> timers(std::size(timeouts));
+    TimerWheel wheel;
+    for (size_t i = 0; i < timers.size(); ++i) {
+        wheel.schedule(&timers[i].entry, START, timeouts[i]);
+        ASSERT_TRUE(TimerWheel::is_scheduled(&timers[i].entry));
+    }
+    ASSERT_EQ(wheel.size(), timers.size());
+
+    for (uint64_t now = START; wheel.size() != 0; ++now) {
+        wheel.advance(now, [now](TimerWheelEntry *entry) {
+            ASSERT_FALSE(TimerWheel::is_scheduled(entry));
+            timer_by_entry(entry)->expired_at = now;
+        });
+    }
+    for (size_t i = 0; i < timers.size(); ++i) {
+        ASSERT_EQ(timers[i].expired_at, START + timeouts[i]) << timeouts[i];
+    }
+}
+
+TEST(TimerWheel, MatchesReferenceModel) {
+    std::mt19937_64 rng(42); // NOLINT(cert-msc32-c,cert-msc51-cpp)
+    std::vector<Timer> timers(2000);
+    TimerWheel wheel;
+    uint64_t now = 5000;
+
+    for (size_t round = 0; round < 3000; ++round) {
+        // Reschedule or cancel some timers
+        for (size_t i = 0; i < 20; ++i) {
+            Timer &timer = timers[rng() % timers.size()];
+            if (rng() % 4 == 0) {
+                wheel.cancel(&timer.entry);
+                timer.deadline = 0;
+            } else {
+                uint64_t timeout = (rng() % 2 == 0) ? rng() % 100 : rng() % 1000000;
+                wheel.schedule(&timer.entry, now, timeout);
+                timer.deadline = now + std::max<uint64_t>(timeout, 1);
+            }
+        }
+
+        now += rng() % 300;
+        wheel.advance(now, [&](TimerWheelEntry *entry) {
+            Timer *timer = timer_by_entry(entry);
+            ASSERT_NE(timer->deadline, 0);
+            ASSERT_LE(timer->deadline, now);
+            timer->deadline = 0;
+        });
+
+        size_t scheduled = 0;
+        for (const Timer &timer : timers) {
+            ASSERT_EQ(TimerWheel::is_scheduled(&timer.entry), timer.deadline != 0);
+            if (timer.deadline != 0) {
+                ASSERT_GT(timer.deadline, now);
+                ++scheduled;
+            }
+        }
+        ASSERT_EQ(wheel.size(), scheduled);
+    }
+}
+
+TEST(TimerWheel, CallbackModifiesWheel) {
+    std::vector<Timer> timers(100);
+    TimerWheel wheel;
+    for (Timer &timer : timers) {
+        wheel.schedule(&timer.entry, 0, 10);
+    }
+
+    // Every expired timer cancels the next one and reschedules itself once
+    size_t expired = 0;
+    wheel.advance(10, [&](TimerWheelEntry *entry) {
+        Timer *timer = timer_by_entry(entry);
+        ++expired;
+        if (timer + 1 < timers.data() + timers.size()) {
+            wheel.cancel(&timer[1].entry);
+        }
+        if (timer->expired_at == 0) {
+            timer->expired_at = 10;
+            wheel.schedule(entry, 10, 5);
+        }
+    });
+    ASSERT_EQ(expired, 50);
+    ASSERT_EQ(wheel.size(), 50);
+
+    wheel.advance(15, [&](TimerWheelEntry *) {
+        ++expired;
+    });
+    ASSERT_EQ(expired, 100);
+    ASSERT_EQ(wheel.size(), 0);
+
+    wheel.schedule(&timers[0].entry, 20, 1);
+    wheel.clear();
+    ASSERT_EQ(wheel.size(), 0);
+    ASSERT_FALSE(TimerWheel::is_scheduled(&timers[0].entry));
+}
+
+class TimerWheelLoad : public ::testing::TestWithParam<size_t> {};
+
+/**
+ * Connection manager ticks (every 3 seconds) with a mix of short (UDP) and long (TCP) timeouts
+ * being refreshed by the traffic expire the same connections as scanning all of them would
+ */
+TEST_P(TimerWheelLoad, MatchesFullScan) {
+    static constexpr uint64_t TICK = 3;
+    static constexpr size_t TICKS = 1200;
+    size_t connections = GetParam();
+    size_t refreshes_per_tick = connections / 100;
+    std::mt19937_64 rng(1); // NOLINT(cert-msc32-c,cert-msc51-cpp)
+    auto timeout = [&rng](size_t i) -> uint64_t {
+        return (i % 2 == 0) ? 300 : 604800 + rng() % 60;
+    };
+
+    std::vector<Timer> timers(connections);
+    TimerWheel wheel;
+    uint64_t now = 1700000000;
+    for (size_t i = 0; i < connections; ++i) {
+        uint64_t t = timeout(i);
+        wheel.schedule(&timers[i].entry, now, t);
+        timers[i].deadline = now + t;
+    }
+
+    size_t expired = 0;
+    size_t scan_expired = 0;
+    for (size_t tick = 0; tick < TICKS; ++tick) {
+        now += TICK;
+        // Part of the connections are active, and some of the expired ones are replaced with new ones
+        for (size_t i = 0; i < refreshes_per_tick; ++i) {
+            size_t n = rng() % connections;
+            uint64_t t = timeout(n);
+            wheel.schedule(&timers[n].entry, now, t);
+            timers[n].deadline = now + t;
+        }
+
+        wheel.advance(now, [&](TimerWheelEntry *) {
+            ++expired;
+        });
+
+        for (Timer &timer : timers) {
+            if (timer.deadline != 0 && timer.deadline <= now) {
+                timer.deadline = 0;
+                ++scan_expired;
+            }
+        }
+        ASSERT_EQ(expired, scan_expired) << "tick " << tick;
+    }
+    ASSERT_GT(expired, 0);
+}
+
+INSTANTIATE_TEST_SUITE_P(TimerWheel, TimerWheelLoad, ::testing::Values(10000, 200000));
@@ -0,0 +1,291 @@
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <vector>
+
+#include <lwip/def.h>
+#include <lwip/inet_chksum.h>
+#include <lwip/pbuf.h>
+#include <lwip/prot/ip.h>
+#include <lwip/prot/ip4.h>
+#include <lwip/prot/tcp.h>
+#include <lwip/prot/udp.h>
+
+#include "tun_offload.h"
+
+using namespace ag;
+
+static constexpr uint32_t SRC_ADDR = 0xc0000201; // 192.0.2.1
+static constexpr uint32_t DST_ADDR = 0xc0000202; // 192.0.2.2
+
+static std::vector<uint8_t> make_ipv4_packet(uint8_t proto, size_t l4_len) {
+    std::vector<uint8_t> packet(IP_HLEN + l4_len);
+    auto *ip = (struct ip_hdr *) packet.data();
+    IPH_VHL_SET(ip, 4, IP_HLEN / 4);
+    IPH_LEN_SET(ip, lwip_htons(packet.size()));
+    IPH_TTL_SET(ip, 64);
+    IPH_PROTO_SET(ip, proto);
+    ip->src.addr = lwip_htonl(SRC_ADDR);
+    ip->dest.addr = lwip_htonl(DST_ADDR);
+    IPH_CHKSUM_SET(ip, inet_chksum(ip, IP_HLEN));
+    for (size_t i = IP_HLEN; i < packet.size(); ++i) {
+        packet[i] = uint8_t(i);
+    }
+    return packet;
+}
+
+static std::vector<uint8_t> make_tcp_segment(uint32_t seq, size_t payload_len, uint8_t flags) {
+    std::vector<uint8_t> packet = make_ipv4_packet(IP_PROTO_TCP, TCP_HLEN + payload_len);
+    auto *tcp = (struct tcp_hdr *) (packet.data() + IP_HLEN);
+    tcp->src = lwip_htons(443);
+    tcp->dest = lwip_htons(40000);
+    tcp->seqno = lwip_htonl(seq);
+    tcp->ackno = lwip_htonl(1);
+    tcp->wnd = lwip_htons(1024);
+    TCPH_HDRLEN_FLAGS_SET(tcp, TCP_HLEN / 4, flags);
+    return packet;
+}
+
+static bool append(TunTsoCoalescer &tso, std::vector<uint8_t> &packet) {
+    evbuffer_iovec chunk = {.iov_base = packet.data(), .iov_len = packet.size()};
+    return tso.append(1, {&chunk, 1});
+}
+
+static uint16_t l4_checksum(const uint8_t *packet, size_t len) {
+    const auto *ip = (const struct ip_hdr *) packet;
+    std::vector<uint8_t> buffer(12 + len - IP_HLEN);
+    memcpy(&buffer[0], &ip->src, 4);
+    memcpy(&buffer[4], &ip->dest, 4);
+    buffer[9] = IPH_PROTO(ip);
+    buffer[10] = uint8_t((len - IP_HLEN) >> 8);
+    buffer[11] = uint8_t(len - IP_HLEN);
+    memcpy(&buffer[12], packet + IP_HLEN, len - IP_HLEN);
+    return inet_chksum(buffer.data(), buffer.size());
+}
+
+static bool l4_checksum_is_valid(const uint8_t *packet, size_t len) {
+    return l4_checksum(packet, len) == 0;
+}
+
+TEST(TunOffload, CoalescesContiguousSegments) {
+    TunTsoCoalescer tso;
+    std::vector<uint8_t> first = make_tcp_segment(1000, 100, TCP_ACK);
+    std::vector<uint8_t> second = make_tcp_segment(1100, 100, TCP_ACK);
+    std::vector<uint8_t> last = make_tcp_segment(1200, 50, TCP_ACK | TCP_PSH);
+    std::vector<uint8_t> next = make_tcp_segment(1250, 100, TCP_ACK);
+
+    ASSERT_TRUE(append(tso, first));
+    ASSERT_TRUE(append(tso, second));
+    ASSERT_TRUE(append(tso, last));
+    // Nothing may follow a pushed segment
+    ASSERT_FALSE(append(tso, next));
+
+    VirtioNetHdr hdr{};
+    std::span<const uint8_t> segment = tso.finish(&hdr);
+    ASSERT_TRUE(tso.empty());
+    ASSERT_EQ(segment.size(), IP_HLEN + TCP_HLEN + 250);
+    ASSERT_EQ(hdr.gso_type, VNET_HDR_GSO_TCPV4);
+    ASSERT_EQ(hdr.gso_size, 100);
+    ASSERT_EQ(hdr.hdr_len, IP_HLEN + TCP_HLEN);
+    ASSERT_EQ(hdr.csum_start, IP_HLEN);
+    ASSERT_EQ(hdr.csum_offset, offsetof(struct tcp_hdr, chksum));
+    ASSERT_EQ(lwip_ntohs(IPH_LEN((const struct ip_hdr *) segment.data())), segment.size());
+    ASSERT_EQ(inet_chksum(segment.data(), IP_HLEN), 0);
+
+    const auto *tcp = (const struct tcp_hdr *) (segment.data() + IP_HLEN);
+    ASSERT_EQ(lwip_ntohl(tcp->seqno), 1000);
+    ASSERT_EQ(TCPH_FLAGS(tcp), TCP_ACK | TCP_PSH);
+    ASSERT_EQ(0, memcmp(segment.data() + IP_HLEN + TCP_HLEN + 100, second.data() + IP_HLEN + TCP_HLEN, 100));
+}
+
+TEST(TunOffload, SingleSegmentIsNotOffloaded) {
+    TunTsoCoalescer tso;
+    std::vector<uint8_t> packet = make_tcp_segment(1000, 100, TCP_ACK);
+    ASSERT_TRUE(append(tso, packet));
+
+    VirtioNetHdr hdr{};
+    std::span<const uint8_t> segment = tso.finish(&hdr);
+    ASSERT_EQ(hdr.gso_type, VNET_HDR_GSO_NONE);
+    ASSERT_EQ(hdr.flags, 0);
+    ASSERT_EQ(0, memcmp(segment.data(), packet.data(), packet.size()));
+}
+
+TEST(TunOffload, RejectsNonCoalescableSegments) {
+    TunTsoCoalescer tso;
+    std::vector<uint8_t> pure_ack = make_tcp_segment(1000, 0, TCP_ACK);
+    std::vector<uint8_t> syn = make_tcp_segment(1000, 100, TCP_SYN | TCP_ACK);
+    ASSERT_FALSE(append(tso, pure_ack));
+    ASSERT_FALSE(append(tso, syn));
+    ASSERT_TRUE(tso.empty());
+
+    std::vector<uint8_t> first = make_tcp_segment(1000, 100, TCP_ACK);
+    std::vector<uint8_t> gap = make_tcp_segment(1200, 100, TCP_ACK);
+    std::vector<uint8_t> longer = make_tcp_segment(1100, 200, TCP_ACK);
+    ASSERT_TRUE(append(tso, first));
+    ASSERT_FALSE(append(tso, gap));
+    ASSERT_FALSE(append(tso, longer));
+
+    std::vector<uint8_t> other_flow = make_tcp_segment(1100, 100, TCP_ACK);
+    ((struct tcp_hdr *) (other_flow.data() + IP_HLEN))->src = lwip_htons(444);
+    ASSERT_FALSE(append(tso, other_flow));
+}
+
+TEST(TunOffload, PreparesTcpSuperPacket) {
+    std::vector<uint8_t> packet = make_tcp_segment(1000, 3000, TCP_ACK);
+    // The kernel leaves the checksum partial and the IP header describing the first segment
+    IPH_LEN_SET((struct ip_hdr *) packet.data(), lwip_htons(IP_HLEN + TCP_HLEN + 1000));
+    VirtioNetHdr hdr = {
+            .flags = VNET_HDR_F_NEEDS_CSUM,
+            .gso_type = VNET_HDR_GSO_TCPV4,
+            .hdr_len = IP_HLEN + TCP_HLEN,
+            .gso_size = 1000,
+            .csum_start = IP_HLEN,
+            .csum_offset = offsetof(struct tcp_hdr, chksum),
+    };
+
+    ASSERT_TRUE(tun_offload_prepare_input(hdr, packet.data(), packet.size()));
+    ASSERT_EQ(lwip_ntohs(IPH_LEN((const struct ip_hdr *) packet.data())), packet.size());
+    ASSERT_EQ(inet_chksum(packet.data(), IP_HLEN), 0);
+    ASSERT_TRUE(l4_checksum_is_valid(packet.data(), packet.size()));
+
+    hdr.csum_start = packet.size();
+    ASSERT_FALSE(tun_offload_prepare_input(hdr, packet.data(), packet.size()));
+}
+
+TEST(TunOffload, SplitsUdpSuperPacket) {
+    std::vector<uint8_t> packet = make_ipv4_packet(IP_PROTO_UDP, UDP_HLEN + 250);
+    VirtioNetHdr hdr = {
+            .flags = VNET_HDR_F_NEEDS_CSUM,
+            .gso_type = VNET_HDR_GSO_UDP_L4,
+            .hdr_len = IP_HLEN + UDP_HLEN,
+            .gso_size = 100,
+            .csum_start = IP_HLEN,
+            .csum_offset = offsetof(struct udp_hdr, chksum),
+    };
+
+    std::vector<uint8_t> datagram(packet.size());
+    size_t sizes[] = {IP_HLEN + UDP_HLEN + 100, IP_HLEN + UDP_HLEN + 100, IP_HLEN + UDP_HLEN + 50};
+    for (size_t i = 0; i < std::size(sizes); ++i) {
+        size_t size = tun_offload_udp_segment(hdr, packet.data(), packet.size(), i, datagram.data());
+        ASSERT_EQ(size, sizes[i]) << i;
+        ASSERT_EQ(lwip_ntohs(IPH_LEN((const struct ip_hdr *) datagram.data())), size);
+        ASSERT_EQ(inet_chksum(datagram.data(), IP_HLEN), 0);
+        ASSERT_EQ(lwip_ntohs(((const struct udp_hdr *) (datagram.data() + IP_HLEN))->len), size - IP_HLEN);
+        ASSERT_TRUE(l4_checksum_is_valid(datagram.data(), size));
+        ASSERT_EQ(0, memcmp(datagram.data() + IP_HLEN + UDP_HLEN, packet.data() + IP_HLEN + UDP_HLEN + i * 100,
+                             size - IP_HLEN - UDP_HLEN));
+    }
+    ASSERT_EQ(0, tun_offload_udp_segment(hdr, packet.data(), packet.size(), std::size(sizes), datagram.data()));
+}
+
+/**
+ * Make a TCP segment with a valid checksum and a payload distinct from the other segments
+ */
+static pbuf *make_gro_segment(uint32_t seq, size_t payload_len, uint8_t flags) {
+    std::vector<uint8_t> packet = make_tcp_segment(seq, payload_len, flags);
+    for (size_t i = 0; i < payload_len; ++i) {
+        packet[IP_HLEN + TCP_HLEN + i] = uint8_t(seq + i);
+    }
+    auto *tcp = (struct tcp_hdr *) (packet.data() + IP_HLEN);
+    tcp->chksum = 0;
+    tcp->urgp = 0;
+    tcp->chksum = l4_checksum(packet.data(), packet.size());
+
+    pbuf *p = pbuf_alloc(PBUF_RAW, packet.size(), PBUF_RAM);
+    memcpy(p->payload, packet.data(), packet.size());
+    return p;
+}
+
+class TunGro : public ::testing::Test {
+protected:
+    std::vector<std::vector<uint8_t>> m_delivered;
+    std::vector<size_t> m_delivered_chains;
+    TunGroCoalescer m_gro{deliver, this};
+
+    static void deliver(void *arg, pbuf *packet) {
+        auto *self = (TunGro *) arg;
+        std::vector<uint8_t> &data = self->m_delivered.emplace_back(packet->tot_len);
+        pbuf_copy_partial(packet, data.data(), packet->tot_len, 0);
+        self->m_delivered_chains.push_back(pbuf_clen(packet));
+        pbuf_free(packet);
+    }
+
+    static uint32_t seq_of(const std::vector<uint8_t> &packet) {
+        return lwip_ntohl(((const struct tcp_hdr *) (packet.data() + IP_HLEN))->seqno);
+    }
+};
+
+TEST_F(TunGro, CoalescesContiguousSegments) {
+    // Odd sizes make the payloads start at odd offsets
+    m_gro.add(make_gro_segment(1000, 101, TCP_ACK));
+    m_gro.add(make_gro_segment(1101, 101, TCP_ACK));
+    m_gro.add(make_gro_segment(1202, 51, TCP_ACK | TCP_PSH));
+    ASSERT_TRUE(m_delivered.empty());
+    m_gro.flush();
+
+    ASSERT_EQ(m_delivered.size(), 1);
+    ASSERT_EQ(m_delivered_chains[0], 3);
+    const std::vector<uint8_t> &segment = m_delivered[0];
+    ASSERT_EQ(segment.size(), IP_HLEN + TCP_HLEN + 253);
+    ASSERT_EQ(lwip_ntohs(IPH_LEN((const struct ip_hdr *) segment.data())), segment.size());
+    ASSERT_EQ(inet_chksum(segment.data(), IP_HLEN), 0);
+    ASSERT_TRUE(l4_checksum_is_valid(segment.data(), segment.size()));
+    ASSERT_EQ(seq_of(segment), 1000);
+    ASSERT_EQ(TCPH_FLAGS((const struct tcp_hdr *) (segment.data() + IP_HLEN)), TCP_ACK | TCP_PSH);
+    for (size_t i = 0; i < 253; ++i) {
+        ASSERT_EQ(segment[IP_HLEN + TCP_HLEN + i], uint8_t(1000 + i)) << i;
+    }
+}
+
+TEST_F(TunGro, KeepsOrderWithinFlow) {
+    m_gro.add(make_gro_segment(1000, 100, TCP_ACK));
+    m_gro.add(make_gro_segment(1100, 100, TCP_ACK));
+    // A FIN can't be held, the held segments go first
+    m_gro.add(make_gro_segment(1200, 0, TCP_ACK | TCP_FIN));
+    ASSERT_EQ(m_delivered.size(), 2);
+    ASSERT_EQ(m_delivered[0].size(), IP_HLEN + TCP_HLEN + 200);
+    ASSERT_EQ(seq_of(m_delivered[1]), 1200);
+
+    // A gap starts a new segment
+    m_gro.add(make_gro_segment(2000, 100, TCP_ACK));
+    m_gro.add(make_gro_segment(2200, 100, TCP_ACK));
+    m_gro.flush();
+    ASSERT_EQ(m_delivered.size(), 4);
+    ASSERT_EQ(seq_of(m_delivered[2]), 2000);
+    ASSERT_EQ(seq_of(m_delivered[3]), 2200);
+}
+
+TEST_F(TunGro, SeparatesFlows) {
+    std::vector<uint8_t> udp = make_ipv4_packet(IP_PROTO_UDP, UDP_HLEN + 10);
+    pbuf *udp_packet = pbuf_alloc(PBUF_RAW, udp.size(), PBUF_RAM);
+    memcpy(udp_packet->payload, udp.data(), udp.size());
+
+    pbuf *other_flow = make_gro_segment(1100, 100, TCP_ACK);
+    ((struct tcp_hdr *) ((uint8_t *) other_flow->payload + IP_HLEN))->src = lwip_htons(444);
+
+    m_gro.add(make_gro_segment(1000, 100, TCP_ACK));
+    m_gro.add(other_flow);
+    m_gro.add(udp_packet);
+    ASSERT_EQ(m_delivered.size(), 1);
+    ASSERT_EQ(m_delivered[0], udp);
+    m_gro.add(make_gro_segment(1100, 100, TCP_ACK));
+    m_gro.flush();
+
+    ASSERT_EQ(m_delivered.size(), 3);
+    ASSERT_EQ(m_delivered[1].size(), IP_HLEN + TCP_HLEN + 200);
+    ASSERT_TRUE(l4_checksum_is_valid(m_delivered[1].data(), m_delivered[1].size()));
+    ASSERT_EQ(m_delivered[2].size(), IP_HLEN + TCP_HLEN + 100);
+}
+
+TEST_F(TunGro, CorruptedSegmentFailsChecksum) {
+    pbuf *corrupted = make_gro_segment(1100, 100, TCP_ACK);
+    ((uint8_t *) corrupted->payload)[IP_HLEN + TCP_HLEN] ^= 0xff;
+
+    m_gro.add(make_gro_segment(1000, 100, TCP_ACK));
+    m_gro.add(corrupted);
+    m_gro.flush();
+
+    ASSERT_EQ(m_delivered.size(), 1);
+    ASSERT_FALSE(l4_checksum_is_valid(m_delivered[0].data(), m_delivered[0].size()));
+}
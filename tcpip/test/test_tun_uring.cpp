@@ -0,0 +1,373 @@
+#include <gtest/gtest.h>
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include <event2/event.h>
+
+#include "tcpip_common.h"
+#include "tun_uring.h"
+#include "udp_fast_path.h"
+#include "vpn/event_loop.h"
+
+#include <lwip/prot/ip4.h>
+
+#ifdef TCPIP_HAVE_IO_URING
+
+using namespace ag;
+
+static constexpr size_t PACKET_SIZE = 1400;
+static constexpr size_t BATCH_SIZE = 64;
+static constexpr size_t BATCHES_NUM = 100;
+static constexpr size_t PACKETS_NUM = BATCH_SIZE * BATCHES_NUM;
+static constexpr int SOCKET_BUFFER_SIZE = 4 * 1024 * 1024;
+
+/**
+ * Emulates a TUN device with a datagram socket pair: each packet written to one end
+ * is read out of the other one as a whole
+ */
+static void make_tun_pair(int fds[2]) {
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, fds)) << strerror(errno);
+    for (int i = 0; i < 2; ++i) {
+        setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &SOCKET_BUFFER_SIZE, sizeof(SOCKET_BUFFER_SIZE));
+        setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &SOCKET_BUFFER_SIZE, sizeof(SOCKET_BUFFER_SIZE));
+    }
+}
+
+class TunUringTest : public ::testing::Test {
+protected:
+    int m_fds[2] = {-1, -1};
+    std::vector<uint8_t> m_received;
+
+    void SetUp() override {
+        make_tun_pair(m_fds);
+        m_received.assign(PACKETS_NUM, 0);
+    }
+
+    void TearDown() override {
+        close(m_fds[0]);
+        close(m_fds[1]);
+    }
+
+    static void fill_packet(uint8_t *packet, uint32_t seq) {
+        memset(packet, uint8_t(seq), PACKET_SIZE);
+        memcpy(packet, &seq, sizeof(seq));
+    }
+
+    void check_packet(const uint8_t *packet, size_t size) {
+        ASSERT_EQ(size, PACKET_SIZE);
+        uint32_t seq = 0;
+        memcpy(&seq, packet, sizeof(seq));
+        ASSERT_LT(seq, PACKETS_NUM);
+        ASSERT_EQ(packet[PACKET_SIZE - 1], uint8_t(seq));
+        ++m_received[seq];
+    }
+};
+
+TEST_F(TunUringTest, ReadsAndWrites) {
+    std::unique_ptr<TunUring> ring = TunUring::create(2 * BATCH_SIZE);
+    if (ring == nullptr) {
+        GTEST_SKIP() << "io_uring is not available: " << strerror(errno);
+    }
+
+    struct Op {
+        bool is_write;
+        std::vector<uint8_t> buffer = std::vector<uint8_t>(PACKET_SIZE);
+        iovec iov{};
+    };
+    std::vector<Op> reads(BATCH_SIZE);
+    std::vector<Op> writes(BATCH_SIZE);
+    auto queue = [&ring](Op &op, uint8_t opcode, int fd) {
+        io_uring_sqe *sqe = ring->get_sqe();
+        ASSERT_NE(sqe, nullptr);
+        op.is_write = opcode == IORING_OP_WRITEV;
+        op.iov = {.iov_base = op.buffer.data(), .iov_len = op.buffer.size()};
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t) &op.iov;
+        sqe->len = 1;
+        sqe->user_data = (uintptr_t) &op;
+    };
+
+    for (Op &op : reads) {
+        queue(op, IORING_OP_READV, m_fds[1]);
+    }
+    for (size_t batch = 0; batch < BATCHES_NUM; ++batch) {
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            fill_packet(writes[i].buffer.data(), batch * BATCH_SIZE + i);
+            queue(writes[i], IORING_OP_WRITEV, m_fds[0]);
+        }
+
+        size_t completed = 0;
+        while (completed < 2 * BATCH_SIZE) {
+            int r = ring->submit(2 * BATCH_SIZE - completed);
+            ASSERT_GE(r, 0) << strerror(-r);
+            io_uring_cqe cqe{};
+            while (ring->pop_cqe(&cqe)) {
+                ++completed;
+                auto *op = (Op *) (uintptr_t) cqe.user_data;
+                ASSERT_GT(cqe.res, 0) << strerror(-cqe.res);
+                if (op->is_write) {
+                    continue;
+                }
+                check_packet(op->buffer.data(), cqe.res);
+                if (batch + 1 < BATCHES_NUM) {
+                    queue(*op, IORING_OP_READV, m_fds[1]);
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < PACKETS_NUM; ++i) {
+        ASSERT_EQ(m_received[i], 1) << i;
+    }
+}
+
+static constexpr uint32_t MTU = 1500;
+static constexpr uint16_t CLIENT_PORT = 10000;
+static constexpr uint16_t SERVER_PORT = 53;
+static constexpr size_t SMALL_PAYLOAD_SIZE = 100;
+/** Exceeds MTU, so the datagram goes through LWIP, which fragments it */
+static constexpr size_t LARGE_PAYLOAD_SIZE = 3000;
+static constexpr auto WAIT_TIMEOUT = std::chrono::seconds(5);
+
+/**
+ * Runs the stack on the io_uring backend with a UDP client on the other end of the emulated TUN device
+ */
+class TcpipUringTest : public ::testing::Test {
+protected:
+    int m_peer = -1;
+    VpnEventLoop *m_loop = nullptr;
+    TcpipCtx *m_tcpip = nullptr;
+    uint64_t m_next_conn_id = 1;
+    uint64_t m_conn_id = 0;
+    std::vector<std::vector<uint8_t>> m_read; /**< Payloads passed by the stack to the server */
+
+    void SetUp() override {
+        if (TunUring::create(1) == nullptr) {
+            GTEST_SKIP() << "io_uring is not available: " << strerror(errno);
+        }
+
+        int fds[2] = {-1, -1};
+        make_tun_pair(fds);
+        m_peer = fds[1];
+        m_loop = vpn_event_loop_create();
+        ASSERT_NE(m_loop, nullptr);
+
+        TcpipParameters params{};
+        params.tun_fd = fds[0]; // Closed by the stack
+        params.tun_io_backend = TCPIP_TUN_IO_URING;
+        params.event_loop = m_loop;
+        params.mtu_size = MTU;
+        params.handler = {&TcpipUringTest::handler, this};
+        m_tcpip = tcpip_open(&params);
+        ASSERT_NE(m_tcpip, nullptr);
+        ASSERT_NE(m_tcpip->uring, nullptr);
+
+        // The first datagram sets the connection up
+        send_from_client(0);
+        ASSERT_TRUE(run_until([this] {
+            return m_read.size() == 1;
+        }));
+        ASSERT_NE(m_conn_id, 0);
+    }
+
+    void TearDown() override {
+        if (m_tcpip != nullptr) {
+            tcpip_close(m_tcpip);
+        }
+        if (m_loop != nullptr) {
+            vpn_event_loop_destroy(m_loop);
+        }
+        if (m_peer != -1) {
+            close(m_peer);
+        }
+    }
+
+    static void handler(void *arg, TcpipEvent event, void *data) {
+        auto *self = (TcpipUringTest *) arg;
+        switch (event) {
+        case TCPIP_EVENT_GENERATE_CONN_ID:
+            *(uint64_t *) data = self->m_next_conn_id++;
+            break;
+        case TCPIP_EVENT_CONNECT_REQUEST: {
+            auto *request = (TcpipConnectRequestEvent *) data;
+            self->m_conn_id = request->id;
+            tcpip_complete_connect_request(self->m_tcpip, request->id, TCPIP_ACT_BYPASS);
+            break;
+        }
+        case TCPIP_EVENT_READ: {
+            auto *read_event = (TcpipReadEvent *) data;
+            std::vector<uint8_t> payload;
+            for (size_t i = 0; i < read_event->iovlen; ++i) {
+                const auto *chunk = (const uint8_t *) read_event->iov[i].iov_base;
+                payload.insert(payload.end(), chunk, chunk + read_event->iov[i].iov_len);
+            }
+            read_event->result = int(payload.size());
+            self->m_read.push_back(std::move(payload));
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    bool run_until(const std::function<bool()> &done) {
+        auto start = std::chrono::steady_clock::now();
+        while (!done()) {
+            if (std::chrono::steady_clock::now() - start > WAIT_TIMEOUT) {
+                return false;
+            }
+            event_base_loop(vpn_event_loop_get_base(m_loop), EVLOOP_NONBLOCK);
+        }
+        return true;
+    }
+
+    static std::vector<uint8_t> make_payload(uint32_t seq, size_t size) {
+        std::vector<uint8_t> payload(size, uint8_t(seq));
+        memcpy(payload.data(), &seq, sizeof(seq));
+        return payload;
+    }
+
+    void send_from_client(uint32_t seq) {
+        std::vector<uint8_t> payload = make_payload(seq, SMALL_PAYLOAD_SIZE);
+        UdpDatagram datagram{};
+        IP_ADDR4(&datagram.src_addr, 10, 0, 0, 2);
+        datagram.src_port = CLIENT_PORT;
+        IP_ADDR4(&datagram.dst_addr, 1, 2, 3, 4);
+        datagram.dst_port = SERVER_PORT;
+        datagram.payload = payload.data();
+        datagram.payload_len = payload.size();
+        uint8_t packet[UDP_FAST_PATH_MAX_HEADERS_SIZE + SMALL_PAYLOAD_SIZE];
+        size_t headers_len = udp_fast_path_build_headers(datagram, 64, packet);
+        memcpy(packet + headers_len, payload.data(), payload.size());
+        ASSERT_EQ(ssize_t(headers_len + payload.size()), write(m_peer, packet, headers_len + payload.size()));
+    }
+
+    void send_to_client(uint32_t seq, size_t size) {
+        std::vector<uint8_t> payload = make_payload(seq, size);
+        ASSERT_EQ(int(size), tcpip_send_to_client(m_tcpip, m_conn_id, payload.data(), payload.size()));
+    }
+
+    /**
+     * Read the packets written by the stack and reassemble the datagrams
+     * @return sequence numbers of the datagrams in the order their packets were written
+     */
+    std::vector<uint32_t> receive_on_client(size_t datagrams_num) {
+        std::vector<uint32_t> seqs;
+        std::vector<uint8_t> packet(MTU);
+        auto start = std::chrono::steady_clock::now();
+        while (seqs.size() < datagrams_num && std::chrono::steady_clock::now() - start < WAIT_TIMEOUT) {
+            ssize_t r = recv(m_peer, packet.data(), packet.size(), MSG_DONTWAIT);
+            if (r <= 0) {
+                event_base_loop(vpn_event_loop_get_base(m_loop), EVLOOP_NONBLOCK);
+                continue;
+            }
+            const auto *iph = (const ip_hdr *) packet.data();
+            uint16_t offset = lwip_ntohs(IPH_OFFSET(iph)) & IP_OFFMASK;
+            if (offset != 0) {
+                // The rest of a fragmented datagram must follow its first fragment
+                EXPECT_FALSE(seqs.empty());
+                continue;
+            }
+            uint32_t seq = 0;
+            memcpy(&seq, packet.data() + IPH_HL_BYTES(iph) + UDP_HLEN, sizeof(seq));
+            seqs.push_back(seq);
+        }
+        return seqs;
+    }
+
+    static std::vector<uint32_t> sequence(uint32_t from, size_t num) {
+        std::vector<uint32_t> seqs(num);
+        for (size_t i = 0; i < num; ++i) {
+            seqs[i] = from + i;
+        }
+        return seqs;
+    }
+
+    [[nodiscard]] size_t queued_writes() const {
+        return m_tcpip->uring->queued_writes.size();
+    }
+
+    [[nodiscard]] size_t writes_in_flight() const {
+        return m_tcpip->uring->writes_in_flight;
+    }
+};
+
+TEST_F(TcpipUringTest, Echo) {
+    for (uint32_t seq = 1; seq <= 10; ++seq) {
+        send_from_client(seq);
+    }
+    ASSERT_TRUE(run_until([this] {
+        return m_read.size() == 11;
+    }));
+    for (uint32_t seq = 0; seq < m_read.size(); ++seq) {
+        ASSERT_EQ(m_read[seq], make_payload(seq, SMALL_PAYLOAD_SIZE));
+        send_to_client(seq, SMALL_PAYLOAD_SIZE);
+    }
+
+    ASSERT_EQ(receive_on_client(11), sequence(0, 11));
+    ASSERT_TRUE(run_until([this] {
+        return writes_in_flight() == 0;
+    }));
+    ASSERT_EQ(queued_writes(), 0);
+}
+
+TEST_F(TcpipUringTest, WritesKeepOrder) {
+    // Copied datagrams of the fast path interleave with fragments of LWIP which are written without copying
+    static constexpr size_t DATAGRAMS_NUM = 60;
+    for (uint32_t seq = 0; seq < DATAGRAMS_NUM; ++seq) {
+        send_to_client(seq, (seq % 3 == 0) ? LARGE_PAYLOAD_SIZE : SMALL_PAYLOAD_SIZE);
+    }
+    size_t packets_num = queued_writes();
+    ASSERT_GT(packets_num, DATAGRAMS_NUM);
+    ASSERT_EQ(writes_in_flight(), 0);
+    ASSERT_TRUE(std::any_of(m_tcpip->uring->queued_writes.begin(), m_tcpip->uring->queued_writes.end(),
+            [](const TunUringOp *op) {
+                return op->pbuf != nullptr;
+            }));
+
+    // All of them go out with a single submission
+    event_base_loop(vpn_event_loop_get_base(m_loop), EVLOOP_NONBLOCK | EVLOOP_ONCE);
+    ASSERT_EQ(queued_writes(), 0);
+    ASSERT_EQ(writes_in_flight(), packets_num);
+
+    // The packets produced while the chain is in flight wait for it instead of being written synchronously
+    send_to_client(DATAGRAMS_NUM, SMALL_PAYLOAD_SIZE);
+    ASSERT_EQ(queued_writes(), 1);
+
+    ASSERT_EQ(receive_on_client(DATAGRAMS_NUM + 1), sequence(0, DATAGRAMS_NUM + 1));
+    ASSERT_TRUE(run_until([this] {
+        return writes_in_flight() == 0 && queued_writes() == 0;
+    }));
+}
+
+TEST_F(TcpipUringTest, WaitsForFreeRequest) {
+    // The writes above the limit wait for the queued ones instead of being dropped or reordered
+    static constexpr size_t DATAGRAMS_NUM = TUN_URING_MAX_WRITES + 100;
+    for (uint32_t seq = 0; seq < DATAGRAMS_NUM; ++seq) {
+        send_to_client(seq, SMALL_PAYLOAD_SIZE);
+    }
+    ASSERT_LE(queued_writes() + writes_in_flight(), TUN_URING_MAX_WRITES);
+
+    ASSERT_EQ(receive_on_client(DATAGRAMS_NUM), sequence(0, DATAGRAMS_NUM));
+}
+
+TEST_F(TcpipUringTest, CloseWritesPending) {
+    send_to_client(1, SMALL_PAYLOAD_SIZE);
+    send_to_client(2, LARGE_PAYLOAD_SIZE);
+    ASSERT_GT(queued_writes(), 0);
+
+    tcpip_close(std::exchange(m_tcpip, nullptr));
+
+    ASSERT_EQ(receive_on_client(2), sequence(1, 2));
+}
+
+#endif // TCPIP_HAVE_IO_URING
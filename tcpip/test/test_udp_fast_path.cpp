@@ -0,0 +1,284 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <vector>
+
+#include "udp_fast_path.h"
+#include "vpn/event_loop.h"
+
+#include <lwip/inet_chksum.h>
+#include <lwip/pbuf.h>
+#include <lwip/prot/ip.h>
+#include <lwip/prot/ip4.h>
+#include <lwip/stats.h>
+
+using namespace ag;
+
+static UdpDatagram make_datagram(bool ipv6, const std::vector<uint8_t> &payload) {
+    UdpDatagram datagram{};
+    if (ipv6) {
+        ip_addr_t src = IPADDR6_INIT_HOST(0xfd000000, 0, 0, 1);
+        ip_addr_t dst = IPADDR6_INIT_HOST(0x20014860, 0x48600000, 0, 0x8888);
+        datagram.src_addr = src;
+        datagram.dst_addr = dst;
+    } else {
+        ip_addr_t src = IPADDR4_INIT_BYTES(172, 16, 0, 2);
+        ip_addr_t dst = IPADDR4_INIT_BYTES(8, 8, 8, 8);
+        datagram.src_addr = src;
+        datagram.dst_addr = dst;
+    }
+    datagram.src_port = 50000;
+    datagram.dst_port = 443;
+    datagram.payload = payload.data();
+    datagram.payload_len = payload.size();
+    return datagram;
+}
+
+static std::vector<uint8_t> build_packet(const UdpDatagram &datagram) {
+    std::vector<uint8_t> packet(UDP_FAST_PATH_MAX_HEADERS_SIZE);
+    size_t headers_len = udp_fast_path_build_headers(datagram, 64, packet.data());
+    packet.resize(headers_len);
+    packet.insert(packet.end(), datagram.payload, datagram.payload + datagram.payload_len);
+    return packet;
+}
+
+static std::vector<uint8_t> make_payload(size_t size) {
+    std::vector<uint8_t> payload(size);
+    for (size_t i = 0; i < size; ++i) {
+        payload[i] = uint8_t(i * 7 + 1);
+    }
+    return payload;
+}
+
+/** Check the UDP checksum the way LWIP does it */
+static bool lwip_checksum_is_valid(const std::vector<uint8_t> &packet, const UdpDatagram &datagram) {
+    size_t ip_header_len = IP_IS_V4_VAL(datagram.src_addr) ? IP_HLEN : IP6_HLEN;
+    size_t udp_len = packet.size() - ip_header_len;
+    pbuf *p = pbuf_alloc(PBUF_RAW, u16_t(udp_len), PBUF_RAM);
+    pbuf_take(p, packet.data() + ip_header_len, u16_t(udp_len));
+    u16_t sum = ip_chksum_pseudo(p, IP_PROTO_UDP, u16_t(udp_len), &datagram.src_addr, &datagram.dst_addr);
+    pbuf_free(p);
+    return sum == 0;
+}
+
+class UdpFastPath : public ::testing::TestWithParam<bool> {};
+
+TEST_P(UdpFastPath, BuildAndParse) {
+    bool ipv6 = GetParam();
+    // Odd and even sizes, and an empty datagram
+    for (size_t size : {0, 1, 1200, 1201}) {
+        std::vector<uint8_t> payload = make_payload(size);
+        UdpDatagram datagram = make_datagram(ipv6, payload);
+        std::vector<uint8_t> packet = build_packet(datagram);
+        ASSERT_TRUE(lwip_checksum_is_valid(packet, datagram)) << size;
+
+        UdpDatagram parsed; // NOLINT(cppcoreguidelines-pro-type-member-init)
+        ASSERT_TRUE(udp_fast_path_parse(packet.data(), packet.size(), &parsed)) << size;
+        ASSERT_TRUE(ip_addr_cmp(&parsed.src_addr, &datagram.src_addr));
+        ASSERT_TRUE(ip_addr_cmp(&parsed.dst_addr, &datagram.dst_addr));
+        ASSERT_EQ(parsed.src_port, datagram.src_port);
+        ASSERT_EQ(parsed.dst_port, datagram.dst_port);
+        ASSERT_EQ(parsed.payload, packet.data() + packet.size() - size);
+        ASSERT_EQ(parsed.payload_len, size);
+        ASSERT_EQ(std::vector<uint8_t>(parsed.payload, parsed.payload + size), payload);
+    }
+}
+
+TEST_P(UdpFastPath, CorruptedDatagramGoesToLwip) {
+    std::vector<uint8_t> payload = make_payload(100);
+    UdpDatagram datagram = make_datagram(GetParam(), payload);
+    std::vector<uint8_t> packet = build_packet(datagram);
+    UdpDatagram parsed; // NOLINT(cppcoreguidelines-pro-type-member-init)
+
+    std::vector<uint8_t> corrupted = packet;
+    corrupted.back() ^= 0x40;
+    ASSERT_FALSE(udp_fast_path_parse(corrupted.data(), corrupted.size(), &parsed));
+
+    // Truncated
+    ASSERT_FALSE(udp_fast_path_parse(packet.data(), packet.size() - 1, &parsed));
+}
+
+INSTANTIATE_TEST_SUITE_P(IpVersion, UdpFastPath, ::testing::Values(false, true));
+
+TEST(UdpFastPath, Ipv4FragmentsAndOptionsGoToLwip) {
+    std::vector<uint8_t> payload = make_payload(100);
+    UdpDatagram datagram = make_datagram(false, payload);
+    std::vector<uint8_t> packet = build_packet(datagram);
+    auto *hdr = (ip_hdr *) packet.data();
+    UdpDatagram parsed; // NOLINT(cppcoreguidelines-pro-type-member-init)
+
+    IPH_OFFSET_SET(hdr, PP_HTONS(IP_MF));
+    IPH_CHKSUM_SET(hdr, 0);
+    IPH_CHKSUM_SET(hdr, inet_chksum(hdr, IP_HLEN));
+    ASSERT_FALSE(udp_fast_path_parse(packet.data(), packet.size(), &parsed));
+
+    // Don't-fragment flag is fine
+    IPH_OFFSET_SET(hdr, PP_HTONS(IP_DF));
+    IPH_CHKSUM_SET(hdr, 0);
+    IPH_CHKSUM_SET(hdr, inet_chksum(hdr, IP_HLEN));
+    ASSERT_TRUE(udp_fast_path_parse(packet.data(), packet.size(), &parsed));
+
+    // Bad header checksum
+    IPH_TTL_SET(hdr, 1);
+    ASSERT_FALSE(udp_fast_path_parse(packet.data(), packet.size(), &parsed));
+
+    // Options
+    std::vector<uint8_t> with_options(packet.begin(), packet.begin() + IP_HLEN);
+    with_options.insert(with_options.end(), {1, 1, 1, 0}); // NOPs and end of options
+    with_options.insert(with_options.end(), packet.begin() + IP_HLEN, packet.end());
+    hdr = (ip_hdr *) with_options.data();
+    IPH_VHL_SET(hdr, 4, (IP_HLEN + 4) / 4);
+    IPH_LEN_SET(hdr, lwip_htons(u16_t(with_options.size())));
+    IPH_CHKSUM_SET(hdr, 0);
+    IPH_CHKSUM_SET(hdr, inet_chksum(hdr, IP_HLEN + 4));
+    ASSERT_FALSE(udp_fast_path_parse(with_options.data(), with_options.size(), &parsed));
+}
+
+TEST(UdpFastPath, ZeroChecksum) {
+    std::vector<uint8_t> payload = make_payload(100);
+    UdpDatagram parsed; // NOLINT(cppcoreguidelines-pro-type-member-init)
+
+    // Optional for IPv4
+    std::vector<uint8_t> packet = build_packet(make_datagram(false, payload));
+    ((udp_hdr *) (packet.data() + IP_HLEN))->chksum = 0;
+    ASSERT_TRUE(udp_fast_path_parse(packet.data(), packet.size(), &parsed));
+
+    // Mandatory for IPv6
+    packet = build_packet(make_datagram(true, payload));
+    ((udp_hdr *) (packet.data() + IP6_HLEN))->chksum = 0;
+    ASSERT_FALSE(udp_fast_path_parse(packet.data(), packet.size(), &parsed));
+}
+
+/**
+ * Drives the stack in callback mode: the first datagram of a flow goes through LWIP to set the connection up,
+ * the rest of the flow has to take the fast path in both directions
+ */
+class UdpFastPathStack : public ::testing::TestWithParam<bool> {
+protected:
+    static constexpr uint32_t MTU = 1500;
+
+    VpnEventLoop *m_loop = nullptr;
+    TcpipCtx *m_tcpip = nullptr;
+    uint64_t m_conn_id = 0;
+    std::vector<std::vector<uint8_t>> m_received;
+    std::vector<std::vector<evbuffer_iovec>> m_output_chunks;
+    std::vector<std::vector<uint8_t>> m_output;
+
+    void SetUp() override {
+        m_loop = vpn_event_loop_create();
+        ASSERT_NE(m_loop, nullptr);
+        TcpipParameters params{};
+        params.tun_fd = -1;
+        params.event_loop = m_loop;
+        params.mtu_size = MTU;
+        params.handler = {&UdpFastPathStack::handler, this};
+        m_tcpip = tcpip_open(&params);
+        ASSERT_NE(m_tcpip, nullptr);
+    }
+
+    void TearDown() override {
+        if (m_tcpip != nullptr) {
+            tcpip_close(m_tcpip);
+        }
+        if (m_loop != nullptr) {
+            vpn_event_loop_destroy(m_loop);
+        }
+    }
+
+    static void handler(void *arg, TcpipEvent event, void *data) {
+        auto *self = (UdpFastPathStack *) arg;
+        switch (event) {
+        case TCPIP_EVENT_GENERATE_CONN_ID:
+            *(uint64_t *) data = 1;
+            break;
+        case TCPIP_EVENT_CONNECT_REQUEST:
+            self->m_conn_id = ((TcpipConnectRequestEvent *) data)->id;
+            tcpip_complete_connect_request(self->m_tcpip, self->m_conn_id, TCPIP_ACT_BYPASS);
+            break;
+        case TCPIP_EVENT_READ: {
+            auto *read = (TcpipReadEvent *) data;
+            std::vector<uint8_t> &datagram = self->m_received.emplace_back();
+            for (size_t i = 0; i < read->iovlen; ++i) {
+                const auto *chunk = (const uint8_t *) read->iov[i].iov_base;
+                datagram.insert(datagram.end(), chunk, chunk + read->iov[i].iov_len);
+                read->result += int(read->iov[i].iov_len);
+            }
+            break;
+        }
+        case TCPIP_EVENT_TUN_OUTPUT: {
+            auto *output = (TcpipTunOutputEvent *) data;
+            std::vector<uint8_t> &packet = self->m_output.emplace_back();
+            for (size_t i = 0; i < output->packet.chunks_num; ++i) {
+                const evbuffer_iovec &chunk = output->packet.chunks[i];
+                packet.insert(packet.end(), (uint8_t *) chunk.iov_base, (uint8_t *) chunk.iov_base + chunk.iov_len);
+            }
+            self->m_output_chunks.emplace_back(
+                    output->packet.chunks, output->packet.chunks + output->packet.chunks_num);
+            break;
+        }
+        case TCPIP_EVENT_CONNECTION_ACCEPTED:
+        case TCPIP_EVENT_CONNECTION_CLOSED:
+        case TCPIP_EVENT_DATA_SENT:
+        case TCPIP_EVENT_STAT_NOTIFY:
+        case TCPIP_EVENT_ICMP_ECHO:
+            break;
+        }
+    }
+
+    void input(const std::vector<uint8_t> &packet) {
+        auto *data = new uint8_t[packet.size()];
+        memcpy(data, packet.data(), packet.size());
+        VpnPacket vpn_packet{data, packet.size(), [](void *, uint8_t *data) {
+                                 delete[] data;
+                             }};
+        VpnPackets packets{&vpn_packet, 1};
+        tcpip_tun_input(m_tcpip, &packets);
+    }
+};
+
+TEST_P(UdpFastPathStack, Exchange) {
+    std::vector<uint8_t> payload = make_payload(1000);
+    UdpDatagram datagram = make_datagram(GetParam(), payload);
+
+    // The first datagram sets the connection up
+    input(build_packet(datagram));
+    ASSERT_NE(m_conn_id, 0);
+    ASSERT_EQ(m_received.size(), 1);
+    ASSERT_EQ(m_received[0], payload);
+
+    // The following ones are delivered without LWIP
+    uint32_t lwip_received = lwip_stats.udp.recv;
+    for (size_t size : {1, 100, 1000}) {
+        std::vector<uint8_t> next = make_payload(size);
+        input(build_packet(make_datagram(GetParam(), next)));
+        ASSERT_EQ(m_received.back(), next) << size;
+    }
+    ASSERT_EQ(m_received.size(), 4);
+    ASSERT_EQ(lwip_stats.udp.recv, lwip_received);
+
+    // The reply is sent as the headers followed by the payload of the caller
+    uint32_t lwip_sent = lwip_stats.udp.xmit;
+    std::vector<uint8_t> reply = make_payload(1200);
+    ASSERT_EQ(tcpip_send_to_client(m_tcpip, m_conn_id, reply.data(), reply.size()), int(reply.size()));
+    ASSERT_EQ(lwip_stats.udp.xmit, lwip_sent);
+    ASSERT_EQ(m_output.size(), 1);
+    ASSERT_EQ(m_output_chunks[0].size(), 2);
+    ASSERT_EQ(m_output_chunks[0][1].iov_base, reply.data());
+
+    UdpDatagram parsed; // NOLINT(cppcoreguidelines-pro-type-member-init)
+    ASSERT_TRUE(udp_fast_path_parse(m_output[0].data(), m_output[0].size(), &parsed));
+    ASSERT_TRUE(lwip_checksum_is_valid(m_output[0], parsed));
+    ASSERT_TRUE(ip_addr_cmp(&parsed.src_addr, &datagram.dst_addr));
+    ASSERT_TRUE(ip_addr_cmp(&parsed.dst_addr, &datagram.src_addr));
+    ASSERT_EQ(parsed.src_port, datagram.dst_port);
+    ASSERT_EQ(parsed.dst_port, datagram.src_port);
+    ASSERT_EQ(std::vector<uint8_t>(parsed.payload, parsed.payload + parsed.payload_len), reply);
+
+    // A datagram above the MTU is fragmented by LWIP
+    std::vector<uint8_t> large = make_payload(3000);
+    ASSERT_EQ(tcpip_send_to_client(m_tcpip, m_conn_id, large.data(), large.size()), int(large.size()));
+    ASSERT_EQ(lwip_stats.udp.xmit, lwip_sent + 1);
+    ASSERT_GT(m_output.size(), 2);
+}
+
+INSTANTIATE_TEST_SUITE_P(IpVersion, UdpFastPathStack, ::testing::Values(false, true));
@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include <event2/util.h>
+#include <lwip/ip.h>
 #include <lwip/ip_addr.h>
 
 #include "common/socket_address.h"
@@ -104,7 +105,60 @@ void test_ip_addr_to_socket_address() {
     }
 }
 
+void test_ip_packet_flow_hash() {
+    // IPv4 TCP header followed by ports 40000 -> 443
+    uint8_t packet[40] = {0x45, 0, 0, 40, 0, 0, 0x40, 0, 64, IP_PROTO_TCP, 0, 0, 192, 0, 2, 1, 192, 0, 2, 2};
+    packet[20] = 0x9c;
+    packet[21] = 0x40;
+    packet[22] = 0x01;
+    packet[23] = 0xbb;
+    uint64_t hash = ip_packet_flow_hash(packet, sizeof(packet));
+    ASSERT(hash != 0);
+    ASSERT(hash == ip_packet_flow_hash(packet, sizeof(packet)));
+
+    // Another source port gives another flow
+    uint8_t other[40];
+    memcpy(other, packet, sizeof(packet));
+    other[21] = 0x41;
+    ASSERT(hash != ip_packet_flow_hash(other, sizeof(other)));
+
+    // All the fragments of a datagram give the same flow, even though only the first one has the ports
+    uint8_t first_fragment[40];
+    memcpy(first_fragment, packet, sizeof(packet));
+    first_fragment[6] = 0x20; // MF
+    uint8_t last_fragment[20];
+    memcpy(last_fragment, packet, sizeof(last_fragment));
+    last_fragment[6] = 0x00;
+    last_fragment[7] = 0x02; // offset 16
+    uint64_t fragment_hash = ip_packet_flow_hash(first_fragment, sizeof(first_fragment));
+    ASSERT(fragment_hash == ip_packet_flow_hash(last_fragment, sizeof(last_fragment)));
+    first_fragment[21] = 0x41;
+    ASSERT(fragment_hash == ip_packet_flow_hash(first_fragment, sizeof(first_fragment)));
+
+    // Malformed packets
+    ASSERT(0 == ip_packet_flow_hash(packet, 10));
+    other[0] = 0x55;
+    ASSERT(0 == ip_packet_flow_hash(other, sizeof(other)));
+}
+
+void test_ip_packet_dscp() {
+    // IPv4 with Expedited Forwarding
+    uint8_t packet4[20] = {0x45, 46 << 2, 0, 20, 0, 0, 0x40, 0, 64, IP_PROTO_TCP, 0, 0, 192, 0, 2, 1, 192, 0, 2, 2};
+    ASSERT(46 == ip_packet_dscp(packet4, sizeof(packet4)));
+
+    // IPv6 with CS1, the traffic class (0x20) spans the first two bytes
+    uint8_t packet6[40] = {0x62, 0x00, 0, 0, 0, 0, IP6_NEXTH_TCP, 64};
+    ASSERT(8 == ip_packet_dscp(packet6, sizeof(packet6)));
+
+    // Malformed packets
+    ASSERT(0 == ip_packet_dscp(packet4, 10));
+    packet4[0] = 0x55;
+    ASSERT(0 == ip_packet_dscp(packet4, sizeof(packet4)));
+}
+
 int main() {
     test_socket_address_to_ip_addr();
     test_ip_addr_to_socket_address();
+    test_ip_packet_flow_hash();
+    test_ip_packet_dscp();
 }
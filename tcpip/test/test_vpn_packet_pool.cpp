@@ -1,6 +1,15 @@
 #include <gtest/gtest.h>
 
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+#include "alloc_hooks.h"
 #include "vpn_packet_pool.h"
+#include "zerocopy_pbuf.h"
 
 using namespace ag;
 
@@ -28,3 +37,78 @@ TEST(VpnPacketPool, Functional) {
     }
     ASSERT_EQ(pool->get_size(), pool_capacity);
 }
+
+TEST(VpnPacketPool, GrowsInSlabs) {
+    constexpr size_t slab_size = 8;
+    VpnPacketPool pool(slab_size, DEFAULT_MTU_SIZE);
+    std::vector<VpnPacket> packets;
+    for (size_t i = 0; i < 2 * slab_size + 1; ++i) {
+        packets.push_back(pool.get_packet());
+        ASSERT_EQ(0, (uintptr_t) VpnPacketPool::headroom(packets.back()) % alignof(std::max_align_t));
+    }
+
+    VpnPacketPoolStats stats = pool.get_stats();
+    ASSERT_EQ(stats.slabs, 3);
+    ASSERT_EQ(stats.misses, 2);
+    ASSERT_EQ(stats.hits, 2 * slab_size - 1);
+    ASSERT_EQ(stats.in_use, 2 * slab_size + 1);
+    ASSERT_EQ(stats.high_water, 2 * slab_size + 1);
+    ASSERT_EQ(pool.get_size(), slab_size - 1);
+
+    for (VpnPacket &packet : packets) {
+        packet.destructor(packet.destructor_arg, packet.data);
+    }
+    stats = pool.get_stats();
+    ASSERT_EQ(stats.in_use, 0);
+    ASSERT_EQ(stats.high_water, 2 * slab_size + 1);
+    // Completely free slabs are released, as long as a slab worth of free blocks remains
+    ASSERT_EQ(stats.slabs, 1);
+    ASSERT_EQ(pool.get_size(), slab_size);
+}
+
+TEST(VpnPacketPool, PacketOutlivesPool) {
+    auto pool = std::make_unique<VpnPacketPool>(1, DEFAULT_MTU_SIZE);
+    VpnPacket packet = pool->get_packet();
+    pool.reset();
+    memset(packet.data, 0, packet.size);
+    packet.destructor(packet.destructor_arg, packet.data);
+}
+
+TEST(VpnPacketPool, HeadroomOfForeignPacket) {
+    uint8_t data[1];
+    VpnPacket packet = {.data = data, .size = sizeof(data)};
+    ASSERT_EQ(VpnPacketPool::headroom(packet), nullptr);
+}
+
+TEST(VpnPacketPool, Benchmark) {
+    constexpr size_t in_flight = 64;
+    constexpr size_t rounds = 100000;
+    VpnPacketPool pool(in_flight, DEFAULT_MTU_SIZE);
+    std::vector<pbuf *> buffers(in_flight);
+
+    auto run_round = [&]() {
+        for (pbuf *&buffer : buffers) {
+            VpnPacket packet = pool.get_packet();
+            buffer = zerocopy_pbuf_create(&packet);
+        }
+        for (pbuf *buffer : buffers) {
+            pbuf_free(buffer);
+        }
+    };
+
+    // Warm up, then make sure that the steady state does not touch the heap
+    run_round();
+    size_t allocations_before = test::heap_allocs();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rounds; ++i) {
+        run_round();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    size_t allocations = test::heap_allocs() - allocations_before;
+
+    printf("%.1f ns/packet, %zu allocations in %zu packets\n", elapsed.count() / (rounds * in_flight), allocations,
+            rounds * in_flight);
+    ASSERT_EQ(allocations, 0);
+    ASSERT_EQ(pool.get_stats().slabs, 1);
+    ASSERT_EQ(pool.get_stats().misses, 0);
+}
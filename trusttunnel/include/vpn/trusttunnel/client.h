@@ -26,6 +26,8 @@ struct VpnCallbacks {
     std::function<void(VpnVerifyCertificateEvent *)> verify_handler;
     std::function<void(VpnStateChangedEvent *)> state_changed_handler;
     std::function<void(VpnClientOutputEvent *)> client_output_handler;
+    /** If set, the packets produced during an event loop iteration are passed here at once instead */
+    std::function<void(VpnClientOutputBatchEvent *)> client_output_batch_handler;
     std::function<void(VpnConnectionInfoEvent *)> connection_info_handler;
 };
 
@@ -73,6 +75,7 @@ public:
      * @param listener_settings If set to `AutoSetup`, automatically create a tunnel or socks based on config.
      *                          If set to `UseTunnelFd`, use provided fd for packet processing.
      *                          If set to `UseProcessPackets`, use `processClientPackets` and `VPN_EVENT_CLIENT_OUTPUT`
+     *                              (`VPN_EVENT_CLIENT_OUTPUT_BATCH` if `client_output_batch_handler` is set)
      *                              to process packets.
      */
     Error<ConnectResultError> connect(ListenerSettings listener_settings);
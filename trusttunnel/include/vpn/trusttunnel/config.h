@@ -45,11 +45,15 @@ struct TrustTunnelConfig {
         std::vector<std::string> included_routes;
         std::vector<std::string> excluded_routes;
         uint32_t mtu_size = 0;
-        uint32_t tcp_recv_buf_size = 0; ///< TCP receive window size in bytes (0 = compile-time default)
-        uint32_t tcp_send_buf_size = 0; ///< TCP send buffer size in bytes (0 = compile-time default)
+        uint32_t tcp_recv_buf_size = 0;   ///< Maximum TCP receive window of a connection in bytes (0 = default)
+        uint32_t tcp_recv_buf_budget = 0; ///< Limit of the sum of TCP receive windows in bytes (0 = default)
+        uint32_t tcp_send_buf_size = 0;   ///< TCP send buffer size in bytes (0 = compile-time default)
+        uint32_t queues_num = 1;          ///< Number of TUN device queues (Linux only, >1 enables `IFF_MULTI_QUEUE`)
         std::string bound_if;
         bool change_system_dns = true;
         bool use_existing = false;
+        bool offload = false;  ///< Exchange GSO super-packets with the TUN device (Linux only, `IFF_VNET_HDR`)
+        bool io_uring = false; ///< Service the TUN device with io_uring (Linux only)
         std::optional<std::string> netns;
     };
 
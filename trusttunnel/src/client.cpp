@@ -315,6 +315,7 @@ VpnListener *TrustTunnelClient::make_tun_listener(ListenerSettings listener_sett
                 .fd = use_fd->fd.release(),
                 .mtu_size = config.mtu_size,
                 .tcp_recv_buf_size = config.tcp_recv_buf_size,
+                .tcp_recv_buf_budget = config.tcp_recv_buf_budget,
                 .tcp_send_buf_size = config.tcp_send_buf_size,
         };
 
@@ -326,7 +327,9 @@ VpnListener *TrustTunnelClient::make_tun_listener(ListenerSettings listener_sett
                 .fd = -1,
                 .mtu_size = config.mtu_size,
                 .tcp_recv_buf_size = config.tcp_recv_buf_size,
+                .tcp_recv_buf_budget = config.tcp_recv_buf_budget,
                 .tcp_send_buf_size = config.tcp_send_buf_size,
+                .batch_output = bool(m_callbacks.client_output_batch_handler),
         };
 
         return vpn_create_tun_listener(m_vpn, &listener_config);
@@ -372,7 +375,9 @@ VpnListener *TrustTunnelClient::make_tun_listener(ListenerSettings listener_sett
             .mtu = int(config.mtu_size),
             .dns_servers = config.change_system_dns ? defaults->dns_servers : VpnAddressArray{},
             .device_name = !config.device_name.empty() ? config.device_name.c_str() : defaults->device_name,
-            .use_existing = config.use_existing};
+            .use_existing = config.use_existing,
+            .queues_num = config.queues_num,
+            .offload = config.offload};
 
     m_tunnel = ag::make_vpn_tunnel();
     if (m_tunnel == nullptr) {
@@ -413,6 +418,10 @@ VpnListener *TrustTunnelClient::make_tun_listener(ListenerSettings listener_sett
         return nullptr;
     }
 
+#ifdef __linux__
+    std::vector<evutil_socket_t> queue_fds = static_cast<VpnLinuxTunnel *>(m_tunnel.get())->get_queue_fds();
+#endif
+
     VpnTunListenerConfig listener_config = {
             .fd = m_tunnel->get_fd(),
 #ifdef _WIN32
@@ -420,7 +429,13 @@ VpnListener *TrustTunnelClient::make_tun_listener(ListenerSettings listener_sett
 #endif
             .mtu_size = config.mtu_size,
             .tcp_recv_buf_size = config.tcp_recv_buf_size,
+            .tcp_recv_buf_budget = config.tcp_recv_buf_budget,
             .tcp_send_buf_size = config.tcp_send_buf_size,
+#ifdef __linux__
+            .queue_fds = {queue_fds.data(), uint32_t(queue_fds.size())},
+            .offload = config.offload,
+            .io_uring = config.io_uring,
+#endif
     };
 
     return vpn_create_tun_listener(m_vpn, &listener_config);
@@ -463,6 +478,13 @@ void TrustTunnelClient::vpn_handler(void *, VpnEvent what, void *data) {
         }
         break;
     }
+    case VPN_EVENT_CLIENT_OUTPUT_BATCH: {
+        auto *event = (VpnClientOutputBatchEvent *) data;
+        if (m_callbacks.client_output_batch_handler) {
+            m_callbacks.client_output_batch_handler(event);
+        }
+        break;
+    }
     case VPN_EVENT_ENDPOINT_CONNECTION_STATS:
     case VPN_EVENT_DNS_UPSTREAM_UNAVAILABLE:
     case VPN_EVENT_TUNNEL_CONNECTION_STATS:
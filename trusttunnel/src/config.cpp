@@ -25,6 +25,7 @@
 using namespace ag; // NOLINT(google-build-using-namespace)
 
 static constexpr uint32_t DEFAULT_MTU = 1350;
+static constexpr uint32_t MAX_TUN_QUEUES_NUM = 256; // `MAX_TAP_QUEUES` in the Linux kernel
 static const Logger g_logger("TRUSTTUNNEL_CLIENT"); // NOLINT(readability-identifier-naming)
 
 static const std::unordered_map<std::string_view, VpnUpstreamProtocol> UPSTREAM_PROTO_MAP = {
@@ -203,14 +204,24 @@ static std::optional<TrustTunnelConfig::TunListener> parse_tun_listener_config(c
         return std::nullopt;
     }
 
+    uint32_t queues_num = (*tun_config)["queues_num"].value<uint32_t>().value_or(1);
+    if (queues_num == 0 || queues_num > MAX_TUN_QUEUES_NUM) {
+        errlog(g_logger, "listener.tun: queues_num must be in range [1, {}]", MAX_TUN_QUEUES_NUM);
+        return std::nullopt;
+    }
+
     TrustTunnelConfig::TunListener tun = {
             .device_name = std::move(device_name),
             .mtu_size = (*tun_config)["mtu_size"].value<uint32_t>().value_or(DEFAULT_MTU),
             .tcp_recv_buf_size = (*tun_config)["tcp_recv_buf_size"].value<uint32_t>().value_or(0),
+            .tcp_recv_buf_budget = (*tun_config)["tcp_recv_buf_budget"].value<uint32_t>().value_or(0),
             .tcp_send_buf_size = (*tun_config)["tcp_send_buf_size"].value<uint32_t>().value_or(0),
+            .queues_num = queues_num,
             .bound_if = std::move(bound_if),
             .change_system_dns = (*tun_config)["change_system_dns"].value_or<bool>(true),
             .use_existing = use_existing,
+            .offload = (*tun_config)["offload"].value_or<bool>(false),
+            .io_uring = (*tun_config)["io_uring"].value_or<bool>(false),
             .netns = (*tun_config)["netns"].value<std::string>(),
     };
 